@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * The types of <basetsd.h> that the protocol headers use, for the POSIX build only.
+ */
+#include <cstdint>
+
+typedef std::int8_t INT8;
+typedef std::int16_t INT16;
+typedef std::int32_t INT32;
+typedef std::int64_t INT64;
+
+typedef std::uint8_t UINT8;
+typedef std::uint16_t UINT16;
+typedef std::uint32_t UINT32;
+typedef std::uint64_t UINT64;
@@ -32,12 +32,6 @@ inline auto dsc_find_next_intf(USB_CONFIGURATION_DESCRIPTOR *dsc_conf, USB_INTER
 	return (USB_INTERFACE_DESCRIPTOR*)dsc_find_next(dsc_conf, (USB_COMMON_DESCRIPTOR*)from, USB_INTERFACE_DESCRIPTOR_TYPE);
 }
 
-using for_each_ep_fn = NTSTATUS (int, const USB_ENDPOINT_DESCRIPTOR&, void*);
-NTSTATUS for_each_endpoint(USB_CONFIGURATION_DESCRIPTOR *cfg, USB_INTERFACE_DESCRIPTOR *iface, for_each_ep_fn &func, void *data);
-
-USB_INTERFACE_DESCRIPTOR *dsc_find_intf(USB_CONFIGURATION_DESCRIPTOR *dsc_conf, UCHAR intf_num, UCHAR alt_setting);
-int get_intf_num_altsetting(USB_CONFIGURATION_DESCRIPTOR *dsc_conf, UCHAR intf_num);
-
 inline auto get_string(USB_STRING_DESCRIPTOR &d)
 {
 	USHORT len = d.bLength - sizeof(USB_COMMON_DESCRIPTOR);
@@ -40,7 +40,8 @@ public:
         auto irp() const { NT_ASSERT(*this); return m_irp; }
 
         _IRQL_requires_max_(APC_LEVEL)
-        NTSTATUS wait_for_completion(_Inout_ NTSTATUS &status);
+        NTSTATUS wait_for_completion(
+                _Inout_ NTSTATUS &status, _In_opt_ LARGE_INTEGER *timeout = nullptr, _In_opt_ KEVENT *abort = nullptr);
 
         _IRQL_requires_max_(DISPATCH_LEVEL)
         void reset();
@@ -107,17 +108,34 @@ NTSTATUS socket_async_context::completion(
         return StopCompletion;
 }
 
+/*
+ * @param abort notification event, the request is canceled if it is signaled
+ */
 _IRQL_requires_max_(APC_LEVEL)
-NTSTATUS socket_async_context::wait_for_completion(_Inout_ NTSTATUS &status)
+NTSTATUS socket_async_context::wait_for_completion(
+        _Inout_ NTSTATUS &status, _In_opt_ LARGE_INTEGER *timeout, _In_opt_ KEVENT *abort)
 {
         PAGED_CODE();
         NT_ASSERT(*this);
 
-        if (status == STATUS_PENDING) {
+        if (status != STATUS_PENDING) {
+                return status;
+        }
+
+        void *objects[] { &m_completion_event, abort };
+
+        if (auto ret = KeWaitForMultipleObjects(abort ? 2 : 1, objects, WaitAny, Executive, KernelMode, false,
+                                                timeout, nullptr); ret != STATUS_WAIT_0) {
+                IoCancelIrp(m_irp);
                 KeWaitForSingleObject(&m_completion_event, Executive, KernelMode, false, nullptr);
-                status = m_irp->IoStatus.Status;
+
+                if (m_irp->IoStatus.Status == STATUS_CANCELLED) {
+                        return status = ret == STATUS_TIMEOUT ? STATUS_IO_TIMEOUT : STATUS_CANCELLED;
+                }
         }
 
+        status = m_irp->IoStatus.Status;
+
         return status;
 }
 
@@ -529,7 +547,8 @@ NTSTATUS wsk::bind(_In_ SOCKET *sock, _In_ SOCKADDR *LocalAddress)
 }
 
 _IRQL_requires_max_(APC_LEVEL)
-NTSTATUS wsk::connect(_In_ SOCKET *sock, _In_ SOCKADDR *RemoteAddress)
+NTSTATUS wsk::connect(
+        _In_ SOCKET *sock, _In_ SOCKADDR *RemoteAddress, _In_opt_ LARGE_INTEGER *timeout, _In_opt_ KEVENT *abort)
 {
         PAGED_CODE();
 
@@ -539,7 +558,7 @@ NTSTATUS wsk::connect(_In_ SOCKET *sock, _In_ SOCKADDR *RemoteAddress)
         }
 
         auto err = sock->Connection->WskConnect(sock->Self, RemoteAddress, 0, ctx.irp());
-        return ctx.wait_for_completion(err);
+        return ctx.wait_for_completion(err, timeout, abort);
 }
 
 _IRQL_requires_max_(APC_LEVEL)
@@ -590,6 +609,10 @@ NTSTATUS wsk::getremoteaddr(_In_ SOCKET *sock, _Out_ SOCKADDR *RemoteAddress)
         return ctx.wait_for_completion(err);
 }
 
+/*
+ * Address families are interleaved, the first one is preferred by getaddrinfo.
+ * A dead address of one family does not delay addresses of another family for long, see RFC 8305, 4.
+ */
 _IRQL_requires_max_(APC_LEVEL)
 auto wsk::for_each(
         _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
@@ -597,7 +620,24 @@ auto wsk::for_each(
 {
         PAGED_CODE();
 
-        for (auto ai = head; ai; ai = ai->ai_next) {
+        if (!head) {
+                return nullptr;
+        }
+
+        auto next = [family = head->ai_family] (auto ai, bool preferred)
+        {
+                for ( ; ai && (ai->ai_family == family) != preferred; ai = ai->ai_next);
+                return ai;
+        };
+
+        auto preferred = head;
+        auto other = next(head, false);
+
+        for (bool turn = true; preferred || other; turn = !turn) {
+
+                auto &cur = (turn && preferred) || !other ? preferred : other;
+                auto ai = cur;
+                cur = next(ai->ai_next, &cur == &preferred);
 
                 SOCKET *sock{};
 
@@ -688,6 +728,23 @@ NTSTATUS wsk::get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, int *in
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS wsk::get_rcvbuf(_In_ SOCKET *sock, ULONG &bytes)
+{
+        PAGED_CODE();
+        return getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+/*
+ * SO_SNDBUF is not supported, WSK does not buffer data that is sent.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS wsk::set_rcvbuf(_In_ SOCKET *sock, ULONG bytes)
+{
+        PAGED_CODE();
+        return setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 NTSTATUS wsk::initialize()
 {
@@ -62,7 +62,9 @@ _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS bind(_In_ SOCKET *sock, _In_ SOCKADDR *LocalAddress);
 
 _IRQL_requires_max_(APC_LEVEL)
-NTSTATUS connect(_In_ SOCKET *sock, _In_ SOCKADDR *RemoteAddress);
+NTSTATUS connect(
+        _In_ SOCKET *sock, _In_ SOCKADDR *RemoteAddress,
+        _In_opt_ LARGE_INTEGER *timeout = nullptr, _In_opt_ KEVENT *abort = nullptr);
 
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS getlocaladdr(_In_ SOCKET *sock, _Out_ SOCKADDR *LocalAddress);
@@ -102,6 +104,12 @@ NTSTATUS get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, int *intvl);
 _IRQL_requires_max_(APC_LEVEL)
 NTSTATUS set_keepalive(_In_ SOCKET *sock, int idle = 0, int cnt = 0, int intvl = 0);
 
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS get_rcvbuf(_In_ SOCKET *sock, ULONG &bytes);
+
+_IRQL_requires_max_(APC_LEVEL)
+NTSTATUS set_rcvbuf(_In_ SOCKET *sock, ULONG bytes);
+
 //
 
 _IRQL_requires_max_(APC_LEVEL)
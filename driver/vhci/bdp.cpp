@@ -0,0 +1,181 @@
+/*
+ * A connection can carry no more than its in-flight limit per round trip. The limit of bulk data
+ * in tx_queue and the default receive buffer of the socket cap the throughput of a high-latency link
+ * well below its rate, a fixed large limit delays urgent PDUs on a fast local link instead.
+ *
+ * The window of each direction is GAIN times the bandwidth-delay product:
+ * the minimal RTT that is measured on import and by send completions, and the maximal delivery rate
+ * that is measured over intervals of at least one RTT. The rate cannot exceed window/RTT,
+ * so GAIN > 1 lets the window grow until the rate stops growing. The maximal rate decays slowly
+ * if the link gets slower. An interval that is much longer than RTT is an idle link and is not sampled.
+ *
+ * The code is constexpr without kernel calls, its convergence is checked by static_assert below.
+ */
+#include "bdp.h"
+
+namespace
+{
+
+enum : LONG64 {
+        UNITS = 10'000'000, // per second, KeQueryInterruptTime is in 100ns units
+        MIN_INTERVAL = UNITS/50, // of sampling
+        IDLE_INTERVALS = 8,
+        GAIN = 2,
+        DECAY = 8, // max_rate loses 1/DECAY per interval with slower rate
+};
+
+enum : ULONG { GRANULARITY = 64*1024 }; // of window, it is not changed for a few bytes
+
+constexpr auto update_window(bdp_estimator &e)
+{
+        auto bdp = e.max_rate/UNITS*e.min_rtt + e.max_rate%UNITS*e.min_rtt/UNITS; // without overflow
+
+        auto w = GAIN*bdp;
+        w += GRANULARITY - 1;
+        w -= w % GRANULARITY;
+
+        auto window = w < e.min_window ? e.min_window :
+                      w > e.max_window ? e.max_window :
+                      static_cast<ULONG>(w);
+
+        auto changed = window != e.window;
+        e.window = window;
+
+        return changed;
+}
+
+constexpr auto make_estimator(ULONG min_window, ULONG max_window)
+{
+        bdp_estimator e{};
+
+        if (max_window) {
+                e.min_window = min_window;
+                e.max_window = max_window < min_window ? min_window : max_window;
+                e.window = e.min_window;
+        }
+
+        return e;
+}
+
+constexpr void update_min_rtt(bdp_estimator &e, LONG64 rtt)
+{
+        if (rtt > 0 && (!e.min_rtt || rtt < e.min_rtt)) {
+                e.min_rtt = rtt;
+        }
+}
+
+constexpr bool update_rate(bdp_estimator &e, ULONG64 bytes, LONG64 now)
+{
+        if (!e.max_window) {
+                return false;
+        }
+
+        if (!e.sample_start) {
+                e.sample_start = now;
+                e.sample_bytes = bytes;
+                return false;
+        }
+
+        e.sample_bytes += bytes;
+
+        auto interval = e.min_rtt > MIN_INTERVAL ? e.min_rtt : MIN_INTERVAL;
+        auto elapsed = now - e.sample_start;
+
+        if (elapsed < interval) {
+                return false;
+        }
+
+        auto idle = elapsed > IDLE_INTERVALS*interval;
+        auto rate = static_cast<LONG64>(e.sample_bytes)*UNITS/elapsed;
+
+        e.sample_start = now;
+        e.sample_bytes = 0;
+
+        if (idle) {
+                return false;
+        }
+
+        auto decayed = e.max_rate - e.max_rate/DECAY;
+        e.max_rate = rate > decayed ? rate : decayed;
+
+        return update_window(e);
+}
+
+enum : ULONG { KB = 1024, MB = KB*KB };
+
+constexpr ULONG round_up(LONG64 bytes)
+{
+        return ULONG((bytes + GRANULARITY - 1)/GRANULARITY*GRANULARITY);
+}
+
+/*
+ * A link of rate bytes per second and rtt, it delivers a window per round trip at most.
+ * The link changes its rate to rate2 at the middle, the estimator is fed every millisecond.
+ * @return the window at the end
+ */
+constexpr ULONG track(LONG64 rate, LONG64 rate2, LONG64 rtt, ULONG min_window, ULONG max_window, int ms)
+{
+        auto e = make_estimator(min_window, max_window);
+        update_min_rtt(e, rtt);
+
+        for (int i = 1; i <= ms; ++i) {
+                auto r = i > ms/2 ? rate2 : rate;
+                auto limit = LONG64(e.window ? e.window : max_window)*UNITS/rtt; // disabled one does not limit
+
+                update_rate(e, (r < limit ? r : limit)/1000, i*UNITS/1000);
+        }
+
+        return e.window;
+}
+
+// the window grows from the minimum to GAIN*BDP
+static_assert(track(100*MB, 100*MB, UNITS/100, 64*KB, 64*MB, 4000) == round_up(GAIN*100*MB/100));
+static_assert(track(10*MB, 10*MB, UNITS/5, 64*KB, 64*MB, 8000) == round_up(GAIN*10*MB/5));
+
+// a fast local link keeps the minimum, a fast distant one is capped
+static_assert(track(1000*MB, 1000*MB, UNITS/10'000, 256*KB, 64*MB, 1000) == 256*KB);
+static_assert(track(1000*MB, 1000*MB, UNITS/10, 64*KB, 16*MB, 4000) == 16*MB);
+
+// the window shrinks if the link gets slower
+static_assert(track(100*MB, 10*MB, UNITS/100, 64*KB, 64*MB, 8000) == round_up(GAIN*10*MB/100));
+
+// a disabled estimator does not change
+static_assert(track(100*MB, 100*MB, UNITS/100, 64*KB, 0, 1000) == 0);
+
+constexpr auto idle_is_not_sampled()
+{
+        auto e = make_estimator(64*KB, 64*MB);
+        update_min_rtt(e, UNITS/100);
+
+        update_rate(e, 0, UNITS);
+        auto changed = update_rate(e, 1*MB, UNITS + IDLE_INTERVALS*MIN_INTERVAL + 1); // 1 MB after an idle gap
+
+        return !changed && !e.max_rate && !e.sample_bytes;
+}
+static_assert(idle_is_not_sampled());
+
+} // namespace
+
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ bdp_estimator &e, _In_ ULONG min_window, _In_ ULONG max_window)
+{
+        e = make_estimator(min_window, max_window);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void rtt_sample(_Inout_ bdp_estimator &e, _In_ LONG64 rtt)
+{
+        update_min_rtt(e, rtt);
+}
+
+/*
+ * @param bytes that are acknowledged or received
+ * @param now KeQueryInterruptTime
+ * @return true if the window is changed
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool delivered(_Inout_ bdp_estimator &e, _In_ ULONG64 bytes, _In_ LONG64 now)
+{
+        return update_rate(e, bytes, now);
+}
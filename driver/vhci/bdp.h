@@ -0,0 +1,29 @@
+#pragma once
+
+#include <wdm.h>
+
+/*
+ * Bandwidth-delay product of one direction of a connection, see bdp.cpp.
+ * Zeroed memory is a valid state, the estimator is disabled.
+ */
+struct bdp_estimator
+{
+        ULONG min_window; // bytes
+        ULONG max_window; // zero if disabled
+        ULONG window; // current estimate, [min_window, max_window]
+
+        LONG64 min_rtt; // 100ns units, zero if unknown
+        LONG64 max_rate; // bytes per second, decays
+
+        LONG64 sample_start; // 100ns units, zero if not started
+        ULONG64 sample_bytes;
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ bdp_estimator &e, _In_ ULONG min_window, _In_ ULONG max_window);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void rtt_sample(_Inout_ bdp_estimator &e, _In_ LONG64 rtt);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool delivered(_Inout_ bdp_estimator &e, _In_ ULONG64 bytes, _In_ LONG64 now);
@@ -0,0 +1,416 @@
+/*
+ * In-flight budget of a device.
+ *
+ * Every URB is sent at once and waits for RET_SUBMIT in vpdo_dev_t::irps, thus a class driver that queues
+ * a lot of transfers fills socket buffers of both sides and delays everything else of the device.
+ * URBs of bulk, interrupt and isoch endpoints are charged against limits of the device and of their endpoint,
+ * by count and by TransferBufferLength, see ioctl_usbip_vhci_plugin.max_urbs and others.
+ * URB that exceeds the budget waits in the cancel-safe queue of this module and is dispatched
+ * when RET_SUBMIT (or unlink, cancel, error) of a charged URB releases enough budget.
+ *
+ * URBs of an endpoint are dispatched in order. URB that is longer than a limit is dispatched alone.
+ * Control transfers are not limited, a segmented bulk transfer is charged by its segments.
+ */
+#include "budget.h"
+#include "trace.h"
+#include "budget.tmh"
+
+#include "dev.h"
+#include "irp.h"
+#include "vhci.h"
+#include "devconf.h"
+#include "segment.h"
+#include "reconnect.h"
+#include "internal_ioctl.h"
+#include "urbtransfer.h"
+
+#include <usbip\vhci.h>
+
+namespace
+{
+
+enum : ULONG { CHARGED = 0x80000000 }; // the rest are bytes, see get_charge
+
+struct peek_context
+{
+        bool admit; // find URB that fits into the budget
+        USBD_PIPE_HANDLE handle; // otherwise find URB of the pipe
+};
+
+inline auto to_budget(_In_ IO_CSQ *csq)
+{
+        return CONTAINING_RECORD(csq, urb_budget, csq);
+}
+
+/*
+ * Zero if the IRP is not charged.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_charge(_In_ IRP *irp)
+{
+        return *reinterpret_cast<ULONG*>(irp->Tail.Overlay.DriverContext + 2); // see get_seqnum, CSQ
+}
+
+/*
+ * URB that is longer than the limit fits if nothing is in flight.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(b.lock)
+auto fits_device(_In_ const urb_budget &b, _In_ ULONG bytes)
+{
+        return !b.urbs || ((!b.max_urbs || b.urbs < b.max_urbs) &&
+                           (!b.max_bytes || ULONG64(b.bytes) + bytes <= b.max_bytes));
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(b.lock)
+auto fits_endpoint(_In_ const urb_budget &b, _In_ int idx, _In_ ULONG bytes)
+{
+        auto urbs = b.ep_urbs[idx];
+
+        return !urbs || ((!b.ep_max_urbs || urbs < b.ep_max_urbs) &&
+                         (!b.ep_max_bytes || ULONG64(b.ep_bytes[idx]) + bytes <= b.ep_max_bytes));
+}
+
+void InsertIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
+{
+        auto &b = *to_budget(csq);
+
+        auto bytes = get_charge(irp);
+
+        if (!(IsListEmpty(&b.irps) && fits_device(b, bytes) &&
+              fits_endpoint(b, get_endpoint_index(get_pipe_handle(irp)), bytes))) {
+                ++b.throttled_cnt;
+        }
+
+        InsertTailList(&b.irps, list_entry(irp));
+        TraceCSQ("%04x", ptr4log(irp));
+}
+
+void RemoveIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+        TraceCSQ("%04x", ptr4log(irp));
+        auto entry = list_entry(irp);
+        RemoveEntryList(entry);
+        InitializeListHead(entry);
+}
+
+/*
+ * URBs of an endpoint must be dispatched in order, so the search always starts from the head.
+ * If URB does not fit into the device budget, the next ones must wait too, otherwise long URB may never fit.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(b.lock)
+IRP *find_fitting(_In_ urb_budget &b)
+{
+        auto head = &b.irps;
+        UINT32 skipped = 0; // endpoints which URBs do not fit
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+
+                auto next = get_irp(entry);
+                if (next->Cancel) { // IoCsqRemoveNextIrp can't remove it
+                        continue;
+                }
+
+                auto idx = get_endpoint_index(get_pipe_handle(next));
+                if (skipped & (1U << idx)) {
+                        continue;
+                }
+
+                auto bytes = get_charge(next);
+
+                if (!fits_device(b, bytes)) {
+                        break;
+                }
+
+                if (fits_endpoint(b, idx, bytes)) {
+                        return next;
+                }
+
+                skipped |= 1U << idx;
+        }
+
+        return nullptr;
+}
+
+/*
+ * @param context see peek_context, nullptr for any URB
+ */
+IRP *PeekNextIrp(_In_ IO_CSQ *csq, _In_opt_ IRP *irp, _In_opt_ PVOID context)
+{
+        auto &b = *to_budget(csq);
+        auto ctx = static_cast<peek_context*>(context);
+
+        if (ctx && ctx->admit) {
+                return find_fitting(b);
+        }
+
+        auto head = &b.irps;
+
+        for (auto entry = irp ? list_entry(irp)->Flink : head->Flink; entry != head; entry = entry->Flink) {
+                auto next = get_irp(entry);
+                if (!ctx || get_pipe_handle(next) == ctx->handle) {
+                        return next;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(csq, urb_budget, csq)->lock)
+void AcquireLock(_In_ IO_CSQ *csq, _Out_ PKIRQL Irql)
+{
+        KeAcquireSpinLock(&to_budget(csq)->lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(csq, urb_budget, csq)->lock)
+void ReleaseLock(_In_ IO_CSQ *csq, _In_ KIRQL Irql)
+{
+        KeReleaseSpinLock(&to_budget(csq)->lock, Irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void CompleteCanceledIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+        TraceMsg("%04x", ptr4log(irp));
+        complete_as_canceled(irp);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void charge(_Inout_ urb_budget &b, _In_ IRP *irp)
+{
+        auto &val = get_charge(irp);
+        NT_ASSERT(!(val & CHARGED));
+
+        auto idx = get_endpoint_index(get_pipe_handle(irp));
+
+        KIRQL irql;
+        KeAcquireSpinLock(&b.lock, &irql);
+
+        ++b.urbs;
+        b.bytes += val;
+
+        ++b.ep_urbs[idx];
+        b.ep_bytes[idx] += val;
+
+        KeReleaseSpinLock(&b.lock, irql);
+
+        val |= CHARGED;
+}
+
+/*
+ * The time when URBs were throttled.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_throttled_time(_Inout_ urb_budget &b)
+{
+        KIRQL irql;
+        KeAcquireSpinLock(&b.lock, &irql);
+
+        auto now = LONG64(KeQueryInterruptTime());
+        auto &since = b.throttled_since;
+
+        if (IsListEmpty(&b.irps)) {
+                if (since) {
+                        b.throttled_time += now - since;
+                        since = 0;
+                }
+        } else if (!since) {
+                since = now;
+        }
+
+        KeReleaseSpinLock(&b.lock, irql);
+}
+
+/*
+ * Dispatches throttled URBs that fit into the budget.
+ * URBs must be dispatched in order, so only one thread does that at a time.
+ * If it is busy, it will dispatch on behalf of the caller.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void admit(_Inout_ urb_budget &b)
+{
+        if (InterlockedIncrement(&b.admit_req) != 1) {
+                return;
+        }
+
+        auto &vpdo = *b.vpdo;
+        peek_context ctx{ .admit = true };
+
+        do {
+                while (auto irp = IoCsqRemoveNextIrp(&b.csq, &ctx)) {
+                        if (!hold_irp(vpdo, irp)) { // will be throttled again after reconnect
+                                charge(b, irp);
+                                submit_urb(vpdo, irp);
+                        }
+                }
+
+                update_throttled_time(b);
+
+        } while (InterlockedDecrement(&b.admit_req));
+}
+
+/*
+ * @return true if the URB is a subject to the budget
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_transfer(_In_ const vpdo_dev_t &vpdo, _In_ IRP *irp, _Out_ USBD_PIPE_HANDLE &handle, _Out_ ULONG &len)
+{
+        auto stack = IoGetCurrentIrpStackLocation(irp);
+        if (stack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB) {
+                return false;
+        }
+
+        auto &urb = *static_cast<URB*>(URB_FROM_IRP(irp));
+        if (!has_urb_trait(urb, URB_BULK | URB_ISOCH)) {
+                return false;
+        }
+
+        auto &tr = AsUrbTransfer(urb);
+        handle = tr.PipeHandle;
+        len = tr.TransferBufferLength;
+
+        if (!handle) {
+                return false;
+        }
+
+        switch (get_endpoint_type(handle)) {
+        case UsbdPipeTypeBulk:
+                return !need_segments(vpdo, urb); // segments are charged
+        case UsbdPipeTypeInterrupt:
+        case UsbdPipeTypeIsochronous:
+                return true;
+        default:
+                return false;
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_budget(_Inout_ vpdo_dev_t &vpdo, _In_ const ioctl_usbip_vhci_plugin &r)
+{
+        PAGED_CODE();
+
+        auto &b = vpdo.budget;
+        b.vpdo = &vpdo;
+
+        b.max_urbs = r.max_urbs;
+        b.max_bytes = r.max_bytes;
+        b.ep_max_urbs = r.ep_max_urbs;
+        b.ep_max_bytes = r.ep_max_bytes;
+
+        InitializeListHead(&b.irps);
+        KeInitializeSpinLock(&b.lock);
+
+        if (b.max_urbs || b.max_bytes || b.ep_max_urbs || b.ep_max_bytes) {
+                TraceMsg("vpdo %04x: device %lu URBs, %lu bytes; endpoint %lu URBs, %lu bytes", ptr4log(&vpdo),
+                          b.max_urbs, b.max_bytes, b.ep_max_urbs, b.ep_max_bytes);
+        }
+
+        return IoCsqInitialize(&b.csq, InsertIrp, RemoveIrp, PeekNextIrp, AcquireLock, ReleaseLock, CompleteCanceledIrp);
+}
+
+/*
+ * Throttled URBs are held if the device is reconnecting, otherwise they are canceled.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void flush_budget(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        auto &csq = vpdo.budget.csq;
+        if (!csq.CsqAcquireLock) { // is not initialized
+                return;
+        }
+
+        while (auto irp = IoCsqRemoveNextIrp(&csq, nullptr)) {
+                if (!hold_irp(vpdo, irp)) {
+                        complete_as_canceled(irp);
+                }
+        }
+
+        update_throttled_time(vpdo.budget);
+}
+
+/*
+ * Throttled URBs of the pipe are canceled, see abort_pipe.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_throttled(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle)
+{
+        auto &csq = vpdo.budget.csq;
+        peek_context ctx{ .handle = handle };
+
+        while (auto irp = IoCsqRemoveNextIrp(&csq, &ctx)) {
+                complete_as_canceled(irp);
+        }
+}
+
+/*
+ * Must be called for every IRP that can be put into vpdo_dev_t::irps, see release_budget.
+ * @return true if the URB was queued, it will be dispatched when the budget allows
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool throttle_irp(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto &b = vpdo.budget;
+        get_charge(irp) = 0;
+
+        if (!(b.max_urbs || b.max_bytes || b.ep_max_urbs || b.ep_max_bytes)) {
+                return false;
+        }
+
+        USBD_PIPE_HANDLE handle{};
+        ULONG len{};
+
+        if (!get_transfer(vpdo, irp, handle, len)) {
+                return false;
+        }
+
+        get_pipe_handle(irp) = handle;
+        get_charge(irp) = len < CHARGED ? len : ~CHARGED;
+
+        IoCsqInsertIrp(&b.csq, irp, nullptr); // marks IRP pending
+        admit(b);
+
+        return true;
+}
+
+/*
+ * Must be called when charged URB leaves vpdo_dev_t::irps or is completed without being sent.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_budget(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto &val = get_charge(irp);
+        if (!(val & CHARGED)) {
+                return;
+        }
+
+        auto bytes = val & ~CHARGED;
+        val = 0;
+
+        auto &b = vpdo.budget;
+        auto idx = get_endpoint_index(get_pipe_handle(irp));
+
+        KIRQL irql;
+        KeAcquireSpinLock(&b.lock, &irql);
+
+        NT_ASSERT(b.urbs && b.ep_urbs[idx]);
+
+        --b.urbs;
+        b.bytes -= bytes;
+
+        --b.ep_urbs[idx];
+        b.ep_bytes[idx] -= bytes;
+
+        KeReleaseSpinLock(&b.lock, irql);
+
+        admit(b);
+}
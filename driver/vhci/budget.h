@@ -0,0 +1,54 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+
+#include <wdm.h>
+#include <usb.h>
+
+struct vpdo_dev_t;
+struct ioctl_usbip_vhci_plugin;
+
+/*
+ * In-flight limits of a device, see budget.cpp.
+ */
+struct urb_budget
+{
+        vpdo_dev_t *vpdo;
+
+        IO_CSQ csq; // throttled URBs
+        LIST_ENTRY irps;
+        KSPIN_LOCK lock;
+
+        // zero if unlimited
+        ULONG max_urbs;
+        ULONG max_bytes;
+        ULONG ep_max_urbs;
+        ULONG ep_max_bytes;
+
+        // guarded by lock
+        ULONG urbs;
+        ULONG bytes;
+        ULONG ep_urbs[32]; // see get_endpoint_index
+        ULONG ep_bytes[32];
+
+        LONG64 throttled_since; // KeQueryInterruptTime, zero if nothing is throttled
+        LONG64 throttled_time; // total, 100ns units
+        ULONG throttled_cnt; // URBs that had to wait
+
+        volatile LONG admit_req; // see admit
+};
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_budget(_Inout_ vpdo_dev_t &vpdo, _In_ const ioctl_usbip_vhci_plugin &r);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void flush_budget(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_throttled(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool throttle_irp(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_budget(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
@@ -0,0 +1,224 @@
+/*
+ * SELECT_CONFIGURATION, SELECT_INTERFACE and hub node-connection requests need interfaces and endpoints
+ * of the active configuration. Instead of a linear scan of the configuration descriptor on each request,
+ * it is parsed once when it becomes active into flat arrays of altsettings and endpoints with
+ * pipe information that is ready to be copied into URB. A lookup scans a few small adjacent entries.
+ *
+ * The parser is plain arithmetic with bounds checks, it does not trust bLength and wTotalLength.
+ */
+#include "config_index.h"
+#include "trace.h"
+#include "config_index.tmh"
+
+#include "vhci.h"
+#include "devconf.h"
+
+namespace
+{
+
+static_assert(!(sizeof(config_index) % alignof(config_altsetting)));
+static_assert(!(sizeof(config_altsetting) % alignof(config_pipe)));
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_pipe(_Out_ USBD_PIPE_INFORMATION &pipe, _In_ const USB_ENDPOINT_DESCRIPTOR &epd, _In_ usb_device_speed speed)
+{
+        pipe.MaximumPacketSize = epd.wMaxPacketSize;
+        pipe.PipeType = static_cast<USBD_PIPE_TYPE>(epd.bmAttributes & USB_ENDPOINT_TYPE_MASK);
+
+        /* From usb_submit_urb in linux */
+        if (pipe.PipeType == UsbdPipeTypeIsochronous && speed == USB_SPEED_HIGH) {
+                USHORT mult = 1 + ((pipe.MaximumPacketSize >> 11) & 0x03);
+                pipe.MaximumPacketSize &= 0x7ff;
+                pipe.MaximumPacketSize *= mult;
+        }
+
+        pipe.EndpointAddress = epd.bEndpointAddress;
+        pipe.Interval = epd.bInterval;
+
+        pipe.PipeHandle = make_pipe_handle(epd.bEndpointAddress, pipe.PipeType, epd.bInterval);
+        NT_ASSERT(pipe.PipeHandle);
+        NT_ASSERT(is_endpoint_direction_in(pipe.PipeHandle) == (bool)USBD_PIPE_DIRECTION_IN(&pipe));
+
+        pipe.MaximumTransferSize = 0; // is not used and does not contain valid data
+        pipe.PipeFlags = 0; // USBD_PF_CHANGE_MAX_PACKET if override MaximumPacketSize
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_max_streams(_Inout_ USBD_PIPE_INFORMATION &pipe, _In_ const USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR &ecd)
+{
+        if (pipe.PipeType == UsbdPipeTypeBulk) {
+                auto n = ecd.bmAttributes.Bulk.MaxStreams;
+                pipe.PipeHandle = make_pipe_handle(pipe.EndpointAddress, pipe.PipeType, pipe.Interval, n);
+        }
+}
+
+/*
+ * Endpoint descriptors that follow an interface descriptor belong to it, no more than its bNumEndpoints.
+ * Counts entries if arrays of idx are not set, fills them otherwise.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void parse(_Inout_ config_index &idx, _In_ const USB_CONFIGURATION_DESCRIPTOR &cd, _In_ usb_device_speed speed)
+{
+        idx.num_altsettings = 0;
+        idx.num_pipes = 0;
+
+        config_altsetting *alt{};
+        config_pipe *last{}; // a companion descriptor follows its endpoint descriptor
+
+        auto cur = reinterpret_cast<const UCHAR*>(&cd);
+        auto end = cur + cd.wTotalLength;
+
+        for (cur += cd.bLength; cur + sizeof(USB_COMMON_DESCRIPTOR) <= end; ) {
+
+                auto &d = *reinterpret_cast<const USB_COMMON_DESCRIPTOR*>(cur);
+                if (d.bLength < sizeof(d) || d.bLength > end - cur) {
+                        if (idx.altsettings) { // once
+                                Trace(TRACE_LEVEL_WARNING, "Descriptor at offset %Id has bLength %d, the rest is ignored",
+                                        cur - reinterpret_cast<const UCHAR*>(&cd), d.bLength);
+                        }
+                        break;
+                }
+
+                cur += d.bLength;
+
+                auto prev = last;
+                last = nullptr;
+
+                if (prev && d.bDescriptorType == USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR_TYPE &&
+                    d.bLength >= sizeof(USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR)) {
+                        auto &ecd = reinterpret_cast<const USB_SUPERSPEED_ENDPOINT_COMPANION_DESCRIPTOR&>(d);
+                        set_max_streams(prev->info, ecd);
+                        continue;
+                }
+
+                if (d.bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE && d.bLength >= sizeof(USB_INTERFACE_DESCRIPTOR)) {
+
+                        auto &ifd = reinterpret_cast<const USB_INTERFACE_DESCRIPTOR&>(d);
+                        alt = idx.altsettings ? idx.altsettings + idx.num_altsettings : nullptr;
+
+                        if (alt) {
+                                alt->InterfaceNumber = ifd.bInterfaceNumber;
+                                alt->AlternateSetting = ifd.bAlternateSetting;
+                                alt->NumberOfPipes = 0;
+                                alt->first_pipe = idx.num_pipes;
+                                alt->desc = &ifd;
+                        }
+
+                        ++idx.num_altsettings;
+                        continue;
+                }
+
+                if (!(d.bDescriptorType == USB_ENDPOINT_DESCRIPTOR_TYPE && d.bLength >= sizeof(USB_ENDPOINT_DESCRIPTOR) &&
+                      idx.num_altsettings)) {
+                        continue;
+                }
+
+                auto &epd = reinterpret_cast<const USB_ENDPOINT_DESCRIPTOR&>(d);
+
+                if (alt) {
+                        if (alt->NumberOfPipes == alt->desc->bNumEndpoints) {
+                                continue;
+                        }
+
+                        auto &p = idx.pipes[idx.num_pipes];
+                        p.desc = &epd;
+                        set_pipe(p.info, epd, speed);
+
+                        last = &p;
+                        ++alt->NumberOfPipes;
+                }
+
+                ++idx.num_pipes; // upper bound if counting
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+config_index *make_config_index(_In_ const USB_CONFIGURATION_DESCRIPTOR &cd, _In_ usb_device_speed speed)
+{
+        if (cd.bLength < sizeof(cd) || cd.wTotalLength < cd.bLength) {
+                Trace(TRACE_LEVEL_ERROR, "Invalid configuration descriptor: bLength %d, wTotalLength %d",
+                        cd.bLength, cd.wTotalLength);
+                return nullptr;
+        }
+
+        config_index cnt{};
+        parse(cnt, cd, speed);
+
+        auto sz = sizeof(cnt) + cnt.num_altsettings*sizeof(*cnt.altsettings) + cnt.num_pipes*sizeof(*cnt.pipes);
+
+        auto idx = (config_index*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sz, USBIP_VHCI_POOL_TAG);
+        if (!idx) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return nullptr;
+        }
+
+        idx->cd = &cd;
+        idx->altsettings = reinterpret_cast<config_altsetting*>(idx + 1);
+        idx->pipes = reinterpret_cast<config_pipe*>(idx->altsettings + cnt.num_altsettings);
+
+        parse(*idx, cd, speed);
+        NT_ASSERT(idx->num_altsettings == cnt.num_altsettings);
+        NT_ASSERT(idx->num_pipes <= cnt.num_pipes);
+
+        TraceDbg("bConfigurationValue %d, altsettings %d, pipes %d",
+                  cd.bConfigurationValue, idx->num_altsettings, idx->num_pipes);
+
+        return idx;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_config_index(_Inout_ config_index* &idx)
+{
+        if (idx) {
+                ExFreePoolWithTag(idx, USBIP_VHCI_POOL_TAG);
+                idx = nullptr;
+        }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+const config_altsetting *find_altsetting(_In_ const config_index &idx, _In_ UCHAR ifnum, _In_ UCHAR altsetting)
+{
+        for (auto alt = idx.altsettings, end = alt + idx.num_altsettings; alt != end; ++alt) {
+                if (alt->InterfaceNumber == ifnum && alt->AlternateSetting == altsetting) {
+                        return alt;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int get_num_altsetting(_In_ const config_index &idx, _In_ UCHAR ifnum)
+{
+        int cnt = 0;
+
+        for (auto alt = idx.altsettings, end = alt + idx.num_altsettings; alt != end; ++alt) {
+                cnt += alt->InterfaceNumber == ifnum;
+        }
+
+        return cnt;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+const USB_COMMON_DESCRIPTOR *find_descriptor(_In_ const config_index &idx, _In_ UCHAR type, _In_ UCHAR index)
+{
+        const void *d{};
+
+        switch (type) {
+        case USB_INTERFACE_DESCRIPTOR_TYPE:
+                if (index < idx.num_altsettings) {
+                        d = idx.altsettings[index].desc;
+                }
+                break;
+        case USB_ENDPOINT_DESCRIPTOR_TYPE:
+                if (index < idx.num_pipes) {
+                        d = idx.pipes[index].desc;
+                }
+                break;
+        }
+
+        return static_cast<const USB_COMMON_DESCRIPTOR*>(d);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <wdm.h>
+#include <usbdi.h>
+
+#include <usbip\ch9.h>
+
+/*
+ * Endpoint of an interface's altsetting.
+ */
+struct config_pipe
+{
+        const USB_ENDPOINT_DESCRIPTOR *desc;
+        USBD_PIPE_INFORMATION info; // as it is returned by SELECT_CONFIGURATION and SELECT_INTERFACE
+};
+
+struct config_altsetting
+{
+        UCHAR InterfaceNumber;
+        UCHAR AlternateSetting;
+        UCHAR NumberOfPipes; // endpoint descriptors that follow, can be less than desc->bNumEndpoints
+        USHORT first_pipe; // index in config_index.pipes
+        const USB_INTERFACE_DESCRIPTOR *desc;
+};
+
+/*
+ * Flat index of a configuration descriptor, it is built once per configuration, see config_index.cpp.
+ * Both arrays are in the order of descriptors and follow this header in the same allocation.
+ * Descriptors are pointers into the indexed configuration descriptor, the index must not outlive it.
+ */
+struct config_index
+{
+        const USB_CONFIGURATION_DESCRIPTOR *cd;
+
+        USHORT num_altsettings;
+        USHORT num_pipes;
+
+        config_altsetting *altsettings;
+        config_pipe *pipes;
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+config_index *make_config_index(_In_ const USB_CONFIGURATION_DESCRIPTOR &cd, _In_ usb_device_speed speed);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_config_index(_Inout_ config_index* &idx);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+const config_altsetting *find_altsetting(_In_ const config_index &idx, _In_ UCHAR ifnum, _In_ UCHAR altsetting);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int get_num_altsetting(_In_ const config_index &idx, _In_ UCHAR ifnum);
+
+/*
+ * @param type USB_INTERFACE_DESCRIPTOR_TYPE or USB_ENDPOINT_DESCRIPTOR_TYPE
+ * @param index zero-based index among descriptors of this type
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+const USB_COMMON_DESCRIPTOR *find_descriptor(_In_ const config_index &idx, _In_ UCHAR type, _In_ UCHAR index);
+
+inline auto get_pipes(_In_ const config_index &idx, _In_ const config_altsetting &alt)
+{
+        return idx.pipes + alt.first_pipe;
+}
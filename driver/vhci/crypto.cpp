@@ -0,0 +1,676 @@
+/*
+ * Authenticated encryption of the data channel.
+ *
+ * If ioctl_usbip_vhci_plugin.key is set, the session keys are negotiated by OP_REQ_CRYPKEY before OP_REQ_IMPORT,
+ * see <usbip/crypto_wire.h> for the wire format. Every connection, including reconnects, has its own keys.
+ * OP_REQ_IMPORT and OP_REP_IMPORT are sent in records, so busid, speed and devid of the reply are trusted
+ * only after its tag is checked. A forged length fails the tag check, as well as a replayed, reordered
+ * or dropped record.
+ *
+ * This driver sends one PDU per record, a received PDU can span records.
+ *
+ * CNG is used with BCRYPT_PROV_DISPATCH, it uses AES-NI and PCLMULQDQ if CPU has them.
+ * The record is sealed in a single pass right from the MDL chain of the PDU with chained GCM calls,
+ * the sealing is done by the drainer of tx_queue, thus records are numbered in the order they are sent.
+ * A received record is decrypted in place, then the receive loop takes PDUs from it as from the socket.
+ */
+#include "crypto.h"
+#include "trace.h"
+#include "crypto.tmh"
+
+#include <usbip\proto_op.h>
+#include <usbip\crypto_wire.h>
+
+#include "dev.h"
+#include "network.h"
+#include "wsk_context.h"
+
+namespace
+{
+
+BCRYPT_ALG_HANDLE g_aes; // GCM, is used at DISPATCH_LEVEL
+BCRYPT_ALG_HANDLE g_hmac; // SHA256
+
+enum : ULONG { AES_BLOCK = 16 };
+
+using nonce_t = UCHAR[CRYPTO_IV_SIZE];
+
+/*
+ * GCM requires that all chained calls except the last one encrypt whole blocks.
+ * The pieces of the MDL chain have arbitrary length, a block that spans them is collected in carry.
+ * The last call gets the tail of plaintext, from one to AES_BLOCK bytes.
+ */
+class sealer
+{
+public:
+        sealer(_In_ crypto_session &s, _Out_writes_(CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE) UCHAR *rec, _In_ ULONG len);
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        NTSTATUS update(_In_reads_bytes_(len) const UCHAR *data, _In_ ULONG len);
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        NTSTATUS finish();
+
+private:
+        BCRYPT_KEY_HANDLE m_key;
+        BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO m_info;
+        nonce_t m_nonce;
+        UCHAR m_mac[CRYPTO_TAG_SIZE]; // context of chained calls
+        UCHAR m_iv[AES_BLOCK];
+        bool m_chained{};
+
+        UCHAR m_carry[AES_BLOCK];
+        ULONG m_carry_len{};
+
+        ULONG m_pos{}; // of plaintext
+        ULONG m_limit; // plaintext that is encrypted by chained calls
+        UCHAR *m_out;
+
+        NTSTATUS encrypt(_In_reads_bytes_(len) const UCHAR *data, _In_ ULONG len, _In_ bool last);
+};
+
+sealer::sealer(_In_ crypto_session &s, UCHAR *rec, _In_ ULONG len) :
+        m_key(s.tx_key),
+        m_out(rec + CRYPTO_HDR_SIZE)
+{
+        NT_ASSERT(len);
+
+        auto tail = len % AES_BLOCK;
+        m_limit = len - (tail ? tail : AES_BLOCK);
+
+        auto hdr = RtlUlongByteSwap(len);
+        RtlCopyMemory(rec, &hdr, sizeof(hdr));
+
+        make_crypto_iv(m_nonce, s.tx_salt, s.tx_seq);
+
+        RtlZeroMemory(m_mac, sizeof(m_mac));
+        RtlZeroMemory(m_iv, sizeof(m_iv));
+
+        BCRYPT_INIT_AUTH_MODE_INFO(m_info);
+        m_info.pbNonce = m_nonce;
+        m_info.cbNonce = sizeof(m_nonce);
+        m_info.pbTag = m_out + len;
+        m_info.cbTag = CRYPTO_TAG_SIZE;
+        m_info.pbMacContext = m_mac;
+        m_info.cbMacContext = sizeof(m_mac);
+        m_info.dwFlags = BCRYPT_AUTH_MODE_CHAIN_CALLS_FLAG;
+}
+
+NTSTATUS sealer::encrypt(_In_ const UCHAR *data, _In_ ULONG len, _In_ bool last)
+{
+        if (last) {
+                m_info.dwFlags &= ~BCRYPT_AUTH_MODE_CHAIN_CALLS_FLAG;
+        } else {
+                NT_ASSERT(!(len % AES_BLOCK));
+                m_chained = true;
+        }
+
+        auto iv = m_chained ? m_iv : nullptr;
+        ULONG done{};
+
+        auto err = BCryptEncrypt(m_key, const_cast<UCHAR*>(data), len, &m_info, iv, iv ? sizeof(m_iv) : 0,
+                                 m_out, len, &done, 0);
+
+        m_out += len;
+        return err;
+}
+
+NTSTATUS sealer::update(_In_ const UCHAR *data, _In_ ULONG len)
+{
+        while (len) {
+                ULONG n;
+
+                if (m_pos < m_limit && !m_carry_len && len >= AES_BLOCK) { // m_pos and m_limit are multiple of AES_BLOCK
+                        n = min(len, m_limit - m_pos) & ~(AES_BLOCK - 1);
+                        if (auto err = encrypt(data, n, false)) {
+                                return err;
+                        }
+                } else {
+                        n = min(len, AES_BLOCK - m_carry_len); // the tail fits too
+
+                        RtlCopyMemory(m_carry + m_carry_len, data, n);
+                        m_carry_len += n;
+
+                        if (m_pos < m_limit && m_carry_len == AES_BLOCK) {
+                                m_carry_len = 0;
+                                if (auto err = encrypt(m_carry, AES_BLOCK, false)) {
+                                        return err;
+                                }
+                        }
+                }
+
+                data += n;
+                len -= n;
+                m_pos += n;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+NTSTATUS sealer::finish()
+{
+        NT_ASSERT(m_pos > m_limit);
+        NT_ASSERT(m_carry_len == m_pos - m_limit);
+
+        return encrypt(m_carry, m_carry_len, true);
+}
+
+/*
+ * @param f is called for each piece of the buffer
+ * @see advance
+ */
+template<typename F>
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS for_each_piece(_In_ const WSK_BUF &buf, _In_ const F &f)
+{
+        auto remaining = ULONG(buf.Length);
+        auto offset = buf.Offset;
+
+        for (auto mdl = buf.Mdl; remaining; mdl = mdl->Next, offset = 0) {
+                NT_ASSERT(mdl);
+
+                auto va = static_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+                if (!va) {
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                auto n = min(MmGetMdlByteCount(mdl) - offset, remaining);
+
+                if (auto err = f(va + offset, n)) {
+                        return err;
+                }
+
+                remaining -= n;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Skips len bytes of the buffer, the offset is kept within the first MDL if the buffer is not empty.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void advance(_Inout_ WSK_BUF &buf, _In_ ULONG len)
+{
+        NT_ASSERT(len <= buf.Length);
+
+        buf.Length -= len;
+        buf.Offset += len;
+
+        while (buf.Length && buf.Offset >= MmGetMdlByteCount(buf.Mdl)) {
+                buf.Offset -= MmGetMdlByteCount(buf.Mdl);
+                buf.Mdl = buf.Mdl->Next;
+                NT_ASSERT(buf.Mdl);
+        }
+}
+
+/*
+ * @param transcript OP_REQ_CRYPKEY and OP_REP_CRYPKEY as they were sent
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto derive_key(
+        _Inout_ BCRYPT_KEY_HANDLE &key, _Out_ UCHAR (&salt)[CRYPTO_SALT_SIZE], _In_ const crypto_session &s, 
+        _In_ const char (&label)[CRYPTO_LABEL_SIZE + 1], _In_ const UCHAR (&transcript)[CRYPTO_TRANSCRIPT_SIZE])
+{
+        PAGED_CODE();
+
+        UCHAR msg[CRYPTO_LABEL_SIZE + CRYPTO_TRANSCRIPT_SIZE];
+
+        RtlCopyMemory(msg, label, CRYPTO_LABEL_SIZE);
+        RtlCopyMemory(msg + CRYPTO_LABEL_SIZE, transcript, sizeof(transcript));
+
+        UCHAR okm[32]; // HMAC-SHA256
+        static_assert(USBIP_KEY_SIZE + sizeof(salt) <= sizeof(okm));
+
+        auto err = BCryptHash(g_hmac, const_cast<UCHAR*>(s.psk), sizeof(s.psk),
+                              msg, sizeof(msg), okm, sizeof(okm));
+
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptHash %!STATUS!", err);
+        } else {
+                if (key) {
+                        BCryptDestroyKey(key);
+                        key = nullptr;
+                }
+
+                err = BCryptGenerateSymmetricKey(g_aes, &key, nullptr, 0, okm, USBIP_KEY_SIZE, 0);
+                if (err) {
+                        Trace(TRACE_LEVEL_ERROR, "BCryptGenerateSymmetricKey %!STATUS!", err);
+                }
+
+                RtlCopyMemory(salt, okm + USBIP_KEY_SIZE, sizeof(salt));
+        }
+
+        RtlSecureZeroMemory(okm, sizeof(okm));
+        return err;
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_crypto()
+{
+        PAGED_CODE();
+
+        if (auto err = BCryptOpenAlgorithmProvider(&g_aes, BCRYPT_AES_ALGORITHM, nullptr, BCRYPT_PROV_DISPATCH)) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptOpenAlgorithmProvider(AES) %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = BCryptSetProperty(g_aes, BCRYPT_CHAINING_MODE,
+                                         (UCHAR*)BCRYPT_CHAIN_MODE_GCM, sizeof(BCRYPT_CHAIN_MODE_GCM), 0)) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptSetProperty(GCM) %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = BCryptOpenAlgorithmProvider(&g_hmac, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG)) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptOpenAlgorithmProvider(HMAC) %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void shutdown_crypto()
+{
+        PAGED_CODE();
+
+        if (g_hmac) {
+                BCryptCloseAlgorithmProvider(g_hmac, 0);
+                g_hmac = nullptr;
+        }
+
+        if (g_aes) {
+                BCryptCloseAlgorithmProvider(g_aes, 0);
+                g_aes = nullptr;
+        }
+}
+
+/*
+ * The key is wiped from the request because it is copied back to the caller.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_session(_Inout_ vpdo_dev_t &vpdo, _Inout_ ioctl_usbip_vhci_plugin &r)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vpdo.crypto);
+
+        auto &key = r.key;
+
+        UCHAR set = 0;
+        for (auto b: key) {
+                set |= b;
+        }
+
+        if (!set) {
+                return STATUS_SUCCESS;
+        }
+
+        auto s = (crypto_session*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*s), USBIP_VHCI_POOL_TAG);
+        if (!s) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate crypto_session");
+                RtlSecureZeroMemory(key, sizeof(key));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        vpdo.crypto = s;
+
+        RtlCopyMemory(s->psk, key, sizeof(key));
+        RtlSecureZeroMemory(key, sizeof(key));
+
+        s->mdl_rx_hdr = usbip::Mdl(&s->rx_hdr, sizeof(s->rx_hdr));
+        if (auto err = s->mdl_rx_hdr.prepare_nonpaged()) {
+                Trace(TRACE_LEVEL_ERROR, "mdl_rx_hdr %!STATUS!", err);
+                return err;
+        }
+
+        TraceMsg("vpdo %04x, the data channel is encrypted", ptr4log(&vpdo));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_session(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        auto s = vpdo.crypto;
+        if (!s) {
+                return;
+        }
+
+        TraceMsg("vpdo %04x, records sent %I64u, received %I64u", ptr4log(&vpdo), s->tx_seq, s->rx_seq);
+
+        if (s->tx_key) {
+                BCryptDestroyKey(s->tx_key);
+        }
+
+        if (s->rx_key) {
+                BCryptDestroyKey(s->rx_key);
+        }
+
+        s->mdl_rx_hdr.reset();
+        s->mdl_rx_buf.reset();
+
+        if (auto buf = s->rx_buf) {
+                ExFreePoolWithTag(buf, USBIP_VHCI_POOL_TAG);
+        }
+
+        RtlSecureZeroMemory(s, sizeof(*s));
+        ExFreePoolWithTag(s, USBIP_VHCI_POOL_TAG);
+
+        vpdo.crypto = nullptr;
+}
+
+/*
+ * The socket is connected, the receive loop is not running.
+ * The keys are bound to both messages, the reply is authenticated by the tag of the first record, see recv_rep_import.
+ * @return result made by make_error()
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE int negotiate_keys(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+        auto &s = *vpdo.crypto;
+
+        struct
+        {
+                op_common hdr;
+                union {
+                        op_crypkey_request req;
+                        op_crypkey_reply rep;
+                } body;
+        } msg[2]{ { .hdr{ USBIP_VERSION, OP_REQ_CRYPKEY, ST_OK } } }; // the transcript
+
+        static_assert(sizeof(op_crypkey_request) == CRYPTO_NONCE_SIZE);
+        static_assert(sizeof(op_crypkey_reply) == CRYPTO_NONCE_SIZE);
+        static_assert(sizeof(msg) == CRYPTO_TRANSCRIPT_SIZE); // packed
+        auto &[req, reply] = msg;
+
+        if (auto err = BCryptGenRandom(nullptr, reinterpret_cast<UCHAR*>(&req.body.req), sizeof(req.body.req),
+                                       BCRYPT_USE_SYSTEM_PREFERRED_RNG)) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptGenRandom %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        PACK_OP_COMMON(0, &req.hdr); // the nonce is opaque
+
+        if (auto err = usbip::send(vpdo.sock, usbip::memory::stack, &req, sizeof(req))) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_CRYPKEY %!STATUS!", err);
+                return make_error(ERR_NETWORK);
+        }
+
+        if (auto err = usbip::recv(vpdo.sock, usbip::memory::stack, &reply, sizeof(reply))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive OP_REP_CRYPKEY %!STATUS!", err);
+                return make_error(ERR_NETWORK);
+        }
+
+        auto hdr = reply.hdr; // the transcript keeps network byte order
+        auto status = ST_OK;
+
+        if (auto err = usbip::check_op_common(hdr, OP_REP_CRYPKEY, status)) {
+                return make_error(err);
+        }
+
+        if (status) {
+                Trace(TRACE_LEVEL_ERROR, "OP_REP_CRYPKEY %!op_status_t!", status);
+                return make_error(ERR_ACCESS);
+        }
+
+        auto &transcript = reinterpret_cast<const UCHAR(&)[CRYPTO_TRANSCRIPT_SIZE]>(msg);
+
+        if (derive_key(s.tx_key, s.tx_salt, s, crypto_label_c2s, transcript) ||
+            derive_key(s.rx_key, s.rx_salt, s, crypto_label_s2c, transcript)) {
+                return make_error(ERR_GENERAL);
+        }
+
+        s.tx_seq = 0;
+        s.rx_seq = 0;
+
+        s.rx_pos = 0;
+        s.rx_len = 0;
+
+        TraceDbg("vpdo %04x, session keys are set", ptr4log(&vpdo));
+        return make_error(ERR_NONE);
+}
+
+/*
+ * Synchronous send of a PDU, the receive loop must not be running.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS send_data(_Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _In_ void *data, _In_ ULONG len)
+{
+        PAGED_CODE();
+
+        auto s = vpdo.crypto;
+        if (!s) {
+                return usbip::send(vpdo.sock, pool, data, len);
+        }
+
+        if (!len || len > CRYPTO_MAX_RECORD) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        ULONG rec_len = CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE;
+
+        auto rec = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, rec_len, USBIP_VHCI_POOL_TAG);
+        if (!rec) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        sealer w(*s, rec, len);
+
+        auto err = w.update(static_cast<UCHAR*>(data), len);
+        if (!err) {
+                err = w.finish();
+        }
+
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "BCryptEncrypt %!STATUS!", err);
+        } else {
+                ++s->tx_seq;
+                err = usbip::send(vpdo.sock, usbip::memory::nonpaged, rec, rec_len);
+        }
+
+        ExFreePoolWithTag(rec, USBIP_VHCI_POOL_TAG);
+        return err;
+}
+
+/*
+ * Synchronous receive of a PDU or its part, the receive loop must not be running.
+ * @return STATUS_AUTH_TAG_MISMATCH if a record is forged or the peer has another key
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS recv_data(_Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _Out_ void *data, _In_ ULONG len)
+{
+        PAGED_CODE();
+
+        auto s = vpdo.crypto;
+        if (!s) {
+                return usbip::recv(vpdo.sock, pool, data, len);
+        }
+
+        for (auto dst = static_cast<UCHAR*>(data); len; ) {
+
+                if (!s->rx_len) {
+                        WSK_BUF buf{ s->mdl_rx_hdr.get(), 0, CRYPTO_HDR_SIZE };
+
+                        if (auto err = receive(vpdo.sock, &buf)) {
+                                return err;
+                        }
+
+                        if (auto err = prepare_record(*s, buf)) {
+                                return err;
+                        }
+
+                        if (auto err = receive(vpdo.sock, &buf)) {
+                                return err;
+                        }
+
+                        if (auto err = open_record(*s)) {
+                                return err;
+                        }
+                }
+
+                auto n = min(len, s->rx_len);
+                RtlCopyMemory(dst, s->rx_buf + s->rx_pos, n);
+
+                s->rx_pos += n;
+                s->rx_len -= n;
+
+                dst += n;
+                len -= n;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Replaces ctx.tx_buf with the record, must be called in the order the records are sent.
+ * @see tx.cpp, transmit
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS seal(_Inout_ vpdo_dev_t &vpdo, _Inout_ wsk_context &ctx)
+{
+        auto &s = *vpdo.crypto;
+        auto &buf = ctx.tx_buf;
+
+        auto len = ULONG(buf.Length);
+        if (!len || len > CRYPTO_MAX_RECORD) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        ULONG rec_len = CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE;
+
+        if (auto err = prepare_sealed(ctx, rec_len)) {
+                Trace(TRACE_LEVEL_ERROR, "prepare_sealed(%lu) %!STATUS!", rec_len, err);
+                return err;
+        }
+
+        sealer w(s, ctx.rec, len);
+
+        auto err = for_each_piece(buf, [&w] (auto data, auto n) { return w.update(data, n); });
+        if (!err) {
+                err = w.finish();
+        }
+
+        if (err) {
+                Trace(TRACE_LEVEL_ERROR, "ctx %04x, %!STATUS!", ptr4log(&ctx), err);
+                return err;
+        }
+
+        ++s.tx_seq;
+        buf = WSK_BUF{ ctx.mdl_rec.get(), 0, rec_len };
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * rx_hdr is received.
+ * @param buf describes the rest of the record
+ *
+ * The buffer is reallocated to the record's size if it is too small,
+ * or if it is longer than CRYPTO_KEEP_RECORD and the record fits in that.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS prepare_record(_Inout_ crypto_session &s, _Out_ WSK_BUF &buf)
+{
+        auto len = RtlUlongByteSwap(s.rx_hdr);
+
+        if (!len || len > CRYPTO_MAX_RECORD) {
+                Trace(TRACE_LEVEL_ERROR, "Invalid record length %lu", len);
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        ULONG rec_len = len + CRYPTO_TAG_SIZE;
+
+        if (s.rx_alloc < rec_len || (s.rx_alloc > CRYPTO_KEEP_RECORD + CRYPTO_TAG_SIZE && rec_len <= CRYPTO_KEEP_RECORD)) {
+                auto ptr = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, rec_len, USBIP_VHCI_POOL_TAG);
+                if (!ptr) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", rec_len);
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                s.mdl_rx_buf.reset();
+
+                if (s.rx_buf) {
+                        ExFreePoolWithTag(s.rx_buf, USBIP_VHCI_POOL_TAG);
+                }
+
+                s.rx_buf = ptr;
+                s.rx_alloc = rec_len;
+
+                s.mdl_rx_buf = usbip::Mdl(s.rx_buf, s.rx_alloc);
+                if (auto err = s.mdl_rx_buf.prepare_nonpaged()) {
+                        s.rx_alloc = 0; // try again next time
+                        return err;
+                }
+        }
+
+        buf = WSK_BUF{ s.mdl_rx_buf.get(), 0, rec_len };
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The record is received by prepare_record's buffer.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS open_record(_Inout_ crypto_session &s)
+{
+        auto len = RtlUlongByteSwap(s.rx_hdr);
+
+        nonce_t nonce;
+        make_crypto_iv(nonce, s.rx_salt, s.rx_seq);
+
+        BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+        BCRYPT_INIT_AUTH_MODE_INFO(info);
+
+        info.pbNonce = nonce;
+        info.cbNonce = sizeof(nonce);
+        info.pbTag = s.rx_buf + len;
+        info.cbTag = CRYPTO_TAG_SIZE;
+
+        ULONG done{};
+
+        if (auto err = BCryptDecrypt(s.rx_key, s.rx_buf, len, &info, nullptr, 0, s.rx_buf, len, &done, 0)) {
+                Trace(TRACE_LEVEL_ERROR, "record #%I64u, length %lu, %!STATUS!", s.rx_seq, len, err);
+                return err;
+        }
+
+        ++s.rx_seq;
+
+        s.rx_pos = 0;
+        s.rx_len = len;
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Copies the plaintext that is left in the opened record, as much as dst can take.
+ * @param dst is advanced by the number of copied bytes, the next record is required if it is not empty
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS read_plaintext(_Inout_ crypto_session &s, _Inout_ WSK_BUF &dst)
+{
+        auto len = min(ULONG(dst.Length), s.rx_len);
+        auto src = s.rx_buf + s.rx_pos;
+
+        auto part = dst;
+        part.Length = len;
+
+        auto err = for_each_piece(part, [&src] (auto data, auto n)
+        {
+                RtlCopyMemory(data, src, n);
+                src += n;
+                return STATUS_SUCCESS;
+        });
+
+        if (!err) {
+                s.rx_pos += len;
+                s.rx_len -= len;
+                advance(dst, len);
+        }
+
+        return err;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <usbip\vhci.h>
+
+#include <libdrv\pageable.h>
+#include <libdrv\mdl_cpp.h>
+
+#include <wdm.h>
+#include <wsk.h>
+#include <bcrypt.h>
+
+struct vpdo_dev_t;
+struct wsk_context;
+
+/*
+ * Encrypted data channel of a device, see crypto.cpp.
+ */
+struct crypto_session
+{
+        UCHAR psk[USBIP_KEY_SIZE]; // pre-shared key
+
+        // session keys, see negotiate_keys
+        BCRYPT_KEY_HANDLE tx_key;
+        BCRYPT_KEY_HANDLE rx_key;
+        UCHAR tx_salt[CRYPTO_SALT_SIZE];
+        UCHAR rx_salt[CRYPTO_SALT_SIZE];
+        UINT64 tx_seq; // of the next record, guarded by tx_queue.drain_req
+        UINT64 rx_seq;
+
+        // the record that is being received, it is decrypted in place
+        UINT32 rx_hdr; // length of plaintext, network byte order, CRYPTO_HDR_SIZE
+        usbip::Mdl mdl_rx_hdr;
+        UCHAR *rx_buf;
+        ULONG rx_alloc;
+        usbip::Mdl mdl_rx_buf;
+        ULONG rx_pos; // of unread plaintext
+        ULONG rx_len; // unread plaintext
+        WSK_BUF rx_dst; // the rest of pending receive, see wsk_receive.cpp
+};
+
+static_assert(sizeof(crypto_session::rx_hdr) == CRYPTO_HDR_SIZE);
+
+enum : ULONG { CRYPTO_KEEP_RECORD = 64*1024 }; // buffers for longer records are not kept for reuse
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_crypto();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void shutdown_crypto();
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_session(_Inout_ vpdo_dev_t &vpdo, _Inout_ ioctl_usbip_vhci_plugin &r);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_session(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE int negotiate_keys(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS send_data(_Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _In_ void *data, _In_ ULONG len);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS recv_data(_Inout_ vpdo_dev_t &vpdo, _In_ usbip::memory pool, _Out_ void *data, _In_ ULONG len);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS seal(_Inout_ vpdo_dev_t &vpdo, _Inout_ wsk_context &ctx);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS prepare_record(_Inout_ crypto_session &s, _Out_ WSK_BUF &buf);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS open_record(_Inout_ crypto_session &s);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS read_plaintext(_Inout_ crypto_session &s, _Inout_ WSK_BUF &dst);
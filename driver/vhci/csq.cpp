@@ -9,6 +9,7 @@
 #include "dev.h"
 #include "irp.h"
 #include "internal_ioctl.h"
+#include "budget.h"
 
 
 namespace
@@ -115,11 +116,25 @@ void ReleaseLock(_In_ IO_CSQ *csq, _In_ KIRQL Irql)
 	KeReleaseSpinLock(&vpdo->irps_lock, Irql);
 }
 
+/*
+ * The IRP is not in flight anymore, see budget.cpp.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto released(_Inout_ vpdo_dev_t &vpdo, _In_opt_ IRP *irp)
+{
+	if (irp) {
+		release_budget(vpdo, irp);
+	}
+	return irp;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void CompleteCanceledIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
 {
 	TraceMsg("%04x", ptr4log(irp));
 	auto vpdo = to_vpdo(csq);
+
+	release_budget(*vpdo, irp);
 	send_cmd_unlink(*vpdo, irp);
 }
 
@@ -134,6 +149,8 @@ PAGEABLE NTSTATUS init_queue(_Inout_ vpdo_dev_t &vpdo)
 	InitializeListHead(&vpdo.irps);
 	KeInitializeSpinLock(&vpdo.irps_lock);
 
+	init_tx(vpdo.tx);
+
 	return IoCsqInitialize(&vpdo.irps_csq,
 				InsertIrp,
 				RemoveIrp,
@@ -153,18 +170,18 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 IRP *dequeue_irp(_Inout_ vpdo_dev_t &vpdo, _In_ seqnum_t seqnum)
 {
 	auto ctx = make_peek_context(seqnum);
-	return IoCsqRemoveNextIrp(&vpdo.irps_csq, &ctx);
+	return released(vpdo, IoCsqRemoveNextIrp(&vpdo.irps_csq, &ctx));
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 IRP *dequeue_irp(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle)
 {
 	auto ctx = make_peek_context(handle);
-	return IoCsqRemoveNextIrp(&vpdo.irps_csq, &ctx);
+	return released(vpdo, IoCsqRemoveNextIrp(&vpdo.irps_csq, &ctx));
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 IRP *dequeue_irp(_Inout_ vpdo_dev_t &vpdo)
 {
-	return IoCsqRemoveNextIrp(&vpdo.irps_csq, nullptr);
+	return released(vpdo, IoCsqRemoveNextIrp(&vpdo.irps_csq, nullptr));
 }
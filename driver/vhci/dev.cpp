@@ -99,13 +99,48 @@ PAGEABLE DEVICE_OBJECT *vdev_create(_In_ DRIVER_OBJECT *drvobj, _In_ hci_version
 	return devobj;
 }
 
-vhub_dev_t *vhub_from_vhci(vhci_dev_t *vhci)
+/*
+ * @param index of the hub, the first one serves IOCTLs of the vhci
+ */
+vhub_dev_t *vhub_from_vhci(vhci_dev_t *vhci, int index)
 {	
 	NT_ASSERT(vhci);
-	auto child_pdo = vhci->child_pdo;
+	if (!(index >= 0 && index < vhci->num_hubs)) {
+		return nullptr;
+	}
+
+	auto child_pdo = vhci->children_pdo[index];
 	return child_pdo ? static_cast<vhub_dev_t*>(child_pdo->fdo) : nullptr;
 }
 
+/*
+ * get_vhub follows the links from PDO to FDO under the lock of the root,
+ * the device extension can't go away while the lock is held.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink_fdo(_Inout_ vdev_t &fdo)
+{
+	auto &pdo = *to_vdev(fdo.pdo);
+	NT_ASSERT(pdo.fdo == &fdo);
+
+	auto root = fdo.parent;
+	while (root && root->type != VDEV_ROOT) {
+		root = root->parent;
+	}
+
+	if (!root) {
+		pdo.fdo = nullptr;
+		return;
+	}
+
+	auto &lock = static_cast<root_dev_t*>(root)->lock;
+
+	KIRQL irql;
+	KeAcquireSpinLock(&lock, &irql);
+	pdo.fdo = nullptr;
+	KeReleaseSpinLock(&lock, irql);
+}
+
 vhci_dev_t *to_vhci_or_null(DEVICE_OBJECT *devobj)
 {
 	auto vdev = to_vdev(devobj);
@@ -9,8 +9,16 @@
 #include <wmilib.h>
 
 #include "devconf.h"
+#include "frame_clock.h"
+#include "tx.h"
+#include "budget.h"
 
 struct wsk_context;
+struct jitter_buffer;
+struct crypto_session;
+struct heartbeat_state;
+struct config_index;
+struct path_delay_state;
 
 namespace wsk
 {
@@ -58,7 +66,6 @@ struct vdev_t
 	SYSTEM_POWER_STATE SystemPowerState;
 	DEVICE_POWER_STATE DevicePowerState;
 
-	vdev_t *child_pdo; // use children_pdo for root_dev_t
 	vdev_t *parent;
 	vdev_t *fdo;
 
@@ -71,10 +78,15 @@ struct vdev_t
 struct root_dev_t : vdev_t 
 {
 	vdev_t* children_pdo[ARRAYSIZE(vhci_list)];
+	KSPIN_LOCK lock; // guards vdev_t::fdo of vhci's and vhub's PDOs, see get_vhub
 };
 
 struct cpdo_dev_t : vdev_t {};
-struct hpdo_dev_t : vdev_t {};
+
+struct hpdo_dev_t : vdev_t 
+{
+	int index; // of the hub in vhci_dev_t::children_pdo
+};
 
 struct vhci_dev_t : vdev_t
 {
@@ -83,6 +95,19 @@ struct vhci_dev_t : vdev_t
 
 	WMILIB_CONTEXT WmiLibInfo;
 	USBIP_BUS_WMI_STD_DATA StdUSBIPBusData;
+
+	int num_ports; // Globals.num_ports at the time the vhci was added
+	int num_hubs; // vhci_num_hubs(version, num_ports)
+	vdev_t* children_pdo[VHCI_MAX_HUBS]; // hpdo of each hub, [num_hubs]
+
+	// journal of attach/detach of all hubs, see IOCTL_USBIP_VHCI_GET_PORT_CHANGES
+	enum { NUM_CHANGES = 1024 }; // power of two, holds the changes of HCI with all ports used
+	ioctl_usbip_vhci_port_change changes[NUM_CHANGES]; // by generation % NUM_CHANGES
+	UINT32 generation; // of the last change
+
+	IO_CSQ changes_csq; // pending IOCTL_USBIP_VHCI_GET_PORT_CHANGES
+	LIST_ENTRY changes_irps;
+	KSPIN_LOCK changes_lock; // also guards the journal
 };
 
 // The device extension for the vpdo.
@@ -96,8 +121,9 @@ struct vpdo_dev_t : vdev_t
         UNICODE_STRING serial; // user-defined
         //
 
-        int port; // unique port number of the device on hub, [1, vhub_dev_t::NUM_PORTS]
+        int port; // unique port number of the device on hub, [1, vhub_dev_t::num_ports], see make_rhport
 	volatile bool unplugged; // see IOCTL_USBIP_VHCI_UNPLUG_HARDWARE
+	EX_RUNDOWN_REF port_ref; // held by vpdo_ref, see vhub_find_vpdo
 
         UINT32 devid;
         static_assert(sizeof(devid) == sizeof(usbip_header_basic::devid));
@@ -114,25 +140,68 @@ struct vpdo_dev_t : vdev_t
 	USB_STRING_DESCRIPTOR* strings[32]; // max size is MAXUCHAR + 1
 
 	USB_CONFIGURATION_DESCRIPTOR *actconfig; // NULL if unconfigured
+	config_index *actindex; // of actconfig
 
 	UCHAR current_intf_num;
 	UCHAR current_intf_alt;
-	ULONG current_frame_number;
+
+	// replayed after reconnect
+	UCHAR current_config; // bConfigurationValue of the last SELECT_CONFIGURATION, zero if unconfigured
+	UCHAR intf_alt[32]; // AlternateSetting of the last SELECT_INTERFACE by InterfaceNumber
+	frame_clock bus_time; // see QueryBusTime
 
 	UNICODE_STRING usb_dev_interface;
 	
 	seqnum_t seqnum; // @see next_seqnum
 	
 	wsk::SOCKET *sock;
+	crypto_session *crypto; // NULL if the data channel is not encrypted, see crypto.cpp
 	_IO_WORKITEM *workitem;
 
 	using received_fn = NTSTATUS (wsk_context&);
 	received_fn *received;
 	size_t receive_size;
 
+	bdp_estimator rx_bdp; // SO_RCVBUF if enabled, see bdp.cpp
+	ULONG rcvbuf; // that is set, zero if the default
+
 	IO_CSQ irps_csq;
 	LIST_ENTRY irps;
 	KSPIN_LOCK irps_lock;
+
+	tx_queue tx; // see tx.cpp
+	urb_budget budget; // see budget.cpp
+
+	// transparent reconnect, see reconnect.cpp
+	USHORT reconnect_timeout; // seconds, zero if the device is unplugged on connection loss
+	volatile LONG reconnecting;
+	_IO_WORKITEM *reconnect_workitem;
+	EX_RUNDOWN_REF reconnect_ref; // the worker must be finished before destroying
+	KEVENT reconnect_stop;
+
+	EX_RUNDOWN_REF sock_ref; // sock can be replaced, send and receive must hold it
+	KEVENT recv_stopped; // the receive loop has exited
+
+	IO_CSQ held_csq; // URBs that arrive while reconnecting
+	LIST_ENTRY held_irps;
+	KSPIN_LOCK held_lock;
+
+	// see segment.cpp
+	ULONG segment_size; // multiple of USBIP_SEGMENT_ALIGN, zero if disabled
+	UINT32 segment_endpoints;
+
+	// see open_static_streams
+	bool streams; // ioctl_usbip_vhci_plugin.streams and the server confirmed it, see negotiate_streams
+	USHORT open_streams[32]; // NumberOfStreams by get_endpoint_index, zero if closed
+
+	jitter_buffer *jitter[15]; // isoch IN endpoints 1..15, see jitter.cpp
+	heartbeat_state *heartbeat; // NULL if disabled, see heartbeat.cpp
+	path_delay_state *path_delay; // see path_delay.cpp
+
+	// see unlink_irps
+	volatile LONG abort_cnt;
+	volatile LONG64 abort_time; // total, 100ns units
+	volatile LONG64 abort_time_max;
 };
 
 /*
@@ -142,9 +211,13 @@ struct vhub_dev_t : vdev_t
 {
 	UNICODE_STRING DevIntfRootHub;
 
-	enum { NUM_PORTS = VHUB_NUM_PORTS };
-	vpdo_dev_t *vpdo[NUM_PORTS];
+	int index; // of the hub on its vhci
+	int num_ports; // vhub_num_ports(version, vhci_dev_t::num_ports, index)
+	vpdo_dev_t **vpdo; // [num_ports], by port - 1; modified under mutex and exclusive vpdo_lock
+	EX_SPIN_LOCK vpdo_lock; // taken shared by vhub_find_vpdo only for a few instructions
 	FAST_MUTEX mutex;
+
+	EX_RUNDOWN_REF ref; // held by vhub_ref, see get_vhub
 };
 
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -158,7 +231,10 @@ constexpr auto is_fdo(vdev_type_t type)
 	return type == VDEV_ROOT || type == VDEV_VHCI || type == VDEV_VHUB;
 }
 
-vhub_dev_t *vhub_from_vhci(vhci_dev_t *vhci);
+vhub_dev_t *vhub_from_vhci(vhci_dev_t *vhci, int index = 0);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink_fdo(_Inout_ vdev_t &fdo);
 
 inline auto vhub_from_vpdo(vpdo_dev_t *vpdo)
 {
@@ -166,6 +242,16 @@ inline auto vhub_from_vpdo(vpdo_dev_t *vpdo)
 	return static_cast<vhub_dev_t*>(vpdo->parent);
 }
 
+constexpr auto is_valid_port(const vhub_dev_t &vhub, int port)
+{
+	return port > 0 && port <= vhub.num_ports;
+}
+
+constexpr auto make_vport(const vhub_dev_t &vhub, int port) // of the hub
+{
+	return make_vport(vhub.version, make_rhport(vhub.version, vhub.index, port));
+}
+
 inline auto vhci_from_vhub(vhub_dev_t *vhub)
 {
 	NT_ASSERT(vhub);
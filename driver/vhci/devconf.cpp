@@ -4,8 +4,9 @@
 
 #include "vhci.h"
 
+#include "config_index.h"
+
 #include <usbip\vhci.h>
-#include <libdrv\usbdsc.h>
 #include <libdrv\dbgcommon.h>
 
 #include <ntstrsafe.h>
@@ -30,13 +31,6 @@ inline const void *get_configuration_end(const _URB_SELECT_CONFIGURATION *cfg)
 	return (char*)cfg + cfg->Hdr.Length;
 }
 
-inline auto make_pipe_handle(UCHAR EndpointAddress, USBD_PIPE_TYPE PipeType, UCHAR Interval)
-{
-	UCHAR v[sizeof(USBD_PIPE_HANDLE)] = { EndpointAddress, Interval, static_cast<UCHAR>(PipeType) };
-	NT_ASSERT(*(USBD_PIPE_HANDLE*)v);
-	return *(USBD_PIPE_HANDLE*)v;
-}
-
 inline auto make_interface_handle(UCHAR ifnum, UCHAR altsetting)
 {
 	UCHAR v[sizeof(USBD_INTERFACE_HANDLE)] = { altsetting, ifnum, 1 }; // must be != 0
@@ -55,53 +49,6 @@ inline auto get_interface_number(USBD_INTERFACE_HANDLE handle)
 	return v[1]; 
 }
 
-_IRQL_requires_max_(DISPATCH_LEVEL)
-void set_pipe(_Out_ USBD_PIPE_INFORMATION &pipe, _In_ const USB_ENDPOINT_DESCRIPTOR &epd, _In_ usb_device_speed speed)
-{
-	pipe.MaximumPacketSize = epd.wMaxPacketSize;
-
-	/* From usb_submit_urb in linux */
-	if (pipe.PipeType == UsbdPipeTypeIsochronous && speed == USB_SPEED_HIGH) {
-		USHORT	mult = 1 + ((pipe.MaximumPacketSize >> 11) & 0x03);
-		pipe.MaximumPacketSize &= 0x7ff;
-		pipe.MaximumPacketSize *= mult;
-	}
-
-	pipe.EndpointAddress = epd.bEndpointAddress;
-	pipe.Interval = epd.bInterval;
-	pipe.PipeType = static_cast<USBD_PIPE_TYPE>(epd.bmAttributes & USB_ENDPOINT_TYPE_MASK);
-
-	pipe.PipeHandle = make_pipe_handle(epd.bEndpointAddress, pipe.PipeType, epd.bInterval);
-	NT_ASSERT(pipe.PipeHandle);
-	NT_ASSERT(is_endpoint_direction_in(pipe.PipeHandle) == (bool)USBD_PIPE_DIRECTION_IN(&pipe));
-
-	pipe.MaximumTransferSize = 0; // is not used and does not contain valid data
-	pipe.PipeFlags = 0; // USBD_PF_CHANGE_MAX_PACKET if override MaximumPacketSize
-}
-
-struct init_ep_data
-{
-	USBD_INTERFACE_INFORMATION &iface;
-	usb_device_speed speed;
-};
-
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_Function_class_(for_each_ep_fn)
-NTSTATUS init_ep(int i, const USB_ENDPOINT_DESCRIPTOR &epd, void *data)
-{
-	auto &r = *static_cast<init_ep_data*>(data);
-	auto cnt = r.iface.NumberOfPipes;
-	
-	if (ULONG(i) < cnt) {
-		auto &pipe = r.iface.Pipes[i];
-		set_pipe(pipe, epd, r.speed);
-		return STATUS_SUCCESS;
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Endpoint index %d, NumberOfPipes %lu", i, cnt);
-		return STATUS_INVALID_PARAMETER;
-	}
-}
-
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void interfaces_str(char *buf, size_t len, const USBD_INTERFACE_INFORMATION *r, int cnt, const void *cfg_end)
 {
@@ -146,23 +93,23 @@ void interfaces_str(char *buf, size_t len, const USBD_INTERFACE_INFORMATION *r,
 
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf, usb_device_speed speed, USB_CONFIGURATION_DESCRIPTOR *cfgd)
+NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf, const config_index &idx)
 {
-	NT_ASSERT(cfgd);
-
 	if (intf->Length < sizeof(*intf) - sizeof(intf->Pipes)) { // can have zero pipes
 		Trace(TRACE_LEVEL_ERROR, "Interface length %d is too short", intf->Length);
 		return STATUS_SUCCESS;
 	}
 
-	auto ifd = dsc_find_intf(cfgd, intf->InterfaceNumber, intf->AlternateSetting);
-	if (!ifd) {
+	auto alt = find_altsetting(idx, intf->InterfaceNumber, intf->AlternateSetting);
+	if (!alt) {
 		Trace(TRACE_LEVEL_WARNING, "Can't find descriptor: InterfaceNumber %d, AlternateSetting %d",
 					intf->InterfaceNumber, intf->AlternateSetting);
 
 		return STATUS_INVALID_DEVICE_REQUEST;
 	}
 
+	auto ifd = alt->desc;
+
 	intf->Class = ifd->bInterfaceClass;
 	intf->SubClass = ifd->bInterfaceSubClass;
 	intf->Protocol = ifd->bInterfaceProtocol;
@@ -171,9 +118,21 @@ NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf, usb_device_speed speed, US
 	NT_ASSERT(intf->InterfaceHandle);
 
 	intf->NumberOfPipes = ifd->bNumEndpoints;
-	init_ep_data data{ *intf, speed };
 
-	return for_each_endpoint(cfgd, ifd, init_ep, &data);
+	if (alt->NumberOfPipes != ifd->bNumEndpoints) {
+		Trace(TRACE_LEVEL_ERROR, "InterfaceNumber %d, AlternateSetting %d: bNumEndpoints %d, found %d",
+					intf->InterfaceNumber, intf->AlternateSetting, ifd->bNumEndpoints, alt->NumberOfPipes);
+
+		return STATUS_NO_MORE_MATCHES;
+	}
+
+	auto pipes = get_pipes(idx, *alt);
+
+	for (ULONG i = 0; i < intf->NumberOfPipes; ++i) {
+		intf->Pipes[i] = pipes[i].info;
+	}
+
+	return STATUS_SUCCESS;
 }
 
 /*
@@ -182,7 +141,7 @@ NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf, usb_device_speed speed, US
  * each element in the array for each unique interface number in the configuration. 
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS setup_config(_URB_SELECT_CONFIGURATION *cfg, usb_device_speed speed)
+NTSTATUS setup_config(_URB_SELECT_CONFIGURATION *cfg, const config_index &idx)
 {
 	auto cd = cfg->ConfigurationDescriptor;
 	NT_ASSERT(cd);
@@ -191,7 +150,7 @@ NTSTATUS setup_config(_URB_SELECT_CONFIGURATION *cfg, usb_device_speed speed)
 	auto cfg_end = get_configuration_end(cfg);
 
 	for (int i = 0; i < cd->bNumInterfaces; ++i, iface = next_interface(iface, cfg_end)) {
-		if (auto err = setup_intf(iface, speed, cd)) {
+		if (auto err = setup_intf(iface, idx)) {
 			return err;
 		}
 	}
@@ -6,11 +6,13 @@
 #include <usbip\ch9.h>
 #include <usbip\proto.h> 
 
+struct config_index;
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS setup_config(_URB_SELECT_CONFIGURATION *cfg, usb_device_speed speed);
+NTSTATUS setup_config(_URB_SELECT_CONFIGURATION *cfg, const config_index &idx);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf_info, usb_device_speed speed, USB_CONFIGURATION_DESCRIPTOR *cfgd);
+NTSTATUS setup_intf(USBD_INTERFACE_INFORMATION *intf_info, const config_index &idx);
 
 enum { 
 	SELECT_CONFIGURATION_STR_BUFSZ = 1024, 
@@ -23,6 +25,39 @@ const char *select_configuration_str(char *buf, size_t len, const _URB_SELECT_CO
 _IRQL_requires_max_(DISPATCH_LEVEL)
 const char *select_interface_str(char *buf, size_t len, const _URB_SELECT_INTERFACE *iface);
 
+/*
+ * @param MaxStreams bmAttributes.Bulk.MaxStreams of SuperSpeed endpoint companion descriptor
+ */
+inline auto make_pipe_handle(UCHAR EndpointAddress, USBD_PIPE_TYPE PipeType, UCHAR Interval, UCHAR MaxStreams = 0)
+{
+	UCHAR v[sizeof(USBD_PIPE_HANDLE)] = { EndpointAddress, Interval, static_cast<UCHAR>(PipeType), MaxStreams };
+	NT_ASSERT(*(USBD_PIPE_HANDLE*)v);
+	return *(USBD_PIPE_HANDLE*)v;
+}
+
+static_assert(sizeof(USBD_PIPE_HANDLE) >= 6); // bytes 4-5 are stream ID
+
+/*
+ * @param handle of bulk pipe
+ * @param StreamID [1..get_endpoint_max_streams(handle)]
+ */
+inline auto make_stream_handle(USBD_PIPE_HANDLE handle, USHORT StreamID)
+{
+	auto v = reinterpret_cast<UCHAR*>(&handle);
+	v[4] = static_cast<UCHAR>(StreamID);
+	v[5] = static_cast<UCHAR>(StreamID >> 8);
+	return handle;
+}
+
+/*
+ * @return zero if the handle is not of a stream
+ */
+inline USHORT get_stream_id(USBD_PIPE_HANDLE handle)
+{
+	auto v = reinterpret_cast<UCHAR*>(&handle);
+	return v[4] | (v[5] << 8);
+}
+
 /*
  * @return bEndpointAddress of endpoint descriptor 
  */
@@ -44,12 +79,33 @@ inline auto get_endpoint_type(USBD_PIPE_HANDLE handle)
 	return static_cast<USBD_PIPE_TYPE>(v[2]);
 }
 
+/*
+ * @return number of streams that bulk endpoint supports, zero if none
+ */
+inline ULONG get_endpoint_max_streams(USBD_PIPE_HANDLE handle)
+{
+	auto v = reinterpret_cast<UCHAR*>(&handle);
+	auto n = v[3] & 0x1F; // USB 3.2, 9.6.7: maximum is 2^MaxStreams, MaxStreams <= 16
+
+	enum : ULONG { MAX_STREAM_ID = 0xFFFD }; // 0xFFFE and 0xFFFF are reserved
+	return !n ? 0 : n < 16 ? 1UL << n : MAX_STREAM_ID;
+}
+
 inline UCHAR get_endpoint_number(USBD_PIPE_HANDLE handle)
 {
 	auto addr = get_endpoint_address(handle);
 	return addr & USB_ENDPOINT_ADDRESS_MASK;
 }
 
+/*
+ * @return [0..31], the same as bit number of segment_endpoint_bit
+ */
+inline auto get_endpoint_index(USBD_PIPE_HANDLE handle)
+{
+	auto addr = get_endpoint_address(handle);
+	return (addr & USB_ENDPOINT_ADDRESS_MASK) | (USB_ENDPOINT_DIRECTION_IN(addr) ? 16 : 0);
+}
+
 /*
  * EP0 is bidirectional. 
  */
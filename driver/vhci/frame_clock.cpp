@@ -0,0 +1,316 @@
+/*
+ * The server's frame number is known only from start_frame of isoch RET_SUBMIT,
+ * so the frame counter of a device is driven by KeQueryInterruptTime and disciplined
+ * by start_frame values with a PI loop. QueryBusTime is called at HIGH_LEVEL,
+ * readers therefore do not take locks: sync writes the inactive slot and then
+ * switches readers to it.
+ *
+ * The server's frame counter wraps at an unknown modulus (host controller dependent),
+ * start_frame is compared with the virtual clock modulo FRAME_WRAP that divides any of them.
+ * The virtual counter never goes back, a large phase error is fixed by a step forward,
+ * a small one is slewed by rate correction.
+ *
+ * The loop (evaluate, correct) is constexpr, its step, slew, drift tracking and monotonicity
+ * across a slot switch are checked by static_assert below.
+ */
+#include "frame_clock.h"
+#include "trace.h"
+#include "frame_clock.tmh"
+
+namespace
+{
+
+enum : LONG64 {
+        TICKS_PER_UFRAME = 1250, // KeQueryInterruptTime is in 100ns units, microframe is 125us
+        Q = 16, // fraction bits of state.uframe
+        FIRST_FRAME = 100, // if QueryBusTime returns zero it is called again and again
+};
+
+enum : LONG {
+        FRAME_WRAP = 1024, // xHCI wraps at 2048, EHCI at its periodic frame list size
+        STEP_FRAMES = 32, // phase error that is not slewed
+        MAX_FREQ_PPM = 500, // USB 2.0, 7.1.11
+        MAX_SLEW_PPM = 500,
+};
+
+static_assert(MAX_FREQ_PPM + MAX_SLEW_PPM < 1'000'000, "rate must be positive");
+
+constexpr LONG64 mul_div(LONG64 a, LONG64 b, LONG64 c)
+{
+        return a/c*b + a%c*b/c; // a*b/c without overflow if b*c fits
+}
+
+/*
+ * @param time, uframe, ppm of frame_clock::state
+ * @return Q16 microframes
+ */
+constexpr LONG64 evaluate(LONG64 time, LONG64 uframe, LONG ppm, LONG64 now)
+{
+        auto dt = now - time;
+        if (dt < 0) { // sync has updated the slot after the caller took the time
+                dt = 0;
+        }
+
+        auto d = mul_div(dt, 1LL << Q, TICKS_PER_UFRAME);
+        return uframe + d + mul_div(d, ppm, 1'000'000);
+}
+
+_IRQL_requires_max_(HIGH_LEVEL)
+inline auto evaluate(_In_ const frame_clock::state &s, _In_ LONG64 now)
+{
+        return evaluate(s.time, s.uframe, s.ppm, now);
+}
+
+_IRQL_requires_max_(HIGH_LEVEL)
+void read(_Out_ frame_clock::state &r, _In_ const frame_clock &clk)
+{
+        while (true) {
+                auto &s = clk.slot[clk.active & 1];
+
+                auto seq = s.seq;
+                KeMemoryBarrier();
+
+                r.time = s.time;
+                r.uframe = s.uframe;
+                r.ppm = s.ppm;
+
+                KeMemoryBarrier();
+                if (!(seq & 1) && s.seq == seq) { // otherwise active has been switched
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void write(_Inout_ frame_clock &clk, _In_ LONG64 time, _In_ LONG64 uframe, _In_ LONG ppm)
+{
+        auto idx = !clk.active;
+        auto &s = clk.slot[idx];
+
+        InterlockedIncrement(&s.seq);
+
+        s.time = time;
+        s.uframe = uframe;
+        s.ppm = ppm;
+
+        InterlockedIncrement(&s.seq);
+        InterlockedExchange(&clk.active, idx);
+}
+
+constexpr auto clamp(LONG val, LONG limit)
+{
+        return val < -limit ? -limit : val > limit ? limit : val;
+}
+
+/*
+ * @return the difference in [-FRAME_WRAP/2, FRAME_WRAP/2)
+ */
+constexpr auto frame_diff(ULONG server_frame, ULONG frame)
+{
+        auto d = LONG((server_frame - frame) % FRAME_WRAP);
+        return d < FRAME_WRAP/2 ? d : d - FRAME_WRAP;
+}
+static_assert(frame_diff(5, FRAME_WRAP + 3) == 2);
+static_assert(frame_diff(FRAME_WRAP - 1, 2*FRAME_WRAP) == -1);
+
+struct correction
+{
+        LONG step; // frames to add to the counter, never negative
+        LONG freq_ppm; // new value of frame_clock.freq_ppm
+        LONG ppm; // rate correction of the new slot
+};
+
+/*
+ * @param err phase error in frames, see frame_diff
+ */
+constexpr correction correct(LONG err, LONG freq_ppm)
+{
+        if (err < -STEP_FRAMES || err > STEP_FRAMES) {
+                return { err < 0 ? err + FRAME_WRAP : err, 0, 0 };
+        }
+
+        auto err_us = err*1000;
+        freq_ppm = clamp(freq_ppm + err_us/256, MAX_FREQ_PPM);
+
+        return { 0, freq_ppm, freq_ppm + clamp(err_us/2, MAX_SLEW_PPM) }; // 1us per second is 1ppm
+}
+
+constexpr auto latest(LONG64 last, LONG64 uframe)
+{
+        return last > uframe ? last : uframe;
+}
+
+// a large error is stepped forward, the integrator is reset
+static_assert(correct(STEP_FRAMES + 1, MAX_FREQ_PPM).step == STEP_FRAMES + 1);
+static_assert(correct(STEP_FRAMES + 1, MAX_FREQ_PPM).freq_ppm == 0);
+static_assert(correct(-STEP_FRAMES - 1, 0).step == FRAME_WRAP - STEP_FRAMES - 1);
+static_assert(!correct(STEP_FRAMES + 1, 0).ppm);
+
+// a small one is slewed within limits
+static_assert(!correct(STEP_FRAMES, 0).step && !correct(-STEP_FRAMES, 0).step);
+static_assert(correct(STEP_FRAMES, MAX_FREQ_PPM).ppm == MAX_FREQ_PPM + MAX_SLEW_PPM);
+static_assert(correct(-STEP_FRAMES, -MAX_FREQ_PPM).ppm == -MAX_FREQ_PPM - MAX_SLEW_PPM);
+static_assert(correct(0, 40).freq_ppm == 40 && correct(0, 40).ppm == 40);
+static_assert(correct(1, 0).ppm > 0 && correct(-1, 0).ppm < 0);
+
+/*
+ * A slot runs forward at any rate correction, and is not behind the value of the slot it replaces
+ * at the time of the switch. Readers that still use the previous slot, or took the time before the switch,
+ * can be ahead of the new slot for a while, get_microframe returns the latest value.
+ */
+constexpr bool is_monotonic(LONG old_ppm, LONG err)
+{
+        const LONG64 t0 = 1'000'000;
+        const LONG64 t1 = t0 + 500*TICKS_PER_UFRAME; // switch
+        const LONG64 u0 = (FIRST_FRAME << 3) << Q;
+
+        auto c = correct(err, old_ppm);
+        auto u1 = evaluate(t0, u0, old_ppm, t1) + (LONG64(c.step) << (Q + 3));
+
+        if (u1 < evaluate(t0, u0, old_ppm, t1)) {
+                return false;
+        }
+
+        LONG64 last = 0;
+
+        for (auto t = t0; t < t1 + 500*TICKS_PER_UFRAME; t += TICKS_PER_UFRAME) {
+                auto prev = evaluate(t0, u0, old_ppm, t);
+                auto next = evaluate(t1, u1, c.ppm, t); // dt < 0 before the switch
+
+                auto stale = (t/TICKS_PER_UFRAME) % 3 == 0; // reader still uses the previous slot
+                auto v = (t < t1 || stale ? prev : next) >> Q;
+
+                if (t >= t1 && next < evaluate(t1, u1, c.ppm, t - TICKS_PER_UFRAME)) {
+                        return false;
+                }
+
+                auto r = latest(last, v);
+                if (r < last) {
+                        return false;
+                }
+                last = r;
+        }
+
+        return true;
+}
+static_assert(is_monotonic(MAX_FREQ_PPM + MAX_SLEW_PPM, -STEP_FRAMES)); // fast slot is replaced by slow one
+static_assert(is_monotonic(-MAX_FREQ_PPM - MAX_SLEW_PPM, STEP_FRAMES));
+static_assert(is_monotonic(0, STEP_FRAMES + 1)); // step
+static_assert(is_monotonic(0, -STEP_FRAMES - 1)); // step forward by FRAME_WRAP - |err|
+
+/*
+ * The server's clock runs at drift_ppm relative to KeQueryInterruptTime and starts offset frames ahead,
+ * sync is called every period_ms.
+ * @return the greatest phase error in frames after settle_ms, -1 if the counter stepped after it
+ */
+constexpr LONG track(LONG drift_ppm, LONG offset, LONG period_ms, LONG count, LONG settle_ms)
+{
+        LONG64 time = 0;
+        LONG64 uframe = (FIRST_FRAME << 3) << Q;
+        LONG ppm = 0;
+        LONG freq_ppm = 0;
+        LONG max_err = 0;
+
+        for (LONG i = 1; i <= count; ++i) {
+                auto now = LONG64(i)*period_ms*10'000;
+
+                auto elapsed = mul_div(now, 1'000'000 + drift_ppm, 10'000'000'000); // server's frames
+                auto server_frame = static_cast<ULONG>(FIRST_FRAME + offset + elapsed);
+                auto cur = evaluate(time, uframe, ppm, now);
+
+                auto err = frame_diff(server_frame, static_cast<ULONG>(cur >> (Q + 3)));
+                auto c = correct(err, freq_ppm);
+
+                auto settled = LONG64(i)*period_ms > settle_ms;
+                if (settled && c.step) {
+                        return -1;
+                } else if (settled && (err < 0 ? -err : err) > max_err) {
+                        max_err = err < 0 ? -err : err;
+                }
+
+                time = now;
+                uframe = cur + (LONG64(c.step) << (Q + 3));
+                ppm = c.ppm;
+                freq_ppm = c.freq_ppm;
+        }
+
+        return max_err;
+}
+static_assert(!track(0, 0, 10, 1000, 0));
+static_assert(!track(0, 200, 10, 1000, 100)); // stepped at once
+static_assert(!track(0, -200, 10, 1000, 100));
+
+// drift is tracked within a frame
+static_assert(track(MAX_FREQ_PPM, 0, 10, 2000, 1000) == 1);
+static_assert(track(-MAX_FREQ_PPM, 0, 10, 2000, 1000) == 1);
+static_assert(track(MAX_FREQ_PPM, 200, 100, 300, 1000) == 1);
+
+// a small offset is slewed away, not stepped, at most MAX_SLEW_PPM less drift
+static_assert(track(0, 5, 10, 2000, 10'000) == 1);
+static_assert(track(0, -20, 100, 600, 30'000) == 1);
+static_assert(track(MAX_FREQ_PPM, STEP_FRAMES, 100, 600, 1000) == STEP_FRAMES); // never stepped
+static_assert(track(-MAX_FREQ_PPM, STEP_FRAMES, 100, 600, 30'000) < 5);
+
+} // namespace
+
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ frame_clock &clk)
+{
+        RtlZeroMemory(&clk, sizeof(clk));
+
+        auto &s = clk.slot[0];
+        s.time = KeQueryInterruptTime();
+        s.uframe = (FIRST_FRAME << 3) << Q;
+}
+
+/*
+ * Is not monotonic by itself because readers can use the previous slot for a short time after sync,
+ * the greatest value returned so far is remembered.
+ */
+_IRQL_requires_max_(HIGH_LEVEL)
+ULONG64 get_microframe(_Inout_ frame_clock &clk)
+{
+        frame_clock::state s;
+        read(s, clk);
+
+        auto uframe = evaluate(s, KeQueryInterruptTime()) >> Q;
+
+        for (auto last = clk.last; last < uframe; last = clk.last) {
+                if (InterlockedCompareExchange64(&clk.last, uframe, last) == last) {
+                        break;
+                }
+        }
+
+        return latest(clk.last, uframe);
+}
+
+/*
+ * Must not be called concurrently, it is called from the receive path of the device.
+ * @param server_frame start_frame of isoch RET_SUBMIT
+ * @return server_frame in numbering of the virtual clock
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG sync(_Inout_ frame_clock &clk, _In_ ULONG server_frame)
+{
+        frame_clock::state s;
+        read(s, clk);
+
+        auto now = KeQueryInterruptTime();
+        auto uframe = evaluate(s, now);
+
+        auto frame = static_cast<ULONG>(uframe >> (Q + 3));
+        auto err = frame_diff(server_frame, frame);
+
+        auto c = correct(err, clk.freq_ppm);
+        clk.freq_ppm = c.freq_ppm;
+
+        if (c.step) {
+                err = c.step;
+                uframe += LONG64(err) << (Q + 3);
+                TraceDbg("step %d frames, server frame %lu", err, server_frame);
+        }
+
+        write(clk, now, uframe, c.ppm);
+        return frame + err;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <wdm.h>
+
+/*
+ * Virtual USB frame counter of a device, see frame_clock.cpp.
+ * Zeroed memory is not a valid state, call init().
+ */
+struct frame_clock
+{
+        struct state
+        {
+                volatile LONG seq; // odd while the slot is being written
+                LONG64 time; // KeQueryInterruptTime
+                LONG64 uframe; // at time, Q16 microframes
+                LONG ppm; // rate correction
+        };
+
+        state slot[2];
+        volatile LONG active; // index of slot that readers use
+        volatile LONG64 last; // the greatest microframe returned to readers
+
+        LONG freq_ppm; // PLL integrator, modified by sync only
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ frame_clock &clk);
+
+_IRQL_requires_max_(HIGH_LEVEL)
+ULONG64 get_microframe(_Inout_ frame_clock &clk);
+
+_IRQL_requires_max_(HIGH_LEVEL)
+inline auto get_frame(_Inout_ frame_clock &clk)
+{
+        return static_cast<ULONG>(get_microframe(clk) >> 3);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG sync(_Inout_ frame_clock &clk, _In_ ULONG server_frame);
@@ -0,0 +1,459 @@
+/*
+ * Application-level heartbeat.
+ *
+ * TCP keepalive detects a dead server in minutes while URBs hang (see set_options in plugin.cpp).
+ * If nothing is received during ioctl_usbip_vhci_plugin.heartbeat, CMD_SUBMIT GET_STATUS is sent on EP0
+ * as a probe. A probe is missed if nothing is received until its timeout, the next one is sent at once.
+ * The connection is lost after ioctl_usbip_vhci_plugin.heartbeat_misses missed probes in a row,
+ * thus a dead server is detected in seconds. A busy link is never probed.
+ *
+ * The round trips of probes are smoothed as in RFC 6298, the timeout of a probe is SRTT + 4*RTTVAR
+ * that is bounded by MIN_TIMEOUT and the interval. SRTT and RTTVAR are reported
+ * by IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES.
+ *
+ * The state machine (tick, received) is constexpr and is checked by static_assert below,
+ * the timer and sending are kernel glue.
+ */
+#include "heartbeat.h"
+#include "trace.h"
+#include "heartbeat.tmh"
+
+#include "dev.h"
+#include "vhci.h"
+#include "proto.h"
+#include "devconf.h"
+#include "reconnect.h"
+#include "internal_ioctl.h"
+
+#include <libdrv\usb_util.h>
+
+namespace
+{
+
+struct link_state
+{
+        LONG64 interval; // 100ns units, idle time before a probe
+        LONG max_misses;
+
+        LONG64 last_rx; // time of the last received PDU
+        LONG64 probe_time; // of the outstanding probe, zero if none
+        seqnum_t probe_seqnum;
+        LONG misses; // in a row
+
+        LONG64 srtt; // zero if there are no samples
+        LONG64 rttvar;
+
+        LONG probes;
+        LONG missed;
+};
+
+} // namespace
+
+
+struct heartbeat_state
+{
+        vpdo_dev_t *vpdo;
+
+        KTIMER timer;
+        KDPC dpc;
+        LONG period; // ms of timer
+
+        KSPIN_LOCK lock;
+        link_state link; // guarded by lock
+};
+
+namespace
+{
+
+enum : LONG64 { // 100ns units
+        MS = 10'000,
+        MIN_INTERVAL = 100*MS,
+        MIN_TIMEOUT = 200*MS,
+};
+
+enum : LONG {
+        DEFAULT_MISSES = 3,
+        MIN_PERIOD = 50, // ms
+};
+
+enum class action { none, probe, dead };
+
+constexpr auto timeout(const link_state &l)
+{
+        auto t = l.srtt ? l.srtt + 4*l.rttvar : l.interval;
+        auto max = l.interval > MIN_TIMEOUT ? l.interval : MIN_TIMEOUT;
+
+        return t < MIN_TIMEOUT ? MIN_TIMEOUT : t > max ? max : t;
+}
+
+constexpr void reset(link_state &l, LONG64 now)
+{
+        l.last_rx = now;
+        l.probe_time = 0;
+        l.misses = 0;
+}
+
+/*
+ * RFC 6298, 2.2 and 2.3.
+ */
+constexpr void rtt_sample(link_state &l, LONG64 rtt)
+{
+        if (!l.srtt) {
+                l.srtt = rtt ? rtt : 1;
+                l.rttvar = rtt/2;
+                return;
+        }
+
+        auto err = l.srtt - rtt;
+        l.rttvar += ((err < 0 ? -err : err) - l.rttvar)/4;
+        l.srtt += (rtt - l.srtt)/8;
+
+        if (!l.srtt) {
+                l.srtt = 1;
+        }
+}
+
+/*
+ * @param seqnum of RET_SUBMIT that has no IRP, zero otherwise
+ * @return RTT of the probe or zero
+ */
+constexpr auto received(link_state &l, seqnum_t seqnum, LONG64 now)
+{
+        l.last_rx = now;
+        l.misses = 0;
+
+        if (!(seqnum && l.probe_time && seqnum == l.probe_seqnum)) {
+                return 0LL;
+        }
+
+        auto rtt = now - l.probe_time;
+        l.probe_time = 0;
+
+        rtt_sample(l, rtt);
+        return rtt;
+}
+
+constexpr auto tick(link_state &l, LONG64 now)
+{
+        if (l.probe_time) {
+                if (now - l.probe_time < timeout(l)) {
+                        return action::none;
+                }
+
+                auto answered = l.last_rx >= l.probe_time; // by another PDU
+                l.probe_time = 0;
+
+                if (!answered) {
+                        ++l.missed;
+
+                        if (++l.misses >= l.max_misses) {
+                                reset(l, now);
+                                return action::dead;
+                        }
+
+                        return action::probe;
+                }
+        }
+
+        return now - l.last_rx >= l.interval ? action::probe : action::none;
+}
+
+static_assert(timeout(link_state{ .interval = 1000*MS }) == 1000*MS); // no samples
+static_assert(timeout(link_state{ .interval = 1000*MS, .srtt = 10*MS, .rttvar = 5*MS }) == MIN_TIMEOUT);
+static_assert(timeout(link_state{ .interval = 1000*MS, .srtt = 500*MS, .rttvar = 500*MS }) == 1000*MS);
+static_assert(timeout(link_state{ .interval = MIN_INTERVAL }) == MIN_TIMEOUT);
+
+constexpr auto smoothed(LONG64 first, LONG64 rtt, int cnt)
+{
+        link_state l{};
+
+        rtt_sample(l, first);
+        for (int i = 0; i < cnt; ++i) {
+                rtt_sample(l, rtt);
+        }
+
+        return l;
+}
+static_assert(smoothed(80, 80, 0).srtt == 80 && smoothed(80, 80, 0).rttvar == 40);
+static_assert(smoothed(0, 0, 0).srtt == 1); // zero means no samples
+static_assert(smoothed(80, 80, 100).srtt == 80 && smoothed(80, 80, 100).rttvar < 4);
+static_assert(smoothed(10*MS, 50*MS, 100).srtt > 49*MS);
+
+/*
+ * The server answers a probe after rtt until alive and is silent after that, on_timer runs every period.
+ * @param busy if not zero, a PDU (not a probe reply) is received with this period until alive
+ * @return time from alive to action::dead, -1 if a live link is declared dead or a busy one is probed
+ */
+constexpr LONG64 dead_after(LONG64 interval, LONG max_misses, LONG64 rtt, LONG64 alive, LONG64 busy = 0)
+{
+        link_state l{ .interval = interval, .max_misses = max_misses };
+        auto period = interval/4 > MIN_PERIOD*MS ? interval/4 : MIN_PERIOD*MS;
+
+        seqnum_t seqnum = 0;
+        LONG64 reply = 0; // due time of the reply to the outstanding probe
+
+        for (auto now = period, rx = busy; now < alive + 100*interval; now += period) {
+                for ( ; busy && rx < alive && rx <= now; rx += busy) {
+                        received(l, 0, rx);
+                }
+
+                if (reply && reply <= now) {
+                        received(l, seqnum, reply);
+                        reply = 0;
+                }
+
+                switch (tick(l, now)) {
+                case action::dead:
+                        return now < alive ? -1 : now - alive;
+                case action::probe:
+                        if (busy && now < alive) {
+                                return -1;
+                        }
+                        l.probe_seqnum = ++seqnum;
+                        l.probe_time = now;
+                        reply = now + rtt < alive ? now + rtt : 0;
+                        break;
+                case action::none:
+                        break;
+                }
+        }
+
+        return -1;
+}
+
+// no RTT samples, probes time out after the interval
+static_assert(dead_after(1000*MS, 3, 0, 0) == 4000*MS);
+static_assert(dead_after(1000*MS, 1, 0, 0) == 2000*MS);
+
+// a live link with RTT below and above MIN_TIMEOUT is never declared dead
+static_assert(dead_after(1000*MS, 3, 10*MS, 60'000*MS) > 0);
+static_assert(dead_after(1000*MS, 3, 600*MS, 60'000*MS) > 0);
+static_assert(dead_after(MIN_INTERVAL, 1, 150*MS, 10'000*MS) > 0);
+
+// a dead server is detected in about interval + misses*timeout
+static_assert(dead_after(1000*MS, 3, 10*MS, 60'000*MS) <= 1000*MS + 3*MIN_TIMEOUT + 2*250*MS);
+static_assert(dead_after(5000*MS, 3, 10*MS, 60'000*MS) <= 5000*MS + 3*MIN_TIMEOUT + 2*1250*MS);
+
+// a busy link is never probed, it is probed once it is idle
+static_assert(dead_after(1000*MS, 3, 10*MS, 60'000*MS, 100*MS) > 0);
+static_assert(dead_after(1000*MS, 3, 10*MS, 60'000*MS, 100*MS) <= 1000*MS + 4000*MS + 2*250*MS);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_probe(_Inout_ heartbeat_state &hb)
+{
+        auto &vpdo = *hb.vpdo;
+
+        const ULONG TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_SHORT_TRANSFER_OK | USBD_TRANSFER_DIRECTION_IN;
+        usbip_header hdr{};
+
+        if (auto err = set_cmd_submit_usbip_header(vpdo, hdr, EP0, TransferFlags, sizeof(USHORT))) {
+                Trace(TRACE_LEVEL_ERROR, "set_cmd_submit_usbip_header %!STATUS!", err);
+                return;
+        }
+
+        auto &pkt = get_submit_setup(hdr);
+        pkt.bmRequestType.B = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+        pkt.bRequest = USB_REQUEST_GET_STATUS;
+        pkt.wLength = sizeof(USHORT);
+
+        auto seqnum = hdr.base.seqnum;
+
+        KIRQL irql;
+        KeAcquireSpinLock(&hb.lock, &irql);
+
+        hb.link.probe_seqnum = seqnum;
+        hb.link.probe_time = KeQueryInterruptTime(); // before sending, the reply can arrive at once
+        ++hb.link.probes;
+
+        KeReleaseSpinLock(&hb.lock, irql);
+
+        if (auto err = send_without_irp(vpdo, hdr); err != STATUS_PENDING) {
+                TraceDbg("vpdo %04x, seqnum %u, %!STATUS!", ptr4log(&vpdo), seqnum, err);
+
+                KeAcquireSpinLock(&hb.lock, &irql);
+                if (hb.link.probe_seqnum == seqnum) {
+                        hb.link.probe_time = 0; // is not a miss, the connection is being reestablished
+                }
+                KeReleaseSpinLock(&hb.lock, irql);
+        }
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+void on_timer(_In_ KDPC*, _In_opt_ void *DeferredContext, _In_opt_ void*, _In_opt_ void*)
+{
+        auto &hb = *static_cast<heartbeat_state*>(DeferredContext);
+        auto &vpdo = *hb.vpdo;
+
+        if (vpdo.reconnecting || vpdo.unplugged) { // start_heartbeat resets the state on resume
+                return;
+        }
+
+        KeAcquireSpinLockAtDpcLevel(&hb.lock);
+        auto act = tick(hb.link, KeQueryInterruptTime());
+        auto misses = hb.link.misses;
+        KeReleaseSpinLockFromDpcLevel(&hb.lock);
+
+        switch (act) {
+        case action::probe:
+                if (misses) {
+                        TraceDbg("vpdo %04x, %ld missed probe(s)", ptr4log(&vpdo), misses);
+                }
+                send_probe(hb);
+                break;
+        case action::dead:
+                Trace(TRACE_LEVEL_WARNING, "vpdo %04x, port %d: %ld probes are missed",
+                        ptr4log(&vpdo), vpdo.port, hb.link.max_misses);
+                connection_lost(vpdo);
+                break;
+        case action::none:
+                break;
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_heartbeat(_Inout_ vpdo_dev_t &vpdo, _In_ USHORT interval, _In_ USHORT misses)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vpdo.heartbeat);
+
+        if (!interval) {
+                return STATUS_SUCCESS;
+        }
+
+        auto hb = (heartbeat_state*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(heartbeat_state), USBIP_VHCI_POOL_TAG);
+        if (!hb) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate heartbeat_state");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        vpdo.heartbeat = hb;
+
+        hb->vpdo = &vpdo;
+
+        KeInitializeTimer(&hb->timer);
+        KeInitializeDpc(&hb->dpc, on_timer, hb);
+        KeInitializeSpinLock(&hb->lock);
+
+        auto &l = hb->link;
+
+        l.interval = interval*MS;
+        if (l.interval < MIN_INTERVAL) {
+                l.interval = MIN_INTERVAL;
+        }
+
+        hb->period = LONG(l.interval/MS/4);
+        if (hb->period < MIN_PERIOD) {
+                hb->period = MIN_PERIOD;
+        }
+
+        l.max_misses = misses ? misses : DEFAULT_MISSES;
+
+        TraceMsg("vpdo %04x, interval %I64d ms, misses %ld", ptr4log(&vpdo), l.interval/MS, l.max_misses);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Must be called before the socket is closed, on_timer can call connection_lost.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void stop_heartbeat(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        if (auto hb = vpdo.heartbeat) {
+                KeCancelTimer(&hb->timer);
+                KeFlushQueuedDpcs();
+        }
+}
+
+/*
+ * Must be called after stop_heartbeat and when vpdo_ref holders are gone, get_imported_devs calls get_rtt.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_heartbeat(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        auto &hb = vpdo.heartbeat;
+        if (!hb) {
+                return;
+        }
+
+        auto &l = hb->link;
+        TraceMsg("vpdo %04x, srtt %I64d us, rttvar %I64d us, probes %ld, missed %ld",
+                  ptr4log(&vpdo), l.srtt/10, l.rttvar/10, l.probes, l.missed);
+
+        ExFreePoolWithTag(hb, USBIP_VHCI_POOL_TAG);
+        hb = nullptr;
+}
+
+/*
+ * The receive loop must be running.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void start_heartbeat(_Inout_ vpdo_dev_t &vpdo)
+{
+        auto hb = vpdo.heartbeat;
+        if (!hb) {
+                return;
+        }
+
+        KIRQL irql;
+        KeAcquireSpinLock(&hb->lock, &irql);
+        reset(hb->link, KeQueryInterruptTime());
+        KeReleaseSpinLock(&hb->lock, irql);
+
+        LARGE_INTEGER due;
+        due.QuadPart = -hb->period*MS; // relative
+        KeSetCoalescableTimer(&hb->timer, due, hb->period, hb->period/4, &hb->dpc);
+}
+
+/*
+ * Any PDU that is received proves that the link is alive.
+ * @param seqnum of RET_SUBMIT that has no IRP, zero otherwise
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void heartbeat_received(_Inout_ vpdo_dev_t &vpdo, _In_ seqnum_t seqnum)
+{
+        auto hb = vpdo.heartbeat;
+        if (!hb) {
+                return;
+        }
+
+        KIRQL irql;
+        KeAcquireSpinLock(&hb->lock, &irql);
+        auto rtt = received(hb->link, seqnum, KeQueryInterruptTime());
+        KeReleaseSpinLock(&hb->lock, irql);
+
+        if (rtt) {
+                TraceDbg("vpdo %04x, rtt %I64d us", ptr4log(&vpdo), rtt/10);
+        }
+}
+
+/*
+ * @param rtt smoothed, microseconds; zero if unknown
+ * @param rttvar microseconds
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_rtt(_In_ vpdo_dev_t &vpdo, _Out_ unsigned int &rtt, _Out_ unsigned int &rttvar)
+{
+        rtt = 0;
+        rttvar = 0;
+
+        auto hb = vpdo.heartbeat;
+        if (!hb) {
+                return;
+        }
+
+        KIRQL irql;
+        KeAcquireSpinLock(&hb->lock, &irql);
+
+        rtt = static_cast<unsigned int>(hb->link.srtt/10);
+        rttvar = static_cast<unsigned int>(hb->link.rttvar/10);
+
+        KeReleaseSpinLock(&hb->lock, irql);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+
+#include <wdm.h>
+#include <usbip\proto.h>
+
+struct vpdo_dev_t;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_heartbeat(_Inout_ vpdo_dev_t &vpdo, _In_ USHORT interval, _In_ USHORT misses);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void stop_heartbeat(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_heartbeat(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void start_heartbeat(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void heartbeat_received(_Inout_ vpdo_dev_t &vpdo, _In_ seqnum_t seqnum);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_rtt(_In_ vpdo_dev_t &vpdo, _Out_ unsigned int &rtt, _Out_ unsigned int &rttvar);
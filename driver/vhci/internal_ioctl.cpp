@@ -16,6 +16,13 @@
 #include "network.h"
 #include "wsk_context.h"
 #include "vhub.h"
+#include "reconnect.h"
+#include "segment.h"
+#include "jitter.h"
+#include "tx.h"
+#include "budget.h"
+#include "urb_traits.h"
+#include "path_delay.h"
 
 namespace
 {
@@ -67,6 +74,10 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         } else if (NT_SUCCESS(st.Status)) { // request has sent
                 switch (old_status) {
                 case ST_RECV_COMPLETE:
+                        if (jitter_hold(vpdo, irp)) {
+                                break;
+                        }
+
                         TraceDbg("Complete irp %04x, %!STATUS!, Information %#Ix",
                                   ptr4log(irp), irp->IoStatus.Status, irp->IoStatus.Information);
 
@@ -84,9 +95,10 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         }
 
         if (st.Status == STATUS_FILE_FORCED_CLOSED) {
-                vhub_unplug_vpdo(&vpdo);
+                connection_lost(vpdo);
         }
 
+        tx_complete(vpdo, *ctx);
         free(ctx, true);
         return StopCompletion;
 }
@@ -123,10 +135,18 @@ auto prepare_wsk_buf(_Out_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ c
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto send(_In_ wsk_context *ctx, _Inout_opt_ const URB *transfer_buffer = nullptr, _In_ bool log_setup = true)
 {
-        WSK_BUF buf;
+        auto &vpdo = *ctx->vpdo;
+
+        if (!acquire_socket(vpdo)) { // the connection is being reestablished
+                free(ctx, false);
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &buf = ctx->tx_buf;
 
         if (auto err = prepare_wsk_buf(buf, *ctx, transfer_buffer)) {
                 free(ctx, false);
+                release_socket(vpdo);
                 return err;
         } else {
                 char str[DBG_USBIP_HDR_BUFSZ];
@@ -134,21 +154,21 @@ auto send(_In_ wsk_context *ctx, _Inout_opt_ const URB *transfer_buffer = nullpt
                             ptr4log(ctx->irp), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
         }
 
+        USBD_PIPE_HANDLE handle{}; // CMD_UNLINK is urgent
+
         if (auto irp = ctx->irp) {
+                handle = get_pipe_handle(irp);
                 get_seqnum(irp) = ctx->hdr.base.seqnum;
                 *get_status(irp) = ST_NONE;
                 enqueue_irp(*ctx->vpdo, irp);
         }
 
         byteswap_header(ctx->hdr, swap_dir::host2net);
+        IoSetCompletionRoutine(ctx->wsk_irp, send_complete, ctx, true, true, true);
 
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx, true, true, true);
+        tx_send(vpdo, *ctx, handle); // do not access ctx after that
+        release_socket(vpdo);
 
-        auto err = send(ctx->vpdo->sock, &buf, WSK_FLAG_NODELAY, wsk_irp);
-        NT_ASSERT(err != STATUS_NOT_SUPPORTED);
-
-        TraceWSK("wsk irp %04x, %!STATUS!", ptr4log(wsk_irp), err);
         return STATUS_PENDING;
 }
 
@@ -171,6 +191,149 @@ auto new_wsk_context(
         return ctx;
 }
 
+enum { UNLINK_BATCH_MAX = 64 }; // CMD_UNLINKs per send
+
+/*
+ * Back-to-back CMD_UNLINK headers that are sent at once, see unlink_irps.
+ */
+struct unlink_batch
+{
+        wsk_context *ctx; // provides wsk_irp
+        usbip::Mdl mdl; // describes hdr[]
+        LONG64 start; // KeQueryInterruptTime of unlink_irps
+        bool last; // batch of unlink_irps
+        ULONG count;
+        usbip_header hdr[UNLINK_BATCH_MAX]; // network byte order
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_In_ unlink_batch *b, _In_ bool reuse)
+{
+        b->mdl.reset();
+        free(b->ctx, reuse);
+        ExFreePoolWithTag(b, USBIP_VHCI_POOL_TAG);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+unlink_batch *alloc_unlink_batch(_In_ vpdo_dev_t &vpdo, _In_ LONG64 start)
+{
+        auto b = (unlink_batch*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(unlink_batch), USBIP_VHCI_POOL_TAG);
+        if (!b) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate unlink_batch");
+                return b;
+        }
+
+        b->start = start;
+
+        if (!(b->ctx = new_wsk_context(vpdo, nullptr))) {
+                Trace(TRACE_LEVEL_ERROR, "new_wsk_context error");
+        } else if (b->mdl = usbip::Mdl(b->hdr, sizeof(b->hdr)); !b->mdl) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate MDL");
+        } else if (auto err = b->mdl.prepare_nonpaged()) {
+                Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+        } else {
+                return b;
+        }
+
+        free(b, false);
+        return nullptr;
+}
+
+/*
+ * The time from unlink_irps call till its CMD_UNLINKs are sent.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void add_abort_time(_Inout_ vpdo_dev_t &vpdo, _In_ LONG64 start)
+{
+        auto t = LONG64(KeQueryInterruptTime()) - start;
+
+        InterlockedIncrement(&vpdo.abort_cnt);
+        InterlockedAdd64(&vpdo.abort_time, t);
+
+        for (auto max = vpdo.abort_time_max; t > max; max = vpdo.abort_time_max) {
+                if (InterlockedCompareExchange64(&vpdo.abort_time_max, t, max) == max) {
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS unlink_batch_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+        auto b = static_cast<unlink_batch*>(Context);
+        auto &vpdo = *b->ctx->vpdo;
+
+        auto &st = wsk_irp->IoStatus;
+        TraceWSK("wsk irp %04x, %!STATUS!, Information %Iu, %lu unlinks", ptr4log(wsk_irp), st.Status, st.Information, b->count);
+
+        if (b->last) {
+                add_abort_time(vpdo, b->start);
+        }
+
+        if (st.Status == STATUS_FILE_FORCED_CLOSED) {
+                connection_lost(vpdo);
+        }
+
+        tx_complete(vpdo, *b->ctx);
+        free(b, true);
+        return StopCompletion;
+}
+
+/*
+ * @return true if the batch was sent and add_abort_time will be called if it is the last one
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool send(_In_ unlink_batch *b)
+{
+        auto &vpdo = *b->ctx->vpdo;
+
+        if (!acquire_socket(vpdo)) { // the connection is being reestablished
+                free(b, false);
+                return false;
+        }
+
+        auto &ctx = *b->ctx;
+
+        ctx.tx_buf = { b->mdl.get(), 0, b->count*sizeof(*b->hdr) };
+        TraceMsg("%lu unlinks, %Iu bytes", b->count, ctx.tx_buf.Length);
+
+        IoSetCompletionRoutine(ctx.wsk_irp, unlink_batch_complete, b, true, true, true);
+
+        tx_send(vpdo, ctx, EP0); // do not access b after that
+        release_socket(vpdo);
+
+        return true;
+}
+
+/*
+ * IRP was dequeued. If its CMD_SUBMIT is not sent yet, there is nothing to unlink.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool cancel_unsent(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto ctx = tx_cancel(vpdo, irp);
+        if (ctx) {
+                free(ctx, true);
+                complete_as_canceled(irp);
+        }
+
+        return ctx;
+}
+
+/*
+ * IRP was dequeued and CMD_UNLINK is sent or can't be sent.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_unlinked(_In_ IRP *irp)
+{
+        auto old_status = atomic_set_status(irp, ST_IRP_CANCELED);
+        NT_ASSERT(old_status != ST_RECV_COMPLETE);
+
+        if (old_status == ST_SEND_COMPLETE) {
+                complete_as_canceled(irp);
+        }
+}
+
 /*
  * USBD_ISO_PACKET_DESCRIPTOR.Length is not used (zero) for USB_DIR_OUT transfer.
  */
@@ -206,13 +369,35 @@ NTSTATUS abort_pipe(_In_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE PipeHandle)
 {
 	TraceUrb("PipeHandle %#Ix", ph4log(PipeHandle));
 
-	while (auto irp = dequeue_irp(vpdo, PipeHandle)) {
-                send_cmd_unlink(vpdo, irp);
-	}
+        cancel_throttled(vpdo, PipeHandle);
+        unlink_irps(vpdo, PipeHandle);
+        jitter_flush(vpdo, PipeHandle);
 
 	return STATUS_SUCCESS;
 }
 
+/*
+ * A client driver must not have pending transfers on the streams, abort them anyway.
+ * The server frees the streams with the interface, see bulk streams extension in <usbip\proto.h>.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto close_static_streams(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE PipeHandle)
+{
+        auto &cnt = vpdo.open_streams[get_endpoint_index(PipeHandle)];
+        if (!cnt) {
+                return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        for (USHORT id = 1; id <= cnt; ++id) {
+                auto handle = make_stream_handle(PipeHandle, id);
+                cancel_throttled(vpdo, handle);
+                unlink_irps(vpdo, handle);
+        }
+
+        cnt = 0;
+        return STATUS_SUCCESS;
+}
+
 /*
  * Any URBs queued for such an endpoint should normally be unlinked by the driver before clearing the halt condition,
  * as described in sections 5.7.5 and 5.8.5 of the USB 2.0 spec.
@@ -254,12 +439,11 @@ NTSTATUS pipe_request(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ URB &urb)
         case URB_FUNCTION_ABORT_PIPE:
                 st = abort_pipe(vpdo, r.PipeHandle);
                 break;
-        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
-                st = clear_endpoint_stall(vpdo, r.PipeHandle, irp);
+        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
+                st = close_static_streams(vpdo, r.PipeHandle);
                 break;
         case URB_FUNCTION_SYNC_RESET_PIPE:
         case URB_FUNCTION_SYNC_CLEAR_STALL:
-        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
                 urb.UrbHeader.Status = USBD_STATUS_NOT_SUPPORTED;
                 break;
         }
@@ -276,6 +460,20 @@ NTSTATUS pipe_request(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ URB &urb)
         return st;
 }
 
+/*
+ * Unlike other pipe requests, it is not served locally, see pipe_request.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Function_class_(urb_function_t)
+NTSTATUS sync_reset_pipe_and_clear_stall(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ URB &urb)
+{
+        auto &r = urb.UrbPipeRequest;
+        NT_ASSERT(r.PipeHandle);
+
+        TraceUrb("irp %04x -> PipeHandle %#Ix", ptr4log(irp), ph4log(r.PipeHandle));
+        return clear_endpoint_stall(vpdo, r.PipeHandle, irp);
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
 NTSTATUS control_get_status_request(vpdo_dev_t &vpdo, IRP *irp, URB &urb, UCHAR recipient)
@@ -650,8 +848,7 @@ NTSTATUS select_interface(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 }
 
 /*
- * Can't be implemented without server's support.
- * In any case the result will be irrelevant due to network latency.
+ * The server's frame number is not available, the virtual clock of the device is used.
  *
  * See: <linux>//drivers/usb/core/usb.c, usb_get_current_frame_number.
  */
@@ -660,7 +857,7 @@ _Function_class_(urb_function_t)
 NTSTATUS get_current_frame_number(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 {
         auto &num = urb.UrbGetCurrentFrameNumber.FrameNumber;
-        num = vpdo.current_frame_number;
+        num = get_frame(vpdo.bus_time);
 
         TraceUrb("irp %04x: FrameNumber %lu", ptr4log(irp), num);
 
@@ -731,6 +928,18 @@ NTSTATUS bulk_or_interrupt_transfer(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (auto id = get_stream_id(r.PipeHandle); id > vpdo.open_streams[get_endpoint_index(r.PipeHandle)]) {
+                Trace(TRACE_LEVEL_ERROR, "Stream %d is not open", id);
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        if (type == UsbdPipeTypeBulk && need_segments(vpdo, urb)) {
+                if (auto st = submit_segments(vpdo, irp, urb); st != STATUS_INSUFFICIENT_RESOURCES) {
+                        return st;
+                }
+                Trace(TRACE_LEVEL_WARNING, "irp %04x, can't split into segments, sending as a whole", ptr4log(irp));
+        }
+
         auto ctx = new_wsk_context(vpdo, irp, r.PipeHandle);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -745,7 +954,8 @@ NTSTATUS bulk_or_interrupt_transfer(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * USBD_START_ISO_TRANSFER_ASAP is appended because StartFrame is in numbering of the virtual clock,
+ * the server's frame number is known only modulo FRAME_WRAP, see frame_clock.cpp.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
@@ -792,6 +1002,7 @@ NTSTATUS isoch_transfer(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
         ctx->hdr.u.cmd_submit.start_frame = r.StartFrame;
         ctx->hdr.u.cmd_submit.number_of_packets = r.NumberOfPackets;
 
+        path_delay_submit(vpdo, irp);
         return send(ctx, &urb, false);
 }
 
@@ -904,35 +1115,77 @@ NTSTATUS get_ms_feature_descriptor(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 }
 
 /*
+ * Delays are measured over the network rather than reported by a host controller, see path_delay.cpp.
  * See: <kernel>/drivers/usb/core/message.c, usb_set_isoch_delay.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
-NTSTATUS get_isoch_pipe_transfer_path_delays(vpdo_dev_t&, IRP *irp, URB &urb)
+NTSTATUS get_isoch_pipe_transfer_path_delays(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 {
 	auto &r = urb.UrbGetIsochPipeTransferPathDelays;
 
+        if (auto type = get_endpoint_type(r.PipeHandle); type != UsbdPipeTypeIsochronous) {
+                Trace(TRACE_LEVEL_ERROR, "%!USBD_PIPE_TYPE!", type);
+                urb.UrbHeader.Status = USBD_STATUS_INVALID_PIPE_HANDLE;
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        get_path_delays(vpdo, r.PipeHandle, r.MaximumSendPathDelayInMilliSeconds, r.MaximumCompletionPathDelayInMilliSeconds);
+
 	TraceUrb("irp %04x -> PipeHandle %#Ix, MaximumSendPathDelayInMilliSeconds %lu, MaximumCompletionPathDelayInMilliSeconds %lu",
                 ptr4log(irp), ph4log(r.PipeHandle),
 		r.MaximumSendPathDelayInMilliSeconds,
 		r.MaximumCompletionPathDelayInMilliSeconds);
 
-	return STATUS_NOT_SUPPORTED;
+	urb.UrbHeader.Status = USBD_STATUS_SUCCESS;
+	return STATUS_SUCCESS;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
-NTSTATUS open_static_streams(vpdo_dev_t&, IRP *irp, URB &urb)
+NTSTATUS open_static_streams(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
 {
 	auto &r = urb.UrbOpenStaticStreams;
 
 	TraceUrb("irp %04x -> PipeHandle %#Ix, NumberOfStreams %lu, StreamInfoVersion %hu, StreamInfoSize %hu",
                   ptr4log(irp), ph4log(r.PipeHandle), r.NumberOfStreams, r.StreamInfoVersion, r.StreamInfoSize);
 
-	return STATUS_NOT_SUPPORTED;
+        if (!vpdo.streams) {
+                return STATUS_NOT_SUPPORTED; // by the server
+        }
+
+        auto max_streams = get_endpoint_max_streams(r.PipeHandle);
+
+        if (!(get_endpoint_type(r.PipeHandle) == UsbdPipeTypeBulk && !get_stream_id(r.PipeHandle) &&
+              r.NumberOfStreams && r.NumberOfStreams <= max_streams &&
+              r.StreamInfoVersion == URB_OPEN_STATIC_STREAMS_VERSION_100 && r.StreamInfoSize == sizeof(*r.Streams))) {
+                Trace(TRACE_LEVEL_ERROR, "Invalid request, endpoint supports %lu streams", max_streams);
+                urb.UrbHeader.Status = USBD_STATUS_INVALID_PARAMETER;
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto &cnt = vpdo.open_streams[get_endpoint_index(r.PipeHandle)];
+        if (cnt) {
+                Trace(TRACE_LEVEL_ERROR, "%d streams are already open", cnt);
+                urb.UrbHeader.Status = USBD_STATUS_INVALID_PARAMETER;
+                return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        for (ULONG i = 0; i < r.NumberOfStreams; ++i) {
+                auto &s = r.Streams[i];
+                s.StreamID = i + 1; // zero is not a stream
+                s.PipeHandle = make_stream_handle(r.PipeHandle, static_cast<USHORT>(s.StreamID));
+                s.MaximumTransferSize = 0; // is not used and does not contain valid data
+                s.PipeFlags = 0;
+        }
+
+        cnt = static_cast<USHORT>(r.NumberOfStreams);
+
+        urb.UrbHeader.Status = USBD_STATUS_SUCCESS;
+        return STATUS_SUCCESS;
 }
 
-urb_function_t* const urb_functions[] =
+constexpr urb_function_t* urb_functions[] =
 {
 	select_configuration,
 	select_interface,
@@ -976,7 +1229,7 @@ urb_function_t* const urb_functions[] =
 
 	nullptr, // URB_FUNCTION_RESERVE_0X001D
 
-        pipe_request, // URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL
+        sync_reset_pipe_and_clear_stall,
 
         class_other,
         vendor_other,
@@ -1024,6 +1277,19 @@ urb_function_t* const urb_functions[] =
 
 	get_isoch_pipe_transfer_path_delays // URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS
 };
+static_assert(check_urb_handlers(urb_functions, URB_RESERVED, nullptr));
+static_assert(check_urb_handlers(urb_functions, URB_BULK, bulk_or_interrupt_transfer));
+static_assert(check_urb_handlers(urb_functions, URB_ISOCH, isoch_transfer));
+
+constexpr urb_function_t* local_urb_functions[] // do not send CMD_SUBMIT
+{
+        pipe_request,
+        function_deprecated,
+        get_current_frame_number,
+        open_static_streams,
+        get_isoch_pipe_transfer_path_delays,
+};
+static_assert(check_urb_handlers(urb_functions, URB_LOCAL, local_urb_functions));
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS usb_submit_urb(vpdo_dev_t &vpdo, IRP *irp, URB &urb)
@@ -1113,6 +1379,10 @@ void send_cmd_unlink(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp)
         auto seqnum = get_seqnum(irp);
         TraceMsg("irp %04x, seqnum %u", ptr4log(irp), seqnum);
 
+        if (cancel_unsent(vpdo, irp)) {
+                return;
+        }
+
         if (!vpdo.sock) {
                 TraceDbg("Socket is closed");
         } else if (auto ctx = new_wsk_context(vpdo, nullptr)) {
@@ -1122,11 +1392,97 @@ void send_cmd_unlink(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp)
                 Trace(TRACE_LEVEL_ERROR, "irp %04x, seqnum %u, new_wsk_context error", ptr4log(irp), seqnum);
         }
 
-        auto old_status = atomic_set_status(irp, ST_IRP_CANCELED);
-        NT_ASSERT(old_status != ST_RECV_COMPLETE);
+        complete_unlinked(irp);
+}
 
-        if (old_status == ST_SEND_COMPLETE) {
-                complete_as_canceled(irp);
+/*
+ * For requests of the driver itself, f.e. heartbeat.
+ * RET_SUBMIT of such CMD_SUBMIT is drained because IRP is not found.
+ * @param hdr in host byte order, its seqnum must be assigned
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_without_irp(_In_ vpdo_dev_t &vpdo, _In_ const usbip_header &hdr)
+{
+        auto ctx = new_wsk_context(vpdo, nullptr);
+        if (!ctx) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ctx->hdr = hdr;
+        return send(ctx);
+}
+
+/*
+ * Unlinks queued IRPs of the pipe, or all of them if handle is NULL.
+ * Unlike send_cmd_unlink, CMD_UNLINKs are sent back-to-back by UNLINK_BATCH_MAX in a single send.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink_irps(_In_ vpdo_dev_t &vpdo, _In_opt_ USBD_PIPE_HANDLE handle)
+{
+        auto start = LONG64(KeQueryInterruptTime());
+
+        unlink_batch *b{};
+        bool sent = false;
+        ULONG cnt = 0;
+
+        while (auto irp = handle ? dequeue_irp(vpdo, handle) : dequeue_irp(vpdo)) {
+                ++cnt;
+
+                if (cancel_unsent(vpdo, irp)) {
+                        continue;
+                }
+
+                if (b && b->count == ARRAYSIZE(b->hdr)) {
+                        sent = send(b) || sent;
+                        b = nullptr;
+                }
+
+                if (!b && vpdo.sock) {
+                        b = alloc_unlink_batch(vpdo, start);
+                }
+
+                if (!b) {
+                        send_cmd_unlink(vpdo, irp);
+                        continue;
+                }
+
+                auto &hdr = b->hdr[b->count++];
+                set_cmd_unlink_usbip_header(vpdo, hdr, get_seqnum(irp));
+
+                TraceDbg("irp %04x, seqnum %u", ptr4log(irp), hdr.u.cmd_unlink.seqnum);
+                byteswap_header(hdr, swap_dir::host2net);
+
+                complete_unlinked(irp);
+        }
+
+        if (b) {
+                b->last = true;
+                if (send(b)) {
+                        return; // unlink_batch_complete will call add_abort_time
+                }
+        }
+
+        if (cnt) {
+                add_abort_time(vpdo, start);
+        }
+
+        TraceMsg("PipeHandle %#Ix, %lu unlinks, batches sent %!bool!", ph4log(handle), cnt, sent);
+}
+
+/*
+ * Dispatches URB that was throttled, see budget.cpp.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit_urb(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto st = vpdo.unplugged ? STATUS_DEVICE_NOT_CONNECTED :
+                  usb_submit_urb(vpdo, irp, *static_cast<URB*>(URB_FROM_IRP(irp)));
+
+        if (st == STATUS_PENDING) {
+                TraceDbg("Leave %!STATUS!, irp %04x", st, ptr4log(irp));
+        } else {
+                release_budget(vpdo, irp);
+                complete_internal_ioctl(irp, st);
         }
 }
 
@@ -1174,6 +1530,12 @@ extern "C" NTSTATUS vhci_internal_ioctl(_In_ DEVICE_OBJECT *devobj, _In_ IRP *ir
                 st = STATUS_NO_SUCH_DEVICE;
         } else if (vpdo->unplugged) {
                 st = STATUS_DEVICE_NOT_CONNECTED;
+        } else if ((ioctl_code == IOCTL_INTERNAL_USB_SUBMIT_URB || ioctl_code == IOCTL_INTERNAL_USB_RESET_PORT) && 
+                    hold_irp(*vpdo, irp)) {
+                st = STATUS_PENDING; // until reconnected
+        } else if ((ioctl_code == IOCTL_INTERNAL_USB_SUBMIT_URB || ioctl_code == IOCTL_INTERNAL_USB_RESET_PORT) &&
+                    throttle_irp(*vpdo, irp)) {
+                st = STATUS_PENDING; // until the budget allows
         } else switch (ioctl_code) {
 	case IOCTL_INTERNAL_USB_SUBMIT_URB:
 		st = usb_submit_urb(*vpdo, irp, *static_cast<URB*>(URB_FROM_IRP(irp)));
@@ -4,10 +4,20 @@
 #include <usb.h>
 
 struct vpdo_dev_t;
+struct usbip_header;
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void send_cmd_unlink(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_without_irp(_In_ vpdo_dev_t &vpdo, _In_ const usbip_header &hdr);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink_irps(_In_ vpdo_dev_t &vpdo, _In_opt_ USBD_PIPE_HANDLE handle = USBD_PIPE_HANDLE());
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit_urb(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS clear_endpoint_stall(_In_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE PipeHandle, _In_opt_ IRP *irp);
 
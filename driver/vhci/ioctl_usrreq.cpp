@@ -147,13 +147,16 @@ PAGEABLE auto get_roothub_symbolic_name(vhci_dev_t &vhci, void *request, _Inout_
 	return get_roothub_name(*vhub, name, len);
 }
 
-PAGEABLE auto get_device_count(const vhub_dev_t &vhub)
+PAGEABLE auto get_device_count(vhci_dev_t &vhci)
 {
 	int cnt = 0;
 
-	for (auto d: vhub.vpdo) {
-		if (d) {
-			++cnt;
+	for (int i = 0; i < vhci.num_hubs; ++i) {
+		auto vhub = vhub_from_vhci(&vhci, i);
+		for (int j = 0; vhub && j < vhub->num_ports; ++j) {
+			if (vhub->vpdo[j]) {
+				++cnt;
+			}
 		}
 	}
 
@@ -175,9 +178,7 @@ PAGEABLE auto get_bandwidth_information(vhci_dev_t &vhci, void *request, _Inout_
 
 	RtlZeroMemory(&r, sizeof(r));
 
-	if (auto vhub = vhub_from_vhci(&vhci)) {
-		r.DeviceCount = get_device_count(*vhub);
-	}
+	r.DeviceCount = get_device_count(vhci);
 
 	r.TotalBusBandwidth = 0; // FIXME
 
@@ -207,7 +208,7 @@ PAGEABLE auto get_bus_statistics_0(vhci_dev_t &vhci, void *request, _Inout_ ULON
 	RtlZeroMemory(&r, sizeof(r));
 
 	auto &vhub = *vhub_from_vhci(&vhci);
-	r.DeviceCount = get_device_count(vhub);
+	r.DeviceCount = get_device_count(vhci);
 
 	r.CurrentSystemTime = GetCurrentSystemTime();
 
@@ -8,6 +8,7 @@
 #include "plugin.h"
 #include "vhub.h"
 #include "ioctl_usrreq.h"
+#include "port_change.h"
 
 #include <usbuser.h>
 #include <ntstrsafe.h>
@@ -33,7 +34,7 @@ PAGEABLE ULONG get_name_prefix_cch(const UNICODE_STRING &s)
 	return 0;
 }
 
-PAGEABLE NTSTATUS ioctl_vhub(vhub_dev_t &vhub, ULONG ioctl_code, void *buffer, ULONG inlen, ULONG &outlen)
+PAGEABLE NTSTATUS ioctl_vhub(vhub_dev_t &vhub, IRP *irp, ULONG ioctl_code, void *buffer, ULONG inlen, ULONG &outlen)
 {
 	PAGED_CODE();
 
@@ -44,13 +45,9 @@ PAGEABLE NTSTATUS ioctl_vhub(vhub_dev_t &vhub, ULONG ioctl_code, void *buffer, U
 		st = inlen == sizeof(ioctl_usbip_vhci_plugin) && outlen == sizeof(ioctl_usbip_vhci_plugin::port) ? 
 			plugin_vpdo(vhub, *static_cast<ioctl_usbip_vhci_plugin*>(buffer)) : STATUS_INVALID_BUFFER_SIZE;
 		break;
-	case IOCTL_USBIP_VHCI_UNPLUG_HARDWARE:
-		outlen = 0;
-		st = inlen == sizeof(ioctl_usbip_vhci_unplug) ? 
-			unplug_vpdo(vhub, static_cast<ioctl_usbip_vhci_unplug*>(buffer)->port) : STATUS_INVALID_BUFFER_SIZE;
-		break;
-	case IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES:
-		st = get_imported_devs(vhub, (ioctl_usbip_vhci_imported_dev*)buffer, outlen/sizeof(ioctl_usbip_vhci_imported_dev));
+	case IOCTL_USBIP_VHCI_PLUGIN_HARDWARE_BATCH:
+		st = inlen >= plugin_batch_size(1) && inlen == outlen ?
+			plugin_vpdo_batch(vhub, irp, *static_cast<ioctl_usbip_vhci_plugin_batch*>(buffer), inlen) : STATUS_INVALID_BUFFER_SIZE;
 		break;
 	case IOCTL_USB_GET_ROOT_HUB_NAME:
 		st = get_roothub_name(vhub, *static_cast<USB_ROOT_HUB_NAME*>(buffer), outlen);
@@ -62,6 +59,18 @@ PAGEABLE NTSTATUS ioctl_vhub(vhub_dev_t &vhub, ULONG ioctl_code, void *buffer, U
 	return st;
 }
 
+PAGEABLE auto get_num_ports(_In_ const vhci_dev_t &vhci, _Out_ ioctl_usbip_vhci_num_ports &r, _In_ ULONG outlen)
+{
+	PAGED_CODE();
+
+	if (outlen != sizeof(r)) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	r.num_ports = vhci.num_ports;
+	return STATUS_SUCCESS;
+}
+
 } // namespace
 
 
@@ -112,7 +121,7 @@ PAGEABLE NTSTATUS get_hcd_driverkey_name(vhci_dev_t &vhci, USB_HCD_DRIVERKEY_NAM
 	auto err = STATUS_SUCCESS;
 	ULONG prop_sz = 0;
 
-	auto prop = (PWSTR)GetDeviceProperty(vhci.child_pdo->Self, DevicePropertyDriverKeyName, err, prop_sz); // NULL terminated
+	auto prop = (PWSTR)GetDeviceProperty(vhci.children_pdo[0]->Self, DevicePropertyDriverKeyName, err, prop_sz); // NULL terminated
 	if (!prop) {
 		return err;
 	}
@@ -133,7 +142,7 @@ PAGEABLE NTSTATUS get_hcd_driverkey_name(vhci_dev_t &vhci, USB_HCD_DRIVERKEY_NAM
 	return err;
 }
 
-PAGEABLE NTSTATUS vhci_ioctl_vhci(vhci_dev_t &vhci, ULONG ioctl_code, void *buffer, ULONG inlen, ULONG &outlen)
+PAGEABLE NTSTATUS vhci_ioctl_vhci(vhci_dev_t &vhci, IRP *irp, ULONG ioctl_code, void *buffer, ULONG inlen, ULONG &outlen)
 {
 	PAGED_CODE();
 
@@ -147,9 +156,23 @@ PAGEABLE NTSTATUS vhci_ioctl_vhci(vhci_dev_t &vhci, ULONG ioctl_code, void *buff
 		NT_ASSERT(inlen == outlen);
 		st = vhci_ioctl_user_request(vhci, static_cast<USBUSER_REQUEST_HEADER*>(buffer), outlen);
 		break;
+	case IOCTL_USBIP_VHCI_UNPLUG_HARDWARE:
+		outlen = 0;
+		st = inlen == sizeof(ioctl_usbip_vhci_unplug) ? 
+			unplug_vpdo(vhci, static_cast<ioctl_usbip_vhci_unplug*>(buffer)->port) : STATUS_INVALID_BUFFER_SIZE;
+		break;
+	case IOCTL_USBIP_VHCI_GET_PORT_CHANGES:
+		st = get_port_changes(vhci, irp, inlen, outlen);
+		break;
+	case IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES:
+		st = get_imported_devs(vhci, (ioctl_usbip_vhci_imported_dev*)buffer, outlen/sizeof(ioctl_usbip_vhci_imported_dev));
+		break;
+	case IOCTL_USBIP_VHCI_GET_NUM_PORTS:
+		st = get_num_ports(vhci, *static_cast<ioctl_usbip_vhci_num_ports*>(buffer), outlen);
+		break;
 	default:
 		if (auto vhub = vhub_from_vhci(&vhci)) {
-			st = ioctl_vhub(*vhub, ioctl_code, buffer, inlen, outlen);
+			st = ioctl_vhub(*vhub, irp, ioctl_code, buffer, inlen, outlen);
 		} else {
 			TraceMsg("vhub has gone");
 		}
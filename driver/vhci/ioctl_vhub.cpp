@@ -10,32 +10,11 @@
 #include "pnp.h"
 #include "vhub.h"
 #include "internal_ioctl.h"
+#include "config_index.h"
 
 namespace
 {
 
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE USB_COMMON_DESCRIPTOR *find_descriptor(USB_CONFIGURATION_DESCRIPTOR *cd, UCHAR type, UCHAR index)
-{
-	PAGED_CODE();
-
-	USB_COMMON_DESCRIPTOR *from{};
-	auto end = reinterpret_cast<char*>(cd + cd->wTotalLength);
-
-	for (int i = 0; (char*)from < end; ++i) {
-		from = dsc_find_next(cd, from, type);
-		if (!from) {
-			break;
-		}
-		if (i == index) {
-			NT_ASSERT(from->bDescriptorType == type);
-			return from;
-		}
-	}
-
-	return nullptr;
-}
-
 /*
  * USB_REQUEST_GET_DESCRIPTOR must not be sent to a server.
  * This IRP_MJ_DEVICE_CONTROL request can run concurrently with IRP_MJ_INTERNAL_DEVICE_CONTROL requests. 
@@ -60,7 +39,7 @@ PAGEABLE NTSTATUS do_get_descr_from_nodeconn(_In_ vpdo_dev_t *vpdo, _Inout_ USB_
 	auto index = setup->wValue.LowByte;
 //	auto lang_id = setup->wIndex.W; // for string descriptor
 
-	void *dsc_data{};
+	const void *dsc_data{};
 	USHORT dsc_len = 0;
 
 	switch (type) {
@@ -86,8 +65,8 @@ PAGEABLE NTSTATUS do_get_descr_from_nodeconn(_In_ vpdo_dev_t *vpdo, _Inout_ USB_
 		break;
 	case USB_INTERFACE_DESCRIPTOR_TYPE:
 	case USB_ENDPOINT_DESCRIPTOR_TYPE:
-		if (auto cd = vpdo->actconfig) {
-			if (auto d = find_descriptor(cd, type, index)) {
+		if (auto idx = vpdo->actindex) {
+			if (auto d = find_descriptor(*idx, type, index)) {
 				dsc_len = d->bLength;
 				dsc_data = d;
 			}
@@ -146,25 +125,6 @@ PAGEABLE void set_speed(_Inout_ USB_NODE_CONNECTION_INFORMATION_EX &ci, _In_ usb
 	}
 }
 
-_IRQL_requires_(PASSIVE_LEVEL)
-_Function_class_(for_each_ep_fn)
-PAGEABLE NTSTATUS copy_endpoint(_In_ int i, _In_ const USB_ENDPOINT_DESCRIPTOR &d, _In_ void *data)
-{
-	PAGED_CODE();
-
-	auto &r = *static_cast<USB_NODE_CONNECTION_INFORMATION_EX*>(data);
-
-	if (ULONG(i) < r.NumberOfOpenPipes) {
-		auto &p = r.PipeList[i];
-		RtlCopyMemory(&p.EndpointDescriptor, &d, sizeof(d));
-		p.ScheduleOffset = 0; // FIXME: TODO
-		return STATUS_SUCCESS;
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Endpoint index %d, NumberOfOpenPipes %lu, ", i, r.NumberOfOpenPipes);
-		return STATUS_INVALID_PARAMETER;
-	}
-}
-
 /*
  * @param vpdo NULL if device is not plugged into the port
  */
@@ -184,7 +144,7 @@ PAGEABLE NTSTATUS get_nodeconn_info(
 	ci.CurrentConfigurationValue = vpdo && vpdo->actconfig ? vpdo->actconfig->bConfigurationValue : 0;
 	set_speed(ci, vpdo ? vpdo->speed : USB_SPEED_UNKNOWN, ex);
 	ci.DeviceIsHub = false;
-	ci.DeviceAddress = vpdo ? static_cast<USHORT>(make_vport(vpdo->version, vpdo->port)) : 0;
+	ci.DeviceAddress = vpdo ? static_cast<USHORT>(make_vport(*vhub_from_vpdo(vpdo), vpdo->port)) : 0;
 	ci.NumberOfOpenPipes = 0;
 	ci.ConnectionStatus = vpdo ? DeviceConnected : NoDeviceConnected;
 
@@ -194,9 +154,10 @@ PAGEABLE NTSTATUS get_nodeconn_info(
 
 	RtlCopyMemory(&ci.DeviceDescriptor, &vpdo->descriptor, sizeof(ci.DeviceDescriptor));
 
-	auto iface = vpdo->actconfig ? dsc_find_intf(vpdo->actconfig, vpdo->current_intf_num, vpdo->current_intf_alt) : nullptr;
-	if (iface) {
-		ci.NumberOfOpenPipes = iface->bNumEndpoints;
+	auto idx = vpdo->actindex;
+	auto alt = idx ? find_altsetting(*idx, vpdo->current_intf_num, vpdo->current_intf_alt) : nullptr;
+	if (alt) {
+		ci.NumberOfOpenPipes = alt->NumberOfPipes;
 	}
 
 	if (old_outlen == outlen) { // header only requested
@@ -215,7 +176,13 @@ PAGEABLE NTSTATUS get_nodeconn_info(
 
 	if (ci.NumberOfOpenPipes) {
 		RtlZeroMemory(ci.PipeList, pipes_sz);
-		return for_each_endpoint(vpdo->actconfig, iface, copy_endpoint, &ci);
+		auto pipes = get_pipes(*idx, *alt);
+
+		for (ULONG i = 0; i < ci.NumberOfOpenPipes; ++i) {
+			auto &p = ci.PipeList[i];
+			RtlCopyMemory(&p.EndpointDescriptor, pipes[i].desc, sizeof(p.EndpointDescriptor));
+			p.ScheduleOffset = 0; // FIXME: TODO
+		}
 	}
 
 	return STATUS_SUCCESS;
@@ -237,7 +204,7 @@ PAGEABLE auto get_nodeconn_info(_In_ vhub_dev_t &vhub, _In_ void *buffer, _In_ U
 	NT_ASSERT(ci.ConnectionIndex);
 	auto vpdo = vhub_find_vpdo(vhub, ci.ConnectionIndex); // NULL if port is empty
 
-	return get_nodeconn_info(vpdo, ci, outlen, ex);
+	return get_nodeconn_info(vpdo.get(), ci, outlen, ex);
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -296,12 +263,12 @@ PAGEABLE void get_hub_descriptor(_In_ vhub_dev_t &vhub, _Out_ USB_HUB_DESCRIPTOR
 {
 	PAGED_CODE();
 
-	static_assert(vhub.NUM_PORTS <= USB_MAXCHILDREN);
-	constexpr auto width = vhub.NUM_PORTS/8 + 1;
+	auto width = vhub.num_ports/8 + 1; // bitmap of ports and bit zero that is reserved
+	static_assert(2*(VHUB_MAX_PORTS/8 + 1) <= sizeof(d.bRemoveAndPowerMask));
 
-	d.bDescriptorLength = USB_DT_HUB_NONVAR_SIZE + 2*width;
+	d.bDescriptorLength = static_cast<UCHAR>(USB_DT_HUB_NONVAR_SIZE + 2*width);
 	d.bDescriptorType = USB_20_HUB_DESCRIPTOR_TYPE; // USB_DT_HUB
-	d.bNumberOfPorts = vhub.NUM_PORTS; 
+	d.bNumberOfPorts = static_cast<UCHAR>(vhub.num_ports);
 	d.wHubCharacteristics = HUB_CHAR_INDV_PORT_LPSM | HUB_CHAR_COMMON_OCPM;
 	d.bPowerOnToPowerGood = 0;
 	d.bHubControlCurrent = 0;
@@ -319,7 +286,9 @@ inline PAGEABLE void get_hub_descriptor(_In_ vhub_dev_t &vhub, _Out_ USB_30_HUB_
 
 	d.bLength = USB_DT_SS_HUB_SIZE;
 	d.bDescriptorType = USB_30_HUB_DESCRIPTOR_TYPE; // USB_DT_SS_HUB
-	d.bNumberOfPorts = vhub.NUM_PORTS; 
+	static_assert(VHUB_SS_MAX_PORTS == USB_SS_MAXPORTS);
+	NT_ASSERT(vhub.num_ports <= USB_SS_MAXPORTS); // see vhub_max_ports
+	d.bNumberOfPorts = static_cast<UCHAR>(vhub.num_ports);
 	d.wHubCharacteristics = HUB_CHAR_INDV_PORT_LPSM | HUB_CHAR_COMMON_OCPM;
 	d.bPowerOnToPowerGood = 0;
 	d.bHubControlCurrent = 0;
@@ -374,7 +343,7 @@ PAGEABLE NTSTATUS get_descr_from_nodeconn(vhub_dev_t &vhub, USB_DESCRIPTOR_REQUE
 	}
 
 	if (auto vpdo = vhub_find_vpdo(vhub, r.ConnectionIndex)) {
-		return do_get_descr_from_nodeconn(vpdo, r, outlen);
+		return do_get_descr_from_nodeconn(vpdo.get(), r, outlen);
 	}
 
 	return STATUS_NO_SUCH_DEVICE;
@@ -0,0 +1,400 @@
+/*
+ * Jitter buffer of isoch IN endpoint.
+ *
+ * Isoch IN URB is completed when its RET_SUBMIT is received, thus delay variation of the network
+ * becomes variation of completion cadence that class drivers of audio and video devices do not expect.
+ * URBs of endpoints enabled by ioctl_usbip_vhci_plugin.jitter_endpoints are held until the virtual clock
+ * of the device (see frame_clock.cpp) reaches StartFrame + delay and are completed in order by a timer.
+ * The class driver must keep enough URBs outstanding to cover the delay.
+ *
+ * The delay starts from ioctl_usbip_vhci_plugin.jitter_delay that is also its minimum.
+ * It grows at once by the lateness of URB that has missed its frame (underrun), otherwise it follows
+ * mean lateness plus four mean deviations, a frame per URB. If too many URBs are held,
+ * the oldest one is completed ahead of time (overrun).
+ */
+#include "jitter.h"
+#include "trace.h"
+#include "jitter.tmh"
+
+#include "dev.h"
+#include "irp.h"
+#include "vhci.h"
+#include "devconf.h"
+#include "urb_traits.h"
+
+struct jitter_buffer
+{
+        vpdo_dev_t *vpdo;
+        int epnum;
+
+        IO_CSQ csq;
+        LIST_ENTRY irps;
+        KSPIN_LOCK lock;
+        LONG held;
+
+        KTIMER timer;
+        KDPC dpc;
+
+        // guarded by lock, see InsertIrpEx
+        LONG min_delay;
+        LONG delay; // frames
+        ULONG last_due;
+        LONG lateness; // mean, Q4 frames
+        LONG deviation; // mean absolute deviation of lateness, Q4 frames
+
+        volatile LONG underruns;
+        volatile LONG overruns;
+};
+
+namespace
+{
+
+enum : LONG {
+        MAX_DELAY = 500, // frames
+        MAX_HELD = 64, // URBs per endpoint
+        Q = 4, // fraction bits of mean values, EWMA weight is 1/2^Q
+};
+
+inline auto to_buffer(_In_ IO_CSQ *csq)
+{
+        return CONTAINING_RECORD(csq, jitter_buffer, csq);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_due(_In_ IRP *irp)
+{
+        return *reinterpret_cast<ULONG*>(irp->Tail.Overlay.DriverContext + 2); // see get_seqnum, CSQ
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_isoch_urb(_In_ IRP *irp)
+{
+        auto urb = static_cast<URB*>(URB_FROM_IRP(irp));
+        return urb->UrbIsochronousTransfer;
+}
+
+constexpr auto clamp(LONG val, LONG lo, LONG hi)
+{
+        return val < lo ? lo : val > hi ? hi : val;
+}
+
+/*
+ * @param context current frame
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+NTSTATUS InsertIrpEx(_In_ IO_CSQ *csq, _In_ IRP *irp, _In_ PVOID context)
+{
+        auto &b = *to_buffer(csq);
+        auto now = *static_cast<ULONG*>(context);
+        auto &r = get_isoch_urb(irp);
+
+        auto late = LONG(now - r.StartFrame) << Q;
+        b.lateness += (late - b.lateness) >> Q;
+
+        auto dev = late - b.lateness;
+        b.deviation += ((dev < 0 ? -dev : dev) - b.deviation) >> Q;
+
+        auto due = r.StartFrame + b.delay;
+        if (b.held && LONG(due - b.last_due) < 0) { // complete in order
+                due = b.last_due;
+        }
+
+        if (auto missed = LONG(now - due); missed > 0) {
+                InterlockedIncrement(&b.underruns);
+                b.delay = clamp(b.delay + missed, b.min_delay, MAX_DELAY);
+                due = now;
+                TraceDbg("ep %d, irp %04x, underrun by %ld frames, delay %ld", b.epnum, ptr4log(irp), missed, b.delay);
+        } else {
+                auto target = clamp((b.lateness + 4*b.deviation) >> Q, b.min_delay, MAX_DELAY);
+                b.delay += b.delay < target ? 1 : b.delay > target ? -1 : 0;
+        }
+
+        get_due(irp) = b.last_due = due;
+
+        InsertTailList(&b.irps, list_entry(irp));
+        ++b.held;
+
+        return STATUS_SUCCESS;
+}
+
+void RemoveIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
+{
+        auto &b = *to_buffer(csq);
+        --b.held;
+
+        auto entry = list_entry(irp);
+        RemoveEntryList(entry);
+        InitializeListHead(entry);
+}
+
+/*
+ * @param context current frame or nullptr for any IRP
+ */
+IRP *PeekNextIrp(_In_ IO_CSQ *csq, _In_opt_ IRP *irp, _In_opt_ PVOID context)
+{
+        auto &b = *to_buffer(csq);
+        auto head = &b.irps;
+
+        auto entry = irp ? list_entry(irp)->Flink : head->Flink;
+        if (entry == head) {
+                return nullptr;
+        }
+
+        auto next = get_irp(entry);
+
+        if (auto now = static_cast<ULONG*>(context); now && LONG(get_due(next) - *now) > 0) {
+                return nullptr; // IRPs are due in order
+        }
+
+        return next;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(csq, jitter_buffer, csq)->lock)
+void AcquireLock(_In_ IO_CSQ *csq, _Out_ PKIRQL Irql)
+{
+        KeAcquireSpinLock(&to_buffer(csq)->lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(csq, jitter_buffer, csq)->lock)
+void ReleaseLock(_In_ IO_CSQ *csq, _In_ KIRQL Irql)
+{
+        KeReleaseSpinLock(&to_buffer(csq)->lock, Irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void CompleteCanceledIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+        complete_as_canceled(irp);
+}
+
+/*
+ * IoStatus of held IRPs is already set.
+ * @param now complete IRPs that are due, all if nullptr
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_Inout_ jitter_buffer &b, _In_opt_ ULONG *now)
+{
+        while (auto irp = IoCsqRemoveNextIrp(&b.csq, now)) {
+                IoCompleteRequest(irp, IO_NO_INCREMENT);
+        }
+}
+
+/*
+ * Arms the timer for the first held IRP.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void schedule(_Inout_ jitter_buffer &b)
+{
+        ULONG due{};
+
+        KIRQL irql;
+        KeAcquireSpinLock(&b.lock, &irql);
+
+        auto empty = IsListEmpty(&b.irps);
+        if (!empty) {
+                due = get_due(get_irp(b.irps.Flink));
+        }
+
+        KeReleaseSpinLock(&b.lock, irql);
+
+        if (empty) {
+                return;
+        }
+
+        auto frames = LONG(due - get_frame(b.vpdo->bus_time));
+
+        LARGE_INTEGER t;
+        t.QuadPart = -(LONG64(frames > 0 ? frames : 0)*10'000 + 1); // relative, 100ns units
+
+        KeSetTimer(&b.timer, t, &b.dpc);
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+void on_timer(_In_ KDPC*, _In_opt_ void *DeferredContext, _In_opt_ void*, _In_opt_ void*)
+{
+        auto &b = *static_cast<jitter_buffer*>(DeferredContext);
+
+        auto now = get_frame(b.vpdo->bus_time);
+        release(b, &now);
+
+        schedule(b);
+}
+
+/*
+ * @return buffer of isoch IN endpoint if it is enabled
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+jitter_buffer *find_buffer(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto stack = IoGetCurrentIrpStackLocation(irp);
+        if (stack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB) {
+                return nullptr;
+        }
+
+        auto urb = static_cast<URB*>(URB_FROM_IRP(irp));
+        if (!has_urb_trait(*urb, URB_ISOCH)) {
+                return nullptr;
+        }
+
+        auto handle = urb->UrbIsochronousTransfer.PipeHandle;
+        if (!is_endpoint_direction_in(handle)) {
+                return nullptr;
+        }
+
+        auto epnum = get_endpoint_number(handle);
+        return epnum ? vpdo.jitter[epnum - 1] : nullptr;
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_jitter(_Inout_ vpdo_dev_t &vpdo, _In_ USHORT delay, _In_ USHORT endpoints)
+{
+        PAGED_CODE();
+
+        if (!(delay && endpoints)) {
+                return STATUS_SUCCESS;
+        }
+
+        for (int epnum = 1; epnum <= int(ARRAYSIZE(vpdo.jitter)); ++epnum) {
+
+                if (!(endpoints & (1U << epnum))) {
+                        continue;
+                }
+
+                auto b = (jitter_buffer*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(jitter_buffer), USBIP_VHCI_POOL_TAG);
+                if (!b) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate jitter_buffer");
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                vpdo.jitter[epnum - 1] = b;
+
+                b->vpdo = &vpdo;
+                b->epnum = epnum;
+
+                InitializeListHead(&b->irps);
+                KeInitializeSpinLock(&b->lock);
+
+                KeInitializeTimer(&b->timer);
+                KeInitializeDpc(&b->dpc, on_timer, b);
+
+                b->delay = b->min_delay = clamp(delay, 1, MAX_DELAY); // 1ms frames
+
+                if (auto err = IoCsqInitializeEx(&b->csq, InsertIrpEx, RemoveIrp, PeekNextIrp,
+                                                 AcquireLock, ReleaseLock, CompleteCanceledIrp)) {
+                        Trace(TRACE_LEVEL_ERROR, "IoCsqInitializeEx %!STATUS!", err);
+                        return err;
+                }
+
+                TraceMsg("ep %d, delay %ld", epnum, b->delay);
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The socket is closed, jitter_hold can't be called concurrently.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_jitter(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        for (auto b: vpdo.jitter) {
+                if (b && b->csq.CsqAcquireLock) { // is initialized?
+                        release(*b, nullptr);
+                        KeCancelTimer(&b->timer);
+                }
+        }
+
+        KeFlushQueuedDpcs();
+
+        for (auto &b: vpdo.jitter) {
+                if (b) {
+                        TraceMsg("ep %d, delay %ld, underruns %ld, overruns %ld",
+                                  b->epnum, b->delay, b->underruns, b->overruns);
+
+                        ExFreePoolWithTag(b, USBIP_VHCI_POOL_TAG);
+                        b = nullptr;
+                }
+        }
+}
+
+/*
+ * @return true if IRP is held and must not be completed by the caller
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool jitter_hold(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto b = find_buffer(vpdo, irp);
+        if (!b) {
+                return false;
+        }
+
+        if (!NT_SUCCESS(irp->IoStatus.Status)) { // must not pass ahead of held ones
+                release(*b, nullptr);
+                return false;
+        }
+
+        auto now = get_frame(vpdo.bus_time);
+
+        if (auto err = IoCsqInsertIrpEx(&b->csq, irp, nullptr, &now)) {
+                Trace(TRACE_LEVEL_ERROR, "irp %04x, IoCsqInsertIrpEx %!STATUS!", ptr4log(irp), err);
+                return false;
+        }
+
+        if (b->held > MAX_HELD) {
+                if (auto victim = IoCsqRemoveNextIrp(&b->csq, nullptr)) {
+                        InterlockedIncrement(&b->overruns);
+                        IoCompleteRequest(victim, IO_NO_INCREMENT);
+                }
+        }
+
+        schedule(*b);
+        return true;
+}
+
+/*
+ * Completes held IRPs of the endpoint ahead of time, f.e. on URB_FUNCTION_ABORT_PIPE.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void jitter_flush(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle)
+{
+        if (!(handle && is_endpoint_direction_in(handle))) {
+                return;
+        }
+
+        if (auto epnum = get_endpoint_number(handle); epnum && vpdo.jitter[epnum - 1]) {
+                release(*vpdo.jitter[epnum - 1], nullptr);
+        }
+}
+
+/*
+ * @return current delay of the endpoint in frames, zero if its URBs are not held
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG jitter_delay(_In_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle)
+{
+        if (!(handle && is_endpoint_direction_in(handle))) {
+                return 0;
+        }
+
+        auto epnum = get_endpoint_number(handle);
+        auto b = epnum ? vpdo.jitter[epnum - 1] : nullptr;
+        if (!b) {
+                return 0;
+        }
+
+        KIRQL irql;
+        KeAcquireSpinLock(&b->lock, &irql);
+        auto delay = b->delay;
+        KeReleaseSpinLock(&b->lock, irql);
+
+        return delay;
+}
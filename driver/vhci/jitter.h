@@ -0,0 +1,23 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+
+#include <wdm.h>
+#include <usb.h>
+
+struct vpdo_dev_t;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_jitter(_Inout_ vpdo_dev_t &vpdo, _In_ USHORT delay, _In_ USHORT endpoints);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_jitter(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool jitter_hold(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void jitter_flush(_Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG jitter_delay(_In_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle);
@@ -55,6 +55,17 @@ PAGEABLE err_t usbip::recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expected_
                 return ERR_NETWORK;
         }
 
+        return check_op_common(r, expected_code, status);
+}
+
+/*
+ * @param r is received from the network, it is converted to host byte order
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE err_t usbip::check_op_common(_Inout_ op_common &r, _In_ UINT16 expected_code, _Out_ op_status_t &status)
+{
+        PAGED_CODE();
+
 	PACK_OP_COMMON(0, &r);
 
 	if (r.version != USBIP_VERSION) {
@@ -13,6 +13,7 @@
 
 struct _URB;
 struct usbip_header;
+struct op_common;
 
 namespace usbip
 {
@@ -28,6 +29,9 @@ PAGEABLE NTSTATUS recv(_Inout_ SOCKET *sock, _In_ memory pool, _Out_ void *data,
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE err_t recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expected_code, _Out_ op_status_t &status);
 
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE err_t check_op_common(_Inout_ op_common &r, _In_ UINT16 expected_code, _Out_ op_status_t &status);
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE NTSTATUS send_cmd(_Inout_ SOCKET *sock, _Inout_ usbip_header &hdr, _Inout_opt_ _URB *transfer_buffer = nullptr);
 
@@ -0,0 +1,273 @@
+/*
+ * Path delays of isoch pipe for URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS.
+ *
+ * A class driver uses them to decide how far ahead of the bus it must submit URBs and how many
+ * it must keep outstanding, so the answer must cover the network rather than a local host controller.
+ * Each isoch URB is a sample: send path is from the submit to StartFrame that RET_SUBMIT reports,
+ * completion path is from the end of the last frame of URB to its reception.
+ *
+ * StartFrame is mapped to the virtual clock (see frame_clock.cpp) that is locked so the server's frame
+ * is close to the virtual frame at reception, thus both samples have an unknown constant offset.
+ * It cancels out of the spread of samples, a delay is one-way network delay (half of smoothed RTT
+ * of heartbeat, see heartbeat.cpp) plus a percentile minus the minimum of recent samples of the pipe.
+ * A high percentile is used instead of the mean because underestimated delay causes underruns.
+ * Completion path also covers the jitter buffer of the endpoint (see jitter.cpp) if it is enabled.
+ */
+#include "path_delay.h"
+#include "trace.h"
+#include "path_delay.tmh"
+
+#include "dev.h"
+#include "vhci.h"
+#include "devconf.h"
+#include "heartbeat.h"
+#include "jitter.h"
+
+#include <limits.h>
+
+namespace
+{
+
+enum {
+        MAX_SAMPLES = 64, // per pipe
+        MIN_SAMPLES = 16, // to take a percentile, otherwise deviation of RTT is used
+        PERCENTILE = 95,
+};
+
+struct samples
+{
+        SHORT send[MAX_SAMPLES]; // frames
+        SHORT completion[MAX_SAMPLES];
+        USHORT pos; // next to write
+        USHORT cnt;
+};
+
+} // namespace
+
+
+struct path_delay_state
+{
+        KSPIN_LOCK lock;
+        samples *pipes[32]; // by get_endpoint_index, allocated by first sample
+};
+
+namespace
+{
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_submit_frame(_In_ IRP *irp)
+{
+        static_assert(sizeof(*irp->Tail.Overlay.DriverContext) == 2*sizeof(ULONG));
+        auto ptr = reinterpret_cast<ULONG*>(irp->Tail.Overlay.DriverContext + 2);
+        return ptr[1]; // high word of DriverContext[2], see get_charge, get_due
+}
+
+constexpr SHORT to_short(LONG val)
+{
+        return SHORT(val < SHRT_MIN ? SHRT_MIN : val > SHRT_MAX ? SHRT_MAX : val);
+}
+
+/*
+ * Period of isoch endpoint is 2^(bInterval-1) frames for full speed and microframes for high speed and above.
+ * @return frames that URB spans on the bus, rounded up
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG get_duration(_In_ const _URB_ISOCH_TRANSFER &r, _In_ usb_device_speed speed)
+{
+        auto interval = get_endpoint_interval(r.PipeHandle);
+        auto shift = interval >= 1 && interval <= 16 ? interval - 1 : 0;
+
+        auto uframes = ULONG64(r.NumberOfPackets) << shift;
+        if (speed <= USB_SPEED_FULL) {
+                uframes <<= 3;
+        }
+
+        return static_cast<ULONG>((uframes + 7) >> 3);
+}
+
+/*
+ * @return frames
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+LONG get_spread(_In_ const SHORT (&ring)[MAX_SAMPLES], _In_ int cnt)
+{
+        NT_ASSERT(cnt > 0 && cnt <= MAX_SAMPLES);
+
+        SHORT v[MAX_SAMPLES];
+        RtlCopyMemory(v, ring, cnt*sizeof(*v));
+
+        for (int i = 1; i < cnt; ++i) { // insertion sort, the ring is small
+                auto x = v[i];
+                auto j = i;
+                for ( ; j && v[j - 1] > x; --j) {
+                        v[j] = v[j - 1];
+                }
+                v[j] = x;
+        }
+
+        auto k = (cnt*PERCENTILE + 99)/100 - 1;
+        return v[k] - v[0];
+}
+
+/*
+ * @return false if there are no samples of the pipe
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool copy_samples(_Out_ samples &s, _In_ path_delay_state &pd, _In_ USBD_PIPE_HANDLE handle)
+{
+        bool ok = false;
+
+        KIRQL irql;
+        KeAcquireSpinLock(&pd.lock, &irql);
+
+        if (auto p = pd.pipes[get_endpoint_index(handle)]) {
+                s = *p;
+                ok = true;
+        }
+
+        KeReleaseSpinLock(&pd.lock, irql);
+        return ok;
+}
+
+/*
+ * @return microseconds to milliseconds, rounded up
+ */
+constexpr LONG to_ms(unsigned int us)
+{
+        return LONG((us + 999)/1000);
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_path_delay(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vpdo.path_delay);
+
+        auto pd = (path_delay_state*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(path_delay_state), USBIP_VHCI_POOL_TAG);
+        if (!pd) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate path_delay_state");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeInitializeSpinLock(&pd->lock);
+
+        vpdo.path_delay = pd;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The socket is closed, path_delay_sample can't be called concurrently.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_path_delay(_Inout_ vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        auto &pd = vpdo.path_delay;
+        if (!pd) {
+                return;
+        }
+
+        for (auto p: pd->pipes) {
+                if (p) {
+                        ExFreePoolWithTag(p, USBIP_VHCI_POOL_TAG);
+                }
+        }
+
+        ExFreePoolWithTag(pd, USBIP_VHCI_POOL_TAG);
+        pd = nullptr;
+}
+
+/*
+ * Must be called before CMD_SUBMIT of isoch URB is sent.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void path_delay_submit(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        get_submit_frame(irp) = get_frame(vpdo.bus_time);
+}
+
+/*
+ * @param start_frame of RET_SUBMIT in numbering of the virtual clock, see sync
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void path_delay_sample(
+        _Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ const _URB_ISOCH_TRANSFER &r, _In_ ULONG start_frame)
+{
+        auto pd = vpdo.path_delay;
+        if (!pd) {
+                return;
+        }
+
+        auto now = get_frame(vpdo.bus_time);
+
+        auto send = to_short(LONG(start_frame - get_submit_frame(irp)));
+        auto completion = to_short(LONG(now - start_frame - get_duration(r, vpdo.speed)));
+
+        auto &pipe = pd->pipes[get_endpoint_index(r.PipeHandle)];
+
+        if (!pipe) {
+                auto p = (samples*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(samples), USBIP_VHCI_POOL_TAG);
+                if (!p) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate samples");
+                        return;
+                }
+
+                if (InterlockedCompareExchangePointer(reinterpret_cast<void**>(&pipe), p, nullptr)) {
+                        ExFreePoolWithTag(p, USBIP_VHCI_POOL_TAG); // set concurrently
+                }
+        }
+
+        KIRQL irql;
+        KeAcquireSpinLock(&pd->lock, &irql);
+
+        auto &s = *pipe;
+
+        s.send[s.pos] = send;
+        s.completion[s.pos] = completion;
+
+        s.pos = (s.pos + 1) % MAX_SAMPLES;
+        if (s.cnt < MAX_SAMPLES) {
+                ++s.cnt;
+        }
+
+        KeReleaseSpinLock(&pd->lock, irql);
+}
+
+/*
+ * @param send MaximumSendPathDelayInMilliSeconds
+ * @param completion MaximumCompletionPathDelayInMilliSeconds
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_path_delays(
+        _Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle, _Out_ ULONG &send, _Out_ ULONG &completion)
+{
+        unsigned int rtt; // microseconds
+        unsigned int rttvar;
+        get_rtt(vpdo, rtt, rttvar);
+
+        if (!rtt) { // heartbeat is disabled or has no samples yet
+                rtt = static_cast<unsigned int>(vpdo.rx_bdp.min_rtt/10);
+        }
+
+        auto base = to_ms(rtt/2);
+        auto send_spread = rttvar ? to_ms(2*rttvar) : base;
+        auto completion_spread = send_spread;
+
+        samples s{};
+        if (vpdo.path_delay && copy_samples(s, *vpdo.path_delay, handle) && s.cnt >= MIN_SAMPLES) {
+                send_spread = get_spread(s.send, s.cnt);
+                completion_spread = get_spread(s.completion, s.cnt);
+        }
+
+        send = max(ULONG(base + send_spread), 1UL);
+
+        completion = max(ULONG(base + completion_spread), jitter_delay(vpdo, handle));
+        completion = max(completion, 1UL);
+
+        TraceDbg("PipeHandle %#Ix, rtt %u us, rttvar %u us, samples %d, send %lu ms, completion %lu ms",
+                  ph4log(handle), rtt, rttvar, s.cnt, send, completion);
+}
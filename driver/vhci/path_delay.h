@@ -0,0 +1,25 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+
+#include <wdm.h>
+#include <usb.h>
+
+struct vpdo_dev_t;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_path_delay(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void free_path_delay(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void path_delay_submit(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void path_delay_sample(
+        _Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ const _URB_ISOCH_TRANSFER &r, _In_ ULONG start_frame);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_path_delays(
+        _Inout_ vpdo_dev_t &vpdo, _In_ USBD_PIPE_HANDLE handle, _Out_ ULONG &send, _Out_ ULONG &completion);
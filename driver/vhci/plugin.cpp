@@ -19,6 +19,13 @@
 #include "proto.h"
 #include "wsk_context.h"
 #include "wsk_receive.h"
+#include "reconnect.h"
+#include "jitter.h"
+#include "budget.h"
+#include "crypto.h"
+#include "heartbeat.h"
+#include "config_index.h"
+#include "path_delay.h"
 #include "pnp.h"
 
 namespace
@@ -63,10 +70,9 @@ inline void log(const USB_CONFIGURATION_DESCRIPTOR &d)
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto check_speed(_In_ hci_version version, _In_ usb_device_speed speed)
+auto get_hci_version(_In_ usb_device_speed speed)
 {
-        auto dev_version = speed >= USB_SPEED_SUPER ? HCI_USB3 : HCI_USB2;
-        return dev_version == version;
+        return speed >= USB_SPEED_SUPER ? HCI_USB3 : HCI_USB2;
 }
 
 /*
@@ -143,6 +149,14 @@ PAGEABLE auto init(vpdo_dev_t &vpdo, const ioctl_usbip_vhci_plugin &r)
                 return err;
         }
 
+        vpdo.reconnect_timeout = r.reconnect;
+        init(vpdo.bus_time);
+
+        vpdo.segment_size = r.segment_size - r.segment_size % USBIP_SEGMENT_ALIGN;
+        vpdo.segment_endpoints = vpdo.segment_size ? r.segment_endpoints : 0;
+
+        vpdo.streams = r.streams;
+
         return STATUS_SUCCESS;
 }
 
@@ -157,18 +171,21 @@ PAGEABLE auto set_class_subclass_proto(vpdo_dev_t &vpdo)
 {
 	PAGED_CODE();
         NT_ASSERT(vpdo.actconfig);
+        NT_ASSERT(vpdo.actindex);
 
         auto use_intf = vpdo.actconfig->bNumInterfaces == 1 && !(vpdo.bDeviceClass || vpdo.bDeviceSubClass || vpdo.bDeviceProtocol);
         if (!use_intf) {
                 return ERR_NONE;
         }
 
-	auto d = dsc_find_next_intf(vpdo.actconfig, nullptr);
-	if (!d) {
+	auto &idx = *vpdo.actindex;
+	if (!idx.num_altsettings) {
 		Trace(TRACE_LEVEL_ERROR, "Interface descriptor not found");
 		return ERR_GENERAL;
 	}
 
+	auto d = idx.altsettings->desc;
+
 	vpdo.bDeviceClass = d->bInterfaceClass;
 	vpdo.bDeviceSubClass = d->bInterfaceSubClass;
 	vpdo.bDeviceProtocol = d->bInterfaceProtocol;
@@ -181,7 +198,7 @@ PAGEABLE auto set_class_subclass_proto(vpdo_dev_t &vpdo)
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto create_vpdo(vpdo_dev_t* &vpdo, vhub_dev_t *vhub, const ioctl_usbip_vhci_plugin &r)
+PAGEABLE auto create_vpdo(vpdo_dev_t* &vpdo, vhub_dev_t *vhub, ioctl_usbip_vhci_plugin &r)
 {
         PAGED_CODE();
         NT_ASSERT(!vpdo);
@@ -193,6 +210,7 @@ PAGEABLE auto create_vpdo(vpdo_dev_t* &vpdo, vhub_dev_t *vhub, const ioctl_usbip
 
         vpdo = to_vpdo_or_null(devobj);
         vpdo->parent = vhub;
+        ExInitializeRundownProtection(&vpdo->port_ref); // before vhub_attach_vpdo, destroy waits for it
 
         vpdo->DevicePowerState = PowerDeviceD3;
         vpdo->SystemPowerState = PowerSystemWorking;
@@ -213,6 +231,39 @@ PAGEABLE auto create_vpdo(vpdo_dev_t* &vpdo, vhub_dev_t *vhub, const ioctl_usbip
                 return make_error(ERR_GENERAL);
         }
 
+        init(vpdo->tx.bdp, r.window_min, r.window_max);
+        init(vpdo->rx_bdp, r.window_min, r.window_max);
+
+        if (auto err = init_budget(*vpdo, r)) {
+                Trace(TRACE_LEVEL_ERROR, "init_budget %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        if (auto err = init_reconnect(*vpdo)) {
+                Trace(TRACE_LEVEL_ERROR, "init_reconnect %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        if (auto err = init_jitter(*vpdo, r.jitter_delay, r.jitter_endpoints)) {
+                Trace(TRACE_LEVEL_ERROR, "init_jitter %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        if (auto err = init_path_delay(*vpdo)) {
+                Trace(TRACE_LEVEL_ERROR, "init_path_delay %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        if (auto err = init_session(*vpdo, r)) {
+                Trace(TRACE_LEVEL_ERROR, "init_session %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
+        if (auto err = init_heartbeat(*vpdo, r.heartbeat, r.heartbeat_misses)) {
+                Trace(TRACE_LEVEL_ERROR, "init_heartbeat %!STATUS!", err);
+                return make_error(ERR_GENERAL);
+        }
+
         return make_error(ERR_NONE);
 }
 
@@ -237,17 +288,27 @@ PAGEABLE auto send_req_import(vpdo_dev_t &vpdo)
         PACK_OP_COMMON(0, &req.hdr);
         PACK_OP_IMPORT_REQUEST(0, &req.body);
 
-        return send(vpdo.sock, usbip::memory::stack, &req, sizeof(req));
+        return send_data(vpdo, usbip::memory::stack, &req, sizeof(req));
 }
 
+/*
+ * The reply of an encrypted device is trusted only if the tag of its record matches, see crypto.cpp.
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto recv_rep_import(vpdo_dev_t &vpdo, usbip::memory pool, op_import_reply &reply)
 {
         PAGED_CODE();
 
+        op_common hdr;
+
+        if (auto err = recv_data(vpdo, usbip::memory::stack, &hdr, sizeof(hdr))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive OP_REP_IMPORT %!STATUS!", err);
+                return make_error(err == STATUS_AUTH_TAG_MISMATCH ? ERR_ACCESS : ERR_NETWORK);
+        }
+
         auto status = ST_OK;
 
-        if (auto err = usbip::recv_op_common(vpdo.sock, OP_REP_IMPORT, status)) {
+        if (auto err = usbip::check_op_common(hdr, OP_REP_IMPORT, status)) {
                 return make_error(err);
         }
 
@@ -256,9 +317,9 @@ PAGEABLE auto recv_rep_import(vpdo_dev_t &vpdo, usbip::memory pool, op_import_re
                 return make_error(ERR_NONE, status);
         }
 
-        if (auto err = recv(vpdo.sock, pool, &reply, sizeof(reply))) {
+        if (auto err = recv_data(vpdo, pool, &reply, sizeof(reply))) {
                 Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
-                return make_error(ERR_NETWORK);
+                return make_error(err == STATUS_AUTH_TAG_MISMATCH ? ERR_ACCESS : ERR_NETWORK);
         }
 
         PACK_OP_IMPORT_REPLY(0, &reply);
@@ -271,6 +332,65 @@ PAGEABLE auto recv_rep_import(vpdo_dev_t &vpdo, usbip::memory pool, op_import_re
         return make_error(ERR_NONE);
 }
 
+/*
+ * Clears vpdo.streams if the server refuses USB 3 bulk streams extension.
+ * @return ERR_STREAMS if the server closed the connection, f.e. Linux usbipd
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto negotiate_streams(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+        NT_ASSERT(vpdo.streams);
+
+        struct 
+        {
+                op_common hdr{ USBIP_VERSION, OP_REQ_STREAMS, ST_OK };
+                op_streams_request body{ USBIP_STREAMS_VERSION };
+        } req;
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        PACK_OP_COMMON(0, &req.hdr);
+        PACK_OP_STREAMS_REQUEST(0, &req.body);
+
+        if (auto err = send_data(vpdo, usbip::memory::stack, &req, sizeof(req))) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_STREAMS %!STATUS!", err);
+                return make_error(ERR_NETWORK);
+        }
+
+        struct
+        {
+                op_common hdr;
+                op_streams_reply body;
+        } reply;
+
+        if (auto err = recv_data(vpdo, usbip::memory::stack, &reply.hdr, sizeof(reply.hdr))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive OP_REP_STREAMS %!STATUS!", err);
+                return make_error(err == STATUS_AUTH_TAG_MISMATCH ? ERR_ACCESS : ERR_STREAMS);
+        }
+
+        auto status = ST_OK;
+
+        if (auto err = usbip::check_op_common(reply.hdr, OP_REP_STREAMS, status)) {
+                return make_error(err);
+        }
+
+        if (!status) {
+                if (auto err = recv_data(vpdo, usbip::memory::stack, &reply.body, sizeof(reply.body))) {
+                        Trace(TRACE_LEVEL_ERROR, "Receive op_streams_reply %!STATUS!", err);
+                        return make_error(err == STATUS_AUTH_TAG_MISMATCH ? ERR_ACCESS : ERR_NETWORK);
+                }
+                PACK_OP_STREAMS_REPLY(0, &reply.body);
+        }
+
+        vpdo.streams = !status && reply.body.version == USBIP_STREAMS_VERSION;
+
+        TraceMsg("OP_REP_STREAMS %!op_status_t!, version %lu -> %!bool!", 
+                  status, status ? 0 : reply.body.version, vpdo.streams);
+
+        return make_error(ERR_NONE);
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto init_req_get_descr(
         _Out_ usbip_header &hdr, vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, USHORT TransferBufferLength)
@@ -293,37 +413,65 @@ PAGEABLE auto init_req_get_descr(
         return true;
 }
 
+/*
+ * Round trips of import are the first RTT samples, see bdp.cpp.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void rtt_sample(_Inout_ vpdo_dev_t &vpdo, _In_ LONG64 start)
+{
+        auto rtt = static_cast<LONG64>(KeQueryInterruptTime()) - start;
+
+        rtt_sample(vpdo.tx.bdp, rtt);
+        rtt_sample(vpdo.rx_bdp, rtt);
+}
+
+/*
+ * Synchronous CMD_SUBMIT on EP0, the receive loop must not be running.
+ * @param hdr CMD_SUBMIT on input, RET_SUBMIT on output
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto read_descr_hdr(vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, _Inout_ USHORT &TransferBufferLength)
+PAGEABLE auto submit_ep0(vpdo_dev_t &vpdo, _Inout_ usbip_header &hdr)
 {
         PAGED_CODE();
 
-        usbip_header hdr{};
-        if (!init_req_get_descr(hdr, vpdo, type, index, lang_id, TransferBufferLength)) {
-                return ERR_GENERAL;
-        }
-
         char buf[DBG_USBIP_HDR_BUFSZ];
         TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "OUT %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
         byteswap_header(hdr, swap_dir::host2net);
+        auto start = static_cast<LONG64>(KeQueryInterruptTime());
 
-        if (auto err = send(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Send header of %!usb_descriptor_type! %!STATUS!", type, err);
+        if (auto err = send_data(vpdo, usbip::memory::stack, &hdr, sizeof(hdr))) {
+                Trace(TRACE_LEVEL_ERROR, "Send header %!STATUS!", err);
                 return ERR_NETWORK;
         }
 
-        if (auto err = recv(vpdo.sock, usbip::memory::stack, &hdr, sizeof(hdr))) {
-                Trace(TRACE_LEVEL_ERROR, "Recv header of %!usb_descriptor_type! %!STATUS!", type, err);
-                return ERR_NETWORK;
+        if (auto err = recv_data(vpdo, usbip::memory::stack, &hdr, sizeof(hdr))) {
+                Trace(TRACE_LEVEL_ERROR, "Recv header %!STATUS!", err);
+                return err == STATUS_AUTH_TAG_MISMATCH ? ERR_ACCESS : ERR_NETWORK; // another pre-shared key
         }
 
+        rtt_sample(vpdo, start);
+
         byteswap_header(hdr, swap_dir::net2host);
         TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "IN %Iu%s", get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, true));
 
         auto &b = hdr.base;
-        if (!(b.command == USBIP_RET_SUBMIT && extract_num(b.seqnum) == vpdo.seqnum)) {
-                return ERR_PROTOCOL;
+        return b.command == USBIP_RET_SUBMIT && extract_num(b.seqnum) == vpdo.seqnum ? ERR_NONE : ERR_PROTOCOL;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto read_descr_hdr(vpdo_dev_t &vpdo, UCHAR type, UCHAR index, USHORT lang_id, _Inout_ USHORT &TransferBufferLength)
+{
+        PAGED_CODE();
+
+        usbip_header hdr{};
+        if (!init_req_get_descr(hdr, vpdo, type, index, lang_id, TransferBufferLength)) {
+                return ERR_GENERAL;
+        }
+
+        if (auto err = submit_ep0(vpdo, hdr)) {
+                Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, index %d -> error %d", type, index, err);
+                return err;
         }
 
         auto &ret = hdr.u.ret_submit;
@@ -349,7 +497,7 @@ PAGEABLE auto read_descr(
                 return err;
         }
 
-        if (auto err = recv(vpdo.sock, pool, dest, len)) {
+        if (auto err = recv_data(vpdo, pool, dest, len)) {
                 Trace(TRACE_LEVEL_ERROR, "%!usb_descriptor_type!, length %d -> %!STATUS!", type, len, err);
                 return ERR_NETWORK;
         }
@@ -412,7 +560,14 @@ PAGEABLE auto read_config_descr(vpdo_dev_t &vpdo)
                 return err;
         }
 
-        return len == cd.wTotalLength ? ERR_NONE : ERR_GENERAL;
+        if (len != cd.wTotalLength) {
+                return ERR_GENERAL;
+        }
+
+        NT_ASSERT(!vpdo.actindex);
+        vpdo.actindex = make_config_index(*vpdo.actconfig, vpdo.speed);
+
+        return vpdo.actindex ? ERR_NONE : ERR_GENERAL;
 }
 
 /*
@@ -525,6 +680,7 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
         }
 
         if (auto err = read_config_descr(vpdo)) {
+                free_config_index(vpdo.actindex);
                 if (auto &ptr = vpdo.actconfig) {
                         ExFreePoolWithTag(ptr, USBIP_VHCI_POOL_TAG);
                         ptr = nullptr;
@@ -546,11 +702,55 @@ PAGEABLE auto fetch_descriptors(vpdo_dev_t &vpdo, const usbip_usb_device &udev)
         return set_class_subclass_proto(vpdo);
 }
 
+/*
+ * The speed of the device is known from OP_REP_IMPORT only.
+ * Instead of failing with ERR_USB_VER and making the client to reconnect to another hub,
+ * the vpdo that is not attached yet is handed over to the hub of the required version.
+ *
+ * @param pin references vpdo.parent, it is replaced by the reference to the new parent,
+ *        the hub can't be removed until the vpdo is attached
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto move_to_hub(vpdo_dev_t &vpdo, hci_version version, vhub_ref &pin)
+{
+        PAGED_CODE();
+        NT_ASSERT(!vpdo.port);
+        NT_ASSERT(pin.get() == vhub_from_vpdo(&vpdo));
+
+        auto vhub = get_vhub(*vhci_from_vhub(pin.get()), version, 0); // vhub_attach_vpdo can choose another hub of the vhci
+        if (!vhub) {
+                return false;
+        }
+
+        TraceMsg("%!hci_version! -> %!hci_version!", vpdo.version, version);
+
+        vpdo.version = version;
+        vpdo.parent = vhub.get();
+
+        pin.swap(vhub); // the previous parent is released on return
+        return true;
+}
+
+/*
+ * @param pin see move_to_hub
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo)
+PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo, vhub_ref &pin)
 {
         PAGED_CODE();
 
+        if (vpdo.crypto) {
+                if (auto err = negotiate_keys(vpdo)) {
+                        return err;
+                }
+        }
+
+        if (vpdo.streams) {
+                if (auto err = negotiate_streams(vpdo)) {
+                        return err;
+                }
+        }
+
         if (auto err = send_req_import(vpdo)) {
                 Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
                 return make_error(ERR_NETWORK);
@@ -565,9 +765,11 @@ PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo)
         auto &udev = reply.udev;
         log(udev);
 
-        if (!check_speed(vpdo.version, static_cast<usb_device_speed>(udev.speed))) {
-                TraceDbg("Mismatch between %!hci_version! and %!usb_device_speed!", vpdo.version, udev.speed);
-                return make_error(ERR_USB_VER);
+        if (auto version = get_hci_version(static_cast<usb_device_speed>(udev.speed)); version != vpdo.version) {
+                if (!move_to_hub(vpdo, version, pin)) {
+                        TraceDbg("Mismatch between %!hci_version! and %!usb_device_speed!", vpdo.version, udev.speed);
+                        return make_error(ERR_USB_VER);
+                }
         }
 
         vpdo.devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
@@ -584,6 +786,141 @@ PAGEABLE auto import_remote_device(vpdo_dev_t &vpdo)
         return make_error(ERR_NONE);
 }
 
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto control_out(vpdo_dev_t &vpdo, UCHAR recipient, UCHAR request, USHORT value, USHORT index)
+{
+        PAGED_CODE();
+
+        usbip_header hdr{};
+        const ULONG TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_TRANSFER_DIRECTION_OUT;
+
+        if (set_cmd_submit_usbip_header(vpdo, hdr, EP0, TransferFlags)) {
+                return ERR_GENERAL;
+        }
+
+        auto &pkt = get_submit_setup(hdr);
+        pkt.bmRequestType.B = USB_DIR_OUT | USB_TYPE_STANDARD | recipient;
+        pkt.bRequest = request;
+        pkt.wValue.W = value;
+        pkt.wIndex.W = index;
+
+        if (auto err = submit_ep0(vpdo, hdr)) {
+                return err;
+        }
+
+        return hdr.u.ret_submit.status ? ERR_GENERAL : ERR_NONE;
+}
+
+/*
+ * The server side device could be reset, restore the state that the function driver has set.
+ * SET_INTERFACE can stall, this is not an error, see urb_select_interface.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto replay_config(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        auto cfg = vpdo.current_config;
+        if (!cfg) {
+                return ERR_NONE;
+        }
+
+        if (auto err = control_out(vpdo, USB_RECIP_DEVICE, USB_REQUEST_SET_CONFIGURATION, cfg, 0)) {
+                Trace(TRACE_LEVEL_ERROR, "SET_CONFIGURATION %d -> error %d", cfg, err);
+                return err;
+        }
+
+        for (UCHAR intf = 0; intf < ARRAYSIZE(vpdo.intf_alt); ++intf) {
+                auto alt = vpdo.intf_alt[intf];
+                if (!alt) {
+                        continue;
+                }
+
+                switch (auto err = control_out(vpdo, USB_RECIP_INTERFACE, USB_REQUEST_SET_INTERFACE, alt, intf)) {
+                case ERR_NONE:
+                        break;
+                case ERR_GENERAL:
+                        Trace(TRACE_LEVEL_WARNING, "SET_INTERFACE %d, alt %d failed", intf, alt);
+                        break;
+                default:
+                        return err;
+                }
+        }
+
+        TraceMsg("bConfigurationValue %d restored", cfg);
+        return ERR_NONE;
+}
+
+/*
+ * The device on busid must be the same, the descriptors that were read on import are kept.
+ * Streams that the function driver could open must be supported by the server as before.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto reimport_remote_device(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        if (vpdo.crypto) {
+                if (auto err = negotiate_keys(vpdo)) {
+                        return err;
+                }
+        }
+
+        if (vpdo.streams) {
+                if (auto err = negotiate_streams(vpdo)) {
+                        return err;
+                }
+                if (!vpdo.streams) {
+                        vpdo.streams = true; // the function driver may still use them, do not reimport without
+                        return make_error(ERR_STREAMS);
+                }
+        }
+
+        if (auto err = send_req_import(vpdo)) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
+                return make_error(ERR_NETWORK);
+        }
+
+        op_import_reply reply{};
+
+        if (auto err = recv_rep_import(vpdo, usbip::memory::stack, reply)) {
+                return err;
+        }
+
+        auto &udev = reply.udev;
+        log(udev);
+
+        if (!(get_hci_version(static_cast<usb_device_speed>(udev.speed)) == vpdo.version && is_same_device(udev, vpdo.descriptor))) {
+                Trace(TRACE_LEVEL_ERROR, "Another device on busid %s", vpdo.busid);
+                return make_error(ERR_NOTEXIST);
+        }
+
+        vpdo.devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum)); // devnum can change
+
+        USB_DEVICE_DESCRIPTOR dd{};
+        USHORT len = sizeof(dd);
+
+        if (auto err = read_descr(vpdo, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, usbip::memory::stack, &dd, len)) {
+                return make_error(err);
+        }
+
+        if (!(len == sizeof(dd) && RtlEqualMemory(&dd, &vpdo.descriptor, sizeof(dd)))) {
+                Trace(TRACE_LEVEL_ERROR, "Device descriptor is not the same");
+                return make_error(ERR_NOTEXIST);
+        }
+
+        if (auto err = replay_config(vpdo)) {
+                return make_error(err);
+        }
+
+        if (auto err = event_callback_control(vpdo.sock, WSK_EVENT_DISCONNECT, false)) {
+                Trace(TRACE_LEVEL_ERROR, "event_callback_control %!STATUS!", err);
+                return make_error(ERR_NETWORK);
+        }
+
+        return make_error(ERR_NONE);
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto getaddrinfo(ADDRINFOEXW* &result, vpdo_dev_t &vpdo)
 {
@@ -642,10 +979,37 @@ PAGEABLE auto set_options(wsk::SOCKET *sock)
         return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+/*
+ * A dead address must not stall the attach for the full TCP connect timeout.
+ */
+enum : LONGLONG {
+        CONNECT_ATTEMPT_TIMEOUT = 5LL*1000*1000*10, // 100-nanosecond units
+        CONNECT_TIMEOUT = 15LL*1000*1000*10
+};
+
+struct connect_args
+{
+        LONGLONG deadline; // for all attempts as returned by KeQueryInterruptTime
+        KEVENT *abort; // optional, stops the attempts if signaled
+};
+
+/*
+ * @param ctx connect_args*
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
+PAGEABLE auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void *ctx)
 {
         PAGED_CODE();
+        auto &args = *static_cast<connect_args*>(ctx);
+
+        if (args.abort && KeReadStateEvent(args.abort)) {
+                return STATUS_CANCELLED;
+        }
+
+        auto remaining = args.deadline - static_cast<LONGLONG>(KeQueryInterruptTime());
+        if (remaining <= 0) {
+                return STATUS_IO_TIMEOUT;
+        }
 
         if (auto err = set_options(sock)) {
                 return err;
@@ -658,7 +1022,9 @@ PAGEABLE auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
                 return err;
         }
 
-        auto err = connect(sock, ai.ai_addr);
+        LARGE_INTEGER timeout{ .QuadPart = -min(remaining, CONNECT_ATTEMPT_TIMEOUT) }; // relative
+
+        auto err = connect(sock, ai.ai_addr, &timeout, args.abort);
         if (err) {
                 Trace(TRACE_LEVEL_ERROR, "address %!BIN! -> %!STATUS!", 
                         WppBinary(ai.ai_addr, static_cast<USHORT>(ai.ai_addrlen)), err);
@@ -667,8 +1033,11 @@ PAGEABLE auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
         return err;
 }
 
+/*
+ * @param abort see connect_args
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE auto connect(vpdo_dev_t &vpdo)
+PAGEABLE auto connect(vpdo_dev_t &vpdo, KEVENT *abort = nullptr)
 {
         PAGED_CODE();
 
@@ -680,33 +1049,158 @@ PAGEABLE auto connect(vpdo_dev_t &vpdo)
 
         static const WSK_CLIENT_CONNECTION_DISPATCH dispatch{ nullptr, WskDisconnectEvent };
 
+        connect_args args{ static_cast<LONGLONG>(KeQueryInterruptTime()) + CONNECT_TIMEOUT, abort };
+
         NT_ASSERT(!vpdo.sock);
-        vpdo.sock = wsk::for_each(WSK_FLAG_CONNECTION_SOCKET, &vpdo, &dispatch, ai, try_connect, nullptr);
+        vpdo.rcvbuf = 0; // the default of a new socket
+
+        vpdo.sock = wsk::for_each(WSK_FLAG_CONNECTION_SOCKET, &vpdo, &dispatch, ai, try_connect, &args);
 
         wsk::free(ai);
         return make_error(vpdo.sock ? ERR_NONE : ERR_NETWORK);
 }
 
+/*
+ * Shared by the workers of IOCTL_USBIP_VHCI_PLUGIN_HARDWARE_BATCH and the cancel routine of its IRP.
+ */
+struct plugin_batch
+{
+        IRP *irp;
+        vhub_dev_t *vhub;
+        ioctl_usbip_vhci_plugin_batch *req;
+        ULONG length;
+        LONG next; // index of the entry to import
+        LONG workers;
+        LONG refs; // see release
+        KEVENT canceled; // notification event, stops connects in progress
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_batch(_In_ IRP *irp)
+{
+        return *reinterpret_cast<plugin_batch**>(irp->Tail.Overlay.DriverContext);
+}
+
+/*
+ * The last worker and on_batch_cancel (or the code that has cleared the cancel routine) hold a reference,
+ * the IRP is completed when both have dropped it.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_Inout_ plugin_batch &b)
+{
+        if (InterlockedDecrement(&b.refs)) {
+                return;
+        }
+
+        auto irp = b.irp;
+        auto cnt = b.req->count;
+
+        irp->IoStatus.Information = b.length;
+        ExFreePoolWithTag(&b, USBIP_VHCI_POOL_TAG);
+
+        TraceMsg("%d entries processed", cnt);
+        CompleteRequest(irp);
+}
+
+_Function_class_(DRIVER_CANCEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_Requires_lock_held_(_Global_cancel_spin_lock_)
+_Releases_lock_(_Global_cancel_spin_lock_)
+void on_batch_cancel(_Inout_ DEVICE_OBJECT*, _In_ _IRQL_uses_cancel_ IRP *irp)
+{
+        IoReleaseCancelSpinLock(irp->CancelIrql);
+        TraceMsg("irp %04x", ptr4log(irp));
+
+        auto &b = *get_batch(irp);
+        KeSetEvent(&b.canceled, IO_NO_INCREMENT, false);
+
+        release(b);
+}
+
+_Function_class_(IO_WORKITEM_ROUTINE_EX)
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PAGEABLE void plugin_batch_worker(_In_ void*, _In_opt_ void *Context, _In_ IO_WORKITEM *workitem)
+{
+        PAGED_CODE();
+
+        auto &b = *static_cast<plugin_batch*>(Context);
+        auto &r = *b.req;
+
+        for (LONG i; (i = InterlockedIncrement(&b.next) - 1) < r.count; ) {
+                auto &entry = r.entries[i];
+
+                if (KeReadStateEvent(&b.canceled)) {
+                        entry.port = make_error(ERR_GENERAL);
+                } else {
+                        plugin_vpdo(*b.vhub, entry, &b.canceled);
+                }
+        }
+
+        IoFreeWorkItem(workitem);
+
+        if (InterlockedDecrement(&b.workers)) {
+                return;
+        }
+
+        if (IoSetCancelRoutine(b.irp, nullptr)) { // on_batch_cancel will not be called
+                release(b);
+        }
+
+        release(b);
+}
+
 } // namespace
 
 
+/*
+ * The vpdo stays attached, its socket must be closed and the receive loop must not be running.
+ * @return result made by make_error()
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE int reconnect_vpdo(vpdo_dev_t &vpdo)
+{
+        PAGED_CODE();
+
+        if (auto err = connect(vpdo)) {
+                return err;
+        }
+
+        auto err = reimport_remote_device(vpdo);
+        if (err) {
+                close_socket(vpdo);
+        }
+
+        return err;
+}
+
+/*
+ * @param abort stops connecting if it is signaled, see connect_args
+ */
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 _When_(return>=0, _Kernel_clear_do_init_(yes))
-PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r)
+PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r, KEVENT *abort)
 {
 	PAGED_CODE();
         TraceMsg("%s:%s, busid %s, serial '%s'", r.host, r.service, r.busid, *r.serial ? r.serial : "");
 
         auto &error = r.port;
 
+        auto pin = get_vhub(*vhci_from_vhub(&vhub), vhub.version, vhub.index); // the parent of vpdo until it is attached
+        if (!pin) {
+                Trace(TRACE_LEVEL_ERROR, "The hub is being removed");
+                error = make_error(ERR_GENERAL);
+                return STATUS_SUCCESS;
+        }
+
         vpdo_dev_t *vpdo{};
         if (bool(error = create_vpdo(vpdo, &vhub, r))) {
                 destroy_device(vpdo);
                 return STATUS_SUCCESS;
         }
 
-        if (bool(error = connect(*vpdo))) {
+        if (bool(error = connect(*vpdo, abort))) {
                 Trace(TRACE_LEVEL_ERROR, "Can't connect to %!USTR!:%!USTR!", &vpdo->node_name, &vpdo->service_name);
                 destroy_device(vpdo);
                 return STATUS_SUCCESS;
@@ -714,13 +1208,25 @@ PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r)
 
         Trace(TRACE_LEVEL_INFORMATION, "Connected to %!USTR!:%!USTR!", &vpdo->node_name, &vpdo->service_name);
 
-        if (bool(error = import_remote_device(*vpdo))) {
+        error = import_remote_device(*vpdo, pin);
+
+        if (error == make_error(ERR_STREAMS)) { // the server does not know OP_REQ_STREAMS and closed the connection
+                Trace(TRACE_LEVEL_WARNING, "USB 3 bulk streams are not supported, import without them");
+                close_socket(*vpdo);
+                vpdo->streams = false;
+
+                if (!(error = connect(*vpdo, abort))) {
+                        error = import_remote_device(*vpdo, pin);
+                }
+        }
+
+        if (error) {
                 destroy_device(vpdo);
                 return STATUS_SUCCESS;
         }
 
         if (vhub_attach_vpdo(vpdo)) {
-                r.port = make_vport(vpdo->version, vpdo->port);
+                r.port = make_vport(*vhub_from_vpdo(vpdo), vpdo->port);
                 NT_ASSERT(is_valid_vport(r.port));
         } else {
                 error = make_error(ERR_PORTFULL);
@@ -732,6 +1238,7 @@ PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r)
         if (auto ctx = alloc_wsk_context(0)) {
                 ctx->vpdo = vpdo;
                 sched_receive_usbip_header(ctx);
+                start_heartbeat(*vpdo);
         } else {
                 error = make_error(ERR_GENERAL);
                 destroy_device(vpdo);
@@ -740,28 +1247,96 @@ PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r)
 
         vpdo->Self->Flags &= ~DO_DEVICE_INITIALIZING; // must be the last step in initialization
 
-        if (auto vhci = vhci_from_vhub(&vhub)) {
+        if (auto vhci = vhci_from_vhub(vhub_from_vpdo(vpdo))) { // not the vhub if the vpdo was moved to another one
                 IoInvalidateDeviceRelations(vhci->pdo, BusRelations); // kick PnP system
         }
 
         return STATUS_SUCCESS;
 }
 
+/*
+ * Imports run concurrently on system worker threads, each worker takes the next entry until none left.
+ * If the IRP is cancelled, connects in progress are aborted and entries that were not started
+ * are failed with ERR_GENERAL. The IRP is completed when the workers are done, devices that are
+ * already attached are reported.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS plugin_vpdo_batch(vhub_dev_t &vhub, IRP *irp, ioctl_usbip_vhci_plugin_batch &r, ULONG length)
+{
+        PAGED_CODE();
+
+        if (!(r.count > 0 && r.count <= USBIP_PLUGIN_BATCH_MAX && length == plugin_batch_size(r.count))) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        auto cnt = r.parallelism > 0 ? min(r.parallelism, USBIP_PLUGIN_BATCH_PARALLELISM) : USBIP_PLUGIN_BATCH_PARALLELISM;
+        cnt = min(cnt, r.count);
+
+        TraceMsg("%d entries, %d workers", r.count, cnt);
+
+        auto b = (plugin_batch*)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(plugin_batch), USBIP_VHCI_POOL_TAG);
+        if (!b) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate plugin_batch");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        IO_WORKITEM *items[USBIP_PLUGIN_BATCH_PARALLELISM]{};
+
+        for (b->workers = 0; b->workers < cnt; ++b->workers) {
+                auto &wi = items[b->workers];
+                if (!(wi = IoAllocateWorkItem(vhub.Self))) {
+                        Trace(TRACE_LEVEL_WARNING, "IoAllocateWorkItem error, %d workers", b->workers);
+                        break;
+                }
+        }
+
+        if (!b->workers) {
+                ExFreePoolWithTag(b, USBIP_VHCI_POOL_TAG);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        b->irp = irp;
+        b->vhub = &vhub;
+        b->req = &r;
+        b->length = length;
+        b->refs = 2; // the last worker and on_batch_cancel
+        KeInitializeEvent(&b->canceled, NotificationEvent, false);
+
+        get_batch(irp) = b;
+        IoMarkIrpPending(irp);
+
+        IoSetCancelRoutine(irp, on_batch_cancel);
+        if (irp->Cancel && IoSetCancelRoutine(irp, nullptr)) { // on_batch_cancel will not be called
+                KeSetEvent(&b->canceled, IO_NO_INCREMENT, false);
+                release(*b);
+        }
+
+        for (LONG i = 0, n = b->workers; i < n; ++i) { // b can be freed by the last worker
+                IoQueueWorkItemEx(items[i], plugin_batch_worker, DelayedWorkQueue, b);
+        }
+
+        return STATUS_PENDING;
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE NTSTATUS unplug_vpdo(vhub_dev_t &vhub, int port)
+PAGEABLE NTSTATUS unplug_vpdo(vhci_dev_t &vhci, int vport)
 {
 	PAGED_CODE();
 
-	if (port <= 0) {
+	if (vport <= 0) {
 		Trace(TRACE_LEVEL_VERBOSE, "Plugging out all devices");
-		vhub_unplug_all_vpdo(vhub);
+		for (int i = 0; i < vhci.num_hubs; ++i) {
+			if (auto vhub = vhub_from_vhci(&vhci, i)) {
+				vhub_unplug_all_vpdo(*vhub);
+			}
+		}
 		return STATUS_SUCCESS;
 	}
 
-	if (auto vpdo = vhub_find_vpdo(vhub, port)) {
-		return vhub_unplug_vpdo(vpdo);
+	if (auto vpdo = vhci_find_vpdo(vhci, vport)) {
+		return vhub_unplug_vpdo(vpdo.get());
 	}
 
-	Trace(TRACE_LEVEL_ERROR, "Invalid or empty port %d", port);
+	Trace(TRACE_LEVEL_ERROR, "Invalid or empty port %d", vport);
 	return STATUS_NO_SUCH_DEVICE;
 }
@@ -3,13 +3,22 @@
 #include <libdrv\pageable.h>
 #include <ntdef.h>
 
+struct vhci_dev_t;
 struct vhub_dev_t;
+struct vpdo_dev_t;
 struct ioctl_usbip_vhci_plugin;
+struct ioctl_usbip_vhci_plugin_batch;
 
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 _When_(return>=0, _Kernel_clear_do_init_(yes))
-PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r);
+PAGEABLE NTSTATUS plugin_vpdo(vhub_dev_t &vhub, ioctl_usbip_vhci_plugin &r, KEVENT *abort = nullptr);
 
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE NTSTATUS unplug_vpdo(vhub_dev_t &vhub, int port);
+PAGEABLE NTSTATUS plugin_vpdo_batch(vhub_dev_t &vhub, IRP *irp, ioctl_usbip_vhci_plugin_batch &r, ULONG length);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS unplug_vpdo(vhci_dev_t &vhci, int vport);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE int reconnect_vpdo(vpdo_dev_t &vpdo);
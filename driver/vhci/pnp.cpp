@@ -13,6 +13,7 @@
 #include "pnp_start.h"
 #include "pnp_remove.h"
 #include "vhub.h"
+#include "internal_ioctl.h"
 
 #include <wdmguid.h>
 
@@ -105,6 +106,11 @@ PAGEABLE NTSTATUS pnp_surprise_removal(vdev_t *vdev, IRP *irp)
 	TraceMsg("%!vdev_type_t!(%04x)", vdev->type, ptr4log(vdev));
 
 	set_state(*vdev, pnp_state::SurpriseRemovePending);
+
+	if (auto vpdo = to_vpdo_or_null(vdev->Self)) {
+		unlink_irps(*vpdo); // while the socket is still open
+	}
+
 	return irp_pass_down_or_complete(vdev, irp);
 }
 
@@ -5,6 +5,7 @@
 #include "dev.h"
 #include "vhci.h"
 #include "csq.h"
+#include "port_change.h"
 #include "pnp_id.h"
 #include "pnp_remove.h"
 
@@ -80,6 +81,7 @@ PAGEABLE auto init(_Inout_ root_dev_t &root)
 	PAGED_CODE();
 
 	static_assert(ARRAYSIZE(vhci_list) == ARRAYSIZE(root.children_pdo));
+	KeInitializeSpinLock(&root.lock);
 
 	for (int i = 0; i < ARRAYSIZE(vhci_list); ++i) {
 		if (auto pdo = create_child_pdo(&root, vhci_list[i], VDEV_CPDO)) {
@@ -89,7 +91,6 @@ PAGEABLE auto init(_Inout_ root_dev_t &root)
 		}
 	}
 
-	NT_ASSERT(!root.child_pdo); // not used
 	return STATUS_SUCCESS;
 }
 
@@ -97,14 +98,28 @@ PAGEABLE auto init(_Inout_ vhci_dev_t &vhci)
 {
 	PAGED_CODE();
 
-	vhci.child_pdo = create_child_pdo(&vhci, vhci.version, VDEV_HPDO);
-        if (!vhci.child_pdo) {
-                return STATUS_UNSUCCESSFUL;
-        }
-
 	RtlUnicodeStringInitEx(&vhci.DevIntfVhci,  nullptr, STRSAFE_IGNORE_NULLS);
 	RtlUnicodeStringInitEx(&vhci.DevIntfUSBHC, nullptr, STRSAFE_IGNORE_NULLS);
 
+	if (auto err = init_port_changes(vhci)) { // destroy(vhci_dev_t&) cancels them
+		return err;
+	}
+
+	vhci.num_ports = Globals.num_ports;
+	NT_ASSERT(is_valid_rhport(vhci.num_ports));
+
+	vhci.num_hubs = vhci_num_hubs(vhci.version, vhci.num_ports);
+	NT_ASSERT(vhci.num_hubs <= ARRAYSIZE(vhci.children_pdo));
+
+	for (int i = 0; i < vhci.num_hubs; ++i) {
+		auto &pdo = vhci.children_pdo[i];
+		if (!(pdo = create_child_pdo(&vhci, vhci.version, VDEV_HPDO))) {
+			return STATUS_UNSUCCESSFUL;
+		}
+		static_cast<hpdo_dev_t*>(pdo)->index = i;
+	}
+
+	TraceMsg("%!hci_version!, %d ports, %d hubs", vhci.version, vhci.num_ports, vhci.num_hubs);
         return STATUS_SUCCESS;
 }
 
@@ -115,6 +130,22 @@ PAGEABLE auto init(_Inout_ vhub_dev_t &vhub)
         ExInitializeFastMutex(&vhub.mutex);
         RtlUnicodeStringInitEx(&vhub.DevIntfRootHub, nullptr, STRSAFE_IGNORE_NULLS);
 
+        vhub.vpdo_lock = 0;
+        ExInitializeRundownProtection(&vhub.ref);
+
+        auto &vhci = *vhci_from_vhub(&vhub);
+        vhub.index = static_cast<hpdo_dev_t*>(to_vdev(vhub.pdo))->index;
+
+        vhub.num_ports = vhub_num_ports(vhub.version, vhci.num_ports, vhub.index);
+        NT_ASSERT(vhub.num_ports > 0 && vhub.num_ports <= vhub_max_ports(vhub.version));
+
+        auto len = vhub.num_ports*sizeof(*vhub.vpdo);
+        vhub.vpdo = (vpdo_dev_t**)ExAllocatePool2(POOL_FLAG_NON_PAGED, len, USBIP_VHCI_POOL_TAG);
+        if (!vhub.vpdo) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", len);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
         return STATUS_SUCCESS;
 }
 
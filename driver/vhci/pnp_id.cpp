@@ -210,9 +210,32 @@ device ID and instance ID, uniquely identifies a device in the system.
 
 An instance ID is persistent across system restarts.
 */
+/*
+ * Hubs of a vhci have the same hardware IDs, the index tells them apart.
+ */
+NTSTATUS setup_hpdo_inst_id(PWCHAR &result, const hpdo_dev_t &hpdo)
+{
+        const size_t cch = 12;
+
+	PWSTR str = (PWSTR)ExAllocatePool2(POOL_FLAG_PAGED|POOL_FLAG_UNINITIALIZED, cch*sizeof(*str), USBIP_VHCI_POOL_TAG);
+	if (!str) {
+		Trace(TRACE_LEVEL_ERROR, "hpdo: InstanceID: out of memory");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	auto status = RtlStringCchPrintfW(str, cch, L"%d", hpdo.index);
+	if (status == STATUS_SUCCESS) {
+		result = str;
+	}
+
+	return status;
+}
+
 NTSTATUS setup_inst_id_or_serial(PWCHAR &result, bool&, vdev_t *vdev, IRP*, bool want_serial)
 {
-	if (vdev->type != VDEV_VPDO) {
+	if (vdev->type == VDEV_HPDO && !want_serial) {
+		return setup_hpdo_inst_id(result, *static_cast<hpdo_dev_t*>(vdev));
+	} else if (vdev->type != VDEV_VPDO) {
 		return STATUS_NOT_SUPPORTED;
 	}
 
@@ -34,15 +34,6 @@ void InterfaceDereference(_In_ PVOID Context)
 	TraceDbg("%!vdev_type_t!(%04x) -> %ld", vdev.type, ptr4log(&vdev), n);
 }
 
-/*
- * If return zero, QueryBusTime() will be called again and again.
- */
-_IRQL_requires_max_(HIGH_LEVEL)
-inline auto get_current_frame_number(const vpdo_dev_t &vpdo)
-{
-	return vpdo.current_frame_number ? vpdo.current_frame_number : 100;
-}
-
 /*
  * @return true if device is operating at high speed
  */
@@ -177,7 +168,7 @@ NTSTATUS USB_BUSIFFN QueryBusTime(_In_ PVOID BusContext, _Out_opt_ ULONG *Curren
 {
 	auto vpdo = static_cast<vpdo_dev_t*>(BusContext);
 
-	*CurrentUsbFrame = get_current_frame_number(*vpdo);
+	*CurrentUsbFrame = get_frame(vpdo->bus_time);
 //	TraceDbg("CurrentUsbFrame -> %lu", *CurrentUsbFrame); // too often
 
 	return STATUS_SUCCESS;
@@ -195,7 +186,7 @@ NTSTATUS USB_BUSIFFN QueryBusTimeEx(_In_opt_ PVOID BusContext, _Out_opt_ ULONG *
 {
 	auto vpdo = static_cast<vpdo_dev_t*>(BusContext);
 
-	*HighSpeedFrameCounter = get_current_frame_number(*vpdo) << 3;
+	*HighSpeedFrameCounter = static_cast<ULONG>(get_microframe(vpdo->bus_time));
 //	TraceDbg("HighSpeedFrameCounter -> %lu", *HighSpeedFrameCounter); // too often
 
 	return STATUS_SUCCESS;
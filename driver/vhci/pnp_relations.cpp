@@ -131,8 +131,17 @@ _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE auto bus_new_relations(_In_ vhci_dev_t &vhci, _Inout_ DEVICE_RELATIONS* &r)
 {
 	PAGED_CODE();
-	auto ok = approve(vhci.child_pdo, r);
-	return append(r, &vhci.child_pdo, ok);
+
+	ULONG cnt = 0;
+	vdev_t* objects[ARRAYSIZE(vhci.children_pdo)];
+
+	for (int i = 0; i < vhci.num_hubs; ++i) {
+		if (auto child = vhci.children_pdo[i]; approve(child, r)) {
+			objects[cnt++] = child;
+		}
+	}
+
+	return append(r, objects, cnt);
 }
 
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -141,9 +150,9 @@ PAGEABLE vpdo_dev_t *find_vpdo(_In_ const vhub_dev_t &vhub, _In_ const DEVICE_OB
 	PAGED_CODE();
 	NT_ASSERT(devobj);
 
-	for (auto i: vhub.vpdo) {
-		if (i && i->Self == devobj) {
-			return i;
+	for (int i = 0; i < vhub.num_ports; ++i) {
+		if (auto vpdo = vhub.vpdo[i]; vpdo && vpdo->Self == devobj) {
+			return vpdo;
 		}
 	}
 
@@ -160,8 +169,8 @@ PAGEABLE auto bus_new_relations(_In_ vhub_dev_t &vhub, _Inout_ DEVICE_RELATIONS*
 
 	ExAcquireFastMutex(&vhub.mutex);
 
-	for (auto i: vhub.vpdo) { 
-		if (i && !i->unplugged) {
+	for (int i = 0; i < vhub.num_ports; ++i) {
+		if (auto vpdo = vhub.vpdo[i]; vpdo && !vpdo->unplugged) {
 			++plugged;
 		}
 	}
@@ -190,8 +199,8 @@ PAGEABLE auto bus_new_relations(_In_ vhub_dev_t &vhub, _Inout_ DEVICE_RELATIONS*
 		}
 	}
 
-	for (auto vpdo: vhub.vpdo) {
-		if (vpdo && !(vpdo->unplugged || contains(*new_r, vpdo->Self))) {
+	for (int i = 0; i < vhub.num_ports; ++i) {
+		if (auto vpdo = vhub.vpdo[i]; vpdo && !(vpdo->unplugged || contains(*new_r, vpdo->Self))) {
 			new_r->Objects[new_r->Count++] = vpdo->Self;
 			ObReferenceObject(vpdo->Self);
 		}
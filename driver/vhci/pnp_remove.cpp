@@ -14,11 +14,31 @@
 #include "irp.h"
 #include "wmi.h"
 #include "vhub.h"
+#include "port_change.h"
+#include "reconnect.h"
 #include "csq.h"
+#include "jitter.h"
+#include "crypto.h"
+#include "heartbeat.h"
+#include "config_index.h"
+#include "path_delay.h"
+#include "tx.h"
+#include "budget.h"
 
 namespace
 {
 
+auto set_parent_null(_In_ vdev_t *child, [[maybe_unused]] _In_ vdev_t *parent)
+{
+	NT_ASSERT(child->parent == parent);
+	child->parent = nullptr;
+
+	if (auto fdo = child->fdo) {
+		NT_ASSERT(fdo->parent == parent);
+		fdo->parent = nullptr;
+	}
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE void destroy(vhci_dev_t &vhci)
 {
@@ -30,6 +50,14 @@ PAGEABLE void destroy(vhci_dev_t &vhci)
 	IoSetDeviceInterfaceState(&vhci.DevIntfUSBHC, false);
 	RtlFreeUnicodeString(&vhci.DevIntfVhci);
 
+	cancel_port_changes(vhci);
+
+	for (int i = 0; i < vhci.num_hubs; ++i) {
+		if (auto child = vhci.children_pdo[i]) {
+			set_parent_null(child, &vhci);
+		}
+	}
+
 	// Inform WMI to remove this DeviceObject from its list of providers.
 	dereg_wmi(&vhci);
 
@@ -43,14 +71,21 @@ PAGEABLE void destroy(vhub_dev_t &vhub)
 
 	TraceMsg("%!hci_version! %04x", vhub.version, ptr4log(&vhub));
 
+	ExWaitForRundownProtectionRelease(&vhub.ref); // plugin_vpdo pins the hub until the vpdo is attached
+
 	IoSetDeviceInterfaceState(&vhub.DevIntfRootHub, false);
 	RtlFreeUnicodeString(&vhub.DevIntfRootHub);
 
 	// At this point, vhub should has no vpdo. With this assumption, there's no need to remove all vpdos.
-	for (int i = 0; i < vhub.NUM_PORTS; ++i) {
-		if (vhub.vpdo[i]) {
-			Trace(TRACE_LEVEL_ERROR, "Port #%d is acquired", i);
+	if (auto &v = vhub.vpdo) {
+		for (int i = 0; i < vhub.num_ports; ++i) {
+			if (v[i]) {
+				Trace(TRACE_LEVEL_ERROR, "Port #%d is acquired", i);
+			}
 		}
+
+		ExFreePoolWithTag(v, USBIP_VHCI_POOL_TAG);
+		v = nullptr;
 	}
 }
 
@@ -96,6 +131,51 @@ PAGEABLE void free_strings(vpdo_dev_t &d)
         free_usb_dev_interface(d.usb_dev_interface);
 }
 
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void destroy(vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+	TraceMsg("%!hci_version! %04x, port %d", vpdo.version, ptr4log(&vpdo), vpdo.port);
+
+	if (auto n = vpdo.abort_cnt) {
+		TraceMsg("%ld aborts, avg %I64d us, max %I64d us", n, vpdo.abort_time/n/10, vpdo.abort_time_max/10);
+	}
+
+	if (auto &b = vpdo.budget; b.throttled_cnt) {
+		TraceMsg("%lu URBs throttled, %I64d ms", b.throttled_cnt, b.throttled_time/10'000);
+	}
+
+	stop_heartbeat(vpdo); // can call connection_lost
+	cancel_reconnect(vpdo);
+	close_socket(vpdo);
+	cancel_pending_irps(vpdo);
+	free_jitter(vpdo);
+	free_path_delay(vpdo);
+	free_session(vpdo);
+
+	vhub_detach_vpdo(&vpdo);
+	ExWaitForRundownProtectionRelease(&vpdo.port_ref); // vpdo_ref holders
+
+	free_heartbeat(vpdo); // see get_imported_devs
+	free_strings(vpdo);
+	free_string_descriptors(vpdo);
+
+	if (auto &wi = vpdo.workitem) {
+		IoFreeWorkItem(wi);
+		wi = nullptr;
+	}
+
+	free_config_index(vpdo.actindex);
+
+	if (vpdo.actconfig) {
+		ExFreePoolWithTag(vpdo.actconfig, USBIP_VHCI_POOL_TAG);
+                vpdo.actconfig = nullptr;
+	}
+}
+
+} // namespace
+
+
 /*
  * The socket is closed, there is no concurrency with send_complete from internal_ioctl.cpp
  */
@@ -108,6 +188,8 @@ PAGEABLE void cancel_pending_irps(vpdo_dev_t &vpdo)
 	TraceMsg("%!hci_version! vpdo %04x", vpdo.version, ptr4log(&vpdo));
 
 	if (auto &csq = vpdo.irps_csq; csq.CsqAcquireLock) { // is initialized?
+		flush_budget(vpdo);
+		tx_flush(vpdo); // PDUs that are not sent hold IRPs of the queue
                 while (auto irp = dequeue_irp(vpdo)) {
 			complete_as_canceled(irp);
                 }
@@ -138,45 +220,6 @@ PAGEABLE void close_socket(vpdo_dev_t &vpdo)
 	vpdo.sock = nullptr;
 }
 
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGEABLE void destroy(vpdo_dev_t &vpdo)
-{
-	PAGED_CODE();
-	TraceMsg("%!hci_version! %04x, port %d", vpdo.version, ptr4log(&vpdo), vpdo.port);
-
-	close_socket(vpdo);
-	cancel_pending_irps(vpdo);
-
-	vhub_detach_vpdo(&vpdo);
-
-	free_strings(vpdo);
-	free_string_descriptors(vpdo);
-
-	if (auto &wi = vpdo.workitem) {
-		IoFreeWorkItem(wi);
-		wi = nullptr;
-	}
-
-	if (vpdo.actconfig) {
-		ExFreePoolWithTag(vpdo.actconfig, USBIP_VHCI_POOL_TAG);
-                vpdo.actconfig = nullptr;
-	}
-}
-
-auto set_parent_null(_In_ vdev_t *child, [[maybe_unused]] _In_ vdev_t *parent)
-{
-	NT_ASSERT(child->parent == parent);
-	child->parent = nullptr;
-
-	if (auto fdo = child->fdo) {
-		NT_ASSERT(fdo->parent == parent);
-		fdo->parent = nullptr;
-	}
-}
-
-} // namespace
-
-
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE void destroy_device(_In_opt_ vdev_t *vdev)
 {
@@ -188,17 +231,12 @@ PAGEABLE void destroy_device(_In_opt_ vdev_t *vdev)
 
 	TraceMsg("%04x %!hci_version!, %!vdev_type_t!", ptr4log(vdev), vdev->version, vdev->type);
 
-	if (auto child = vdev->child_pdo) {
-		NT_ASSERT(vdev->type != VDEV_ROOT);
-		set_parent_null(child, vdev);
-	}
-
 	if (auto fdo = vdev->fdo) {
 		fdo->pdo = nullptr;
 	}
 
 	if (vdev->pdo && vdev->type != VDEV_ROOT) {
-		to_vdev(vdev->pdo)->fdo = nullptr;
+		unlink_fdo(*vdev); // get_vhub can't find it anymore
 	}
 
 	if (auto n = vdev->intf_ref_cnt) {
@@ -5,6 +5,7 @@
 
 struct _IRP;
 struct vdev_t;
+struct vpdo_dev_t;
 
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE void destroy_device(_In_opt_ vdev_t *vdev);
@@ -12,4 +13,8 @@ PAGEABLE void destroy_device(_In_opt_ vdev_t *vdev);
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGEABLE NTSTATUS pnp_remove_device(vdev_t *vdev, _IRP *irp);
 
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void close_socket(_Inout_ vpdo_dev_t &vpdo);
 
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void cancel_pending_irps(_Inout_ vpdo_dev_t &vpdo);
@@ -0,0 +1,210 @@
+#include "port_change.h"
+#include "trace.h"
+#include "port_change.tmh"
+
+#include "dev.h"
+#include "irp.h"
+
+namespace
+{
+
+inline auto to_vhci(IO_CSQ *csq)
+{
+	return CONTAINING_RECORD(csq, vhci_dev_t, changes_csq);
+}
+
+inline auto get_requested_generation(IRP *irp)
+{
+	return static_cast<ioctl_usbip_vhci_get_port_changes*>(irp->AssociatedIrp.SystemBuffer)->generation;
+}
+
+void InsertIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
+{
+	auto vhci = to_vhci(csq);
+	InsertTailList(&vhci->changes_irps, list_entry(irp));
+
+	TraceCSQ("%04x", ptr4log(irp));
+}
+
+void RemoveIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+	TraceCSQ("%04x", ptr4log(irp));
+	auto entry = list_entry(irp);
+	RemoveEntryList(entry);
+	InitializeListHead(entry);
+}
+
+/*
+ * @param context if not NULL, skip IRPs that have nothing to report
+ */
+auto PeekNextIrp(_In_ IO_CSQ *csq, _In_ IRP *irp, _In_ PVOID context)
+{
+	auto vhci = to_vhci(csq);
+	auto head = &vhci->changes_irps;
+
+	for (auto entry = irp ? list_entry(irp)->Flink : head->Flink; entry != head; entry = entry->Flink) {
+		auto entry_irp = get_irp(entry);
+		if (!context || get_requested_generation(entry_irp) != vhci->generation) {
+			return entry_irp;
+		}
+	}
+
+	return static_cast<IRP*>(nullptr);
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(csq, vhci_dev_t, changes_csq)->changes_lock)
+void AcquireLock(_In_ IO_CSQ *csq, _Out_ PKIRQL Irql)
+{
+	auto vhci = to_vhci(csq);
+	KeAcquireSpinLock(&vhci->changes_lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(csq, vhci_dev_t, changes_csq)->changes_lock)
+void ReleaseLock(_In_ IO_CSQ *csq, _In_ KIRQL Irql)
+{
+	auto vhci = to_vhci(csq);
+	KeReleaseSpinLock(&vhci->changes_lock, Irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void CompleteCanceledIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+	TraceMsg("%04x", ptr4log(irp));
+	irp->IoStatus.Information = 0;
+	CompleteRequest(irp, STATUS_CANCELLED);
+}
+
+/*
+ * Copies the changes that follow the requested generation, the oldest first.
+ * PORT_CHANGE_SYNC goes first if the caller has no base to apply the changes to.
+ */
+_Requires_lock_held_(vhci.changes_lock)
+auto fill(_In_ const vhci_dev_t &vhci, _In_ UINT32 requested, _Out_ ioctl_usbip_vhci_port_change *r, _In_ ULONG cnt)
+{
+	NT_ASSERT(cnt);
+
+	auto gen = vhci.generation;
+	auto oldest = gen >= vhci.NUM_CHANGES ? gen - vhci.NUM_CHANGES + 1 : 1; // in the journal
+	ULONG n = 0;
+
+	if (requested == USBIP_PORT_CHANGES_SYNC || requested > gen) {
+		requested = gen;
+		r[n++] = { .generation = requested, .port = 0, .event = PORT_CHANGE_SYNC };
+	} else if (requested + 1 < oldest) { // overwritten
+		requested = oldest - 1;
+		r[n++] = { .generation = requested, .port = 0, .event = PORT_CHANGE_SYNC };
+	}
+
+	for (auto i = requested + 1; i <= gen && n < cnt; ++i) {
+		r[n++] = vhci.changes[i % vhci.NUM_CHANGES];
+	}
+
+	return n;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete(_Inout_ vhci_dev_t &vhci, _In_ IRP *irp)
+{
+	auto &ioc = IoGetCurrentIrpStackLocation(irp)->Parameters.DeviceIoControl;
+	auto cnt = ULONG(ioc.OutputBufferLength/sizeof(ioctl_usbip_vhci_port_change));
+
+	auto requested = get_requested_generation(irp); // the same buffer is used for output
+	auto r = static_cast<ioctl_usbip_vhci_port_change*>(irp->AssociatedIrp.SystemBuffer);
+
+	KIRQL irql;
+	KeAcquireSpinLock(&vhci.changes_lock, &irql);
+	auto n = fill(vhci, requested, r, cnt);
+	KeReleaseSpinLock(&vhci.changes_lock, irql);
+
+	TraceDbg("%!hci_version!, %04x, generation %lu -> %lu changes", vhci.version, ptr4log(irp), requested, n);
+
+	irp->IoStatus.Information = n*sizeof(*r);
+	CompleteRequest(irp);
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_port_changes(_Inout_ vhci_dev_t &vhci)
+{
+	PAGED_CODE();
+
+	vhci.generation = 0;
+
+	InitializeListHead(&vhci.changes_irps);
+	KeInitializeSpinLock(&vhci.changes_lock);
+
+	return IoCsqInitialize(&vhci.changes_csq,
+				InsertIrp,
+				RemoveIrp,
+				PeekNextIrp,
+				AcquireLock,
+				ReleaseLock,
+				CompleteCanceledIrp);
+}
+
+/*
+ * Call complete_port_changes after releasing the locks that are held.
+ * @param port virtual port
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void port_changed(_Inout_ vhci_dev_t &vhci, _In_ int port, _In_ port_change_event event)
+{
+	NT_ASSERT(is_valid_vport(port));
+
+	KIRQL irql;
+	KeAcquireSpinLock(&vhci.changes_lock, &irql);
+
+	auto gen = ++vhci.generation;
+	vhci.changes[gen % vhci.NUM_CHANGES] = { .generation = gen, .port = port, .event = event };
+
+	KeReleaseSpinLock(&vhci.changes_lock, irql);
+
+	TraceMsg("%!hci_version!, generation %lu, port %d, event %d", vhci.version, gen, port, event);
+}
+
+/*
+ * Completes pending requests that have something to report.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_port_changes(_Inout_ vhci_dev_t &vhci)
+{
+	bool has_changes = true;
+
+	while (auto irp = IoCsqRemoveNextIrp(&vhci.changes_csq, &has_changes)) {
+		complete(vhci, irp);
+	}
+}
+
+/*
+ * The request is always queued. If a change was recorded before it was inserted,
+ * complete_port_changes below completes it, otherwise port_changed's caller will.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS get_port_changes(_Inout_ vhci_dev_t &vhci, _In_ IRP *irp, _In_ ULONG inlen, _In_ ULONG outlen)
+{
+	PAGED_CODE();
+
+	if (!(inlen == sizeof(ioctl_usbip_vhci_get_port_changes) && outlen >= sizeof(ioctl_usbip_vhci_port_change))) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	IoCsqInsertIrp(&vhci.changes_csq, irp, nullptr); // marks IRP pending
+	complete_port_changes(vhci);
+
+	return STATUS_PENDING;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_port_changes(_Inout_ vhci_dev_t &vhci)
+{
+	while (auto irp = IoCsqRemoveNextIrp(&vhci.changes_csq, nullptr)) {
+		TraceMsg("%04x", ptr4log(irp));
+		irp->IoStatus.Information = 0;
+		CompleteRequest(irp, STATUS_NO_SUCH_DEVICE);
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+
+#include <wdm.h>
+#include <usbip\vhci.h>
+
+struct vhci_dev_t;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_port_changes(_Inout_ vhci_dev_t &vhci);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void port_changed(_Inout_ vhci_dev_t &vhci, _In_ int port, _In_ port_change_event event);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_port_changes(_Inout_ vhci_dev_t &vhci);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS get_port_changes(_Inout_ vhci_dev_t &vhci, _In_ IRP *irp, _In_ ULONG inlen, _In_ ULONG outlen);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_port_changes(_Inout_ vhci_dev_t &vhci);
@@ -71,7 +71,7 @@ NTSTATUS set_cmd_submit_usbip_header(
 	if (auto r = &hdr.u.cmd_submit) {
 		r->transfer_flags = to_linux_flags(TransferFlags, dir_in);
 		r->transfer_buffer_length = TransferBufferLength;
-		r->start_frame = 0;
+		r->start_frame = get_stream_id(PipeHandle); // see bulk streams extension in <usbip\proto.h>
 		r->number_of_packets = 0; // doesn't work if number_of_packets_non_isoch, see usbip protocol
 		r->interval = get_endpoint_interval(PipeHandle);
 		RtlZeroMemory(r->setup, sizeof(r->setup));
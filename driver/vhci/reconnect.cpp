@@ -0,0 +1,304 @@
+#include "reconnect.h"
+#include "trace.h"
+#include "reconnect.tmh"
+
+#include "dev.h"
+#include "irp.h"
+#include "vhub.h"
+#include "plugin.h"
+#include "pnp_remove.h"
+#include "wsk_context.h"
+#include "wsk_receive.h"
+#include "internal_ioctl.h"
+#include "heartbeat.h"
+
+namespace
+{
+
+enum : LONGLONG { // 100-nanosecond units
+        SECOND = 1000LL*1000*10,
+        RETRY_DELAY = SECOND, // after the first failed attempt, doubles on every next failure
+        MAX_RETRY_DELAY = 8*SECOND
+};
+
+inline auto to_vpdo(IO_CSQ *csq)
+{
+	return CONTAINING_RECORD(csq, vpdo_dev_t, held_csq);
+}
+
+void InsertIrp(_In_ IO_CSQ *csq, _In_ IRP *irp)
+{
+	auto vpdo = to_vpdo(csq);
+	InsertTailList(&vpdo->held_irps, list_entry(irp));
+
+	TraceCSQ("%04x", ptr4log(irp));
+}
+
+void RemoveIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+	TraceCSQ("%04x", ptr4log(irp));
+	auto entry = list_entry(irp);
+	RemoveEntryList(entry);
+	InitializeListHead(entry);
+}
+
+auto PeekNextIrp(_In_ IO_CSQ *csq, _In_ IRP *irp, _In_ PVOID)
+{
+	auto vpdo = to_vpdo(csq);
+	auto head = &vpdo->held_irps;
+
+	auto entry = irp ? list_entry(irp)->Flink : head->Flink;
+	return entry == head ? static_cast<IRP*>(nullptr) : get_irp(entry);
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(csq, vpdo_dev_t, held_csq)->held_lock)
+void AcquireLock(_In_ IO_CSQ *csq, _Out_ PKIRQL Irql)
+{
+	auto vpdo = to_vpdo(csq);
+	KeAcquireSpinLock(&vpdo->held_lock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(csq, vpdo_dev_t, held_csq)->held_lock)
+void ReleaseLock(_In_ IO_CSQ *csq, _In_ KIRQL Irql)
+{
+	auto vpdo = to_vpdo(csq);
+	KeReleaseSpinLock(&vpdo->held_lock, Irql);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void CompleteCanceledIrp(_In_ IO_CSQ*, _In_ IRP *irp)
+{
+	TraceMsg("%04x", ptr4log(irp));
+	complete_as_canceled(irp);
+}
+
+/*
+ * Held IRPs are dispatched again, they fail if the device was unplugged or removed meanwhile.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void dispatch_held_irps(_Inout_ vpdo_dev_t &vpdo)
+{
+	while (auto irp = IoCsqRemoveNextIrp(&vpdo.held_csq, nullptr)) {
+		vhci_internal_ioctl(vpdo.Self, irp);
+	}
+}
+
+/*
+ * The socket is closed, pending receive completes soon.
+ * @return false if the worker must give up
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto wait_receive_stopped(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	void *events[] { &vpdo.recv_stopped, &vpdo.reconnect_stop };
+	static_assert(ARRAYSIZE(events) <= THREAD_WAIT_OBJECTS);
+
+	auto st = KeWaitForMultipleObjects(ARRAYSIZE(events), events, WaitAny, Executive, KernelMode, false, nullptr, nullptr);
+	return st == STATUS_WAIT_0;
+}
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto reconnect(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	auto deadline = static_cast<LONGLONG>(KeQueryInterruptTime()) + vpdo.reconnect_timeout*SECOND;
+	LONGLONG delay = RETRY_DELAY;
+
+	for (int attempt = 1; !vpdo.unplugged; ++attempt) {
+
+		auto err = reconnect_vpdo(vpdo);
+		if (!err) {
+			Trace(TRACE_LEVEL_INFORMATION, "vpdo %04x, port %d: reconnected, attempt %d", ptr4log(&vpdo), vpdo.port, attempt);
+			return true;
+		}
+
+		Trace(TRACE_LEVEL_WARNING, "vpdo %04x, port %d: attempt %d, error %#x", ptr4log(&vpdo), vpdo.port, attempt, err);
+
+		if (err == make_error(ERR_NOTEXIST)) { // another device on that busid
+			break;
+		}
+
+		auto remaining = deadline - static_cast<LONGLONG>(KeQueryInterruptTime());
+		if (remaining <= 0) {
+			break;
+		}
+
+		LARGE_INTEGER timeout{ .QuadPart = -min(delay, remaining) }; // relative
+		if (KeWaitForSingleObject(&vpdo.reconnect_stop, Executive, KernelMode, false, &timeout) == STATUS_SUCCESS) {
+			break;
+		}
+
+		delay = min(2*delay, MAX_RETRY_DELAY);
+	}
+
+	return false;
+}
+
+/*
+ * Sending and receiving are resumed with the new socket.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE auto resume(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	auto ctx = alloc_wsk_context(0);
+	if (!ctx) {
+		return false;
+	}
+
+	ExReInitializeRundownProtection(&vpdo.sock_ref);
+	KeClearEvent(&vpdo.recv_stopped);
+
+	ctx->vpdo = &vpdo;
+	sched_receive_usbip_header(ctx);
+
+	start_heartbeat(vpdo);
+	return true;
+}
+
+/*
+ * Old socket is closed after all its users have gone, URBs that were sent are failed.
+ * New URBs are held in held_csq until the device is imported again or the timeout expires.
+ */
+_Function_class_(IO_WORKITEM_ROUTINE_EX)
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PAGEABLE void reconnect_worker(_In_ void*, _In_opt_ void *Context, _In_ IO_WORKITEM*)
+{
+	PAGED_CODE();
+
+	auto &vpdo = *static_cast<vpdo_dev_t*>(Context);
+	TraceMsg("vpdo %04x, port %d, timeout %d sec", ptr4log(&vpdo), vpdo.port, vpdo.reconnect_timeout);
+
+	ExWaitForRundownProtectionRelease(&vpdo.sock_ref);
+	close_socket(vpdo);
+
+	auto ok = wait_receive_stopped(vpdo);
+	if (ok) {
+		cancel_pending_irps(vpdo);
+		ok = reconnect(vpdo) && resume(vpdo);
+	}
+
+	InterlockedExchange(&vpdo.reconnecting, false);
+
+	if (!ok) {
+		Trace(TRACE_LEVEL_ERROR, "vpdo %04x: can't reconnect, unplugging", ptr4log(&vpdo));
+		vhub_unplug_vpdo(&vpdo);
+	}
+
+	dispatch_held_irps(vpdo);
+	ExReleaseRundownProtection(&vpdo.reconnect_ref);
+}
+
+} // namespace
+
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_reconnect(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	ExInitializeRundownProtection(&vpdo.reconnect_ref);
+	KeInitializeEvent(&vpdo.reconnect_stop, NotificationEvent, false);
+
+	ExInitializeRundownProtection(&vpdo.sock_ref);
+	KeInitializeEvent(&vpdo.recv_stopped, NotificationEvent, false);
+
+	InitializeListHead(&vpdo.held_irps);
+	KeInitializeSpinLock(&vpdo.held_lock);
+
+	if (auto err = IoCsqInitialize(&vpdo.held_csq,
+					InsertIrp,
+					RemoveIrp,
+					PeekNextIrp,
+					AcquireLock,
+					ReleaseLock,
+					CompleteCanceledIrp)) {
+		return err;
+	}
+
+	vpdo.reconnect_workitem = IoAllocateWorkItem(vpdo.Self); // also means that all above are initialized
+	return vpdo.reconnect_workitem ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+/*
+ * Waits for the worker and prevents it from being queued again.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void cancel_reconnect(_Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+
+	auto &wi = vpdo.reconnect_workitem;
+	if (!wi) {
+		return;
+	}
+
+	KeSetEvent(&vpdo.reconnect_stop, IO_NO_INCREMENT, false);
+	ExWaitForRundownProtectionRelease(&vpdo.reconnect_ref);
+
+	dispatch_held_irps(vpdo);
+
+	IoFreeWorkItem(wi);
+	wi = nullptr;
+}
+
+/*
+ * Called on disconnect event, network error of receive or send.
+ * The device is unplugged at once if reconnect is disabled.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void connection_lost(_Inout_ vpdo_dev_t &vpdo)
+{
+	if (!vpdo.reconnect_timeout || vpdo.unplugged || !ExAcquireRundownProtection(&vpdo.reconnect_ref)) {
+		vhub_unplug_vpdo(&vpdo);
+		return;
+	}
+
+	if (InterlockedCompareExchange(&vpdo.reconnecting, true, false)) {
+		ExReleaseRundownProtection(&vpdo.reconnect_ref); // the worker is already running
+		return;
+	}
+
+	Trace(TRACE_LEVEL_WARNING, "vpdo %04x, port %d: connection lost, reconnecting", ptr4log(&vpdo), vpdo.port);
+	IoQueueWorkItemEx(vpdo.reconnect_workitem, reconnect_worker, DelayedWorkQueue, &vpdo);
+}
+
+/*
+ * @return false if the device is not reconnecting and the IRP must be dispatched
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool hold_irp(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+	if (!vpdo.reconnecting) {
+		return false;
+	}
+
+	TraceDbg("vpdo %04x, irp %04x", ptr4log(&vpdo), ptr4log(irp));
+	IoCsqInsertIrp(&vpdo.held_csq, irp, nullptr); // marks IRP pending
+
+	if (!vpdo.reconnecting) { // the worker could finish before the insertion
+		dispatch_held_irps(vpdo);
+	}
+
+	return true;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool acquire_socket(_Inout_ vpdo_dev_t &vpdo)
+{
+	return ExAcquireRundownProtection(&vpdo.sock_ref);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_socket(_Inout_ vpdo_dev_t &vpdo)
+{
+	ExReleaseRundownProtection(&vpdo.sock_ref);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <libdrv\pageable.h>
+#include <wdm.h>
+
+struct vpdo_dev_t;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE NTSTATUS init_reconnect(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGEABLE void cancel_reconnect(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void connection_lost(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool hold_irp(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool acquire_socket(_Inout_ vpdo_dev_t &vpdo);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_socket(_Inout_ vpdo_dev_t &vpdo);
@@ -0,0 +1,410 @@
+/*
+ * A long bulk transfer is split into segments that are sent as separate CMD_SUBMITs.
+ * The server starts the transfer of the first segment while the next ones are still on the way,
+ * thus network and USB transfer times overlap instead of adding up.
+ *
+ * Each segment is an IRP of this driver that is dispatched as an ordinary URB,
+ * so unlink, abort pipe, reconnect and removal work for segments as for any other URB.
+ * Segments are sent in order, at most SEGMENTS_IN_FLIGHT at a time.
+ * A short or failed segment ends the transfer, segments after it are canceled.
+ *
+ * Segmentation is enabled per endpoint by ioctl_usbip_vhci_plugin.segment_endpoints, for OUT endpoints only.
+ * An IN transfer can end early with a short packet, f.e. data-in phase of Bulk-Only Transport,
+ * and IN segments that are already queued on the server would consume the data that follows it (CSW)
+ * before they are canceled. Sending IN segments one at a time adds a round trip per segment
+ * and is slower than a single URB, so IN transfers are never split.
+ */
+#include "segment.h"
+#include "trace.h"
+#include "segment.tmh"
+
+#include "dev.h"
+#include "irp.h"
+#include "vhci.h"
+#include "devconf.h"
+
+#include <usbip\vhci.h>
+#include <libdrv\mdl_cpp.h>
+#include <libdrv\dbgcommon.h>
+
+namespace
+{
+
+enum { SEGMENTS_IN_FLIGHT = 4 };
+
+struct segments;
+
+struct segment
+{
+        segments *owner;
+        IRP *irp;
+        usbip::Mdl mdl; // partial MDL of the caller's TransferBufferMDL
+        _URB_BULK_OR_INTERRUPT_TRANSFER urb;
+        ULONG length; // requested
+        NTSTATUS status;
+        bool done;
+};
+
+struct segments
+{
+        vpdo_dev_t *vpdo;
+        IRP *irp; // of the caller
+        _URB_BULK_OR_INTERRUPT_TRANSFER *urb;
+
+        volatile LONG refs; // see release
+        volatile LONG active; // submit_segments and segments in flight, see deactivate
+        volatile LONG submit_req; // see submit
+        volatile LONG in_flight;
+
+        volatile bool stop; // do not submit more segments
+        volatile bool canceled; // the caller's IRP
+
+        volatile ULONG next; // segment to submit, modified by submit only
+        ULONG count;
+        segment seg[1]; // count
+};
+
+constexpr ULONG segment_count(ULONG length, ULONG seg_len)
+{
+        return length/seg_len + bool(length % seg_len);
+}
+
+constexpr ULONG segment_length(ULONG length, ULONG seg_len, ULONG offset)
+{
+        auto rest = length - offset;
+        return rest < seg_len ? rest : seg_len;
+}
+
+/*
+ * Segments are of seg_len except the last one, their lengths add up to length.
+ */
+constexpr bool check_split(ULONG length, ULONG seg_len)
+{
+        auto count = segment_count(length, seg_len);
+        ULONG total = 0;
+
+        for (ULONG i = 0, offset = 0; i < count; ++i, offset += seg_len) {
+                auto len = segment_length(length, seg_len, offset);
+                if (!len || (len != seg_len && i != count - 1)) {
+                        return false;
+                }
+                total += len;
+        }
+
+        return total == length;
+}
+static_assert(segment_count(4*65536, 65536) == 4);
+static_assert(segment_count(4*65536 + 1, 65536) == 5);
+static_assert(segment_count(1, 65536) == 1);
+static_assert(check_split(4*65536, 65536));
+static_assert(check_split(4*65536 + 1, 65536));
+static_assert(check_split(1'000'000, 4096));
+static_assert(check_split(ULONG(-1), 16*1024*1024));
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_segments(_In_ IRP *irp)
+{
+        return *reinterpret_cast<segments**>(irp->Tail.Overlay.DriverContext + 2); // see get_seqnum, CSQ
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_In_ segments *s)
+{
+        for (ULONG i = 0; i < s->count; ++i) {
+                auto &g = s->seg[i];
+                if (g.irp) {
+                        IoFreeIrp(g.irp);
+                }
+                g.mdl.reset();
+        }
+
+        ExFreePoolWithTag(s, USBIP_VHCI_POOL_TAG);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+segments *alloc_segments(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ _URB_BULK_OR_INTERRUPT_TRANSFER &r)
+{
+        auto seg_len = vpdo.segment_size;
+        auto count = segment_count(r.TransferBufferLength, seg_len);
+
+        auto size = offsetof(segments, seg) + count*sizeof(segment);
+        auto s = (segments*)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, USBIP_VHCI_POOL_TAG);
+        if (!s) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", size);
+                return s;
+        }
+
+        s->vpdo = &vpdo;
+        s->irp = irp;
+        s->urb = &r;
+        s->count = count;
+
+        auto mdl = r.TransferBufferMDL;
+        auto buf = static_cast<char*>(r.TransferBuffer);
+
+        for (ULONG i = 0, offset = 0; i < count; ++i, offset += seg_len) {
+                auto &g = s->seg[i];
+
+                g.owner = s;
+                g.length = segment_length(r.TransferBufferLength, seg_len, offset);
+
+                if (mdl && !(g.mdl = usbip::Mdl(mdl, offset, g.length))) {
+                        free(s);
+                        return nullptr;
+                }
+
+                auto &u = g.urb;
+                u = r;
+
+                u.Hdr.Length = sizeof(u);
+                u.Hdr.Function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+                u.Hdr.Status = USBD_STATUS_SUCCESS;
+                u.TransferBufferLength = g.length;
+                u.TransferBuffer = mdl ? nullptr : buf + offset;
+                u.TransferBufferMDL = g.mdl.get();
+                u.UrbLink = nullptr;
+
+                g.irp = IoAllocateIrp(vpdo.Self->StackSize, false);
+                if (!g.irp) {
+                        free(s);
+                        return nullptr;
+                }
+        }
+
+        return s;
+}
+
+/*
+ * A segment that failed or had a short packet ends the transfer.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete(_In_ segments *s)
+{
+        auto irp = s->irp;
+        auto &r = *s->urb;
+
+        ULONG actual = 0;
+        auto st = STATUS_SUCCESS;
+        USBD_STATUS usbd_status = USBD_STATUS_SUCCESS;
+
+        for (ULONG i = 0; i < s->count; ++i) {
+                auto &g = s->seg[i];
+
+                if (!g.done) { // was not submitted
+                        break;
+                } else if (!NT_SUCCESS(g.status)) {
+                        st = g.status;
+                        usbd_status = g.urb.Hdr.Status ? g.urb.Hdr.Status : USBD_STATUS_CANCELED;
+                        break;
+                }
+
+                actual += g.urb.TransferBufferLength;
+
+                if (g.urb.TransferBufferLength < g.length) { // short packet
+                        break;
+                }
+        }
+
+        if (s->canceled) {
+                st = STATUS_CANCELLED;
+                usbd_status = USBD_STATUS_CANCELED;
+        }
+
+        TraceUrb("irp %04x, %lu segments, TransferBufferLength %lu -> %lu, %s, %!STATUS!",
+                  ptr4log(irp), s->count, r.TransferBufferLength, actual, get_usbd_status(usbd_status), st);
+
+        r.TransferBufferLength = actual;
+        r.Hdr.Status = usbd_status;
+
+        free(s);
+
+        irp->IoStatus.Information = 0;
+        CompleteRequest(irp, st);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_Inout_ segments &s)
+{
+        if (!InterlockedDecrement(&s.refs)) {
+                complete(&s);
+        }
+}
+
+/*
+ * The last one who leaves drops the reference of on_cancel if it will not be called.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void deactivate(_Inout_ segments &s)
+{
+        if (InterlockedDecrement(&s.active)) {
+                return;
+        }
+
+        if (IoSetCancelRoutine(s.irp, nullptr)) {
+                release(s);
+        }
+
+        release(s);
+}
+
+/*
+ * @param from cancel submitted segments starting from this one
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ segments &s, _In_ ULONG from)
+{
+        for (ULONG i = from, n = s.next; i < n; ++i) {
+                IoCancelIrp(s.seg[i].irp); // does nothing if it has completed
+        }
+}
+
+_Function_class_(DRIVER_CANCEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_Requires_lock_held_(_Global_cancel_spin_lock_)
+_Releases_lock_(_Global_cancel_spin_lock_)
+void on_cancel(_Inout_ DEVICE_OBJECT*, _In_ _IRQL_uses_cancel_ IRP *irp)
+{
+        IoReleaseCancelSpinLock(irp->CancelIrql);
+
+        auto &s = *get_segments(irp);
+        TraceMsg("irp %04x, %lu segments submitted", ptr4log(irp), s.next);
+
+        s.canceled = true;
+        s.stop = true;
+
+        cancel(s, 0);
+        release(s);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_complete(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexpressible_("varies")) void *context);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send(_Inout_ segment &g)
+{
+        auto irp = g.irp;
+
+        auto stack = IoGetNextIrpStackLocation(irp);
+        stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+        stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+        stack->Parameters.Others.Argument1 = &g.urb;
+
+        irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+        IoSetCompletionRoutine(irp, on_complete, &g, true, true, true);
+
+        IoCallDriver(g.owner->vpdo->Self, irp);
+}
+
+/*
+ * Segments must be sent in order, so only one thread submits them at a time.
+ * If it is busy, it will submit on behalf of the caller.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit(_Inout_ segments &s)
+{
+        if (InterlockedIncrement(&s.submit_req) != 1) {
+                return;
+        }
+
+        do {
+                while (!s.stop && s.next < s.count && s.in_flight < SEGMENTS_IN_FLIGHT) {
+                        auto &g = s.seg[s.next++];
+
+                        InterlockedIncrement(&s.active);
+                        InterlockedIncrement(&s.in_flight);
+
+                        send(g);
+
+                        if (s.stop) { // cancel() could miss it
+                                IoCancelIrp(g.irp);
+                        }
+                }
+        } while (InterlockedDecrement(&s.submit_req));
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_complete(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        auto &g = *static_cast<segment*>(context);
+        auto &s = *g.owner;
+        auto idx = ULONG(&g - s.seg);
+
+        g.status = irp->IoStatus.Status;
+        g.done = true;
+
+        TraceDbg("irp %04x, segment %lu/%lu, %!STATUS!, %lu/%lu",
+                  ptr4log(s.irp), idx + 1, s.count, g.status, g.urb.TransferBufferLength, g.length);
+
+        if (!(NT_SUCCESS(g.status) && g.urb.TransferBufferLength == g.length)) {
+                s.stop = true;
+                cancel(s, idx + 1);
+        }
+
+        InterlockedDecrement(&s.in_flight);
+        submit(s);
+        deactivate(s);
+
+        return StopCompletion; // the IRP is reused until complete()
+}
+
+} // namespace
+
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool need_segments(_In_ const vpdo_dev_t &vpdo, _In_ const URB &urb)
+{
+        auto &r = urb.UrbBulkOrInterruptTransfer;
+
+        if (!(vpdo.segment_size && r.TransferBufferLength > vpdo.segment_size)) {
+                return false;
+        } else if (urb.UrbHeader.Function != URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
+                return false; // IoBuildPartialMdl can't be used for chained MDL
+        } else if (auto mdl = r.TransferBufferMDL; mdl && mdl->Next) {
+                return false;
+        } else if (get_stream_id(r.PipeHandle)) {
+                return false; // the data phase of a command must be one transfer of its stream
+        } else if (is_endpoint_direction_in(r.PipeHandle)) {
+                return false; // see the top of the file
+        }
+
+        return vpdo.segment_endpoints & segment_endpoint_bit(get_endpoint_address(r.PipeHandle));
+}
+
+/*
+ * @return STATUS_PENDING or an error if the transfer can't be split and should be sent as a whole
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS submit_segments(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ URB &urb)
+{
+        auto &r = urb.UrbBulkOrInterruptTransfer;
+
+        auto s = alloc_segments(vpdo, irp, r);
+        if (!s) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TraceUrb("irp %04x, TransferBufferLength %lu, %lu segments of %lu",
+                  ptr4log(irp), r.TransferBufferLength, s->count, vpdo.segment_size);
+
+        s->refs = 2; // see deactivate and on_cancel
+        s->active = 1; // this function
+
+        get_segments(irp) = s;
+        IoMarkIrpPending(irp);
+
+        IoSetCancelRoutine(irp, on_cancel);
+        if (irp->Cancel && IoSetCancelRoutine(irp, nullptr)) { // on_cancel will not be called
+                s->canceled = true;
+                s->stop = true;
+                release(*s);
+        }
+
+        submit(*s);
+        deactivate(*s);
+
+        return STATUS_PENDING;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <wdm.h>
+#include <usb.h>
+
+struct vpdo_dev_t;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool need_segments(_In_ const vpdo_dev_t &vpdo, _In_ const URB &urb);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS submit_segments(_In_ vpdo_dev_t &vpdo, _In_ IRP *irp, _In_ URB &urb);
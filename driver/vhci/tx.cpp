@@ -0,0 +1,365 @@
+/*
+ * Transmit scheduler of a device.
+ *
+ * All PDUs of a device share one TCP connection, so a long bulk transfer that is already in the socket buffer
+ * delays control, interrupt and isoch PDUs and CMD_UNLINKs that are sent after it.
+ * PDUs are queued by endpoint class and are passed to WskSend by priority: control, interrupt and CMD_UNLINK first,
+ * isoch next, bulk last. Bulk endpoints share the rest by deficit round-robin with the quantum of BULK_QUANTUM bytes,
+ * so a single endpoint cannot starve the others.
+ *
+ * Bulk PDUs that are passed to WskSend and are not completed are limited by BULK_QUANTUM bytes,
+ * thus urgent PDU never waits behind more than one quantum of bulk data. A longer bulk PDU is sent alone,
+ * see segment.cpp to split long transfers. WSK completes a send when it is acknowledged, so the limit
+ * is also the send window of the connection. It follows bandwidth-delay product if it is enabled, see bdp.cpp.
+ *
+ * Only one thread drains the queues at a time. If it is busy, it will send on behalf of the caller.
+ * It also seals PDUs of an encrypted device, see crypto.cpp.
+ */
+#include "tx.h"
+#include "trace.h"
+#include "tx.tmh"
+
+#include "dev.h"
+#include "wsk_context.h"
+#include "reconnect.h"
+#include "devconf.h"
+#include "crypto.h"
+
+#include <libdrv\wsk_cpp.h>
+
+namespace
+{
+
+enum : LONG { BULK_QUANTUM = 64*1024 }; // bytes
+
+inline auto next_entry(_Inout_ LIST_ENTRY &head)
+{
+        auto entry = RemoveHeadList(&head);
+        return CONTAINING_RECORD(entry, wsk_context, tx_entry);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline ULONG bulk_window(_In_ const tx_queue &q)
+{
+        return q.bdp.max_window ? q.bdp.window : BULK_QUANTUM;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void next_bulk(_Inout_ tx_queue &q)
+{
+        q.bulk_cur = (q.bulk_cur + 1) % TX_BULK_QUEUES;
+        q.bulk_turn = false;
+}
+
+/*
+ * Deficit round-robin.
+ */
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(q.lock)
+wsk_context *pick_bulk(_Inout_ tx_queue &q)
+{
+        if (!q.bulk_mask || q.bulk_inflight >= bulk_window(q)) {
+                return nullptr;
+        }
+
+        for ( ;; next_bulk(q)) {
+                auto i = q.bulk_cur;
+                if (!(q.bulk_mask & (1U << i))) {
+                        continue;
+                }
+
+                if (!q.bulk_turn) {
+                        q.deficit[i] += BULK_QUANTUM;
+                        q.bulk_turn = true;
+                }
+
+                auto &head = q.bulk[i];
+                auto len = LONG(CONTAINING_RECORD(head.Flink, wsk_context, tx_entry)->tx_buf.Length);
+
+                if (len > q.deficit[i]) {
+                        continue;
+                }
+
+                q.deficit[i] -= len;
+                auto ctx = next_entry(head);
+
+                if (IsListEmpty(&head)) {
+                        q.bulk_mask &= ~(1U << i);
+                        q.deficit[i] = 0;
+                        next_bulk(q);
+                }
+
+                ctx->tx_bulk = len;
+                q.bulk_inflight += len;
+                return ctx;
+        }
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(q.lock)
+wsk_context *pick(_Inout_ tx_queue &q)
+{
+        if (!IsListEmpty(&q.urgent)) {
+                return next_entry(q.urgent);
+        }
+
+        if (!IsListEmpty(&q.isoch)) {
+                return next_entry(q.isoch);
+        }
+
+        return pick_bulk(q);
+}
+
+/*
+ * Calls the completion routine that was set by the owner of ctx.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void fail(_Inout_ wsk_context &ctx, _In_ NTSTATUS status)
+{
+        auto wsk_irp = ctx.wsk_irp;
+
+        wsk_irp->IoStatus.Status = status;
+        wsk_irp->IoStatus.Information = 0;
+
+        auto stack = IoGetNextIrpStackLocation(wsk_irp);
+        stack->CompletionRoutine(nullptr, wsk_irp, stack->Context);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void transmit(_Inout_ vpdo_dev_t &vpdo, _Inout_ wsk_context &ctx)
+{
+        if (!acquire_socket(vpdo)) { // the connection is being reestablished
+                TraceDbg("ctx %04x, socket is closed", ptr4log(&ctx));
+                fail(ctx, STATUS_DEVICE_NOT_CONNECTED);
+                return;
+        }
+
+        if (vpdo.crypto) {
+                if (auto err = seal(vpdo, ctx)) {
+                        release_socket(vpdo);
+                        fail(ctx, err);
+                        return;
+                }
+        }
+
+        auto wsk_irp = ctx.wsk_irp; // do not access ctx or wsk_irp after send
+        ctx.tx_time = KeQueryInterruptTime();
+
+        auto err = send(vpdo.sock, &ctx.tx_buf, WSK_FLAG_NODELAY, wsk_irp);
+        NT_ASSERT(err != STATUS_NOT_SUPPORTED);
+
+        release_socket(vpdo);
+        TraceWSK("wsk irp %04x, %!STATUS!", ptr4log(wsk_irp), err);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void drain(_Inout_ vpdo_dev_t &vpdo)
+{
+        auto &q = vpdo.tx;
+
+        if (InterlockedIncrement(&q.drain_req) != 1) {
+                return;
+        }
+
+        do {
+                while (true) {
+                        KLOCK_QUEUE_HANDLE lh;
+                        KeAcquireInStackQueuedSpinLock(&q.lock, &lh);
+                        auto ctx = pick(q);
+                        KeReleaseInStackQueuedSpinLock(&lh);
+
+                        if (!ctx) {
+                                break;
+                        }
+
+                        transmit(vpdo, *ctx);
+                }
+        } while (InterlockedDecrement(&q.drain_req));
+}
+
+} // namespace
+
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_tx(_Out_ tx_queue &q)
+{
+        RtlZeroMemory(&q, sizeof(q));
+        KeInitializeSpinLock(&q.lock);
+
+        InitializeListHead(&q.urgent);
+        InitializeListHead(&q.isoch);
+
+        for (auto &head: q.bulk) {
+                InitializeListHead(&head);
+        }
+}
+
+/*
+ * ctx.tx_buf and the completion routine of ctx.wsk_irp must be set.
+ * @param handle of the pipe, EP0 for control transfers and CMD_UNLINK
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_send(_Inout_ vpdo_dev_t &vpdo, _Inout_ wsk_context &ctx, _In_opt_ USBD_PIPE_HANDLE handle)
+{
+        auto &q = vpdo.tx;
+        ctx.tx_bulk = 0;
+
+        KLOCK_QUEUE_HANDLE lh;
+        KeAcquireInStackQueuedSpinLock(&q.lock, &lh);
+
+        switch (handle ? get_endpoint_type(handle) : UsbdPipeTypeControl) {
+        case UsbdPipeTypeIsochronous:
+                InsertTailList(&q.isoch, &ctx.tx_entry);
+                break;
+        case UsbdPipeTypeBulk: {
+                auto i = get_endpoint_index(handle);
+                InsertTailList(&q.bulk[i], &ctx.tx_entry);
+                q.bulk_mask |= 1U << i;
+                break;
+        }
+        default:
+                InsertTailList(&q.urgent, &ctx.tx_entry);
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lh);
+
+        drain(vpdo);
+}
+
+/*
+ * Must be called by the completion routine of ctx.wsk_irp.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_complete(_Inout_ vpdo_dev_t &vpdo, _In_ wsk_context &ctx)
+{
+        auto &q = vpdo.tx;
+
+        if (!(ctx.tx_bulk || q.bdp.max_window)) {
+                return;
+        }
+
+        auto &st = ctx.wsk_irp->IoStatus;
+        auto sample = q.bdp.max_window && NT_SUCCESS(st.Status) && st.Information; // was sent
+        auto now = sample ? static_cast<LONG64>(KeQueryInterruptTime()) : 0;
+        ULONG window = 0;
+
+        KLOCK_QUEUE_HANDLE lh;
+        KeAcquireInStackQueuedSpinLock(&q.lock, &lh);
+
+        NT_ASSERT(q.bulk_inflight >= ctx.tx_bulk);
+        q.bulk_inflight -= ctx.tx_bulk;
+
+        if (sample) {
+                rtt_sample(q.bdp, now - ctx.tx_time);
+                if (delivered(q.bdp, st.Information, now)) {
+                        window = q.bdp.window;
+                }
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lh);
+
+        if (window) {
+                TraceDbg("vpdo %04x, send window %lu", ptr4log(&vpdo), window);
+        }
+
+        drain(vpdo);
+}
+
+/*
+ * Removes the PDU of the IRP if it is not sent yet.
+ * The completion routine of ctx.wsk_irp will not be called, the caller owns ctx.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wsk_context *tx_cancel(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp)
+{
+        auto &q = vpdo.tx;
+        wsk_context *found{};
+
+        auto remove = [irp, &found] (auto &head)
+        {
+                for (auto entry = head.Flink; entry != &head; entry = entry->Flink) {
+                        auto ctx = CONTAINING_RECORD(entry, wsk_context, tx_entry);
+                        if (ctx->irp == irp) {
+                                RemoveEntryList(entry);
+                                found = ctx;
+                                return true;
+                        }
+                }
+                return false;
+        };
+
+        KLOCK_QUEUE_HANDLE lh;
+        KeAcquireInStackQueuedSpinLock(&q.lock, &lh);
+
+        if (!(remove(q.urgent) || remove(q.isoch))) {
+                for (auto mask = q.bulk_mask; mask; ) {
+                        ULONG i;
+                        BitScanForward(&i, mask);
+                        mask &= mask - 1;
+
+                        if (remove(q.bulk[i])) {
+                                if (IsListEmpty(&q.bulk[i])) {
+                                        q.bulk_mask &= ~(1U << i);
+                                        q.deficit[i] = 0;
+                                }
+                                break;
+                        }
+                }
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lh);
+
+        if (found) {
+                TraceDbg("irp %04x, PDU is not sent", ptr4log(irp));
+        }
+
+        return found;
+}
+
+/*
+ * Fails PDUs that are not sent yet, the socket must be closed.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_flush(_Inout_ vpdo_dev_t &vpdo)
+{
+        NT_ASSERT(!vpdo.sock);
+
+        auto &q = vpdo.tx;
+        LIST_ENTRY list;
+        InitializeListHead(&list);
+
+        auto move = [&list] (auto &head)
+        {
+                while (!IsListEmpty(&head)) {
+                        auto entry = RemoveHeadList(&head);
+                        InsertTailList(&list, entry);
+                }
+        };
+
+        KLOCK_QUEUE_HANDLE lh;
+        KeAcquireInStackQueuedSpinLock(&q.lock, &lh);
+
+        move(q.urgent);
+        move(q.isoch);
+
+        for (auto &head: q.bulk) {
+                move(head);
+        }
+
+        q.bulk_mask = 0;
+        RtlZeroMemory(q.deficit, sizeof(q.deficit));
+
+        KeReleaseInStackQueuedSpinLock(&lh);
+
+        ULONG cnt = 0;
+
+        for ( ; !IsListEmpty(&list); ++cnt) {
+                auto ctx = next_entry(list);
+                ctx->tx_bulk = 0;
+                fail(*ctx, STATUS_DEVICE_NOT_CONNECTED);
+        }
+
+        if (cnt) {
+                TraceMsg("vpdo %04x, %lu PDUs failed", ptr4log(&vpdo), cnt);
+        }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <wdm.h>
+#include <usb.h>
+
+#include "bdp.h"
+
+struct vpdo_dev_t;
+struct wsk_context;
+
+enum { TX_BULK_QUEUES = 32 }; // see get_endpoint_index
+
+/*
+ * Transmit queue of a device, see tx.cpp.
+ */
+struct tx_queue
+{
+        KSPIN_LOCK lock;
+
+        LIST_ENTRY urgent; // control, interrupt, CMD_UNLINK
+        LIST_ENTRY isoch;
+
+        LIST_ENTRY bulk[TX_BULK_QUEUES]; // by endpoint
+        LONG deficit[TX_BULK_QUEUES];
+        UINT32 bulk_mask; // non-empty queues
+        int bulk_cur; // queue which turn it is
+        bool bulk_turn; // the quantum is added to deficit[bulk_cur]
+
+        ULONG bulk_inflight; // bytes of bulk PDUs that are sent and not completed
+        bdp_estimator bdp; // limit of bulk_inflight if enabled, see bulk_window
+
+        volatile LONG drain_req; // see drain
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_tx(_Out_ tx_queue &q);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_send(_Inout_ vpdo_dev_t &vpdo, _Inout_ wsk_context &ctx, _In_opt_ USBD_PIPE_HANDLE handle);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_complete(_Inout_ vpdo_dev_t &vpdo, _In_ wsk_context &ctx);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wsk_context *tx_cancel(_Inout_ vpdo_dev_t &vpdo, _In_ IRP *irp);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void tx_flush(_Inout_ vpdo_dev_t &vpdo);
@@ -0,0 +1,169 @@
+/*
+ * Traits of URB functions that are shared by internal_ioctl.cpp (send) and wsk_receive.cpp (receive).
+ * The table is built at compile time, a lookup is a single load. Dispatch tables of both paths
+ * are checked against it by static_assert, so they can't drift apart.
+ */
+#pragma once
+
+#include <wdm.h>
+#include <usb.h>
+
+enum urb_trait : UCHAR
+{
+        URB_RESERVED = 1 << 0, // there is no such function, it has no handler
+        URB_XFER_BUF = 1 << 1, // has TransferBuffer, see UrbTransfer
+        URB_BULK = 1 << 2, // bulk or interrupt transfer
+        URB_ISOCH = 1 << 3,
+        URB_LOCAL = 1 << 4, // is served without CMD_SUBMIT/RET_SUBMIT
+};
+
+enum : USHORT { URB_FUNCTION_COUNT = URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS + 1 };
+
+/*
+ * Direction is not a trait, it is taken from PipeHandle or usbip_header because TransferFlags can be wrong.
+ */
+constexpr UCHAR make_urb_traits(_In_ USHORT func)
+{
+        switch (func) {
+        case URB_FUNCTION_ABORT_PIPE:
+        case URB_FUNCTION_TAKE_FRAME_LENGTH_CONTROL:
+        case URB_FUNCTION_RELEASE_FRAME_LENGTH_CONTROL:
+        case URB_FUNCTION_GET_FRAME_LENGTH:
+        case URB_FUNCTION_SET_FRAME_LENGTH:
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+        case URB_FUNCTION_SYNC_RESET_PIPE:
+        case URB_FUNCTION_SYNC_CLEAR_STALL:
+        case URB_FUNCTION_OPEN_STATIC_STREAMS:
+        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
+        case URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS:
+                return URB_LOCAL;
+
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+        case URB_FUNCTION_SELECT_INTERFACE:
+        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL: // CLEAR_FEATURE(ENDPOINT_HALT)
+        case URB_FUNCTION_SET_FEATURE_TO_DEVICE:
+        case URB_FUNCTION_SET_FEATURE_TO_INTERFACE:
+        case URB_FUNCTION_SET_FEATURE_TO_ENDPOINT:
+        case URB_FUNCTION_SET_FEATURE_TO_OTHER:
+        case URB_FUNCTION_CLEAR_FEATURE_TO_DEVICE:
+        case URB_FUNCTION_CLEAR_FEATURE_TO_INTERFACE:
+        case URB_FUNCTION_CLEAR_FEATURE_TO_ENDPOINT:
+        case URB_FUNCTION_CLEAR_FEATURE_TO_OTHER:
+                return 0; // control transfer without data stage
+
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL:
+                return URB_XFER_BUF | URB_BULK;
+
+        case URB_FUNCTION_ISOCH_TRANSFER:
+        case URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL:
+                return URB_XFER_BUF | URB_ISOCH;
+
+        case URB_FUNCTION_CONTROL_TRANSFER:
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+        case URB_FUNCTION_GET_CONFIGURATION:
+        case URB_FUNCTION_GET_INTERFACE:
+        case URB_FUNCTION_GET_MS_FEATURE_DESCRIPTOR:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+                return URB_XFER_BUF;
+        }
+
+        return URB_RESERVED;
+}
+
+struct urb_traits_table
+{
+        UCHAR traits[URB_FUNCTION_COUNT]{};
+
+        constexpr urb_traits_table()
+        {
+                for (USHORT func = 0; func < URB_FUNCTION_COUNT; ++func) {
+                        traits[func] = make_urb_traits(func);
+                }
+        }
+};
+
+inline constexpr urb_traits_table urb_traits_v;
+
+constexpr auto urb_traits(_In_ USHORT func)
+{
+        return func < URB_FUNCTION_COUNT ? urb_traits_v.traits[func] : UCHAR(URB_RESERVED);
+}
+
+constexpr bool has_urb_trait(_In_ USHORT func, _In_ UCHAR mask)
+{
+        return urb_traits(func) & mask;
+}
+
+inline bool has_urb_trait(_In_ const URB &urb, _In_ UCHAR mask)
+{
+        return has_urb_trait(urb.UrbHeader.Function, mask);
+}
+
+/*
+ * @param handlers dispatch table by URB function
+ * @param mask entries that have these traits must be equal to value, others must not
+ */
+template<typename F, size_t N>
+constexpr bool check_urb_handlers(_In_ F const (&handlers)[N], _In_ UCHAR mask, _In_ decltype(handlers[0]) value)
+{
+        if (N != URB_FUNCTION_COUNT) {
+                return false;
+        }
+
+        for (USHORT func = 0; func < N; ++func) {
+                if (has_urb_trait(func, mask) != (handlers[func] == value)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/*
+ * @param values entries that have these traits must be one of them, others must not
+ */
+template<typename F, size_t N, size_t M>
+constexpr bool check_urb_handlers(_In_ F const (&handlers)[N], _In_ UCHAR mask, _In_ F const (&values)[M])
+{
+        if (N != URB_FUNCTION_COUNT) {
+                return false;
+        }
+
+        for (USHORT func = 0; func < N; ++func) {
+                bool found = false;
+                for (auto v: values) {
+                        found |= handlers[func] == v;
+                }
+                if (has_urb_trait(func, mask) != found) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static_assert(urb_traits(URB_FUNCTION_RESERVED_0X0016) == URB_RESERVED);
+static_assert(urb_traits(URB_FUNCTION_COUNT) == URB_RESERVED);
+static_assert(has_urb_trait(URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL, URB_ISOCH));
+static_assert(has_urb_trait(URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL, URB_BULK));
+static_assert(has_urb_trait(URB_FUNCTION_GET_MS_FEATURE_DESCRIPTOR, URB_XFER_BUF));
+static_assert(has_urb_trait(URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS, URB_LOCAL));
+static_assert(!has_urb_trait(URB_FUNCTION_SELECT_CONFIGURATION, URB_XFER_BUF | URB_LOCAL | URB_RESERVED));
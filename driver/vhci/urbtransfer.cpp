@@ -62,47 +62,3 @@ static_assert(offsetof(_URB_CONTROL_VENDOR_OR_CLASS_REQUEST, TransferBufferMDL)
 static_assert(offsetof(_URB_CONTROL_GET_INTERFACE_REQUEST, TransferBufferMDL) == off_mdl);
 static_assert(offsetof(_URB_CONTROL_GET_CONFIGURATION_REQUEST, TransferBufferMDL) == off_mdl);
 static_assert(offsetof(_URB_OS_FEATURE_DESCRIPTOR_REQUEST, TransferBufferMDL) == off_mdl);
-
-bool has_transfer_buffer(_In_ const URB &urb)
-{
-        switch (urb.UrbHeader.Function) {
-        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
-        case URB_FUNCTION_ISOCH_TRANSFER:
-        case URB_FUNCTION_CONTROL_TRANSFER:
-
-        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL:
-        case URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL:
-        case URB_FUNCTION_CONTROL_TRANSFER_EX:
-
-        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
-        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
-        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
-
-        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
-        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
-        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
-
-        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
-        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
-        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
-        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
-
-        case URB_FUNCTION_VENDOR_DEVICE:
-        case URB_FUNCTION_VENDOR_INTERFACE:
-        case URB_FUNCTION_VENDOR_ENDPOINT:
-        case URB_FUNCTION_VENDOR_OTHER:
-
-        case URB_FUNCTION_CLASS_DEVICE:
-        case URB_FUNCTION_CLASS_INTERFACE:
-        case URB_FUNCTION_CLASS_ENDPOINT:
-        case URB_FUNCTION_CLASS_OTHER:
-
-        case URB_FUNCTION_GET_CONFIGURATION:
-        case URB_FUNCTION_GET_INTERFACE:
-
-        case URB_FUNCTION_GET_MS_FEATURE_DESCRIPTOR:
-                return true;
-        }
-
-        return false;
-}
@@ -8,6 +8,8 @@
 #include <wdm.h>
 #include <usb.h>
 
+#include "urb_traits.h"
+
 struct UrbTransfer
 {
 	using type = _URB_CONTROL_TRANSFER;
@@ -21,7 +23,10 @@ struct UrbTransfer
 };
 
 
-bool has_transfer_buffer(_In_ const URB &urb);
+inline bool has_transfer_buffer(_In_ const URB &urb)
+{
+	return has_urb_trait(urb, URB_XFER_BUF);
+}
 
 inline auto& AsUrbTransfer(_In_ URB &urb) 
 { 
@@ -13,6 +13,7 @@
 #include "vhub.h"
 #include "ioctl.h"
 #include "wsk_context.h"
+#include "crypto.h"
 #include "internal_ioctl.h"
 
 #include <ntstrsafe.h>
@@ -71,6 +72,7 @@ PAGEABLE void DriverUnload(_In_ DRIVER_OBJECT *drvobj)
 	TraceMsg("%04x", ptr4log(drvobj));
 
         wsk::shutdown();
+        shutdown_crypto();
 
 	if (g_init_flags & INIT_WSK_CTX_LIST) {
 		ExDeleteLookasideListEx(&wsk_context_list);
@@ -110,18 +112,12 @@ PAGEABLE NTSTATUS set_verbose_on(HANDLE h)
 	return st;
 }
 
-/*
-* Configure Inflight Trace Recorder (IFR) parameter "VerboseOn".
-* The default setting of zero causes the IFR to log errors, warnings, and informational events.
-* Set to one to add verbose output to the log.
-*
-* reg add "HKLM\SYSTEM\ControlSet001\Services\usbip_vhci\Parameters" /v VerboseOn /t REG_DWORD /d 1 /f
-*/
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
-PAGEABLE NTSTATUS set_ifr_verbose(const UNICODE_STRING *RegistryPath)
+PAGEABLE NTSTATUS open_parameters(_Out_ HANDLE &h, _In_ const UNICODE_STRING *RegistryPath)
 {
 	PAGED_CODE();
+	h = nullptr;
 
 	UNICODE_STRING params;
 	RtlInitUnicodeString(&params, L"\\Parameters");
@@ -144,17 +140,80 @@ PAGEABLE NTSTATUS set_ifr_verbose(const UNICODE_STRING *RegistryPath)
 	OBJECT_ATTRIBUTES attrs;
 	InitializeObjectAttributes(&attrs, &path, OBJ_KERNEL_HANDLE, nullptr, nullptr);
 
-	HANDLE h = nullptr;
-	err = ZwCreateKey(&h, KEY_WRITE, &attrs, 0, nullptr, 0, nullptr);
+	err = ZwCreateKey(&h, KEY_READ | KEY_WRITE, &attrs, 0, nullptr, 0, nullptr);
+
+	ExFreePoolWithTag(path.Buffer, USBIP_VHCI_POOL_TAG);
+	return err;
+}
+
+/*
+* Configure Inflight Trace Recorder (IFR) parameter "VerboseOn".
+* The default setting of zero causes the IFR to log errors, warnings, and informational events.
+* Set to one to add verbose output to the log.
+*
+* reg add "HKLM\SYSTEM\ControlSet001\Services\usbip_vhci\Parameters" /v VerboseOn /t REG_DWORD /d 1 /f
+*/
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PAGEABLE NTSTATUS set_ifr_verbose(const UNICODE_STRING *RegistryPath)
+{
+	PAGED_CODE();
+
+	HANDLE h;
+	auto err = open_parameters(h, RegistryPath);
 	if (!err) {
 		err = set_verbose_on(h);
 		ZwClose(h);
 	}
 
-	ExFreePoolWithTag(path.Buffer, USBIP_VHCI_POOL_TAG);
 	return err;
 }
 
+/*
+* The number of ports of each HCI, [1, VHCI_MAX_PORTS]. Takes effect after the driver is reloaded.
+* The ports are spread over several root hubs if a hub can't have that many, see vhub_max_ports.
+*
+* reg add "HKLM\SYSTEM\ControlSet001\Services\usbip_vhci\Parameters" /v NumPorts /t REG_DWORD /d 510 /f
+*/
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+PAGEABLE void read_num_ports(const UNICODE_STRING *RegistryPath)
+{
+	PAGED_CODE();
+
+	auto &num_ports = Globals.num_ports;
+	num_ports = VHCI_DEFAULT_PORTS;
+
+	HANDLE h;
+	if (auto err = open_parameters(h, RegistryPath)) {
+		Trace(TRACE_LEVEL_ERROR, "Can't open parameters %!STATUS!", err);
+		return;
+	}
+
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"NumPorts");
+
+	UCHAR buf[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD)];
+	auto &info = *reinterpret_cast<KEY_VALUE_PARTIAL_INFORMATION*>(buf);
+	ULONG len = 0;
+
+	if (auto st = ZwQueryValueKey(h, &name, KeyValuePartialInformation, &info, sizeof(buf), &len)) {
+		if (st != STATUS_OBJECT_NAME_NOT_FOUND) {
+			Trace(TRACE_LEVEL_ERROR, "ZwQueryValueKey %!STATUS!", st);
+		}
+	} else if (DWORD val{}; info.Type == REG_DWORD && info.DataLength == sizeof(val)) {
+		RtlCopyMemory(&val, info.Data, sizeof(val));
+		if (val && val <= VHCI_MAX_PORTS) {
+			num_ports = val;
+		} else {
+			Trace(TRACE_LEVEL_ERROR, "NumPorts %lu is out of range", val);
+		}
+	}
+
+	ZwClose(h);
+	Trace(TRACE_LEVEL_INFORMATION, "%d ports per HCI", num_ports);
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 PAGEABLE auto save_registry_path(const UNICODE_STRING *RegistryPath)
@@ -214,6 +273,7 @@ extern "C" NTSTATUS DriverEntry(_In_ DRIVER_OBJECT *drvobj, _In_ UNICODE_STRING
 	}
 
 	TraceMsg("%04x", ptr4log(drvobj));
+	read_num_ports(RegistryPath);
 
 	if (auto err = init_lookaside_lists()) {
 		Trace(TRACE_LEVEL_CRITICAL, "init_lookaside_lists %!STATUS!", err);
@@ -226,6 +286,12 @@ extern "C" NTSTATUS DriverEntry(_In_ DRIVER_OBJECT *drvobj, _In_ UNICODE_STRING
                 DriverUnload(drvobj);
                 return err;
         }
+
+        if (auto err = init_crypto()) {
+                Trace(TRACE_LEVEL_CRITICAL, "init_crypto %!STATUS!", err);
+                DriverUnload(drvobj);
+                return err;
+        }
         
         if (auto err = save_registry_path(RegistryPath)) {
                 DriverUnload(drvobj);
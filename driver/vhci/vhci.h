@@ -7,6 +7,7 @@ const ULONG USBIP_VHCI_POOL_TAG = 'ICHV';
 struct GLOBALS
 {
 	UNICODE_STRING RegistryPath; // Path to the driver's Services Key in the registry
+	int num_ports; // of each HCI, [1, VHCI_MAX_PORTS]
 };
 
 inline GLOBALS Globals;
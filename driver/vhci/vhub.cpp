@@ -4,6 +4,8 @@
 #include "vhub.tmh"
 
 #include "dev.h"
+#include "port_change.h"
+#include "heartbeat.h"
 
 #include <usbip\vhci.h>
 #include <libdrv\usbdsc.h>
@@ -29,51 +31,173 @@ void to_ansi_str(char *dest, USHORT len, const UNICODE_STRING &src)
 	RtlZeroMemory(s.Buffer + s.Length, len - s.Length);
 }
 
+/*
+ * Must be called under vhub.mutex, the lock only waits for vhub_find_vpdo callers that are reading this slot.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+void set_vpdo(_Inout_ vhub_dev_t &vhub, _In_ int port, _In_opt_ vpdo_dev_t *vpdo)
+{
+	auto irql = ExAcquireSpinLockExclusive(&vhub.vpdo_lock);
+	vhub.vpdo[port - 1] = vpdo;
+	ExReleaseSpinLockExclusive(&vhub.vpdo_lock, irql);
+}
+
+/*
+ * @return port of the hub, zero if all ports are used
+ */
+PAGEABLE auto attach(_Inout_ vhub_dev_t &vhub, _Inout_ vpdo_dev_t &vpdo)
+{
+	PAGED_CODE();
+	auto &vhci = *vhci_from_vhub(&vhub);
+
+	ExAcquireFastMutex(&vhub.mutex);
+
+	for (int i = 0; i < vhub.num_ports; ++i) {
+		if (!vhub.vpdo[i]) {
+			vpdo.parent = &vhub;
+			vpdo.port = i + 1;
+			NT_ASSERT(is_valid_port(vhub, vpdo.port));
+			set_vpdo(vhub, vpdo.port, &vpdo);
+			port_changed(vhci, make_vport(vhub, vpdo.port), PORT_CHANGE_ATTACHED);
+			break;
+		}
+	}
+
+	ExReleaseFastMutex(&vhub.mutex);
+
+	if (vpdo.port) {
+		complete_port_changes(vhci);
+	}
+
+	return vpdo.port;
+}
+
 } // namespace
 
 
-PAGEABLE vpdo_dev_t *vhub_find_vpdo(vhub_dev_t &vhub, int port)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void vpdo_ref::reset()
 {
-	PAGED_CODE();
+        if (m_vpdo) {
+                ExReleaseRundownProtection(&m_vpdo->port_ref);
+                m_vpdo = nullptr;
+        }
+}
 
-	if (!is_valid_rhport(port)) {
-		return nullptr;
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void vhub_ref::reset()
+{
+        if (m_vhub) {
+                ExReleaseRundownProtection(&m_vhub->ref);
+                m_vhub = nullptr;
+        }
+}
+
+/*
+ * @param vhci any vhci of the root, the caller guarantees that it is not removed yet
+ * @param version of the vhci that owns the hub, it can be a sibling of the given one
+ * @return reference to the started hub, empty if it is gone or is being removed
+ *
+ * The links from PDO to FDO are cleared by unlink_fdo under the root's lock before the device
+ * extension is deleted, destroy() of the hub waits for the references to be released.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vhub_ref get_vhub(_In_ vhci_dev_t &vhci, _In_ hci_version version, _In_ int index)
+{
+	auto root = static_cast<root_dev_t*>(vhci.parent);
+	if (!root) {
+		return vhub_ref();
 	}
 
-	ExAcquireFastMutex(&vhub.mutex);
+	vhub_dev_t *vhub{};
+
+	KIRQL irql;
+	KeAcquireSpinLock(&root->lock, &irql);
+
+	auto target = version == vhci.version ? &vhci : nullptr;
+
+	for (auto cpdo: root->children_pdo) {
+		if (!target && cpdo && cpdo->version == version) {
+			target = static_cast<vhci_dev_t*>(cpdo->fdo);
+		}
+	}
+
+	if (target && target->PnPState == pnp_state::Started && index >= 0 && index < target->num_hubs) {
+		if (auto hpdo = target->children_pdo[index]) {
+			vhub = static_cast<vhub_dev_t*>(hpdo->fdo);
+		}
+	}
+
+	if (vhub && !(vhub->PnPState == pnp_state::Started && ExAcquireRundownProtection(&vhub->ref))) {
+		vhub = nullptr;
+	}
+
+	KeReleaseSpinLock(&root->lock, irql);
+	return vhub_ref(vhub);
+}
+
+/*
+ * Lookups do not take vhub.mutex and do not wait for attach or detach of other devices.
+ * The shared lock is held only to take a reference, vhub_detach_vpdo removes the vpdo from the table
+ * before destroy() waits for the references to be released.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vpdo_ref vhub_find_vpdo(_In_ vhub_dev_t &vhub, _In_ int port)
+{
+	if (!is_valid_port(vhub, port)) {
+		return vpdo_ref();
+	}
+
+	auto irql = ExAcquireSpinLockShared(&vhub.vpdo_lock);
 
 	auto vpdo = vhub.vpdo[port - 1];
 	if (vpdo) {
 		NT_ASSERT(vpdo->port == port);
+		if (!ExAcquireRundownProtection(&vpdo->port_ref)) { // can't fail while vpdo is in the table
+			vpdo = nullptr;
+		}
 	}
 
-	ExReleaseFastMutex(&vhub.mutex);
-	return vpdo;
+	ExReleaseSpinLockShared(&vhub.vpdo_lock, irql);
+	return vpdo_ref(vpdo);
+}
+
+/*
+ * @param vport of a device on any hub of the vhci
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vpdo_ref vhci_find_vpdo(_In_ vhci_dev_t &vhci, _In_ int vport)
+{
+	if (!(is_valid_vport(vport) && get_hci_version(vport) == vhci.version)) {
+		return vpdo_ref();
+	}
+
+	auto rhport = get_rhport(vport);
+	auto vhub = vhub_from_vhci(&vhci, get_hub_index(vhci.version, rhport));
+
+	return vhub ? vhub_find_vpdo(*vhub, get_hub_port(vhci.version, rhport)) : vpdo_ref();
 }
 
+/*
+ * The vpdo is attached to the first started hub of its vhci that has a free port.
+ * vpdo->parent is set to that hub. The caller keeps the current parent pinned, see plugin_vpdo.
+ */
 PAGEABLE bool vhub_attach_vpdo(vpdo_dev_t *vpdo)
 {
 	PAGED_CODE();
 
 	NT_ASSERT(!vpdo->port);
-	auto vhub = vhub_from_vpdo(vpdo);
+	auto vhci = vhci_from_vhub(vhub_from_vpdo(vpdo));
 
-	ExAcquireFastMutex(&vhub->mutex);
-
-	for (int i = 0; i < vhub->NUM_PORTS; ++i) {
-		auto &ptr = vhub->vpdo[i];
-		if (!ptr) {
-			ptr = vpdo;
-			vpdo->port = i + 1;
-			NT_ASSERT(is_valid_rhport(vpdo->port));
-			break;
+	for (int i = 0; i < vhci->num_hubs; ++i) {
+		if (auto vhub = get_vhub(*vhci, vhci->version, i); vhub && attach(*vhub.get(), *vpdo)) {
+			TraceMsg("%04x, hub %d, port %d", ptr4log(vpdo), i, vpdo->port);
+			return true;
 		}
 	}
 
-	ExReleaseFastMutex(&vhub->mutex);
-
-	TraceMsg("%04x, port %d", ptr4log(vpdo), vpdo->port);
-	return vpdo->port;
+	TraceMsg("%04x, all ports of %d hubs are used", ptr4log(vpdo), vhci->num_hubs);
+	return false;
 }
 
 PAGEABLE void vhub_detach_vpdo(vpdo_dev_t *vpdo)
@@ -86,17 +210,21 @@ PAGEABLE void vhub_detach_vpdo(vpdo_dev_t *vpdo)
 		return;
 	}
 
-	NT_ASSERT(is_valid_rhport(vpdo->port));
 	auto vhub = vhub_from_vpdo(vpdo);
+	NT_ASSERT(is_valid_port(*vhub, vpdo->port));
+
+	auto &vhci = *vhci_from_vhub(vhub);
 
 	ExAcquireFastMutex(&vhub->mutex);
 	{
-		auto i = vpdo->port - 1;
-		NT_ASSERT(vhub->vpdo[i] == vpdo);
-		vhub->vpdo[i] = nullptr;
+		NT_ASSERT(vhub->vpdo[vpdo->port - 1] == vpdo);
+		set_vpdo(*vhub, vpdo->port, nullptr);
+
+		port_changed(vhci, make_vport(*vhub, vpdo->port), PORT_CHANGE_DETACHED);
 	}
 	ExReleaseFastMutex(&vhub->mutex);
 
+	complete_port_changes(vhci);
 	vpdo->port = 0;
 }
 
@@ -105,17 +233,17 @@ PAGEABLE NTSTATUS vhub_get_information_ex(vhub_dev_t &vhub, USB_HUB_INFORMATION_
 	PAGED_CODE();
 
 	p.HubType = UsbRootHub;
-	p.HighestPortNumber = vhub.NUM_PORTS;
+	p.HighestPortNumber = static_cast<USHORT>(vhub.num_ports);
 	RtlZeroMemory(&p.u, sizeof(p.u));
 
 	return STATUS_SUCCESS;
 }
 
-PAGEABLE NTSTATUS vhub_get_port_connector_properties(vhub_dev_t&, USB_PORT_CONNECTOR_PROPERTIES &r, ULONG &outlen)
+PAGEABLE NTSTATUS vhub_get_port_connector_properties(vhub_dev_t &vhub, USB_PORT_CONNECTOR_PROPERTIES &r, ULONG &outlen)
 {
 	PAGED_CODE();
 
-	if (!is_valid_rhport(r.ConnectionIndex)) {
+	if (!is_valid_port(vhub, r.ConnectionIndex)) {
 		return STATUS_INVALID_PARAMETER;
 	}
 
@@ -167,28 +295,29 @@ PAGEABLE void vhub_unplug_all_vpdo(vhub_dev_t &vhub)
 
 	ExAcquireFastMutex(&vhub.mutex);
 
-	for (auto i: vhub.vpdo) {
-		if (i) {
-			vhub_unplug_vpdo(i);
+	for (int i = 0; i < vhub.num_ports; ++i) {
+		if (auto vpdo = vhub.vpdo[i]) {
+			vhub_unplug_vpdo(vpdo);
 		}
 	}
 
 	ExReleaseFastMutex(&vhub.mutex);
 }
 
-PAGEABLE NTSTATUS get_imported_devs(vhub_dev_t &vhub, ioctl_usbip_vhci_imported_dev *dev, size_t cnt)
+PAGEABLE NTSTATUS get_imported_devs(vhci_dev_t &vhci, ioctl_usbip_vhci_imported_dev *dev, size_t cnt)
 {
 	PAGED_CODE();
-	TraceMsg("%!hci_version!, cnt %Iu", vhub.version, cnt);
+	TraceMsg("%!hci_version!, cnt %Iu", vhci.version, cnt);
 
 	if (!cnt) {
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	ExAcquireFastMutex(&vhub.mutex);
+	for (int rhport = 1; rhport <= vhci.num_ports; ++rhport) {
 
-	for (auto vpdo: vhub.vpdo) {
+		auto vport = make_vport(vhci.version, rhport);
 
+		auto vpdo = vhci_find_vpdo(vhci, vport);
 		if (!vpdo) {
 			continue;
 		}
@@ -197,7 +326,7 @@ PAGEABLE NTSTATUS get_imported_devs(vhub_dev_t &vhub, ioctl_usbip_vhci_imported_
 			break;
 		}
 
-		dev->port = make_vport(vpdo->version, vpdo->port);
+		dev->port = vport; // vpdo->port is zeroed by vhub_detach_vpdo
 		NT_ASSERT(is_valid_vport(dev->port));
 
 		RtlStringCbCopyA(dev->busid, sizeof(dev->busid), vpdo->busid);
@@ -206,6 +335,8 @@ PAGEABLE NTSTATUS get_imported_devs(vhub_dev_t &vhub, ioctl_usbip_vhci_imported_
 		to_ansi_str(dev->host, sizeof(dev->host), vpdo->node_name);
 		to_ansi_str(dev->serial, sizeof(dev->serial), vpdo->serial);
 
+		dev->reconnect = vpdo->reconnect_timeout;
+
                 dev->status = SDEV_ST_USED;
 
                 if (auto d = &vpdo->descriptor) {
@@ -215,12 +346,12 @@ PAGEABLE NTSTATUS get_imported_devs(vhub_dev_t &vhub, ioctl_usbip_vhci_imported_
 		
 		dev->devid = vpdo->devid;
 		dev->speed = vpdo->speed;
+
+		get_rtt(*vpdo, dev->rtt, dev->rttvar);
 		
 		++dev;
 	}
 
-	ExReleaseFastMutex(&vhub.mutex);
-
 	dev->port = 0; // end of mark
 	return STATUS_SUCCESS;
 }
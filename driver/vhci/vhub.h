@@ -1,16 +1,79 @@
 #pragma once
 
 #include <libdrv\pageable.h>
-#include <ntdef.h>
+#include <wdm.h>
+
+#include <usbip\vport.h>
 
 struct _USB_HUB_INFORMATION_EX;
 struct _USB_PORT_CONNECTOR_PROPERTIES;
 
+struct vhci_dev_t;
 struct vhub_dev_t;
 struct vpdo_dev_t;
 struct ioctl_usbip_vhci_imported_dev;
 
-PAGEABLE vpdo_dev_t *vhub_find_vpdo(vhub_dev_t &vhub, int port);
+/*
+ * Members of the vpdo can be used until the reference is released, destroy() waits for that.
+ */
+class vpdo_ref
+{
+public:
+        explicit vpdo_ref(_In_opt_ vpdo_dev_t *vpdo = nullptr) : m_vpdo(vpdo) {}
+        ~vpdo_ref() { reset(); }
+
+        vpdo_ref(const vpdo_ref&) = delete;
+        vpdo_ref& operator =(const vpdo_ref&) = delete;
+
+        explicit operator bool() const { return m_vpdo; }
+        auto operator !() const { return !m_vpdo; }
+
+        auto get() const { return m_vpdo; }
+        auto operator ->() const { return m_vpdo; }
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        void reset();
+
+private:
+        vpdo_dev_t *m_vpdo{};
+};
+
+/*
+ * The hub can be used until the reference is released, destroy() waits for that.
+ * Its vhci can't be removed before the hub.
+ */
+class vhub_ref
+{
+public:
+        explicit vhub_ref(_In_opt_ vhub_dev_t *vhub = nullptr) : m_vhub(vhub) {}
+        ~vhub_ref() { reset(); }
+
+        vhub_ref(const vhub_ref&) = delete;
+        vhub_ref& operator =(const vhub_ref&) = delete;
+
+        explicit operator bool() const { return m_vhub; }
+        auto operator !() const { return !m_vhub; }
+
+        auto get() const { return m_vhub; }
+        auto operator ->() const { return m_vhub; }
+
+        void swap(vhub_ref &r) { auto p = m_vhub; m_vhub = r.m_vhub; r.m_vhub = p; }
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        void reset();
+
+private:
+        vhub_dev_t *m_vhub{};
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vhub_ref get_vhub(_In_ vhci_dev_t &vhci, _In_ hci_version version, _In_ int index);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vpdo_ref vhub_find_vpdo(_In_ vhub_dev_t &vhub, _In_ int port);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+vpdo_ref vhci_find_vpdo(_In_ vhci_dev_t &vhci, _In_ int vport);
 
 PAGEABLE bool vhub_attach_vpdo(vpdo_dev_t *vpdo);
 PAGEABLE void vhub_detach_vpdo(vpdo_dev_t *vpdo);
@@ -21,4 +84,4 @@ PAGEABLE NTSTATUS vhub_get_port_connector_properties(vhub_dev_t &vhub, _USB_PORT
 NTSTATUS vhub_unplug_vpdo(vpdo_dev_t *vpdo);
 PAGEABLE void vhub_unplug_all_vpdo(vhub_dev_t &vhub);
 
-PAGEABLE NTSTATUS get_imported_devs(vhub_dev_t &vhub, ioctl_usbip_vhci_imported_dev *idevs, size_t cnt);
+PAGEABLE NTSTATUS get_imported_devs(vhci_dev_t &vhci, ioctl_usbip_vhci_imported_dev *idevs, size_t cnt);
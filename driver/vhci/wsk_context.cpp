@@ -7,6 +7,7 @@
 #include "wsk_context.tmh"
 
 #include "dev.h"
+#include "crypto.h"
 
 namespace
 {
@@ -25,6 +26,7 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
         ctx->mdl_hdr.reset();
         ctx->mdl_buf.reset();
         ctx->mdl_isoc.reset();
+        ctx->mdl_rec.reset();
 
         if (auto irp = ctx->wsk_irp) {
                 IoFreeIrp(irp);
@@ -34,6 +36,10 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
                 ExFreePoolWithTag(ptr, AllocTag);
         }
 
+        if (auto ptr = ctx->rec) {
+                ExFreePoolWithTag(ptr, AllocTag);
+        }
+
         ExFreePoolWithTag(ctx, AllocTag);
 }
 
@@ -142,6 +148,40 @@ NTSTATUS prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
         return STATUS_SUCCESS;
 }
 
+/*
+ * The buffer is kept for next records, see free() for its limit.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS prepare_sealed(_In_ wsk_context &ctx, _In_ ULONG len)
+{
+        if (ctx.rec_alloc >= len) {
+                return STATUS_SUCCESS;
+        }
+
+        auto rec = (UCHAR*)ExAllocatePool2(POOL_FLAG_NON_PAGED, len, AllocTag);
+        if (!rec) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ctx.mdl_rec.reset();
+
+        if (ctx.rec) {
+                ExFreePoolWithTag(ctx.rec, AllocTag);
+        }
+
+        ctx.rec = rec;
+        ctx.rec_alloc = len;
+
+        ctx.mdl_rec = usbip::Mdl(ctx.rec, ctx.rec_alloc);
+
+        auto err = ctx.mdl_rec.prepare_nonpaged();
+        if (err) {
+                ctx.rec_alloc = 0; // try again next time
+        }
+
+        return err;
+}
+
 /*
  * alloc_wsk_context set ctx->is_isoc, it's safe do not clear it.
  */
@@ -156,6 +196,13 @@ void free(_In_opt_ wsk_context *ctx, _In_ bool reuse)
         ctx->irp = nullptr;
         ctx->mdl_buf.reset();
 
+        if (ctx->rec_alloc > CRYPTO_HDR_SIZE + CRYPTO_KEEP_RECORD + CRYPTO_TAG_SIZE) { // do not pin a huge buffer in the list
+                ctx->mdl_rec.reset();
+                ExFreePoolWithTag(ctx->rec, AllocTag);
+                ctx->rec = nullptr;
+                ctx->rec_alloc = 0;
+        }
+
         if (reuse) {
                 ::reuse(*ctx);
         }
@@ -7,6 +7,8 @@
 #include <usbip\proto.h>
 #include <libdrv\mdl_cpp.h>
 
+#include <wsk.h>
+
 struct vpdo_dev_t;
 
 inline LOOKASIDE_LIST_EX wsk_context_list;
@@ -23,6 +25,12 @@ struct wsk_context
 
         usbip::Mdl mdl_buf; // describes URB_FROM_IRP(irp)->TransferBuffer(MDL)
 
+        // see tx.cpp
+        LIST_ENTRY tx_entry;
+        WSK_BUF tx_buf;
+        ULONG tx_bulk; // bytes that are counted in tx_queue.bulk_inflight
+        LONG64 tx_time; // KeQueryInterruptTime when passed to WskSend
+
         // preallocated data
 
         IRP *wsk_irp;
@@ -34,6 +42,10 @@ struct wsk_context
         usbip_iso_packet_descriptor *isoc;
         ULONG isoc_alloc_cnt;
         bool is_isoc;
+
+        usbip::Mdl mdl_rec; // sealed PDU, see crypto.cpp
+        UCHAR *rec;
+        ULONG rec_alloc;
 };
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -42,6 +54,9 @@ wsk_context *alloc_wsk_context(_In_ ULONG NumberOfPackets);
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS prepare_sealed(_In_ wsk_context &ctx, _In_ ULONG len);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void free(_In_opt_ wsk_context *ctx, _In_ bool reuse);
 
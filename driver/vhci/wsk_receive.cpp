@@ -18,6 +18,12 @@
 #include "wsk_context.h"
 #include "vhub.h"
 #include "vhci.h"
+#include "reconnect.h"
+#include "jitter.h"
+#include "crypto.h"
+#include "heartbeat.h"
+#include "config_index.h"
+#include "path_delay.h"
 
 namespace
 {
@@ -47,6 +53,9 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto select_config(_In_ vpdo_dev_t &vpdo, _Inout_ _URB_SELECT_CONFIGURATION *r)
 {
+	free_config_index(vpdo.actindex);
+	RtlZeroMemory(vpdo.open_streams, sizeof(vpdo.open_streams)); // the server frees them
+
 	if (vpdo.actconfig) {
 		ExFreePoolWithTag(vpdo.actconfig, USBIP_VHCI_POOL_TAG);
 		vpdo.actconfig = nullptr;
@@ -57,6 +66,8 @@ auto select_config(_In_ vpdo_dev_t &vpdo, _Inout_ _URB_SELECT_CONFIGURATION *r)
 		Trace(TRACE_LEVEL_INFORMATION, "Going to unconfigured state");
 		vpdo.current_intf_num = 0;
 		vpdo.current_intf_alt = 0;
+		vpdo.current_config = 0;
+		RtlZeroMemory(vpdo.intf_alt, sizeof(vpdo.intf_alt));
 		return STATUS_SUCCESS;
 	}
 
@@ -69,11 +80,19 @@ auto select_config(_In_ vpdo_dev_t &vpdo, _Inout_ _URB_SELECT_CONFIGURATION *r)
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	auto status = setup_config(r, vpdo.speed);
+	vpdo.actindex = make_config_index(*vpdo.actconfig, vpdo.speed);
+	if (!vpdo.actindex) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	auto status = setup_config(r, *vpdo.actindex);
 
 	if (NT_SUCCESS(status)) {
 		r->ConfigurationHandle = (USBD_CONFIGURATION_HANDLE)(0x100 | cd->bConfigurationValue);
 
+		vpdo.current_config = cd->bConfigurationValue;
+		RtlZeroMemory(vpdo.intf_alt, sizeof(vpdo.intf_alt));
+
 		char buf[SELECT_CONFIGURATION_STR_BUFSZ];
 		Trace(TRACE_LEVEL_INFORMATION, "%s", select_configuration_str(buf, sizeof(buf), r));
 	}
@@ -101,13 +120,13 @@ NTSTATUS urb_select_configuration(_In_ wsk_context &ctx, _Inout_ URB &urb)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto select_interface(vpdo_dev_t &vpdo, _URB_SELECT_INTERFACE *r)
 {
-	if (!vpdo.actconfig) {
+	if (!vpdo.actindex) {
 		Trace(TRACE_LEVEL_ERROR, "Device is unconfigured");
 		return STATUS_INVALID_DEVICE_REQUEST;
 	}
 
 	auto &iface = r->Interface;
-	auto status = setup_intf(&iface, vpdo.speed, vpdo.actconfig);
+	auto status = setup_intf(&iface, *vpdo.actindex);
 
 	if (NT_SUCCESS(status)) {
 		char buf[SELECT_INTERFACE_STR_BUFSZ];
@@ -115,6 +134,16 @@ auto select_interface(vpdo_dev_t &vpdo, _URB_SELECT_INTERFACE *r)
 
 		vpdo.current_intf_num = iface.InterfaceNumber;
 		vpdo.current_intf_alt = iface.AlternateSetting;
+
+		for (ULONG i = 0; i < iface.NumberOfPipes; ++i) { // the server frees streams
+			vpdo.open_streams[get_endpoint_index(iface.Pipes[i].PipeHandle)] = 0;
+		}
+
+		if (iface.InterfaceNumber < ARRAYSIZE(vpdo.intf_alt)) {
+			vpdo.intf_alt[iface.InterfaceNumber] = iface.AlternateSetting;
+		} else {
+			Trace(TRACE_LEVEL_WARNING, "InterfaceNumber %d will not be restored after reconnect", iface.InterfaceNumber);
+		}
 	}
 
 	return status;
@@ -140,7 +169,7 @@ NTSTATUS urb_select_interface(_In_ wsk_context &ctx, _Inout_ URB &urb)
 		auto ifnum = urb.UrbSelectInterface.Interface.InterfaceNumber;
 
 		Trace(TRACE_LEVEL_WARNING, "Ignoring EP0 %s, usbip status %d, InterfaceNumber %d, num_altsetting %d",
-			get_usbd_status(err), ret.status, ifnum, get_intf_num_altsetting(vpdo.actconfig, ifnum));
+			get_usbd_status(err), ret.status, ifnum, vpdo.actindex ? get_num_altsetting(*vpdo.actindex, ifnum) : 0);
 
 		err = USBD_STATUS_SUCCESS;
 	}
@@ -366,12 +395,12 @@ NTSTATUS urb_isoch_transfer(_In_ wsk_context &ctx, _Inout_ URB &urb)
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
+	auto start_frame = sync(ctx.vpdo->bus_time, ret.start_frame);
+
 	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+		r.StartFrame = start_frame;
 	}
 
-	ctx.vpdo->current_frame_number = ret.start_frame;
-
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
 		NT_ASSERT(r.NumberOfPackets == number_of_packets(ctx));
 		byteswap(ctx.isoc, cnt);
@@ -380,6 +409,10 @@ NTSTATUS urb_isoch_transfer(_In_ wsk_context &ctx, _Inout_ URB &urb)
 		return STATUS_INVALID_PARAMETER;
 	}
 
+	if (r.Hdr.Status != USBD_STATUS_ISOCH_REQUEST_FAILED) {
+		path_delay_sample(*ctx.vpdo, ctx.irp, r, start_frame);
+	}
+
 	char *buf{};
 
 	if (is_transfer_direction_in(ctx.hdr)) { // TransferFlags can have wrong direction
@@ -419,7 +452,7 @@ NTSTATUS urb_function_unexpected(_In_ wsk_context&, _Inout_ URB &urb)
 
 using urb_function_t = NTSTATUS(_In_ wsk_context&, _Inout_ URB&);
 
-urb_function_t* const urb_functions[] =
+constexpr urb_function_t* urb_functions[] =
 {
 	urb_select_configuration,
 	urb_select_interface,
@@ -509,6 +542,9 @@ urb_function_t* const urb_functions[] =
 
 	urb_function_unexpected // URB_FUNCTION_GET_ISOCH_PIPE_TRANSFER_PATH_DELAYS
 };
+static_assert(check_urb_handlers(urb_functions, URB_RESERVED, nullptr));
+static_assert(check_urb_handlers(urb_functions, URB_LOCAL, urb_function_unexpected));
+static_assert(check_urb_handlers(urb_functions, URB_ISOCH, urb_isoch_transfer));
 
 /*
 if (urb.UrbHeader.Status == EndpointStalled && ctx.irp) {
@@ -558,7 +594,7 @@ NTSTATUS usb_reset_port(const usbip_header_ret_submit &ret)
  * @see internal_ioctl.cpp, send_complete 
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void complete(_Inout_ IRP* &irp, _In_ NTSTATUS status)
+void complete(_Inout_ vpdo_dev_t &vpdo, _Inout_ IRP* &irp, _In_ NTSTATUS status)
 {
 	NT_ASSERT(irp);
 	auto &st = irp->IoStatus;
@@ -571,7 +607,9 @@ void complete(_Inout_ IRP* &irp, _In_ NTSTATUS status)
 	auto old_status = atomic_set_status(irp, ST_RECV_COMPLETE);
 	NT_ASSERT(old_status != ST_IRP_CANCELED);
 
-	if (old_status == ST_SEND_COMPLETE) {
+	if (old_status != ST_SEND_COMPLETE) {
+		// send_complete will complete it
+	} else if (!jitter_hold(vpdo, irp)) {
 		TraceDbg("irp %04x, %!STATUS!, Information %#Ix", ptr4log(irp), st.Status, st.Information);
 		IoCompleteRequest(irp, IO_NO_INCREMENT);
 	}
@@ -602,7 +640,7 @@ NTSTATUS ret_submit(_Inout_ wsk_context &ctx)
 		Trace(TRACE_LEVEL_ERROR, "Unexpected IoControlCode %s(%#08lX)", internal_device_control_name(ioctl), ioctl);
 	}
 
-	complete(irp, st);
+	complete(*ctx.vpdo, irp, st);
 	return RECV_NEXT_USBIP_HDR;
 }
 
@@ -727,9 +765,14 @@ NTSTATUS on_receive(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inex
 	TraceWSK("wsk irp %04x, %!STATUS!, Information %Iu", ptr4log(wsk_irp), st.Status, st.Information);
 
 	auto ok = NT_SUCCESS(st.Status);
+	auto lost = !(ok && st.Information == vpdo->receive_size); // otherwise received() has failed
+
+	if (!lost) {
+		delivered(vpdo->rx_bdp, st.Information, KeQueryInterruptTime());
+	}
 
-	auto err = ok && st.Information == vpdo->receive_size ? vpdo->received(ctx) :
-		   ok ? STATUS_RECEIVE_PARTIAL : 
+	auto err = !lost ? vpdo->received(ctx) :
+		   ok ? STATUS_RECEIVE_PARTIAL : // the peer has closed the connection
 		   st.Status; // has nonzero severity code
 
 	switch (err) {
@@ -744,17 +787,165 @@ NTSTATUS on_receive(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inex
 		free_drain_buffer(ctx);
 	} else if (auto &irp = ctx.irp) {
 		NT_ASSERT(vpdo->received != ret_submit); // never fails
-		complete(irp, STATUS_CANCELLED);
+		complete(*vpdo, irp, STATUS_CANCELLED);
 	}
 	NT_ASSERT(!ctx.irp);
 
-	TraceMsg("vpdo %04x: unplugging after %!STATUS!", ptr4log(vpdo), NT_SUCCESS(st.Status) ? err : st.Status);
-	vhub_unplug_vpdo(vpdo);
+	TraceMsg("vpdo %04x: %s after %!STATUS!", ptr4log(vpdo), lost ? "connection lost" : "unplugging", err);
+
+	if (lost) {
+		connection_lost(*vpdo);
+	} else {
+		vhub_unplug_vpdo(vpdo);
+	}
 
 	free(&ctx, true);
+	KeSetEvent(&vpdo->recv_stopped, IO_NO_INCREMENT, false);
+
 	return StopCompletion;
 }
 
+/*
+ * @param completion is called in any case
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void post_receive(_In_ WSK_BUF &buf, _In_ wsk_context &ctx, _In_ IO_COMPLETION_ROUTINE *completion)
+{
+	auto &vpdo = *ctx.vpdo;
+	reuse(ctx);
+
+	auto wsk_irp = ctx.wsk_irp; // do not access ctx or wsk_irp after send
+
+	if (!acquire_socket(vpdo)) { // the connection is being reestablished, stop the loop
+		wsk_irp->IoStatus.Status = STATUS_CONNECTION_ABORTED;
+		wsk_irp->IoStatus.Information = 0;
+		completion(nullptr, wsk_irp, &ctx);
+		return;
+	}
+
+	IoSetCompletionRoutine(wsk_irp, completion, &ctx, true, true, true);
+
+	auto err = receive(vpdo.sock, &buf, WSK_FLAG_WAITALL, wsk_irp);
+	NT_ASSERT(err != STATUS_NOT_SUPPORTED);
+
+	release_socket(vpdo);
+	TraceWSK("wsk irp %04x, %!STATUS!", ptr4log(wsk_irp), err);
+}
+
+/*
+ * Encrypted data channel, see crypto.cpp.
+ * The result is passed to on_receive as if the socket has received vpdo.receive_size bytes.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_receive(_In_ wsk_context &ctx, _In_ NTSTATUS status)
+{
+	auto wsk_irp = ctx.wsk_irp;
+	auto &st = wsk_irp->IoStatus;
+
+	st.Status = status;
+	st.Information = status == STATUS_SUCCESS ? ctx.vpdo->receive_size : 0;
+
+	on_receive(nullptr, wsk_irp, &ctx);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto check_received(_In_ const IO_STATUS_BLOCK &st, _In_ ULONG expected)
+{
+	TraceWSK("%!STATUS!, Information %Iu", st.Status, st.Information);
+
+	return !NT_SUCCESS(st.Status) ? st.Status :
+		st.Information == expected ? STATUS_SUCCESS : 
+		STATUS_RECEIVE_PARTIAL; // the peer has closed the connection
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void receive_record(_In_ wsk_context &ctx);
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_record(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+	auto &ctx = *static_cast<wsk_context*>(Context);
+	auto &s = *ctx.vpdo->crypto;
+
+	auto err = check_received(wsk_irp->IoStatus, RtlUlongByteSwap(s.rx_hdr) + CRYPTO_TAG_SIZE);
+
+	if (!err) {
+		err = open_record(s);
+	}
+
+	if (!err) {
+		err = read_plaintext(s, s.rx_dst);
+	}
+
+	if (err || !s.rx_dst.Length) {
+		complete_receive(ctx, err);
+	} else {
+		receive_record(ctx); // the PDU spans records
+	}
+
+	return StopCompletion;
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_record_hdr(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+	auto &ctx = *static_cast<wsk_context*>(Context);
+	auto &s = *ctx.vpdo->crypto;
+
+	WSK_BUF buf;
+	auto err = check_received(wsk_irp->IoStatus, CRYPTO_HDR_SIZE);
+
+	if (!err) {
+		err = prepare_record(s, buf);
+	}
+
+	if (err) {
+		complete_receive(ctx, err);
+	} else {
+		post_receive(buf, ctx, on_record);
+	}
+
+	return StopCompletion;
+}
+
+/*
+ * Receives the next record for the rest of s.rx_dst.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void receive_record(_In_ wsk_context &ctx)
+{
+	auto &s = *ctx.vpdo->crypto;
+	NT_ASSERT(!s.rx_len);
+
+	WSK_BUF hdr{ s.mdl_rx_hdr.get(), 0, CRYPTO_HDR_SIZE };
+	post_receive(hdr, ctx, on_record_hdr);
+}
+
+/*
+ * The plaintext that is left in the current record is used first, the next record is received if it is not enough.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void receive_record(_In_ WSK_BUF &buf, _In_ wsk_context &ctx)
+{
+	auto &s = *ctx.vpdo->crypto;
+	s.rx_dst = buf;
+
+	if (s.rx_len) {
+		if (auto err = read_plaintext(s, s.rx_dst); err || !s.rx_dst.Length) {
+			reuse(ctx);
+			complete_receive(ctx, err);
+			return;
+		}
+	}
+
+	receive_record(ctx);
+}
+
 /*
  * @param received will be called if requested number of bytes are received without error
  */
@@ -770,15 +961,11 @@ void receive(_In_ WSK_BUF &buf, _In_ vpdo_dev_t::received_fn received, _In_ wsk_
 	NT_ASSERT(received);
 	vpdo.received = received;
 
-	reuse(ctx);
-
-	auto wsk_irp = ctx.wsk_irp; // do not access ctx or wsk_irp after send
-	IoSetCompletionRoutine(wsk_irp, on_receive, &ctx, true, true, true);
-
-	auto err = receive(ctx.vpdo->sock, &buf, WSK_FLAG_WAITALL, wsk_irp);
-	NT_ASSERT(err != STATUS_NOT_SUPPORTED);
-
-	TraceWSK("wsk irp %04x, %!STATUS!", ptr4log(wsk_irp), err);
+	if (vpdo.crypto) {
+		receive_record(buf, ctx);
+	} else {
+		post_receive(buf, ctx, on_receive);
+	}
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -845,7 +1032,10 @@ _Function_class_(vpdo_dev_t::received_fn)
 NTSTATUS ret_command(_Inout_ wsk_context &ctx)
 {
 	auto &hdr = ctx.hdr; // IRP must be completed
-	ctx.irp = hdr.base.command == USBIP_RET_SUBMIT ? dequeue_irp(*ctx.vpdo, hdr.base.seqnum) : nullptr;
+	auto submit = hdr.base.command == USBIP_RET_SUBMIT;
+
+	ctx.irp = submit ? dequeue_irp(*ctx.vpdo, hdr.base.seqnum) : nullptr;
+	heartbeat_received(*ctx.vpdo, submit && !ctx.irp ? hdr.base.seqnum : 0); // a probe has no IRP
 
 	{
 		char buf[DBG_USBIP_HDR_BUFSZ];
@@ -898,12 +1088,35 @@ auto validate_header(_Inout_ usbip_header &hdr)
 	return ok;
 }
 
+/*
+ * SO_RCVBUF follows vpdo.rx_bdp.
+ */
+_IRQL_requires_(PASSIVE_LEVEL)
+void tune_rcvbuf(_Inout_ vpdo_dev_t &vpdo)
+{
+	auto bytes = vpdo.rx_bdp.window;
+
+	if (bytes == vpdo.rcvbuf || !acquire_socket(vpdo)) {
+		return;
+	}
+
+	if (auto err = set_rcvbuf(vpdo.sock, bytes)) {
+		Trace(TRACE_LEVEL_WARNING, "vpdo %04x, SO_RCVBUF %lu, %!STATUS!", ptr4log(&vpdo), bytes, err);
+	} else {
+		TraceDbg("vpdo %04x, SO_RCVBUF %lu", ptr4log(&vpdo), bytes);
+	}
+
+	release_socket(vpdo);
+	vpdo.rcvbuf = bytes; // do not retry on error
+}
+
 _Function_class_(IO_WORKITEM_ROUTINE)
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 void receive_usbip_header(_In_ DEVICE_OBJECT*, _In_opt_ void *Context)
 {
 	auto &ctx = *static_cast<wsk_context*>(Context);
+	tune_rcvbuf(*ctx.vpdo);
 
 	NT_ASSERT(!ctx.irp); // must be completed and zeroed on every cycle
 	ctx.mdl_buf.reset();
@@ -928,7 +1141,7 @@ NTSTATUS WskDisconnectEvent(_In_opt_ PVOID SocketContext, _In_ ULONG Flags)
 	auto vpdo = static_cast<vpdo_dev_t*>(SocketContext);
 	TraceMsg("vpdo %04x, Flags %#x", ptr4log(vpdo), Flags);
 
-	vhub_unplug_vpdo(vpdo);
+	connection_lost(*vpdo);
 	return STATUS_SUCCESS;
 }
 
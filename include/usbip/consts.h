@@ -13,7 +13,8 @@ enum op_status_t // op_common.status
 /* error codes for userspace tools and library */
 enum err_t
 {
-        ERR_USB_VER = -13,
+        ERR_STREAMS = -14, // the server does not know OP_REQ_STREAMS
+        ERR_USB_VER,
         ERR_CERTIFICATE,
         ERR_ACCESS,
         ERR_PORTFULL,
@@ -64,7 +65,7 @@ enum
 constexpr auto make_error(err_t err, op_status_t status = ST_OK)
 {
         static_assert(sizeof(int) == 4);
-        return int(status ? status : err) << 16;
+        return (status ? int(status) : int(err)) << 16;
 }
 
 static_assert(!make_error(ERR_NONE));
@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Wire format of the encrypted data channel that is shared by the driver and the reference peer.
+ * Does not depend on Windows headers, see peer/ and tests/crypto_test.cpp.
+ *
+ * Handshake, both messages are sent in plaintext:
+ *   OP_REQ_CRYPKEY: op_common, random nonce of the client, CRYPTO_NONCE_SIZE bytes
+ *   OP_REP_CRYPKEY: op_common, random nonce of the server, CRYPTO_NONCE_SIZE bytes
+ * The transcript is both messages in the order and the form they are sent.
+ * The key and the salt of each direction are HMAC-SHA256(psk, label || transcript),
+ * the first USBIP_KEY_SIZE bytes are the AES-128-GCM key, the next CRYPTO_SALT_SIZE bytes are the salt.
+ *
+ * Everything after OP_REP_CRYPKEY, OP_REQ_IMPORT and OP_REP_IMPORT too, is a byte stream that is sent in records:
+ *   length of plaintext, UINT32 in network byte order, [1..CRYPTO_MAX_RECORD]
+ *   ciphertext
+ *   tag, CRYPTO_TAG_SIZE bytes
+ * The IV is the salt and the big-endian sequence number of the record in the direction, it is never sent.
+ * A record carries any part of the stream, a PDU can span records.
+ *
+ * The first record that passes the tag check proves that the peer has the same key and the same transcript.
+ * Neither side uses the import exchange before that, a peer closes the connection if a record fails the check.
+ */
+
+enum {
+        USBIP_KEY_SIZE = 16, // AES-128
+        CRYPTO_NONCE_SIZE = 16,
+        CRYPTO_HELLO_SIZE = 8 + CRYPTO_NONCE_SIZE, // op_common and the nonce
+        CRYPTO_TRANSCRIPT_SIZE = 2*CRYPTO_HELLO_SIZE,
+        CRYPTO_SALT_SIZE = 4,
+        CRYPTO_IV_SIZE = CRYPTO_SALT_SIZE + 8,
+        CRYPTO_HDR_SIZE = 4,
+        CRYPTO_TAG_SIZE = 16,
+        CRYPTO_MAX_RECORD = 32*1024*1024, // plaintext
+};
+
+inline constexpr char crypto_label_c2s[] = "usbip c2s"; // client to server, the terminating null is not used
+inline constexpr char crypto_label_s2c[] = "usbip s2c";
+
+enum { CRYPTO_LABEL_SIZE = sizeof(crypto_label_c2s) - 1 };
+static_assert(sizeof(crypto_label_s2c) - 1 == CRYPTO_LABEL_SIZE);
+
+constexpr void make_crypto_iv(
+        unsigned char (&iv)[CRYPTO_IV_SIZE], const unsigned char (&salt)[CRYPTO_SALT_SIZE], unsigned long long seq)
+{
+        for (int i = 0; i < CRYPTO_SALT_SIZE; ++i) {
+                iv[i] = salt[i];
+        }
+
+        for (int i = CRYPTO_IV_SIZE - 1; i >= CRYPTO_SALT_SIZE; --i, seq >>= 8) {
+                iv[i] = static_cast<unsigned char>(seq);
+        }
+}
@@ -60,6 +60,12 @@ struct usbip_header_basic {
 
 /*
 * An additional header for a CMD_SUBMIT packet.
+*
+* USB 3 bulk streams extension, Linux usbip has no stream_id in CMD_SUBMIT.
+* It is used only if the server confirms it by OP_REP_STREAMS, see proto_op.h.
+* start_frame of bulk CMD_SUBMIT is ignored by Linux, it carries urb->stream_id, zero if none.
+* The server allocates streams of an endpoint by usb_alloc_streams when it gets the first
+* nonzero stream ID for it, and frees them on SET_CONFIGURATION and SET_INTERFACE.
 */
 struct usbip_header_cmd_submit {
 	/* these values are basically the same as in a URB. */
@@ -72,7 +78,7 @@ struct usbip_header_cmd_submit {
 	INT32	transfer_buffer_length;
 
 	/* it is difficult for usbip to sync frames (reserved only?) */
-	INT32	start_frame;
+	INT32	start_frame; /* or stream ID of bulk transfer, see above */
 
 	/* the number of iso descriptors that follows this header */
 	INT32	number_of_packets;
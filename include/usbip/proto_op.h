@@ -133,20 +133,55 @@ struct op_unexport_reply {
 } while (0)
 
 /* ---------------------------------------------------------------------- */
-/* Negotiate IPSec encryption key. (still not used) */
+/*
+ * Negotiate session keys of the data channel before OP_REQ_IMPORT.
+ * Both sides must have the same pre-shared key, the nonces are random.
+ * OP_REQ_IMPORT and the rest of the connection are encrypted, see crypto_wire.h.
+ */
 #define OP_CRYPKEY	0x04
 #define OP_REQ_CRYPKEY	(OP_REQUEST | OP_CRYPKEY)
 #define OP_REP_CRYPKEY	(OP_REPLY   | OP_CRYPKEY)
 
 struct op_crypkey_request {
-        /* 128bit key */
+        /* 128bit nonce of the client */
         UINT32 key[4];
 };
 
 struct op_crypkey_reply {
-        UINT32 _reserved;
+        /* 128bit nonce of the server */
+        UINT32 key[4];
+};
+
+
+/* ---------------------------------------------------------------------- */
+/*
+ * Ask whether the server supports USB 3 bulk streams extension, see usbip_header_cmd_submit.
+ * It is sent after OP_REP_CRYPKEY and before OP_REQ_IMPORT, only if the client is asked to use streams.
+ * The server replies ST_OK and the same version if it supports the extension, ST_NA otherwise.
+ * Linux usbipd closes the connection on the unknown code, the client connects again without streams.
+ */
+#define OP_STREAMS	0x08
+#define OP_REQ_STREAMS	(OP_REQUEST | OP_STREAMS)
+#define OP_REP_STREAMS	(OP_REPLY   | OP_STREAMS)
+
+enum { USBIP_STREAMS_VERSION = 1 };
+
+struct op_streams_request {
+        UINT32 version; /* USBIP_STREAMS_VERSION */
 };
 
+struct op_streams_reply {
+        UINT32 version;
+};
+
+#define PACK_OP_STREAMS_REQUEST(pack, request)  do {\
+	usbip_net_pack_uint32_t(pack, &(request)->version);	\
+} while (0)
+
+#define PACK_OP_STREAMS_REPLY(pack, reply)  do {\
+	usbip_net_pack_uint32_t(pack, &(reply)->version);	\
+} while (0)
+
 
 /* ---------------------------------------------------------------------- */
 /* Retrieve the list of exported USB devices. */
@@ -14,58 +14,8 @@
 #include "ch9.h"
 #include "consts.h"
 #include "proto.h"
-
-enum hci_version { HCI_USB2, HCI_USB3 };
-inline const hci_version vhci_list[] { HCI_USB2, HCI_USB3 };
-
-enum { 
-        VHUB_NUM_PORTS = 30, // see ch11.h, USB_MAXCHILDREN
-        USBIP_TOTAL_PORTS = ARRAYSIZE(vhci_list)*VHUB_NUM_PORTS
-};
-
-constexpr auto is_valid_rhport(int port) // root hub port
-{
-        return port > 0 && port <= VHUB_NUM_PORTS;
-}
-
-constexpr auto is_valid_vport(int port) // virtual port
-{
-        return port > 0 && port <= USBIP_TOTAL_PORTS;
-}
-
-
-constexpr auto get_hci_version(int vport) // [1..USBIP_TOTAL_PORTS]
-{
-        return hci_version(--vport/VHUB_NUM_PORTS);
-}
-static_assert(get_hci_version(1) == HCI_USB2);
-static_assert(get_hci_version(VHUB_NUM_PORTS) == HCI_USB2);
-static_assert(get_hci_version(VHUB_NUM_PORTS + 1) == HCI_USB3);
-static_assert(get_hci_version(USBIP_TOTAL_PORTS) == HCI_USB3);
-
-
-constexpr auto get_rhport(int vport) // [1..USBIP_TOTAL_PORTS]
-{
-        return --vport % VHUB_NUM_PORTS + 1;
-}
-static_assert(get_rhport(1) == 1);
-static_assert(get_rhport(VHUB_NUM_PORTS) == VHUB_NUM_PORTS);
-static_assert(get_rhport(VHUB_NUM_PORTS + 1) == 1);
-static_assert(get_rhport(USBIP_TOTAL_PORTS) == VHUB_NUM_PORTS);
-
-
-constexpr auto make_vport(hci_version version, int rhport) // [1..VHUB_NUM_PORTS]
-{
-        return int(VHUB_NUM_PORTS)*version + rhport;
-}
-static_assert(make_vport(HCI_USB3, VHUB_NUM_PORTS) == USBIP_TOTAL_PORTS);
-
-static_assert(get_hci_version(make_vport(HCI_USB2, VHUB_NUM_PORTS)) == HCI_USB2);
-static_assert(get_hci_version(make_vport(HCI_USB3, VHUB_NUM_PORTS)) == HCI_USB3);
-
-static_assert(get_rhport(make_vport(HCI_USB2, VHUB_NUM_PORTS)) == VHUB_NUM_PORTS);
-static_assert(get_rhport(make_vport(HCI_USB3, VHUB_NUM_PORTS)) == VHUB_NUM_PORTS);
-
+#include "vport.h"
+#include "crypto_wire.h"
 
 DEFINE_GUID(GUID_DEVINTERFACE_EHCI_USBIP,
         0xB8B60941, 0xCACB, 0x454A, 0xA8, 0xD1, 0x35, 0xAC, 0xB8, 0xFA, 0x1F, 0x1E);
@@ -90,6 +40,9 @@ enum {
         IOCTL_USBIP_VHCI_PLUGIN_HARDWARE      = USBIP_VHCI_IOCTL(0),
         IOCTL_USBIP_VHCI_UNPLUG_HARDWARE      = USBIP_VHCI_IOCTL(1),
         IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES = USBIP_VHCI_IOCTL(2),
+        IOCTL_USBIP_VHCI_PLUGIN_HARDWARE_BATCH = USBIP_VHCI_IOCTL(3),
+        IOCTL_USBIP_VHCI_GET_PORT_CHANGES     = USBIP_VHCI_IOCTL(4),
+        IOCTL_USBIP_VHCI_GET_NUM_PORTS        = USBIP_VHCI_IOCTL(5),
 };
 
 struct ioctl_usbip_vhci_plugin
@@ -99,8 +52,54 @@ struct ioctl_usbip_vhci_plugin
         char service[32]; // NI_MAXSERV
         char host[1025];  // NI_MAXHOST in ws2def.h
         char serial[255];
+        unsigned short reconnect; // seconds to keep the device and reconnect on connection loss, zero to unplug at once
+        unsigned int segment_size; // bulk transfers that are longer are split into pipelined CMD_SUBMITs, zero to disable
+        unsigned int segment_endpoints; // OUT endpoints for which segment_size is used, see segment_endpoint_bit
+        unsigned short jitter_delay; // ms, minimal delay of isoch IN completions, zero to disable
+        unsigned short jitter_endpoints; // bit per isoch IN endpoint number for which jitter_delay is used
+        unsigned short max_urbs; // in flight per device, excess URBs wait; zero if unlimited
+        unsigned int max_bytes; // in flight per device, sum of TransferBufferLength; zero if unlimited
+        unsigned short ep_max_urbs; // the same per endpoint
+        unsigned int ep_max_bytes;
+        unsigned char key[USBIP_KEY_SIZE]; // pre-shared, the data channel is encrypted unless all zeros; not returned
+        unsigned int window_min; // bytes, bounds of send window and SO_RCVBUF that follow bandwidth-delay product
+        unsigned int window_max; // zero to disable
+        unsigned short heartbeat; // ms of idle link before a probe, zero to disable, see heartbeat.cpp
+        unsigned short heartbeat_misses; // probes in a row without reply before the connection is lost, default if zero
+        bool streams; // use USB 3 bulk streams extension if the server supports it, see OP_REQ_STREAMS
+};
+
+enum { USBIP_SEGMENT_ALIGN = 1024 }; // segment_size is rounded down to a multiple, wMaxPacketSize of any bulk endpoint divides it
+
+constexpr auto segment_endpoint_bit(unsigned char bEndpointAddress)
+{
+        auto dir_in = bEndpointAddress & 0x80; // USB_ENDPOINT_DIRECTION_MASK
+        return 1U << ((bEndpointAddress & 0xF) | (dir_in ? 16 : 0));
+}
+static_assert(segment_endpoint_bit(0x01) == 1U << 1);
+static_assert(segment_endpoint_bit(0x8F) == 1U << 31);
+
+enum {
+        USBIP_PLUGIN_BATCH_MAX = 30, // entries, a batch is sent to one hub
+        USBIP_PLUGIN_BATCH_PARALLELISM = 8, // default and maximum number of concurrent imports
 };
 
+/*
+ * The same buffer is used for output, the port of each entry is set as for IOCTL_USBIP_VHCI_PLUGIN_HARDWARE.
+ * The request is pending until all entries are processed.
+ */
+struct ioctl_usbip_vhci_plugin_batch
+{
+        int count; // [1..USBIP_PLUGIN_BATCH_MAX]
+        int parallelism; // [1..USBIP_PLUGIN_BATCH_PARALLELISM], default if <= 0
+        ioctl_usbip_vhci_plugin entries[1]; // count
+};
+
+constexpr auto plugin_batch_size(int count)
+{
+        return offsetof(ioctl_usbip_vhci_plugin_batch, entries) + count*sizeof(ioctl_usbip_vhci_plugin);
+}
+
 struct ioctl_usbip_vhci_imported_dev : ioctl_usbip_vhci_plugin
 {
         usbip_device_status status;
@@ -108,9 +107,45 @@ struct ioctl_usbip_vhci_imported_dev : ioctl_usbip_vhci_plugin
         unsigned short product;
         UINT32 devid;
         usb_device_speed speed;
+        unsigned int rtt; // us, smoothed by heartbeat, zero if unknown
+        unsigned int rttvar; // us
+};
+
+enum port_change_event
+{
+        PORT_CHANGE_SYNC, // changes up to this generation are lost, re-read imported devices
+        PORT_CHANGE_ATTACHED,
+        PORT_CHANGE_DETACHED
+};
+
+struct ioctl_usbip_vhci_port_change
+{
+        UINT32 generation; // of HCI, increments on every change
+        int port; // [1..USBIP_TOTAL_PORTS], zero for PORT_CHANGE_SYNC
+        port_change_event event;
+};
+
+enum : UINT32 { USBIP_PORT_CHANGES_SYNC = UINT32(-1) };
+
+/*
+ * Input is the last seen generation, output is ioctl_usbip_vhci_port_change[] that follow it.
+ * The request is pending while there are no such changes.
+ * USBIP_PORT_CHANGES_SYNC completes at once with PORT_CHANGE_SYNC for the current generation.
+ */
+struct ioctl_usbip_vhci_get_port_changes
+{
+        UINT32 generation;
 };
 
 struct ioctl_usbip_vhci_unplug
 {
         int port; // [1..USBIP_TOTAL_PORTS] or all ports if <= 0
 };
+
+/*
+ * IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES returns at most num_ports records and the end mark.
+ */
+struct ioctl_usbip_vhci_num_ports
+{
+        int num_ports; // of HCI, [1..VHCI_MAX_PORTS]
+};
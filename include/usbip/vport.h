@@ -0,0 +1,118 @@
+#pragma once
+
+/*
+ * Port numbering that is shared by the driver and userspace.
+ * Does not depend on Windows headers, see tests/vport_test.cpp.
+ */
+
+enum hci_version { HCI_USB2, HCI_USB3 };
+inline const hci_version vhci_list[] { HCI_USB2, HCI_USB3 };
+
+/*
+ * The number of ports of each HCI is read from the registry when the driver is loaded, see vhci.cpp.
+ * The ports are spread over as many root hubs as needed, see vhub_max_ports.
+ *
+ * rhport is a port of HCI, [1..num_ports], it is not limited by the number of ports of a hub.
+ * Hub port is a port of one of the root hubs, [1..vhub_max_ports].
+ */
+enum {
+        VHCI_MAX_PORTS = 1020, // of each HCI, multiple of VHUB_MAX_PORTS and VHUB_SS_MAX_PORTS
+        VHCI_DEFAULT_PORTS = 30, // the number of ports before it became configurable
+        VHUB_MAX_PORTS = 255, // USB_HUB_DESCRIPTOR.bNumberOfPorts is UCHAR
+        VHUB_SS_MAX_PORTS = 15, // USB_SS_MAXPORTS, USB_30_HUB_DESCRIPTOR.DeviceRemovable is USHORT
+        VHCI_MAX_HUBS = VHCI_MAX_PORTS/VHUB_SS_MAX_PORTS,
+
+        USBIP_TOTAL_PORTS = sizeof(vhci_list)/sizeof(*vhci_list)*VHCI_MAX_PORTS,
+        USBIP_COMPAT_PORTS = sizeof(vhci_list)/sizeof(*vhci_list)*VHCI_DEFAULT_PORTS, // see make_vport
+};
+
+static_assert(VHCI_MAX_PORTS % VHUB_MAX_PORTS == 0);
+static_assert(VHCI_MAX_PORTS % VHUB_SS_MAX_PORTS == 0);
+
+constexpr auto is_valid_rhport(int port)
+{
+        return port > 0 && port <= VHCI_MAX_PORTS;
+}
+
+constexpr auto is_valid_vport(int port) // virtual port
+{
+        return port > 0 && port <= USBIP_TOTAL_PORTS;
+}
+
+/*
+ * Virtual ports are unique across HCIs. The first VHCI_DEFAULT_PORTS of each HCI keep the numbers
+ * they had before the number of ports became configurable (USB2 1..30, USB3 31..60),
+ * the next ones of USB2 follow, then the next ones of USB3.
+ */
+constexpr auto make_vport(hci_version version, int rhport) // [1..VHCI_MAX_PORTS]
+{
+        return rhport <= VHCI_DEFAULT_PORTS ?
+                int(VHCI_DEFAULT_PORTS)*version + rhport :
+                USBIP_COMPAT_PORTS + (VHCI_MAX_PORTS - VHCI_DEFAULT_PORTS)*version + rhport - VHCI_DEFAULT_PORTS;
+}
+
+constexpr auto get_hci_version(int vport) // [1..USBIP_TOTAL_PORTS]
+{
+        return hci_version(vport <= USBIP_COMPAT_PORTS ?
+                           (vport - 1)/VHCI_DEFAULT_PORTS :
+                           (vport - USBIP_COMPAT_PORTS - 1)/(VHCI_MAX_PORTS - VHCI_DEFAULT_PORTS));
+}
+
+constexpr auto get_rhport(int vport) // [1..USBIP_TOTAL_PORTS]
+{
+        return vport <= USBIP_COMPAT_PORTS ?
+                (vport - 1) % VHCI_DEFAULT_PORTS + 1 :
+                (vport - USBIP_COMPAT_PORTS - 1) % (VHCI_MAX_PORTS - VHCI_DEFAULT_PORTS) + VHCI_DEFAULT_PORTS + 1;
+}
+
+static_assert(make_vport(HCI_USB2, 1) == 1);
+static_assert(make_vport(HCI_USB2, VHCI_DEFAULT_PORTS) == VHCI_DEFAULT_PORTS);
+static_assert(make_vport(HCI_USB3, 1) == VHCI_DEFAULT_PORTS + 1);
+static_assert(make_vport(HCI_USB3, VHCI_DEFAULT_PORTS) == USBIP_COMPAT_PORTS);
+static_assert(make_vport(HCI_USB2, VHCI_DEFAULT_PORTS + 1) == USBIP_COMPAT_PORTS + 1);
+static_assert(make_vport(HCI_USB3, VHCI_MAX_PORTS) == USBIP_TOTAL_PORTS);
+
+static_assert(get_hci_version(make_vport(HCI_USB3, 1)) == HCI_USB3);
+static_assert(get_rhport(make_vport(HCI_USB3, 1)) == 1);
+static_assert(get_hci_version(make_vport(HCI_USB2, VHCI_MAX_PORTS)) == HCI_USB2);
+static_assert(get_rhport(make_vport(HCI_USB2, VHCI_MAX_PORTS)) == VHCI_MAX_PORTS);
+
+
+constexpr auto vhub_max_ports(hci_version version)
+{
+        return version == HCI_USB3 ? int(VHUB_SS_MAX_PORTS) : int(VHUB_MAX_PORTS);
+}
+
+constexpr auto vhci_num_hubs(hci_version version, int num_ports) // of HCI
+{
+        auto n = vhub_max_ports(version);
+        return (num_ports + n - 1)/n;
+}
+
+constexpr auto vhub_num_ports(hci_version version, int num_ports, int hub) // [0..vhci_num_hubs)
+{
+        auto n = vhub_max_ports(version);
+        auto left = num_ports - hub*n;
+        return left < n ? left : n;
+}
+
+constexpr auto get_hub_index(hci_version version, int rhport)
+{
+        return (rhport - 1)/vhub_max_ports(version);
+}
+
+constexpr auto get_hub_port(hci_version version, int rhport)
+{
+        return (rhport - 1) % vhub_max_ports(version) + 1;
+}
+
+constexpr auto make_rhport(hci_version version, int hub, int port) // port of the hub
+{
+        return hub*vhub_max_ports(version) + port;
+}
+
+static_assert(vhci_num_hubs(HCI_USB3, VHCI_MAX_PORTS) == VHCI_MAX_HUBS);
+static_assert(vhci_num_hubs(HCI_USB3, VHCI_DEFAULT_PORTS) == 2);
+static_assert(vhci_num_hubs(HCI_USB2, VHCI_DEFAULT_PORTS) == 1);
+static_assert(vhub_num_ports(HCI_USB3, 31, 2) == 1);
+static_assert(make_rhport(HCI_USB3, get_hub_index(HCI_USB3, 16), get_hub_port(HCI_USB3, 16)) == 16);
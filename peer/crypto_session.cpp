@@ -0,0 +1,281 @@
+/*
+ * OpenSSL backend of the encrypted data channel, the driver uses CNG, see driver/vhci/crypto.cpp.
+ */
+#include "crypto_session.h"
+#include <usbip/consts.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <memory>
+#include <string>
+
+namespace
+{
+
+using namespace usbip::crypto;
+
+enum : unsigned { OP_REQ_CRYPKEY = 0x8004, OP_REP_CRYPKEY = 0x0004 }; // see proto_op.h
+
+using cipher_ctx = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
+
+auto new_cipher_ctx()
+{
+        cipher_ctx ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+        if (!ctx) {
+                throw std::bad_alloc();
+        }
+        return ctx;
+}
+
+void check(int ok, const char *what)
+{
+        if (ok != 1) {
+                throw std::runtime_error(what);
+        }
+}
+
+void put_be(unsigned char *p, std::uint32_t val, int size)
+{
+        for (int i = size - 1; i >= 0; --i, val >>= 8) {
+                p[i] = static_cast<unsigned char>(val);
+        }
+}
+
+auto get_be(const unsigned char *p, int size)
+{
+        std::uint32_t val{};
+        for (int i = 0; i < size; ++i) {
+                val = val << 8 | p[i];
+        }
+        return val;
+}
+
+/*
+ * op_common in network byte order and the nonce.
+ */
+auto make_hello(unsigned code, unsigned status, const nonce &n)
+{
+        bytes msg(CRYPTO_HELLO_SIZE);
+        auto p = msg.data();
+
+        put_be(p, USBIP_VERSION, 2);
+        put_be(p + 2, code, 2);
+        put_be(p + 4, status, 4);
+        std::copy(n.begin(), n.end(), p + 8);
+
+        return msg;
+}
+
+void check_hello(std::span<const unsigned char> msg, unsigned code)
+{
+        if (msg.size() != CRYPTO_HELLO_SIZE) {
+                throw std::invalid_argument("handshake message size " + std::to_string(msg.size()));
+        }
+
+        if (auto ver = get_be(msg.data(), 2); ver != USBIP_VERSION) {
+                throw std::runtime_error("version " + std::to_string(ver));
+        }
+
+        if (auto c = get_be(msg.data() + 2, 2); c != code) {
+                throw std::runtime_error("unexpected op code " + std::to_string(c));
+        }
+
+        if (auto st = get_be(msg.data() + 4, 4)) {
+                throw std::runtime_error("encryption is refused, status " + std::to_string(st));
+        }
+}
+
+} // namespace
+
+
+key usbip::crypto::parse_key(std::string_view hex)
+{
+        key k;
+
+        if (hex.size() != 2*k.size()) {
+                throw std::invalid_argument("key must have " + std::to_string(2*k.size()) + " hex digits");
+        }
+
+        auto digit = [] (char c)
+        {
+                if (c >= '0' && c <= '9') return c - '0';
+                if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+                throw std::invalid_argument("key is not in hex");
+        };
+
+        for (size_t i = 0; i < k.size(); ++i) {
+                k[i] = static_cast<unsigned char>(digit(hex[2*i]) << 4 | digit(hex[2*i + 1]));
+        }
+
+        return k;
+}
+
+nonce usbip::crypto::random_nonce()
+{
+        nonce n;
+        check(RAND_bytes(n.data(), int(n.size())), "RAND_bytes");
+        return n;
+}
+
+usbip::crypto::session::~session()
+{
+        OPENSSL_cleanse(m_psk.data(), m_psk.size());
+        OPENSSL_cleanse(&m_tx, sizeof(m_tx));
+        OPENSSL_cleanse(&m_rx, sizeof(m_rx));
+}
+
+bytes usbip::crypto::session::request(const nonce &n)
+{
+        if (m_role != client || !m_transcript.empty()) {
+                throw std::logic_error("request");
+        }
+
+        m_transcript = make_hello(OP_REQ_CRYPKEY, ST_OK, n);
+        return m_transcript;
+}
+
+bytes usbip::crypto::session::reply(std::span<const unsigned char> request, const nonce &n)
+{
+        if (m_role != server || !m_transcript.empty()) {
+                throw std::logic_error("reply");
+        }
+
+        check_hello(request, OP_REQ_CRYPKEY);
+
+        auto msg = make_hello(OP_REP_CRYPKEY, ST_OK, n);
+
+        m_transcript.assign(request.begin(), request.end());
+        m_transcript.insert(m_transcript.end(), msg.begin(), msg.end());
+
+        derive_keys();
+        return msg;
+}
+
+void usbip::crypto::session::finish(std::span<const unsigned char> reply)
+{
+        if (m_role != client || m_transcript.size() != CRYPTO_HELLO_SIZE) {
+                throw std::logic_error("finish");
+        }
+
+        check_hello(reply, OP_REP_CRYPKEY);
+
+        m_transcript.insert(m_transcript.end(), reply.begin(), reply.end());
+        derive_keys();
+}
+
+/*
+ * HMAC-SHA256(psk, label || transcript), the key and the salt are its first bytes.
+ */
+void usbip::crypto::session::derive_keys()
+{
+        static_assert(USBIP_KEY_SIZE + CRYPTO_SALT_SIZE <= 32);
+
+        auto derive = [this] (direction &d, const char (&label)[CRYPTO_LABEL_SIZE + 1])
+        {
+                bytes msg(label, label + CRYPTO_LABEL_SIZE);
+                msg.insert(msg.end(), m_transcript.begin(), m_transcript.end());
+
+                unsigned char okm[32];
+                unsigned int len = sizeof(okm);
+
+                if (!HMAC(EVP_sha256(), m_psk.data(), int(m_psk.size()), msg.data(), msg.size(), okm, &len)) {
+                        throw std::runtime_error("HMAC");
+                }
+
+                std::copy(okm, okm + USBIP_KEY_SIZE, d.key);
+                std::copy(okm + USBIP_KEY_SIZE, okm + USBIP_KEY_SIZE + CRYPTO_SALT_SIZE, d.salt);
+                d.seq = 0;
+
+                OPENSSL_cleanse(okm, sizeof(okm));
+        };
+
+        auto client_dir = m_role == client ? &m_tx : &m_rx;
+        auto server_dir = m_role == client ? &m_rx : &m_tx;
+
+        derive(*client_dir, crypto_label_c2s);
+        derive(*server_dir, crypto_label_s2c);
+
+        m_ready = true;
+}
+
+bytes usbip::crypto::session::seal(std::span<const unsigned char> plaintext)
+{
+        if (!m_ready) {
+                throw std::logic_error("seal: no keys");
+        }
+
+        if (plaintext.empty() || plaintext.size() > CRYPTO_MAX_RECORD) {
+                throw std::invalid_argument("record length " + std::to_string(plaintext.size()));
+        }
+
+        auto len = static_cast<int>(plaintext.size());
+
+        bytes rec(CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE);
+        put_be(rec.data(), len, CRYPTO_HDR_SIZE);
+
+        unsigned char iv[CRYPTO_IV_SIZE];
+        make_crypto_iv(iv, m_tx.salt, m_tx.seq);
+
+        auto ctx = new_cipher_ctx();
+        auto out = rec.data() + CRYPTO_HDR_SIZE;
+        int n{};
+
+        check(EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, m_tx.key, iv), "EVP_EncryptInit_ex");
+        check(EVP_EncryptUpdate(ctx.get(), out, &n, plaintext.data(), len), "EVP_EncryptUpdate");
+        check(EVP_EncryptFinal_ex(ctx.get(), out + n, &n), "EVP_EncryptFinal_ex");
+        check(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, CRYPTO_TAG_SIZE, out + len), "EVP_CTRL_GCM_GET_TAG");
+
+        ++m_tx.seq;
+        return rec;
+}
+
+void usbip::crypto::session::open(bytes &in, bytes &out)
+{
+        if (!m_ready) {
+                throw std::logic_error("open: no keys");
+        }
+
+        size_t pos = 0;
+
+        for (size_t avail; (avail = in.size() - pos) >= CRYPTO_HDR_SIZE; ) {
+
+                auto len = get_be(in.data() + pos, CRYPTO_HDR_SIZE);
+                if (!len || len > CRYPTO_MAX_RECORD) {
+                        throw std::runtime_error("invalid record length " + std::to_string(len));
+                }
+
+                if (avail < CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE) {
+                        break;
+                }
+
+                auto data = in.data() + pos + CRYPTO_HDR_SIZE;
+                auto tag = data + len;
+
+                unsigned char iv[CRYPTO_IV_SIZE];
+                make_crypto_iv(iv, m_rx.salt, m_rx.seq);
+
+                auto ctx = new_cipher_ctx();
+                auto off = out.size();
+                out.resize(off + len);
+
+                int n{};
+
+                check(EVP_DecryptInit_ex(ctx.get(), EVP_aes_128_gcm(), nullptr, m_rx.key, iv), "EVP_DecryptInit_ex");
+                check(EVP_DecryptUpdate(ctx.get(), out.data() + off, &n, data, int(len)), "EVP_DecryptUpdate");
+                check(EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, CRYPTO_TAG_SIZE, tag), "EVP_CTRL_GCM_SET_TAG");
+
+                if (EVP_DecryptFinal_ex(ctx.get(), out.data() + off + n, &n) != 1) {
+                        out.resize(off);
+                        throw auth_error("record #" + std::to_string(m_rx.seq) + " failed the tag check");
+                }
+
+                ++m_rx.seq;
+                pos += CRYPTO_HDR_SIZE + len + CRYPTO_TAG_SIZE;
+        }
+
+        in.erase(in.begin(), in.begin() + pos);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <usbip/crypto_wire.h>
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace usbip::crypto
+{
+
+using bytes = std::vector<unsigned char>;
+using key = std::array<unsigned char, USBIP_KEY_SIZE>;
+using nonce = std::array<unsigned char, CRYPTO_NONCE_SIZE>;
+
+/*
+ * A record failed the tag check, the peer has another key or the stream is forged.
+ */
+struct auth_error : std::runtime_error
+{
+        using runtime_error::runtime_error;
+};
+
+/*
+ * @param hex USBIP_KEY_SIZE bytes in hex, the format of "usbip attach --key-file"
+ */
+key parse_key(std::string_view hex);
+
+nonce random_nonce();
+
+/*
+ * One side of the encrypted data channel, see <usbip/crypto_wire.h>.
+ * Errors are reported by exceptions.
+ */
+class session
+{
+public:
+        enum role { client, server };
+
+        session(role r, const key &psk) : m_role(r), m_psk(psk) {}
+        ~session();
+
+        session(const session&) = delete;
+        session& operator =(const session&) = delete;
+
+        bytes request(const nonce &n); // client, OP_REQ_CRYPKEY
+        bytes reply(std::span<const unsigned char> request, const nonce &n); // server, OP_REP_CRYPKEY, keys are set
+        void finish(std::span<const unsigned char> reply); // client, keys are set
+
+        bool ready() const { return m_ready; }
+
+        bytes seal(std::span<const unsigned char> plaintext);
+
+        /*
+         * Takes whole records from the front of in, appends their plaintext to out.
+         * An incomplete record is left in in.
+         */
+        void open(bytes &in, bytes &out);
+
+        auto records_sent() const { return m_tx.seq; }
+        auto records_received() const { return m_rx.seq; }
+
+private:
+        struct direction
+        {
+                unsigned char key[USBIP_KEY_SIZE];
+                unsigned char salt[CRYPTO_SALT_SIZE];
+                std::uint64_t seq;
+        };
+
+        role m_role;
+        key m_psk;
+
+        bytes m_transcript;
+        bool m_ready{};
+
+        direction m_tx{};
+        direction m_rx{};
+
+        void derive_keys();
+};
+
+} // namespace usbip::crypto
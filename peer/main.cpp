@@ -0,0 +1,346 @@
+/*
+ * Reference peer of the encrypted data channel, see <usbip/crypto_wire.h>.
+ * It runs next to usbipd on the server, terminates the encrypted connections of "usbip attach --key-file"
+ * and relays the plaintext to usbipd.
+ */
+#include "crypto_session.h"
+
+#include <openssl/crypto.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+namespace
+{
+
+using namespace usbip::crypto;
+
+const char usage_string[] =
+"usage: usbip-crypto-peer --key-file <file> [options]\n"
+"    -k, --key-file=<file>  The pre-shared 128-bit key in hex, \"-\" is stdin\n"
+"    -l, --listen=<port>    Accept encrypted connections on <port>, default is 3241\n"
+"    -u, --usbipd=<host>:<port>  Relay them to usbipd, default is localhost:3240\n"
+"    -v, --verbose          Log every connection\n";
+
+bool g_verbose;
+std::atomic<unsigned> g_conn_id;
+
+class fd_guard
+{
+public:
+        explicit fd_guard(int fd = -1) : m_fd(fd) {}
+        ~fd_guard() { if (m_fd >= 0) close(m_fd); }
+
+        fd_guard(const fd_guard&) = delete;
+        fd_guard& operator =(const fd_guard&) = delete;
+
+        auto get() const { return m_fd; }
+        explicit operator bool() const { return m_fd >= 0; }
+
+private:
+        int m_fd;
+};
+
+void set_nodelay(int fd)
+{
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+bool send_all(int fd, const unsigned char *data, size_t len)
+{
+        while (len) {
+                auto n = send(fd, data, len, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                } else if (n <= 0) {
+                        return false;
+                }
+                data += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+bool recv_all(int fd, unsigned char *data, size_t len)
+{
+        while (len) {
+                auto n = recv(fd, data, len, 0);
+                if (n < 0 && errno == EINTR) {
+                        continue;
+                } else if (n <= 0) {
+                        return false;
+                }
+                data += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+int connect_to(const std::string &host, const std::string &port)
+{
+        addrinfo hints{ .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        addrinfo *res{};
+
+        if (auto err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+                fprintf(stderr, "getaddrinfo('%s:%s') %s\n", host.c_str(), port.c_str(), gai_strerror(err));
+                return -1;
+        }
+
+        int fd = -1;
+
+        for (auto ai = res; ai && fd < 0; ai = ai->ai_next) {
+                fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+                if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                        close(fd);
+                        fd = -1;
+                }
+        }
+
+        freeaddrinfo(res);
+        return fd;
+}
+
+int listen_on(const std::string &port)
+{
+        addrinfo hints{ .ai_flags = AI_PASSIVE, .ai_family = AF_INET6, .ai_socktype = SOCK_STREAM };
+        addrinfo *res{};
+
+        if (getaddrinfo(nullptr, port.c_str(), &hints, &res)) {
+                hints.ai_family = AF_INET;
+                if (auto err = getaddrinfo(nullptr, port.c_str(), &hints, &res)) {
+                        fprintf(stderr, "getaddrinfo(':%s') %s\n", port.c_str(), gai_strerror(err));
+                        return -1;
+                }
+        }
+
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd >= 0) {
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+                int off = 0; // dual-stack
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+                if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, SOMAXCONN)) {
+                        perror("bind/listen");
+                        close(fd);
+                        fd = -1;
+                }
+        }
+
+        freeaddrinfo(res);
+        return fd;
+}
+
+/*
+ * Handshake, then relays records of the client as plaintext to usbipd and seals whatever usbipd sends.
+ * The connection is closed on the first error, a record that fails the tag check too.
+ */
+void serve(int client_fd, key psk, std::string host, std::string port)
+{
+        fd_guard client(client_fd);
+        auto id = ++g_conn_id;
+
+        session s(session::server, psk);
+        OPENSSL_cleanse(psk.data(), psk.size());
+
+        unsigned char req[CRYPTO_HELLO_SIZE];
+        if (!recv_all(client.get(), req, sizeof(req))) {
+                return;
+        }
+
+        try {
+                auto rep = s.reply(req, random_nonce());
+                if (!send_all(client.get(), rep.data(), rep.size())) {
+                        return;
+                }
+        } catch (std::exception &e) {
+                fprintf(stderr, "#%u: handshake: %s\n", id, e.what());
+                return;
+        }
+
+        fd_guard usbipd(connect_to(host, port));
+        if (!usbipd) {
+                fprintf(stderr, "#%u: can't connect to %s:%s\n", id, host.c_str(), port.c_str());
+                return;
+        }
+
+        set_nodelay(usbipd.get());
+
+        if (g_verbose) {
+                fprintf(stderr, "#%u: connected\n", id);
+        }
+
+        pollfd fds[] {
+                { .fd = client.get(), .events = POLLIN },
+                { .fd = usbipd.get(), .events = POLLIN },
+        };
+
+        bytes records;
+        bytes plaintext;
+        bytes buf(64*1024);
+
+        try {
+                while (true) {
+                        if (poll(fds, std::size(fds), -1) < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                break;
+                        }
+
+                        if (fds[0].revents) {
+                                auto n = recv(client.get(), buf.data(), buf.size(), 0);
+                                if (n <= 0) {
+                                        break;
+                                }
+
+                                records.insert(records.end(), buf.begin(), buf.begin() + n);
+                                s.open(records, plaintext);
+
+                                if (!send_all(usbipd.get(), plaintext.data(), plaintext.size())) {
+                                        break;
+                                }
+                                plaintext.clear();
+                        }
+
+                        if (fds[1].revents) {
+                                auto n = recv(usbipd.get(), buf.data(), buf.size(), 0);
+                                if (n <= 0) {
+                                        break;
+                                }
+
+                                auto rec = s.seal({ buf.data(), size_t(n) });
+                                if (!send_all(client.get(), rec.data(), rec.size())) {
+                                        break;
+                                }
+                        }
+                }
+        } catch (std::exception &e) {
+                fprintf(stderr, "#%u: %s\n", id, e.what());
+        }
+
+        if (g_verbose) {
+                fprintf(stderr, "#%u: closed, records sent %llu, received %llu\n", id,
+                        (unsigned long long)s.records_sent(), (unsigned long long)s.records_received());
+        }
+}
+
+bool read_key(const char *path, key &k)
+{
+        std::string s;
+
+        if (std::string_view(path) == "-") {
+                std::getline(std::cin, s);
+        } else if (std::ifstream in(path); in) {
+                std::getline(in, s);
+        } else {
+                fprintf(stderr, "can't open '%s'\n", path);
+                return false;
+        }
+
+        while (!s.empty() && isspace(static_cast<unsigned char>(s.back()))) {
+                s.pop_back();
+        }
+
+        try {
+                k = parse_key(s);
+        } catch (std::exception &e) {
+                fprintf(stderr, "%s: %s\n", path, e.what());
+                return false;
+        }
+
+        return true;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        const option opts[] =
+        {
+                { "key-file", required_argument, nullptr, 'k' },
+                { "listen", required_argument, nullptr, 'l' },
+                { "usbipd", required_argument, nullptr, 'u' },
+                { "verbose", no_argument, nullptr, 'v' },
+                {}
+        };
+
+        key psk{};
+        bool has_key{};
+
+        std::string listen_port = "3241";
+        std::string host = "localhost";
+        std::string port = "3240";
+
+        for (int opt; (opt = getopt_long(argc, argv, "k:l:u:v", opts, nullptr)) != -1; ) {
+                switch (opt) {
+                case 'k':
+                        if (!(has_key = read_key(optarg, psk))) {
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'l':
+                        listen_port = optarg;
+                        break;
+                case 'u':
+                        host = optarg;
+                        if (auto pos = host.rfind(':'); pos != host.npos) {
+                                port = host.substr(pos + 1);
+                                host.resize(pos);
+                        }
+                        break;
+                case 'v':
+                        g_verbose = true;
+                        break;
+                default:
+                        fputs(usage_string, stderr);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (!has_key) {
+                fputs(usage_string, stderr);
+                return EXIT_FAILURE;
+        }
+
+        fd_guard srv(listen_on(listen_port));
+        if (!srv) {
+                return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "listening on %s, usbipd is %s:%s\n", listen_port.c_str(), host.c_str(), port.c_str());
+
+        while (true) {
+                auto fd = accept(srv.get(), nullptr, nullptr);
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+                        perror("accept");
+                        return EXIT_FAILURE;
+                }
+
+                set_nodelay(fd);
+                std::thread(serve, fd, psk, host, port).detach();
+        }
+}
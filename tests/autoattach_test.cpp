@@ -0,0 +1,225 @@
+#include <usbip/autoattach_rules.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <sstream>
+
+namespace
+{
+
+using namespace usbip::autoattach;
+
+auto make_device(const char *busid, UINT16 vid, UINT16 pid, UINT32 devnum)
+{
+        usbip_usb_device d{};
+
+        snprintf(d.busid, sizeof(d.busid), "%s", busid);
+        d.busnum = 1;
+        d.devnum = devnum;
+        d.speed = 3;
+        d.idVendor = vid;
+        d.idProduct = pid;
+        d.bcdDevice = 0x0100;
+
+        return d;
+}
+
+auto make_host(std::vector<rule> rules)
+{
+        return host_state{ .name = "host", .rules = std::move(rules) };
+}
+
+TEST(autoattach, parse_rule)
+{
+        rule r{};
+        ASSERT_TRUE(parse_rule("*", r));
+        EXPECT_TRUE(r.any);
+
+        r = {};
+        ASSERT_TRUE(parse_rule("1-1.2", r));
+        EXPECT_EQ(r.busid, "1-1.2");
+        EXPECT_FALSE(r.any);
+
+        r = {};
+        ASSERT_TRUE(parse_rule("1005:B113", r));
+        EXPECT_TRUE(r.busid.empty());
+        EXPECT_EQ(r.vid, 0x1005);
+        EXPECT_EQ(r.pid, 0xb113);
+
+        for (std::string s: { "1005:", ":b113", "1005:b113x", "1005:b113:1", "10000:1", "1:fffff", "x:1", "-1:1" }) {
+                r = {};
+                EXPECT_FALSE(parse_rule(s, r)) << s;
+        }
+
+        r = {};
+        EXPECT_FALSE(parse_rule(std::string(USBIP_BUS_ID_SIZE, '1'), r)) << "busid is too long";
+}
+
+TEST(autoattach, read_rules)
+{
+        std::istringstream in(
+                "# host rule\n"
+                "\n"
+                "a 1-1\n"
+                "  b 1005:b113\n"
+                "a *\n"
+                "a 0001:7778  # comment\n");
+
+        std::vector<host_state> hosts;
+        std::string error;
+
+        ASSERT_TRUE(read_rules(in, hosts, error)) << error;
+        ASSERT_EQ(hosts.size(), 2);
+
+        EXPECT_EQ(hosts[0].name, "a");
+        ASSERT_EQ(hosts[0].rules.size(), 3);
+        EXPECT_EQ(hosts[0].rules[0].busid, "1-1");
+        EXPECT_TRUE(hosts[0].rules[1].any);
+        EXPECT_EQ(hosts[0].rules[2].vid, 0x0001);
+
+        EXPECT_EQ(hosts[1].name, "b");
+        ASSERT_EQ(hosts[1].rules.size(), 1);
+        EXPECT_EQ(hosts[1].rules[0].pid, 0xb113);
+}
+
+TEST(autoattach, read_rules_errors)
+{
+        for (auto [text, expected]: {
+                std::pair{ "", "no rules" },
+                { "# comment only\n", "no rules" },
+                { "a 1-1\nb\n", "line 2: busid, <vid>:<pid> or * expected" },
+                { "\na 1005:zz\n", "line 2: busid, <vid>:<pid> or * expected" } }) {
+
+                std::istringstream in(text);
+                std::vector<host_state> hosts;
+                std::string error;
+
+                EXPECT_FALSE(read_rules(in, hosts, error)) << text;
+                EXPECT_EQ(error, expected);
+        }
+}
+
+TEST(autoattach, parse_seconds)
+{
+        clock_type::duration d{};
+
+        ASSERT_TRUE(parse_seconds("30", d));
+        EXPECT_EQ(d, 30s);
+
+        for (auto s: { "", "0", "-1", "1s", " 1", "99999999999" }) {
+                d = 5s;
+                EXPECT_FALSE(parse_seconds(s, d)) << s;
+                EXPECT_EQ(d, 5s);
+        }
+}
+
+TEST(autoattach, matches)
+{
+        auto d = make_device("1-2", 0x1005, 0xb113, 3);
+
+        EXPECT_FALSE(matches({}, d));
+        EXPECT_TRUE(matches({ rule{ .any = true } }, d));
+        EXPECT_TRUE(matches({ rule{ .busid = "1-2" } }, d));
+        EXPECT_FALSE(matches({ rule{ .busid = "1-20" } }, d));
+        EXPECT_TRUE(matches({ rule{ .vid = 0x1005, .pid = 0xb113 } }, d));
+        EXPECT_FALSE(matches({ rule{ .vid = 0x1005, .pid = 0xb114 } }, d));
+}
+
+TEST(autoattach, update)
+{
+        auto h = make_host({ rule{ .busid = "1-1" }, rule{ .vid = 0x1005, .pid = 0xb113 } });
+        auto t0 = clock_type::now();
+
+        auto a = make_device("1-1", 0x0001, 0x7778, 2);
+        auto b = make_device("1-2", 0x1005, 0xb113, 3);
+        auto c = make_device("1-3", 0x046d, 0xc077, 4); // does not match
+
+        devlist_changes ch;
+        ASSERT_TRUE(update(h, { a, b, c }, t0, ch));
+        ASSERT_EQ(ch.appeared.size(), 2);
+        EXPECT_EQ(get_busid(ch.appeared[0]), "1-1");
+        EXPECT_EQ(get_busid(ch.appeared[1]), "1-2");
+        EXPECT_TRUE(ch.gone.empty());
+
+        ASSERT_EQ(h.devices.size(), 3);
+        EXPECT_TRUE(h.devices["1-1"].match);
+        EXPECT_EQ(h.devices["1-2"].next_try, t0);
+        EXPECT_FALSE(h.devices["1-3"].match);
+
+        h.devices["1-1"].port = 5;
+        h.devices["1-2"].failures = 2;
+
+        ch = {};
+        EXPECT_FALSE(update(h, { a, b, c }, t0 + 1s, ch)) << "the same devlist";
+        EXPECT_TRUE(ch.appeared.empty());
+        EXPECT_TRUE(ch.gone.empty());
+        EXPECT_EQ(h.devices["1-1"].port, 5) << "state is kept";
+        EXPECT_EQ(h.devices["1-2"].failures, 2);
+
+        auto t1 = t0 + 2s;
+        b.devnum = 7; // replugged
+
+        ch = {};
+        ASSERT_TRUE(update(h, { b, c }, t1, ch));
+        ASSERT_EQ(ch.appeared.size(), 1);
+        EXPECT_EQ(get_busid(ch.appeared[0]), "1-2");
+        ASSERT_EQ(ch.gone.size(), 1);
+        EXPECT_EQ(ch.gone[0], "1-1");
+
+        ASSERT_EQ(h.devices.size(), 2);
+        EXPECT_EQ(h.devices["1-2"].failures, 0) << "a new device";
+        EXPECT_EQ(h.devices["1-2"].next_try, t1);
+
+        ch = {};
+        EXPECT_TRUE(update(h, { b }, t1, ch)) << "non-matching device has gone";
+        EXPECT_TRUE(ch.appeared.empty());
+        EXPECT_TRUE(ch.gone.empty());
+}
+
+TEST(autoattach, next_poll_interval)
+{
+        poll_params p{ .min_interval = 2s, .max_interval = 60s };
+
+        auto i = p.min_interval;
+        for (auto expected: { 4s, 8s, 16s, 32s, 60s, 60s }) {
+                i = next_poll_interval(i, false, p);
+                EXPECT_EQ(i, expected);
+        }
+
+        EXPECT_EQ(next_poll_interval(i, true, p), p.min_interval);
+}
+
+TEST(autoattach, next_retry_delay)
+{
+        EXPECT_EQ(next_retry_delay(1), retry_delay);
+        EXPECT_EQ(next_retry_delay(2), 2*retry_delay);
+        EXPECT_EQ(next_retry_delay(5), 16*retry_delay);
+        EXPECT_EQ(next_retry_delay(9), 256*retry_delay);
+
+        for (auto failures: { 10U, 17U, 1000U, UINT_MAX }) {
+                EXPECT_EQ(next_retry_delay(failures), max_retry_delay) << failures;
+        }
+}
+
+TEST(autoattach, next_wakeup)
+{
+        EXPECT_EQ(next_wakeup({}), clock_type::time_point::max());
+
+        auto t0 = clock_type::now();
+
+        auto h = make_host({ rule{ .any = true } });
+        h.next_poll = t0 + 10s;
+        EXPECT_EQ(next_wakeup({ h }), h.next_poll);
+
+        h.devices["1-1"] = device_state{ .match = true, .port = 0, .next_try = t0 + 3s };
+        h.devices["1-2"] = device_state{ .match = true, .port = 1, .next_try = t0 + 1s }; // attached
+        h.devices["1-3"] = device_state{ .match = false, .next_try = t0 + 1s };
+        EXPECT_EQ(next_wakeup({ h }), t0 + 3s);
+
+        auto other = make_host({});
+        other.next_poll = t0 + 2s;
+        EXPECT_EQ(next_wakeup({ h, other }), t0 + 2s);
+}
+
+} // namespace
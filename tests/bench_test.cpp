@@ -0,0 +1,395 @@
+#include <usbip/benchmark.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bench;
+using namespace std::chrono_literals;
+
+/*
+ * In-memory usbipd, it answers OP_REQ_IMPORT and CMD_SUBMIT.
+ * Replies are sent when the client wants to read them, in reverse order of the requests.
+ */
+class fake_usbipd : public stream
+{
+public:
+        explicit fake_usbipd(bool imported = false) : m_imported(imported) {}
+
+        const char *busid = "1-2";
+        UINT32 busnum = 1;
+        UINT32 devnum = 5;
+        UINT32 import_status = ST_OK;
+        UINT16 version = USBIP_VERSION;
+
+        INT32 urb_status{}; // of every RET_SUBMIT
+        seqnum_t bad_seqnum{}; // is replied with seqnum + 1000
+        size_t fail_after = SIZE_MAX; // bytes to send to the client
+
+        std::vector<usbip_header> submits; // in host byte order
+
+        bool send(const void *data, size_t len) override
+        {
+                auto p = static_cast<const char*>(data);
+                m_in.insert(m_in.end(), p, p + len);
+
+                while (parse()) {}
+                return true;
+        }
+
+        bool recv(void *data, size_t len) override
+        {
+                if (m_out.size() - m_pos < len) {
+                        flush();
+                }
+
+                if (m_out.size() - m_pos < len || m_pos + len > fail_after) {
+                        return false;
+                }
+
+                memcpy(data, m_out.data() + m_pos, len);
+                m_pos += len;
+                return true;
+        }
+
+private:
+        std::vector<char> m_in;
+        std::vector<char> m_out;
+        size_t m_pos{};
+
+        bool m_imported;
+        std::vector<usbip_header> m_pending;
+
+        void put(const void *data, size_t len)
+        {
+                auto p = static_cast<const char*>(data);
+                m_out.insert(m_out.end(), p, p + len);
+        }
+
+        bool parse()
+        {
+                if (!m_imported) {
+                        op_common hdr;
+                        op_import_request req;
+
+                        if (m_in.size() < sizeof(hdr) + sizeof(req)) {
+                                return false;
+                        }
+
+                        memcpy(&hdr, m_in.data(), sizeof(hdr));
+                        memcpy(&req, m_in.data() + sizeof(hdr), sizeof(req));
+                        m_in.erase(m_in.begin(), m_in.begin() + sizeof(hdr) + sizeof(req));
+
+                        PACK_OP_COMMON(0, &hdr);
+                        EXPECT_EQ(hdr.version, USBIP_VERSION);
+                        EXPECT_EQ(hdr.code, OP_REQ_IMPORT);
+                        EXPECT_STREQ(req.busid, busid);
+
+                        op_common rep_hdr{ version, OP_REP_IMPORT, import_status };
+                        PACK_OP_COMMON(1, &rep_hdr);
+                        put(&rep_hdr, sizeof(rep_hdr));
+
+                        if (import_status == ST_OK) {
+                                op_import_reply rep{};
+                                strcpy(rep.udev.busid, busid);
+                                rep.udev.busnum = busnum;
+                                rep.udev.devnum = devnum;
+                                rep.udev.idVendor = 0x1005;
+                                rep.udev.idProduct = 0xb113;
+                                PACK_OP_IMPORT_REPLY(1, &rep);
+                                put(&rep, sizeof(rep));
+                        }
+
+                        m_imported = true;
+                        return true;
+                }
+
+                usbip_header h;
+                if (m_in.size() < sizeof(h)) {
+                        return false;
+                }
+
+                memcpy(&h, m_in.data(), sizeof(h));
+                byteswap(h);
+
+                EXPECT_EQ(h.base.command, USBIP_CMD_SUBMIT);
+                size_t len = sizeof(h);
+
+                if (h.base.direction == USBIP_DIR_OUT) {
+                        len += h.u.cmd_submit.transfer_buffer_length;
+                        if (m_in.size() < len) {
+                                return false;
+                        }
+                }
+
+                m_in.erase(m_in.begin(), m_in.begin() + len);
+
+                submits.push_back(h);
+                m_pending.push_back(h);
+                return true;
+        }
+
+        void flush()
+        {
+                for (auto i = m_pending.rbegin(); i != m_pending.rend(); ++i) {
+                        auto &cmd = *i;
+
+                        usbip_header h{};
+                        h.base.command = USBIP_RET_SUBMIT;
+                        h.base.seqnum = cmd.base.seqnum == bad_seqnum ? bad_seqnum + 1000 : cmd.base.seqnum;
+
+                        auto &ret = h.u.ret_submit;
+                        ret.status = urb_status;
+                        ret.actual_length = cmd.u.cmd_submit.transfer_buffer_length;
+
+                        byteswap(h);
+                        put(&h, sizeof(h));
+
+                        if (cmd.base.direction == USBIP_DIR_IN) {
+                                std::vector<char> data(cmd.u.cmd_submit.transfer_buffer_length, 'x');
+                                put(data.data(), data.size());
+                        }
+                }
+
+                m_pending.clear();
+        }
+};
+
+auto parse(std::vector<std::string> args, bench_args &r, std::string &error)
+{
+        args.insert(args.begin(), "bench");
+
+        std::vector<char*> argv;
+        for (auto &s: args) {
+                argv.push_back(s.data());
+        }
+        argv.push_back(nullptr);
+
+        optind = 0; // as usbip.cpp does before a command
+        return parse_args(int(args.size()), argv.data(), r, error);
+}
+
+TEST(bench, parse_args)
+{
+        bench_args a;
+        std::string error;
+
+        ASSERT_TRUE(parse({"-r", "host", "-b", "1-2", "-m", "bulk-in", "-e", "0x2", "-n", "10", "-q", "4", "-s", "1024"}, a, error)) << error;
+        EXPECT_STREQ(a.host, "host");
+        EXPECT_STREQ(a.busid, "1-2");
+        EXPECT_EQ(a.params.mode, bench_mode::bulk_in);
+        EXPECT_EQ(a.params.ep, 2U);
+        EXPECT_EQ(a.params.count, 10U);
+        EXPECT_EQ(a.params.depth, 4U);
+        EXPECT_EQ(a.params.size, 1024);
+
+        a = {};
+        ASSERT_TRUE(parse({"--remote=host", "--busid=1-2", "--size=4096"}, a, error)) << error;
+        EXPECT_EQ(a.params.mode, bench_mode::ping);
+        EXPECT_EQ(a.params.size, 2) << "GET_STATUS";
+
+        const std::vector<std::string> invalid[] =
+        {
+                {"-b", "1-2"},
+                {"-r", "host"},
+                {"-r", "host", "-b", "1-2", "-m", "iso"},
+                {"-r", "host", "-b", "1-2", "-m", "bulk-out"},
+                {"-r", "host", "-b", "1-2", "-m", "intr", "-e", "16"},
+                {"-r", "host", "-b", "1-2", "-n", "0"},
+                {"-r", "host", "-b", "1-2", "-q", "-1"},
+                {"-r", "host", "-b", "1-2", "-s", "0x80000000"},
+                {"-r", "host", "-b", "1-2", "-x"},
+        };
+
+        for (auto &args: invalid) {
+                a = {};
+                error.clear();
+                EXPECT_FALSE(parse(args, a, error)) << args.back();
+                EXPECT_FALSE(error.empty());
+        }
+}
+
+TEST(bench, make_cmd_submit)
+{
+        bench_params p;
+
+        auto h = make_cmd_submit(p, 0x10005, 7);
+        EXPECT_EQ(h.base.command, USBIP_CMD_SUBMIT);
+        EXPECT_EQ(h.base.seqnum, 7U);
+        EXPECT_EQ(h.base.devid, 0x10005U);
+        EXPECT_EQ(h.base.direction, USBIP_DIR_IN);
+        EXPECT_EQ(h.base.ep, 0U);
+        EXPECT_EQ(h.u.cmd_submit.transfer_buffer_length, 2);
+        EXPECT_EQ(h.u.cmd_submit.number_of_packets, number_of_packets_non_isoch);
+
+        const unsigned char get_status[] { 0x80, 0, 0, 0, 0, 0, 2, 0 };
+        EXPECT_FALSE(memcmp(h.u.cmd_submit.setup, get_status, sizeof(get_status)));
+
+        p = { .mode = bench_mode::bulk_out, .ep = 1, .size = 4096 };
+        h = make_cmd_submit(p, 1, 1);
+        EXPECT_EQ(h.base.direction, USBIP_DIR_OUT);
+        EXPECT_EQ(h.base.ep, 1U);
+        EXPECT_EQ(h.u.cmd_submit.transfer_buffer_length, 4096);
+        EXPECT_EQ(h.u.cmd_submit.interval, 0);
+
+        p = { .mode = bench_mode::intr, .ep = 3, .size = 8 };
+        h = make_cmd_submit(p, 1, 1);
+        EXPECT_EQ(h.base.direction, USBIP_DIR_IN);
+        EXPECT_EQ(h.base.ep, 3U);
+        EXPECT_EQ(h.u.cmd_submit.interval, 1);
+}
+
+TEST(bench, byteswap)
+{
+        auto h = make_cmd_submit({}, 0x10005, 0x01020304);
+        auto orig = h;
+
+        byteswap(h);
+
+        auto p = reinterpret_cast<const unsigned char*>(&h);
+        const unsigned char be[] { 0, 0, 0, 1, 1, 2, 3, 4, 0, 1, 0, 5 }; // command, seqnum, devid
+        EXPECT_FALSE(memcmp(p, be, sizeof(be)));
+
+        EXPECT_FALSE(memcmp(h.u.cmd_submit.setup, orig.u.cmd_submit.setup, sizeof(orig.u.cmd_submit.setup)));
+
+        byteswap(h);
+        EXPECT_FALSE(memcmp(&h, &orig, sizeof(h)));
+}
+
+TEST(bench, import_device)
+{
+        fake_usbipd srv;
+        usbip_usb_device udev{};
+        std::string error;
+
+        EXPECT_EQ(import_device(srv, "1-2", udev, error), 0x10005U) << error;
+        EXPECT_EQ(udev.idVendor, 0x1005);
+        EXPECT_EQ(udev.idProduct, 0xb113);
+}
+
+TEST(bench, import_device_errors)
+{
+        usbip_usb_device udev{};
+        std::string error;
+
+        {
+                fake_usbipd srv;
+                srv.import_status = ST_DEV_BUSY;
+                EXPECT_EQ(import_device(srv, "1-2", udev, error), 0U);
+                EXPECT_NE(error.find("import failed"), error.npos) << error;
+        }
+        {
+                fake_usbipd srv;
+                srv.version = 0x0106;
+                EXPECT_EQ(import_device(srv, "1-2", udev, error), 0U);
+                EXPECT_NE(error.find("version"), error.npos) << error;
+        }
+        {
+                fake_usbipd srv;
+                srv.fail_after = sizeof(op_common);
+                EXPECT_EQ(import_device(srv, "1-2", udev, error), 0U);
+                EXPECT_NE(error.find("import reply"), error.npos) << error;
+        }
+
+        fake_usbipd srv;
+        std::string busid(USBIP_BUS_ID_SIZE, '1');
+        EXPECT_EQ(import_device(srv, busid.c_str(), udev, error), 0U);
+        EXPECT_TRUE(srv.submits.empty());
+}
+
+struct run_case
+{
+        bench_mode mode;
+        UINT32 count;
+        UINT32 depth;
+        INT32 size;
+};
+
+class bench_run : public testing::TestWithParam<run_case> {};
+
+TEST_P(bench_run, completes)
+{
+        auto &c = GetParam();
+        bench_params p{ .mode = c.mode, .ep = c.mode == bench_mode::ping ? 0U : 1U, .count = c.count, .depth = c.depth,
+                        .size = c.size };
+
+        fake_usbipd srv;
+        srv.busid = "3-1";
+        srv.urb_status = -32; // EPIPE, the URB is completed anyway
+
+        usbip_usb_device udev{};
+        std::string error;
+
+        auto devid = import_device(srv, srv.busid, udev, error);
+        ASSERT_TRUE(devid) << error;
+
+        bench_result r;
+        ASSERT_TRUE(run(srv, devid, p, r, error)) << error;
+
+        EXPECT_EQ(r.completed, c.count);
+        EXPECT_EQ(r.errors, c.count);
+        EXPECT_EQ(r.bytes, UINT64(c.count)*c.size);
+        EXPECT_EQ(r.latency.size(), c.count);
+        EXPECT_GT(r.elapsed, 0ns);
+
+        ASSERT_EQ(srv.submits.size(), c.count);
+        for (UINT32 i = 0; i < c.count; ++i) {
+                EXPECT_EQ(srv.submits[i].base.seqnum, i + 1);
+                EXPECT_EQ(srv.submits[i].base.devid, devid);
+        }
+}
+
+INSTANTIATE_TEST_SUITE_P(bench, bench_run, testing::Values(
+        run_case{ bench_mode::ping, 100, 1, 2 },
+        run_case{ bench_mode::bulk_in, 100, 8, 512 },   // replies are out of order
+        run_case{ bench_mode::bulk_out, 50, 4, 4096 },
+        run_case{ bench_mode::intr, 3, 10, 8 }          // depth > count
+), [] (auto &info) { return "mode" + std::to_string(int(info.param.mode)) + "_depth" + std::to_string(info.param.depth); });
+
+TEST(bench, run_errors)
+{
+        bench_params p{ .count = 10, .depth = 4, .size = 2 };
+        bench_result r;
+        std::string error;
+
+        {
+                fake_usbipd srv(true);
+                srv.bad_seqnum = 3;
+                EXPECT_FALSE(run(srv, 1, p, r, error));
+                EXPECT_NE(error.find("unknown seqnum"), error.npos) << error;
+        }
+
+        fake_usbipd srv(true);
+        srv.fail_after = 5*(sizeof(usbip_header) + p.size);
+
+        r = {};
+        EXPECT_FALSE(run(srv, 1, p, r, error));
+        EXPECT_EQ(r.completed, 5U);
+}
+
+TEST(bench, summarize)
+{
+        std::vector<clock_type::duration> v;
+        EXPECT_EQ(summarize(v).max, 0ns);
+
+        for (int i = 1000; i > 0; --i) {
+                v.push_back(i*1us);
+        }
+
+        auto s = summarize(v);
+        EXPECT_EQ(s.min, 1us);
+        EXPECT_EQ(s.p50, 500us);
+        EXPECT_EQ(s.p99, 990us);
+        EXPECT_EQ(s.p999, 999us);
+        EXPECT_EQ(s.max, 1000us);
+
+        EXPECT_TRUE(std::is_sorted(v.begin(), v.end()));
+}
+
+} // namespace
@@ -0,0 +1,218 @@
+#include <libusbip/connector.h>
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip::net;
+using namespace std::chrono_literals;
+
+auto make_address(const char *ip, int port)
+{
+        address a{ AF_INET, SOCK_STREAM, IPPROTO_TCP, sizeof(sockaddr_in), {} };
+
+        sockaddr_in sa{};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(port);
+        inet_pton(AF_INET, ip, &sa.sin_addr);
+
+        memcpy(&a.addr, &sa, sizeof(sa));
+        return a;
+}
+
+auto make_address6(const char *ip, int port)
+{
+        address a{ AF_INET6, SOCK_STREAM, IPPROTO_TCP, sizeof(sockaddr_in6), {} };
+
+        sockaddr_in6 sa{};
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = htons(port);
+        inet_pton(AF_INET6, ip, &sa.sin6_addr);
+
+        memcpy(&a.addr, &sa, sizeof(sa));
+        return a;
+}
+
+class listener
+{
+public:
+        listener()
+        {
+                m_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+                auto a = make_address("127.0.0.1", 0);
+                socklen_t len = a.addrlen;
+
+                if (bind(m_fd, reinterpret_cast<sockaddr*>(&a.addr), len) || listen(m_fd, 8) ||
+                    getsockname(m_fd, reinterpret_cast<sockaddr*>(&a.addr), &len)) {
+                        ::close(m_fd);
+                        m_fd = -1;
+                }
+
+                m_port = ntohs(reinterpret_cast<sockaddr_in&>(a.addr).sin_port);
+        }
+
+        ~listener() { close(); }
+
+        void close()
+        {
+                if (m_fd >= 0) {
+                        ::close(m_fd);
+                        m_fd = -1;
+                }
+        }
+
+        explicit operator bool() const { return m_fd >= 0; }
+        auto port() const { return m_port; }
+        auto addr() const { return make_address("127.0.0.1", m_port); }
+
+private:
+        int m_fd = -1;
+        int m_port{};
+};
+
+/*
+ * A loopback address that refuses connections.
+ */
+auto dead_address()
+{
+        listener l;
+        return l.addr();
+}
+
+TEST(connector, interleave)
+{
+        auto a1 = make_address6("::1", 1);
+        auto a2 = make_address6("::1", 2);
+        auto a3 = make_address6("::1", 3);
+        auto b1 = make_address("127.0.0.1", 1);
+        auto b2 = make_address("127.0.0.1", 2);
+
+        EXPECT_EQ(interleave({ a1, a2, a3, b1, b2 }), (std::vector{ a1, b1, a2, b2, a3 }));
+        EXPECT_EQ(interleave({ b1, a1, a2, a3 }), (std::vector{ b1, a1, a2, a3 }));
+        EXPECT_EQ(interleave({ a1, a2, a3 }), (std::vector{ a1, a2, a3 }));
+        EXPECT_TRUE(interleave({}).empty());
+}
+
+TEST(connector, cache_expires)
+{
+        address_cache cache(10s);
+        std::vector<address> v;
+
+        auto t0 = clock_type::now();
+        EXPECT_FALSE(cache.get("host:3240", v, t0));
+
+        cache.put("host:3240", { make_address("10.0.0.1", 3240) }, t0);
+
+        EXPECT_TRUE(cache.get("host:3240", v, t0 + 9s));
+        EXPECT_EQ(v.size(), 1U);
+        EXPECT_FALSE(cache.get("other:3240", v, t0));
+
+        EXPECT_FALSE(cache.get("host:3240", v, t0 + 10s));
+        EXPECT_FALSE(cache.get("host:3240", v, t0)) << "expired entry must be removed";
+}
+
+TEST(connector, cache_remember)
+{
+        auto a = make_address6("::1", 3240);
+        auto b = make_address("127.0.0.1", 3240);
+        auto c = make_address("127.0.0.2", 3240);
+
+        address_cache cache;
+        cache.put("host:3240", { a, b, c });
+
+        std::vector<address> v;
+
+        cache.remember("host:3240", &c);
+        ASSERT_TRUE(cache.get("host:3240", v));
+        EXPECT_EQ(v, (std::vector{ c, a, b }));
+
+        cache.remember("host:3240", &c);
+        ASSERT_TRUE(cache.get("host:3240", v));
+        EXPECT_EQ(v, (std::vector{ c, a, b }));
+
+        auto unknown = make_address("127.0.0.3", 3240);
+        cache.remember("host:3240", &unknown);
+        ASSERT_TRUE(cache.get("host:3240", v));
+        EXPECT_EQ(v, (std::vector{ c, a, b }));
+
+        cache.remember("host:3240", nullptr);
+        EXPECT_FALSE(cache.get("host:3240", v)) << "all addresses have failed, resolve again";
+}
+
+TEST(connector, resolve)
+{
+        address_cache cache;
+        std::vector<address> v;
+
+        ASSERT_EQ(resolve("127.0.0.1", "3240", v, &cache), 0);
+        ASSERT_EQ(v.size(), 1U);
+        EXPECT_EQ(v.front(), make_address("127.0.0.1", 3240));
+
+        std::vector<address> cached;
+        EXPECT_TRUE(cache.get(cache_key("127.0.0.1", "3240"), cached));
+        EXPECT_EQ(cached, v);
+
+        EXPECT_NE(resolve("127.0.0.1", "no-such-service", v, nullptr), 0);
+}
+
+TEST(connector, race_skips_dead_address)
+{
+        listener live;
+        ASSERT_TRUE(live);
+
+        std::vector addrs{ dead_address(), live.addr() };
+        const address *winner{};
+
+        auto t0 = clock_type::now();
+        auto s = race(addrs, 5s, winner, 1s);
+        auto elapsed = clock_type::now() - t0;
+
+        ASSERT_NE(s, invalid_socket);
+        EXPECT_EQ(winner, &addrs[1]);
+        EXPECT_LT(elapsed, 1s) << "a refused attempt must start the next one without delay";
+
+        sockaddr_storage peer{};
+        socklen_t len = sizeof(peer);
+        EXPECT_FALSE(getpeername(s, reinterpret_cast<sockaddr*>(&peer), &len));
+
+        close(s);
+}
+
+TEST(connector, race_first_wins)
+{
+        listener first;
+        listener second;
+        ASSERT_TRUE(first && second);
+
+        std::vector addrs{ first.addr(), second.addr() };
+        const address *winner{};
+
+        auto s = race(addrs, 5s, winner);
+        ASSERT_NE(s, invalid_socket);
+        EXPECT_EQ(winner, &addrs[0]);
+
+        close(s);
+}
+
+TEST(connector, race_fails)
+{
+        std::vector addrs{ dead_address(), dead_address(), dead_address() };
+        const address *winner{};
+
+        auto t0 = clock_type::now();
+        EXPECT_EQ(race(addrs, 5s, winner), invalid_socket);
+        EXPECT_LT(clock_type::now() - t0, 1s);
+        EXPECT_FALSE(winner);
+
+        EXPECT_EQ(race({}, 5s, winner), invalid_socket);
+}
+
+} // namespace
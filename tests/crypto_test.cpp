@@ -0,0 +1,411 @@
+#include "crypto_session.h"
+
+#include <gtest/gtest.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <csignal>
+#include <string>
+#include <thread>
+
+namespace
+{
+
+using namespace usbip::crypto;
+
+const auto psk = parse_key("000102030405060708090a0b0c0d0e0f");
+
+auto hex(const bytes &b)
+{
+        std::string s;
+        for (auto c: b) {
+                char buf[3];
+                snprintf(buf, sizeof(buf), "%02x", c);
+                s += buf;
+        }
+        return s;
+}
+
+auto to_bytes(std::string_view s)
+{
+        return bytes(s.begin(), s.end());
+}
+
+auto make_nonce(unsigned char first)
+{
+        nonce n;
+        for (auto &b: n) {
+                b = first++;
+        }
+        return n;
+}
+
+void handshake(session &client, session &server, const nonce &cn = random_nonce(), const nonce &sn = random_nonce())
+{
+        auto req = client.request(cn);
+        auto rep = server.reply(req, sn);
+        client.finish(rep);
+
+        ASSERT_TRUE(client.ready());
+        ASSERT_TRUE(server.ready());
+}
+
+/*
+ * The driver must produce the same bytes, the keys are HMAC-SHA256 of the transcript, see crypto_wire.h.
+ */
+TEST(crypto, known_answer)
+{
+        session client(session::client, psk);
+        session server(session::server, psk);
+
+        auto req = client.request(make_nonce(0x10));
+        EXPECT_EQ(hex(req), "0111800400000000101112131415161718191a1b1c1d1e1f");
+
+        auto rep = server.reply(req, make_nonce(0xF0));
+        EXPECT_EQ(hex(rep), "0111000400000000f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+
+        client.finish(rep);
+
+        auto pt = to_bytes("usbip");
+        EXPECT_EQ(hex(client.seal(pt)), "0000000598494698bb393bfa18139446eb5f83ba91f9975f1a");
+        EXPECT_EQ(hex(server.seal(pt)), "00000005640045c657f6134484dc0470d0b52617a200ddcde9");
+}
+
+TEST(crypto, both_directions)
+{
+        session client(session::client, psk);
+        session server(session::server, psk);
+        handshake(client, server);
+
+        bytes in;
+        bytes out;
+
+        for (int i = 1; i <= 100; ++i) {
+                bytes pt(i*37, static_cast<unsigned char>(i));
+
+                in = client.seal(pt);
+                server.open(in, out);
+                EXPECT_TRUE(in.empty());
+                EXPECT_EQ(out, pt);
+                out.clear();
+
+                in = server.seal(pt);
+                client.open(in, out);
+                EXPECT_EQ(out, pt);
+                out.clear();
+        }
+
+        EXPECT_EQ(client.records_sent(), 100U);
+        EXPECT_EQ(server.records_received(), 100U);
+}
+
+/*
+ * Records arrive by arbitrary pieces, a PDU can span records.
+ */
+TEST(crypto, stream)
+{
+        session client(session::client, psk);
+        session server(session::server, psk);
+        handshake(client, server);
+
+        bytes stream;
+        bytes expected;
+
+        for (int i = 0; i < 10; ++i) {
+                auto pt = to_bytes("part " + std::to_string(i) + " of a PDU;");
+                auto rec = server.seal(pt);
+                stream.insert(stream.end(), rec.begin(), rec.end());
+                expected.insert(expected.end(), pt.begin(), pt.end());
+        }
+
+        bytes in;
+        bytes out;
+
+        for (auto b: stream) {
+                in.push_back(b);
+                client.open(in, out);
+        }
+
+        EXPECT_TRUE(in.empty());
+        EXPECT_EQ(out, expected);
+}
+
+TEST(crypto, wrong_key)
+{
+        auto other = psk;
+        other.back() ^= 1;
+
+        session client(session::client, psk);
+        session server(session::server, other);
+        handshake(client, server);
+
+        auto in = client.seal(to_bytes("OP_REQ_IMPORT"));
+        bytes out;
+
+        EXPECT_THROW(server.open(in, out), auth_error);
+        EXPECT_TRUE(out.empty());
+}
+
+/*
+ * A forged nonce of either side gives other keys, the first record does not pass the tag check.
+ */
+TEST(crypto, transcript_is_bound)
+{
+        for (auto side: { 0, 1 }) {
+                session client(session::client, psk);
+                session server(session::server, psk);
+
+                auto req = client.request(random_nonce());
+                auto forged = req;
+
+                if (!side) {
+                        forged.back() ^= 0x80;
+                }
+
+                auto rep = server.reply(forged, random_nonce());
+
+                if (side) {
+                        rep.back() ^= 0x80;
+                }
+
+                client.finish(rep);
+
+                auto in = server.seal(to_bytes("OP_REP_IMPORT")); // busid, speed, devid
+                bytes out;
+
+                EXPECT_THROW(client.open(in, out), auth_error) << side;
+        }
+}
+
+TEST(crypto, refused)
+{
+        session client(session::client, psk);
+        client.request(random_nonce());
+
+        session server(session::server, psk);
+        auto rep = server.reply(session(session::client, psk).request(random_nonce()), random_nonce());
+        rep[7] = 1; // status
+
+        EXPECT_THROW(client.finish(rep), std::runtime_error);
+        EXPECT_FALSE(client.ready());
+}
+
+TEST(crypto, replay_reorder_tamper)
+{
+        session client(session::client, psk);
+        session server(session::server, psk);
+        handshake(client, server);
+
+        auto r0 = client.seal(to_bytes("first"));
+        auto r1 = client.seal(to_bytes("second"));
+
+        bytes out;
+        {
+                auto in = r1;
+                EXPECT_THROW(server.open(in, out), auth_error) << "reordered";
+        }
+
+        session client2(session::client, psk);
+        session server2(session::server, psk);
+        handshake(client2, server2);
+
+        auto a = client2.seal(to_bytes("first"));
+        auto in = a;
+        server2.open(in, out);
+        EXPECT_EQ(out, to_bytes("first"));
+
+        in = a;
+        EXPECT_THROW(server2.open(in, out), auth_error) << "replayed";
+
+        for (size_t i = 0; i < r0.size(); ++i) {
+                session c(session::client, psk);
+                session s(session::server, psk);
+                handshake(c, s);
+
+                auto rec = c.seal(to_bytes("first"));
+                rec[i] ^= 1;
+
+                bytes plain;
+                if (i < CRYPTO_HDR_SIZE) { // a longer record is incomplete, a shorter one fails the check
+                        try {
+                                s.open(rec, plain);
+                        } catch (auth_error&) {
+                        }
+                } else {
+                        EXPECT_THROW(s.open(rec, plain), auth_error) << i;
+                }
+                EXPECT_TRUE(plain.empty());
+        }
+}
+
+TEST(crypto, record_length)
+{
+        session client(session::client, psk);
+        session server(session::server, psk);
+        handshake(client, server);
+
+        EXPECT_THROW(client.seal({}), std::invalid_argument);
+
+        bytes in{ 0, 0, 0, 0, 1, 2, 3 }; // zero length
+        bytes out;
+        EXPECT_THROW(server.open(in, out), std::runtime_error);
+
+        in = { 0xFF, 0xFF, 0xFF, 0xFF };
+        EXPECT_THROW(server.open(in, out), std::runtime_error);
+}
+
+TEST(crypto, parse_key)
+{
+        EXPECT_EQ(parse_key("000102030405060708090A0B0C0D0E0F"), psk);
+        EXPECT_THROW(parse_key("000102030405060708090a0b0c0d0e"), std::invalid_argument);
+        EXPECT_THROW(parse_key("000102030405060708090a0b0c0d0e0g"), std::invalid_argument);
+        EXPECT_THROW(parse_key(""), std::invalid_argument);
+}
+
+int tcp_socket()
+{
+        auto fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        return fd;
+}
+
+int listen_any(int &port)
+{
+        auto fd = tcp_socket();
+
+        sockaddr_in addr{ .sin_family = AF_INET, .sin_addr{ htonl(INADDR_LOOPBACK) } };
+        socklen_t len = sizeof(addr);
+
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), len) || listen(fd, 1) ||
+            getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len)) {
+                close(fd);
+                return -1;
+        }
+
+        port = ntohs(addr.sin_port);
+        return fd;
+}
+
+bool send_all(int fd, const bytes &b)
+{
+        return send(fd, b.data(), b.size(), MSG_NOSIGNAL) == ssize_t(b.size());
+}
+
+bool recv_all(int fd, bytes &b, size_t len)
+{
+        b.resize(len);
+        for (size_t pos = 0; pos < len; ) {
+                auto n = recv(fd, b.data() + pos, len - pos, 0);
+                if (n <= 0) {
+                        return false;
+                }
+                pos += n;
+        }
+        return true;
+}
+
+/*
+ * usbip-crypto-peer in front of a fake usbipd that echoes everything it receives.
+ * The client is this test that speaks the protocol of the driver.
+ */
+TEST(crypto, peer_relays_to_usbipd)
+{
+        int usbipd_port{};
+        auto usbipd = listen_any(usbipd_port);
+        ASSERT_GE(usbipd, 0);
+
+        std::thread echo([usbipd]
+        {
+                auto fd = accept(usbipd, nullptr, nullptr);
+                unsigned char buf[4096];
+                for (ssize_t n; (n = recv(fd, buf, sizeof(buf), 0)) > 0; ) {
+                        send(fd, buf, n, MSG_NOSIGNAL);
+                }
+                close(fd);
+        });
+
+        int peer_port{};
+        close(listen_any(peer_port)); // a free port
+
+        int key_pipe[2];
+        ASSERT_FALSE(pipe(key_pipe));
+
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_adddup2(&fa, key_pipe[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&fa, key_pipe[1]);
+
+        auto listen_arg = std::to_string(peer_port);
+        auto usbipd_arg = "127.0.0.1:" + std::to_string(usbipd_port);
+
+        const char *argv[] { USBIP_CRYPTO_PEER, "--key-file", "-", "--listen", listen_arg.c_str(),
+                             "--usbipd", usbipd_arg.c_str(), nullptr };
+
+        pid_t pid{};
+        ASSERT_FALSE(posix_spawn(&pid, USBIP_CRYPTO_PEER, &fa, nullptr, const_cast<char**>(argv), environ));
+        posix_spawn_file_actions_destroy(&fa);
+
+        close(key_pipe[0]);
+        std::string key_line = "000102030405060708090a0b0c0d0e0f\n";
+        ASSERT_EQ(write(key_pipe[1], key_line.data(), key_line.size()), ssize_t(key_line.size()));
+        close(key_pipe[1]);
+
+        int fd = -1;
+        for (int i = 0; i < 100 && fd < 0; ++i) {
+                fd = tcp_socket();
+                sockaddr_in addr{ .sin_family = AF_INET, .sin_port = htons(peer_port), .sin_addr{ htonl(INADDR_LOOPBACK) } };
+                if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+                        close(fd);
+                        fd = -1;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+        }
+        ASSERT_GE(fd, 0) << "usbip-crypto-peer does not listen";
+
+        session client(session::client, psk);
+
+        ASSERT_TRUE(send_all(fd, client.request(random_nonce())));
+
+        bytes rep;
+        ASSERT_TRUE(recv_all(fd, rep, CRYPTO_HELLO_SIZE));
+        client.finish(rep);
+
+        auto pt = to_bytes("OP_REQ_IMPORT and some CMD_SUBMIT");
+        ASSERT_TRUE(send_all(fd, client.seal(pt)));
+
+        bytes in;
+        bytes out;
+
+        while (out.size() < pt.size()) {
+                unsigned char buf[4096];
+                auto n = recv(fd, buf, sizeof(buf), 0);
+                ASSERT_GT(n, 0);
+                in.insert(in.end(), buf, buf + n);
+                client.open(in, out);
+        }
+
+        EXPECT_EQ(out, pt);
+
+        auto forged = client.seal(pt);
+        forged.back() ^= 1;
+        ASSERT_TRUE(send_all(fd, forged));
+
+        unsigned char buf[1];
+        EXPECT_EQ(recv(fd, buf, sizeof(buf), 0), 0) << "the peer must close the connection";
+
+        close(fd);
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+
+        echo.join();
+        close(usbipd);
+}
+
+} // namespace
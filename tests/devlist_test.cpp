@@ -0,0 +1,199 @@
+#include <libusbip/devlist.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip;
+
+auto make_device(int n, UINT8 num_ifs)
+{
+        usbip_usb_device d{};
+
+        snprintf(d.path, sizeof(d.path), "/sys/devices/pci0000:00/usb1/1-%d", n);
+        snprintf(d.busid, sizeof(d.busid), "1-%d", n);
+
+        d.busnum = 1;
+        d.devnum = n;
+        d.speed = 3;
+        d.idVendor = 0x1005;
+        d.idProduct = static_cast<UINT16>(0xb100 + n);
+        d.bcdDevice = 0x0100;
+        d.bNumConfigurations = 1;
+        d.bNumInterfaces = num_ifs;
+
+        return d;
+}
+
+/*
+ * OP_REP_DEVLIST after op_common in network byte order.
+ */
+auto encode(const std::vector<usbip_usb_device> &devs, UINT32 ndev)
+{
+        std::vector<char> v;
+
+        auto put = [&v] (const void *p, size_t len)
+        {
+                auto c = static_cast<const char*>(p);
+                v.insert(v.end(), c, c + len);
+        };
+
+        op_devlist_reply reply{ ndev };
+        PACK_OP_DEVLIST_REPLY(1, &reply);
+        put(&reply, sizeof(reply));
+
+        for (auto d: devs) {
+                auto num_ifs = d.bNumInterfaces;
+
+                usbip_net_pack_usb_device(1, &d);
+                put(&d, sizeof(d));
+
+                for (UINT8 i = 0; i < num_ifs; ++i) {
+                        usbip_usb_interface intf{ 0xFF, i, UINT8(i + 1), 0 };
+                        put(&intf, sizeof(intf));
+                }
+        }
+
+        return v;
+}
+
+/*
+ * Hands out the data by chunks of the given size like recv.
+ */
+auto reader(const std::vector<char> &data, size_t chunk, size_t *calls = nullptr)
+{
+        return [&data, chunk, calls, pos = size_t()] (void *buf, size_t len) mutable
+        {
+                if (calls) {
+                        ++*calls;
+                }
+
+                auto n = std::min({ len, chunk, data.size() - pos });
+                memcpy(buf, data.data() + pos, n);
+                pos += n;
+                return static_cast<int>(n);
+        };
+}
+
+void check(const std::vector<exported_device> &devs, const std::vector<usbip_usb_device> &expected)
+{
+        ASSERT_EQ(devs.size(), expected.size());
+
+        for (size_t i = 0; i < devs.size(); ++i) {
+                auto &d = devs[i];
+                EXPECT_FALSE(memcmp(&d.udev, &expected[i], sizeof(d.udev))) << i;
+
+                ASSERT_EQ(d.interfaces.size(), expected[i].bNumInterfaces);
+                for (size_t j = 0; j < d.interfaces.size(); ++j) {
+                        EXPECT_EQ(d.interfaces[j].bInterfaceClass, 0xFF);
+                        EXPECT_EQ(d.interfaces[j].bInterfaceSubClass, j);
+                        EXPECT_EQ(d.interfaces[j].bInterfaceProtocol, j + 1);
+                }
+        }
+}
+
+TEST(devlist, empty)
+{
+        auto data = encode({}, 0);
+        BufferedReader rd(reader(data, data.size()));
+
+        std::vector<exported_device> devs(1);
+        std::string error;
+
+        EXPECT_TRUE(read_devlist(rd, devs, error)) << error;
+        EXPECT_TRUE(devs.empty());
+}
+
+TEST(devlist, chunked)
+{
+        std::vector<usbip_usb_device> expected;
+        for (int i = 1; i <= 20; ++i) {
+                expected.push_back(make_device(i, UINT8(i % 4)));
+        }
+
+        auto data = encode(expected, UINT32(expected.size()));
+
+        for (size_t chunk: { size_t(1), size_t(7), sizeof(usbip_usb_device) + 1, data.size() }) {
+                size_t calls{};
+                BufferedReader rd(reader(data, chunk, &calls));
+
+                std::vector<exported_device> devs;
+                std::string error;
+
+                ASSERT_TRUE(read_devlist(rd, devs, error)) << "chunk " << chunk << ": " << error;
+                check(devs, expected);
+
+                EXPECT_EQ(calls, (data.size() + chunk - 1)/chunk) << "chunk " << chunk;
+        }
+}
+
+/*
+ * The buffer is a bit larger than a record, its tail is moved to the beginning almost on every get.
+ */
+TEST(devlist, small_buffer)
+{
+        std::vector<usbip_usb_device> expected;
+        for (int i = 1; i <= 10; ++i) {
+                expected.push_back(make_device(i, 3));
+        }
+
+        auto data = encode(expected, UINT32(expected.size()));
+
+        for (size_t extra: { 0, 1, 5, 100 }) {
+                BufferedReader rd(reader(data, data.size()), sizeof(usbip_usb_device) + extra);
+
+                std::vector<exported_device> devs;
+                std::string error;
+
+                ASSERT_TRUE(read_devlist(rd, devs, error)) << "extra " << extra << ": " << error;
+                check(devs, expected);
+        }
+}
+
+TEST(devlist, short_reply)
+{
+        std::vector<usbip_usb_device> v{ make_device(1, 2), make_device(2, 1) };
+        auto data = encode(v, UINT32(v.size()));
+
+        for (size_t len = 0; len < data.size(); ++len) {
+                std::vector<char> cut(data.begin(), data.begin() + len);
+                BufferedReader rd(reader(cut, 16));
+
+                std::vector<exported_device> devs;
+                std::string error;
+
+                EXPECT_FALSE(read_devlist(rd, devs, error)) << len;
+                EXPECT_FALSE(error.empty());
+        }
+}
+
+TEST(devlist, ndev_mismatch)
+{
+        std::vector<usbip_usb_device> v{ make_device(1, 0), make_device(2, 0) };
+        auto data = encode(v, 3);
+
+        BufferedReader rd(reader(data, data.size()));
+
+        std::vector<exported_device> devs;
+        std::string error;
+
+        EXPECT_FALSE(read_devlist(rd, devs, error));
+        EXPECT_EQ(error, "failed to recv devlist: usbip_usb_device[2]");
+}
+
+TEST(devlist, recv_error)
+{
+        BufferedReader rd([] (void*, size_t) { return -1; });
+
+        std::vector<exported_device> devs;
+        std::string error;
+
+        EXPECT_FALSE(read_devlist(rd, devs, error));
+        EXPECT_EQ(error, "failed to recv devlist");
+}
+
+} // namespace
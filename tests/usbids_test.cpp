@@ -0,0 +1,179 @@
+#include <usbids/compiler.h>
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+
+using namespace std::string_view_literals;
+
+const char sample[] =
+"#\n"
+"# List of USB ID's\n"
+"#\n"
+"0001  Fry's Electronics\n"
+"\t7778  Counterfeit flash drive [Kingston]\n"
+"1005  Apacer Technology, Inc.\n"
+"\t1001  MP3 Player\n"
+"\tb113  Handy Steno/AH123 / Handy Steno 2.0/HT203\n"
+"\t\t00  interfaces are not indexed\n"
+"ffff  The last vendor\n"
+"\n"
+"# List of known device classes, subclasses and protocols\n"
+"C 00  (Defined at Interface level)\n"
+"C 03  Human Interface Device\n"
+"\t00  No Subclass\n"
+"\t01  Boot Interface Subclass\n"
+"\t\t00  None\n"
+"\t\t01  Keyboard\n"
+"\t\t02  Mouse\n"
+"C ff  Vendor Specific Class\n"
+"\tff  Vendor Specific Subclass\n"
+"\t\tff  Vendor Specific Protocol\n"
+"\n"
+"# List of Audio Class Terminal Types\n"
+"AT 0100  USB Undefined\n";
+
+auto compile(std::string_view text)
+{
+        std::string error;
+        auto index = usbids::compile(text, error);
+        EXPECT_FALSE(index.empty()) << error;
+        return index;
+}
+
+void check_sample(const UsbIds &ids)
+{
+        ASSERT_TRUE(ids);
+
+        EXPECT_EQ(ids.find_product(0x1005, 0xb113), std::make_pair("Apacer Technology, Inc."sv,
+                                                                   "Handy Steno/AH123 / Handy Steno 2.0/HT203"sv));
+        EXPECT_EQ(ids.find_product(0x1005, 0x1001).second, "MP3 Player");
+        EXPECT_EQ(ids.find_product(0x0001, 0x7778).second, "Counterfeit flash drive [Kingston]");
+        EXPECT_EQ(ids.find_product(0xffff, 0).first, "The last vendor");
+
+        EXPECT_EQ(ids.find_product(0x1005, 0x0000), std::make_pair("Apacer Technology, Inc."sv, ""sv));
+        EXPECT_EQ(ids.find_product(0x0001, 0x1001), std::make_pair("Fry's Electronics"sv, ""sv)) << "product of other vendor";
+        EXPECT_EQ(ids.find_product(0x1004, 0xb113), std::make_pair(""sv, ""sv));
+
+        EXPECT_EQ(ids.find_class_subclass_proto(0, 0, 0), std::make_tuple("(Defined at Interface level)"sv, ""sv, ""sv));
+        EXPECT_EQ(ids.find_class_subclass_proto(3, 1, 2), std::make_tuple("Human Interface Device"sv,
+                                                                          "Boot Interface Subclass"sv, "Mouse"sv));
+        EXPECT_EQ(ids.find_class_subclass_proto(3, 0, 1), std::make_tuple("Human Interface Device"sv, "No Subclass"sv, ""sv));
+        EXPECT_EQ(ids.find_class_subclass_proto(0xff, 0xff, 0xff), std::make_tuple("Vendor Specific Class"sv,
+                                                                                   "Vendor Specific Subclass"sv,
+                                                                                   "Vendor Specific Protocol"sv));
+        EXPECT_EQ(ids.find_class_subclass_proto(9, 0, 0), std::make_tuple(""sv, ""sv, ""sv));
+}
+
+TEST(usbids, lookups)
+{
+        auto index = compile(sample);
+        check_sample(UsbIds(index));
+}
+
+TEST(usbids, crlf)
+{
+        std::string text;
+        for (auto c: std::string_view(sample)) {
+                if (c == '\n') {
+                        text += '\r';
+                }
+                text += c;
+        }
+
+        auto index = compile(text);
+        EXPECT_EQ(index, compile(sample));
+}
+
+TEST(usbids, empty)
+{
+        std::string error;
+
+        EXPECT_TRUE(usbids::compile("", error).empty());
+        EXPECT_FALSE(error.empty());
+
+        error.clear();
+        EXPECT_TRUE(usbids::compile("1005  Apacer Technology, Inc.\n", error).empty()) << "no classes";
+        EXPECT_FALSE(error.empty());
+}
+
+TEST(usbids, usb_ids_file)
+{
+        std::ifstream in(USBIP_USB_IDS, std::ios::binary);
+        ASSERT_TRUE(in) << USBIP_USB_IDS;
+
+        std::ostringstream os;
+        os << in.rdbuf();
+
+        auto index = compile(os.str());
+        UsbIds ids(index);
+        ASSERT_TRUE(ids);
+
+        EXPECT_EQ(ids.find_product(0x1005, 0xb113), std::make_pair("Apacer Technology, Inc."sv,
+                                                                   "Handy Steno/AH123 / Handy Steno 2.0/HT203"sv));
+        EXPECT_EQ(std::get<0>(ids.find_class_subclass_proto(9, 0, 0)), "Hub");
+        EXPECT_EQ(std::get<2>(ids.find_class_subclass_proto(3, 1, 1)), "Keyboard");
+}
+
+TEST(usbids, corrupt_index)
+{
+        using namespace usbids;
+
+        const auto good = compile(sample);
+        auto hdr = [] (std::string &s) { return reinterpret_cast<header*>(s.data()); };
+
+        std::vector<std::pair<const char*, std::string>> v;
+
+        auto add = [&] (const char *what, auto &&corrupt)
+        {
+                auto s = good;
+                corrupt(s);
+                v.emplace_back(what, std::move(s));
+        };
+
+        add("magic", [&] (auto &s) { hdr(s)->magic[0] = 'X'; });
+        add("version", [&] (auto &s) { ++hdr(s)->version; });
+        add("truncated header", [&] (auto &s) { s.resize(sizeof(header) - 1); });
+        add("truncated strings", [&] (auto &s) { s.pop_back(); });
+        add("truncated records", [&] (auto &s) { s.resize(hdr(s)->sections[SEC_STRINGS].offset - 1); });
+        add("offset", [&] (auto &s) { hdr(s)->sections[SEC_PRODUCT].offset = uint32_t(s.size() + 16); });
+        add("misaligned", [&] (auto &s) { ++hdr(s)->sections[SEC_CLASS].offset; });
+        add("count", [&] (auto &s) { hdr(s)->sections[SEC_VENDOR].count = UINT32_MAX; });
+        add("strings", [&] (auto &s) { hdr(s)->sections[SEC_STRINGS].count += 1; });
+
+        for (auto &[what, s]: v) {
+                UsbIds ids(s);
+                EXPECT_FALSE(ids) << what;
+                EXPECT_EQ(ids.find_product(0x1005, 0xb113), std::make_pair(""sv, ""sv)) << what;
+        }
+
+        ASSERT_TRUE(UsbIds(good));
+}
+
+/*
+ * Children out of range of the next level are not looked up.
+ */
+TEST(usbids, corrupt_record)
+{
+        using namespace usbids;
+
+        auto s = compile(sample);
+        auto &hdr = *reinterpret_cast<header*>(s.data());
+        auto vendors = reinterpret_cast<record*>(s.data() + hdr.sections[SEC_VENDOR].offset);
+
+        ASSERT_EQ(vendors[1].id, 0x1005);
+        vendors[1].first = hdr.sections[SEC_PRODUCT].count;
+        vendors[1].name = uint32_t(s.size());
+
+        UsbIds ids(s);
+        ASSERT_TRUE(ids);
+
+        EXPECT_EQ(ids.find_product(0x1005, 0xb113), std::make_pair(""sv, ""sv));
+        EXPECT_EQ(ids.find_product(0x0001, 0x7778).second, "Counterfeit flash drive [Kingston]");
+}
+
+} // namespace
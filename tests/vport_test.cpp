@@ -0,0 +1,126 @@
+#include <usbip/vport.h>
+
+#include <gtest/gtest.h>
+
+#include <set>
+#include <vector>
+
+namespace
+{
+
+TEST(vport, numbers_of_fixed_ports_are_kept)
+{
+        for (auto version: vhci_list) {
+                for (int rhport = 1; rhport <= VHCI_DEFAULT_PORTS; ++rhport) {
+                        EXPECT_EQ(make_vport(version, rhport), int(VHCI_DEFAULT_PORTS)*version + rhport);
+                }
+        }
+}
+
+TEST(vport, round_trip)
+{
+        std::set<int> seen;
+
+        for (auto version: vhci_list) {
+                for (int rhport = 1; rhport <= VHCI_MAX_PORTS; ++rhport) {
+                        auto vport = make_vport(version, rhport);
+                        ASSERT_TRUE(is_valid_vport(vport)) << vport;
+                        EXPECT_EQ(get_hci_version(vport), version);
+                        EXPECT_EQ(get_rhport(vport), rhport);
+                        EXPECT_TRUE(seen.insert(vport).second) << vport;
+                }
+        }
+
+        EXPECT_EQ(seen.size(), size_t(USBIP_TOTAL_PORTS));
+}
+
+class hubs : public testing::TestWithParam<int> {}; // the number of ports of HCI
+
+TEST_P(hubs, cover_ports_of_hci)
+{
+        auto num_ports = GetParam();
+
+        for (auto version: vhci_list) {
+                auto num_hubs = vhci_num_hubs(version, num_ports);
+                ASSERT_GT(num_hubs, 0);
+                ASSERT_LE(num_hubs, VHCI_MAX_HUBS);
+
+                int total = 0;
+
+                for (int hub = 0; hub < num_hubs; ++hub) {
+                        auto n = vhub_num_ports(version, num_ports, hub);
+                        ASSERT_GT(n, 0);
+                        ASSERT_LE(n, vhub_max_ports(version));
+
+                        for (int port = 1; port <= n; ++port) {
+                                auto rhport = make_rhport(version, hub, port);
+                                ASSERT_EQ(rhport, ++total);
+                                EXPECT_EQ(get_hub_index(version, rhport), hub);
+                                EXPECT_EQ(get_hub_port(version, rhport), port);
+                        }
+                }
+
+                EXPECT_EQ(total, num_ports);
+        }
+}
+
+/*
+ * The same steps as the driver does: a table of vpdo per hub, a device takes the first free port
+ * of the first hub that has one, see vhub_attach_vpdo and vhci_find_vpdo.
+ */
+TEST_P(hubs, attach_all_ports)
+{
+        auto num_ports = GetParam();
+
+        for (auto version: vhci_list) {
+                std::vector<std::vector<int>> vhubs(vhci_num_hubs(version, num_ports));
+                for (int i = 0; i < int(vhubs.size()); ++i) {
+                        vhubs[i].resize(vhub_num_ports(version, num_ports, i));
+                }
+
+                auto attach = [&vhubs, version] (int dev)
+                {
+                        for (int hub = 0; hub < int(vhubs.size()); ++hub) {
+                                auto &v = vhubs[hub];
+                                for (int i = 0; i < int(v.size()); ++i) {
+                                        if (!v[i]) {
+                                                v[i] = dev;
+                                                return make_vport(version, make_rhport(version, hub, i + 1));
+                                        }
+                                }
+                        }
+                        return 0;
+                };
+
+                auto find = [&vhubs, version] (int vport) -> int&
+                {
+                        auto rhport = get_rhport(vport);
+                        return vhubs.at(get_hub_index(version, rhport)).at(get_hub_port(version, rhport) - 1);
+                };
+
+                std::vector<int> vports;
+
+                for (int dev = 1; dev <= num_ports; ++dev) {
+                        auto vport = attach(dev);
+                        ASSERT_TRUE(is_valid_vport(vport));
+                        EXPECT_EQ(get_hci_version(vport), version);
+                        EXPECT_EQ(find(vport), dev);
+                        vports.push_back(vport);
+                }
+
+                EXPECT_FALSE(attach(num_ports + 1)) << "all ports are used";
+                EXPECT_EQ(std::set<int>(vports.begin(), vports.end()).size(), vports.size());
+
+                for (size_t i = 0; i < vports.size(); i += 2) {
+                        find(vports[i]) = 0;
+                }
+
+                for (size_t i = 0; i < vports.size(); i += 2) {
+                        EXPECT_EQ(attach(-1), vports[i]) << "the first free port is reused";
+                }
+        }
+}
+
+INSTANTIATE_TEST_SUITE_P(num_ports, hubs, testing::Values(1, 15, 16, 30, 255, 256, 1000, int(VHCI_MAX_PORTS)));
+
+} // namespace
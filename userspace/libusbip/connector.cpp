@@ -0,0 +1,294 @@
+#include "connector.h"
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/select.h>
+  #include <unistd.h>
+  #include <cerrno>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip::net;
+
+struct attempt_tag {};
+using attempt_socket = usbip::generic_handle<socket_t, attempt_tag, invalid_socket>;
+
+} // namespace
+
+
+namespace usbip
+{
+
+template<>
+inline void close_handle(attempt_socket::type s, attempt_socket::tag_type) noexcept
+{
+#ifdef _WIN32
+        closesocket(s);
+#else
+        close(s);
+#endif
+}
+
+} // namespace usbip
+
+
+namespace
+{
+
+auto set_nonblocking(socket_t s, bool enable)
+{
+#ifdef _WIN32
+        u_long val = enable;
+        return !ioctlsocket(s, FIONBIO, &val);
+#else
+        auto flags = fcntl(s, F_GETFL);
+        return flags != -1 && fcntl(s, F_SETFL, enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) != -1;
+#endif
+}
+
+auto connect_in_progress()
+{
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EINPROGRESS;
+#endif
+}
+
+/*
+ * Linux reports a refused connection as writable, Windows as an exception.
+ */
+auto connect_error(socket_t s)
+{
+        int err{};
+        socklen_t len = sizeof(err);
+
+        return getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len) ? -1 : err;
+}
+
+struct attempt
+{
+        attempt_socket sock;
+        const address *addr;
+        clock_type::time_point deadline;
+};
+
+/*
+ * @return true if connection is in progress or established
+ */
+auto start(attempt &a, const address &addr, clock_type::time_point now)
+{
+        a.sock.reset(socket(addr.family, addr.socktype, addr.protocol));
+        if (!a.sock) {
+                return false;
+        }
+
+        a.addr = &addr;
+        a.deadline = now + connection_attempt_timeout;
+
+        if (!set_nonblocking(a.sock.get(), true)) {
+                return false;
+        }
+
+        return !connect(a.sock.get(), reinterpret_cast<const sockaddr*>(&addr.addr), addr.addrlen) ||
+               connect_in_progress();
+}
+
+auto to_timeval(clock_type::duration d)
+{
+        auto ms = std::chrono::duration_cast<milliseconds>(std::max(d, clock_type::duration::zero())).count();
+        return timeval{ static_cast<long>(ms / 1000), static_cast<long>(ms % 1000 * 1000) };
+}
+
+} // namespace
+
+
+bool usbip::net::operator ==(const address &a, const address &b)
+{
+        return a.addrlen == b.addrlen && !memcmp(&a.addr, &b.addr, a.addrlen);
+}
+
+std::vector<address> usbip::net::interleave(std::vector<address> v)
+{
+        if (v.empty()) {
+                return v;
+        }
+
+        auto mid = std::stable_partition(v.begin(), v.end(), [family = v.front().family] (auto &a)
+        {
+                return a.family == family;
+        });
+
+        std::vector<address> r;
+        r.reserve(v.size());
+
+        for (auto a = v.begin(), b = mid; a != mid || b != v.end(); ) {
+                if (a != mid) {
+                        r.push_back(*a++);
+                }
+                if (b != v.end()) {
+                        r.push_back(*b++);
+                }
+        }
+
+        return r;
+}
+
+bool usbip::net::address_cache::get(const std::string &key, std::vector<address> &addrs, clock_type::time_point now)
+{
+        std::lock_guard lock(m_mtx);
+
+        auto i = m_entries.find(key);
+        if (i == m_entries.end()) {
+                return false;
+        } else if (now >= i->second.expires) {
+                m_entries.erase(i);
+                return false;
+        }
+
+        addrs = i->second.addrs;
+        return true;
+}
+
+void usbip::net::address_cache::put(const std::string &key, std::vector<address> addrs, clock_type::time_point now)
+{
+        std::lock_guard lock(m_mtx);
+        m_entries[key] = entry{ std::move(addrs), now + m_ttl };
+}
+
+void usbip::net::address_cache::remember(const std::string &key, const address *winner)
+{
+        std::lock_guard lock(m_mtx);
+
+        auto i = m_entries.find(key);
+        if (i == m_entries.end()) {
+                return;
+        } else if (!winner) {
+                m_entries.erase(i);
+                return;
+        }
+
+        auto &v = i->second.addrs;
+
+        if (auto pos = std::find(v.begin(), v.end(), *winner); pos != v.end()) {
+                std::rotate(v.begin(), pos, pos + 1);
+        }
+}
+
+int usbip::net::resolve(const char *hostname, const char *port, std::vector<address> &addrs, address_cache *cache)
+{
+        auto key = cache_key(hostname, port);
+
+        if (cache && cache->get(key, addrs)) {
+                return 0;
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo *res{};
+        if (auto err = getaddrinfo(hostname, port, &hints, &res)) {
+                return err;
+        }
+
+        std::vector<address> v;
+
+        for (auto rp = res; rp; rp = rp->ai_next) {
+                address a{ rp->ai_family, rp->ai_socktype, rp->ai_protocol, static_cast<int>(rp->ai_addrlen), {} };
+                if (rp->ai_addrlen <= sizeof(a.addr)) {
+                        memcpy(&a.addr, rp->ai_addr, rp->ai_addrlen);
+                        v.push_back(a);
+                }
+        }
+
+        freeaddrinfo(res);
+
+        addrs = interleave(std::move(v));
+        if (cache && !addrs.empty()) {
+                cache->put(key, addrs);
+        }
+
+        return 0;
+}
+
+socket_t usbip::net::race(const std::vector<address> &addrs, milliseconds timeout, const address* &winner,
+                          milliseconds attempt_delay)
+{
+        std::vector<attempt> pending;
+        pending.reserve(std::min(addrs.size(), size_t(FD_SETSIZE)));
+
+        auto now = clock_type::now();
+        auto deadline = now + timeout;
+        auto next_start = now;
+
+        for (auto next = addrs.begin(); now < deadline; now = clock_type::now()) {
+
+                if (next != addrs.end() && (now >= next_start || pending.empty()) && pending.size() < FD_SETSIZE) {
+                        attempt a;
+                        if (start(a, *next++, now)) {
+                                pending.push_back(std::move(a));
+                                next_start = now + attempt_delay;
+                        } else {
+                                next_start = now;
+                        }
+                        continue;
+                }
+
+                std::erase_if(pending, [now] (auto &a) { return now >= a.deadline; });
+
+                if (pending.empty()) {
+                        if (next == addrs.end()) {
+                                break;
+                        }
+                        continue;
+                }
+
+                fd_set wr;
+                fd_set ex;
+                FD_ZERO(&wr);
+                FD_ZERO(&ex);
+
+                auto wakeup = deadline;
+                if (next != addrs.end()) {
+                        wakeup = std::min(wakeup, next_start);
+                }
+
+                socket_t maxfd{};
+
+                for (auto &a: pending) {
+                        FD_SET(a.sock.get(), &wr);
+                        FD_SET(a.sock.get(), &ex);
+                        maxfd = std::max(maxfd, a.sock.get());
+                        wakeup = std::min(wakeup, a.deadline);
+                }
+
+                auto tv = to_timeval(wakeup - now);
+                if (select(static_cast<int>(maxfd) + 1, nullptr, &wr, &ex, &tv) < 0) { // nfds is ignored by Winsock
+                        break;
+                }
+
+                for (auto i = pending.begin(); i != pending.end(); ) {
+                        auto s = i->sock.get();
+                        auto failed = FD_ISSET(s, &ex) || (FD_ISSET(s, &wr) && connect_error(s));
+
+                        if (failed) {
+                                i = pending.erase(i);
+                                next_start = now; // start the next attempt without delay
+                        } else if (FD_ISSET(s, &wr)) {
+                                winner = i->addr;
+                                set_nonblocking(s, false);
+                                return i->sock.release();
+                        } else {
+                                ++i;
+                        }
+                }
+        }
+
+        return invalid_socket;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * Happy Eyeballs Version 2 (RFC 8305) of usbip_net_tcp_connect, it does not depend on Windows.
+ * It is built by libusbip.vcxproj and on POSIX, see userspace/CMakeLists.txt.
+ */
+
+#include "generic_handle.h"
+
+#ifdef _WIN32
+  #include <WinSock2.h>
+  #include <ws2tcpip.h>
+#else
+  #include <netdb.h>
+  #include <sys/socket.h>
+#endif
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace usbip::net
+{
+
+#ifdef _WIN32
+  using socket_t = SOCKET;
+  inline constexpr socket_t invalid_socket = INVALID_SOCKET;
+#else
+  using socket_t = int;
+  inline constexpr socket_t invalid_socket = -1;
+#endif
+
+using clock_type = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+constexpr milliseconds connection_attempt_delay(250);
+constexpr milliseconds connection_attempt_timeout(5'000);
+constexpr milliseconds resolve_cache_ttl(60'000);
+
+struct address
+{
+        int family;
+        int socktype;
+        int protocol;
+        int addrlen;
+        sockaddr_storage addr;
+};
+
+bool operator ==(const address &a, const address &b);
+
+/*
+ * Interleave address families, the first family is the one that getaddrinfo prefers.
+ */
+std::vector<address> interleave(std::vector<address> v);
+
+/*
+ * Resolved addresses of "host:port" in order of connection attempts.
+ */
+class address_cache
+{
+public:
+        explicit address_cache(clock_type::duration ttl = resolve_cache_ttl) : m_ttl(ttl) {}
+
+        bool get(const std::string &key, std::vector<address> &addrs, clock_type::time_point now = clock_type::now());
+        void put(const std::string &key, std::vector<address> addrs, clock_type::time_point now = clock_type::now());
+
+        /*
+         * The address that has connected will be tried first next time.
+         * @param winner nullptr if all addresses have failed, the host will be resolved again
+         */
+        void remember(const std::string &key, const address *winner);
+
+private:
+        struct entry
+        {
+                std::vector<address> addrs;
+                clock_type::time_point expires;
+        };
+
+        clock_type::duration m_ttl;
+
+        std::mutex m_mtx;
+        std::map<std::string, entry> m_entries;
+};
+
+inline auto cache_key(const char *hostname, const char *port)
+{
+        return std::string(hostname).append(":").append(port);
+}
+
+/*
+ * Uses the cache if it is not null and stores the result in it.
+ * @return zero or the error of getaddrinfo
+ */
+int resolve(const char *hostname, const char *port, std::vector<address> &addrs, address_cache *cache);
+
+/*
+ * Start a new attempt every attempt_delay or immediately if the previous one has failed.
+ * The first connected socket wins, other attempts are abandoned.
+ * @param winner points to the element of addrs that has connected
+ * @return blocking connected socket that the caller must close, or invalid_socket
+ */
+socket_t race(const std::vector<address> &addrs, milliseconds timeout, const address* &winner,
+              milliseconds attempt_delay = connection_attempt_delay);
+
+} // namespace usbip::net
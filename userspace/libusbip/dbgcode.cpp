@@ -17,7 +17,8 @@ const char *dbg_errcode(int err)
 	{
                 "ERR_NONE", "ERR_GENERAL", "ERR_INVARG", "ERR_NETWORK", "ERR_VERSION", 
                 "ERR_PROTOCOL", "ERR_STATUS", "ERR_EXIST", "ERR_NOTEXIST", "ERR_DRIVER", 
-                "ERR_PORTFULL", "ERR_ACCESS", "ERR_CERTIFICATE", "ERR_USB_VER"
+                "ERR_PORTFULL", "ERR_ACCESS", "ERR_CERTIFICATE", "ERR_USB_VER",
+                "ERR_STREAMS"
 	};
 
 	if (err < 0) {
@@ -0,0 +1,66 @@
+#include "devlist.h"
+
+#include <cassert>
+#include <cstring>
+
+void *usbip::BufferedReader::fetch(size_t len)
+{
+        assert(len <= m_buf.size());
+
+        if (m_end - m_pos < len && m_buf.size() - m_pos < len) { // move the tail to the beginning
+                memmove(m_buf.data(), m_buf.data() + m_pos, m_end - m_pos);
+                m_end -= m_pos;
+                m_pos = 0;
+        }
+
+        while (m_end - m_pos < len) {
+                auto n = m_recv(m_buf.data() + m_end, m_buf.size() - m_end);
+                if (n <= 0) {
+                        return nullptr;
+                }
+                m_end += n;
+        }
+
+        auto p = m_buf.data() + m_pos;
+        m_pos += len;
+        return p;
+}
+
+bool usbip::read_devlist(BufferedReader &rd, std::vector<exported_device> &devs, std::string &error)
+{
+        devs.clear();
+
+        auto reply = rd.get<op_devlist_reply>();
+        if (!reply) {
+                error = "failed to recv devlist";
+                return false;
+        }
+
+        PACK_OP_DEVLIST_REPLY(0, reply);
+        auto ndev = reply->ndev; // reply is valid until the next get
+
+        for (UINT32 i = 0; i < ndev; ++i) {
+
+                auto udev = rd.get<usbip_usb_device>();
+                if (!udev) {
+                        error = "failed to recv devlist: usbip_usb_device[" + std::to_string(i) + ']';
+                        return false;
+                }
+
+                usbip_net_pack_usb_device(0, udev);
+                auto &d = devs.emplace_back(exported_device{ *udev, {} });
+
+                for (int j = 0; j < d.udev.bNumInterfaces; ++j) {
+                        auto uintf = rd.get<usbip_usb_interface>();
+                        if (!uintf) {
+                                error = "failed to recv devlist: usbip_usb_intf[" + std::to_string(j) + ']';
+                                return false;
+                        }
+
+                        usbip_net_pack_usb_interface(0, uintf);
+                        d.interfaces.push_back(*uintf);
+                }
+        }
+
+        return true;
+}
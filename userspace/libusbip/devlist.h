@@ -0,0 +1,64 @@
+#pragma once
+
+/*
+ * Decoder of OP_REP_DEVLIST, it does not depend on Windows.
+ * It is built by libusbip.vcxproj and on POSIX, see userspace/CMakeLists.txt.
+ */
+
+#include <usbip/proto_op.h>
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace usbip
+{
+
+/*
+ * Pulls the reply in large chunks and hands out records in place.
+ * Records are packed, so any offset in the buffer is properly aligned.
+ * A returned pointer is valid until the next get, it can move the tail of the buffer.
+ */
+class BufferedReader
+{
+public:
+        enum { max_capacity = 64*1024 };
+
+        /*
+         * Reads at most len bytes like recv.
+         * @return the number of bytes read, zero or negative if the connection is closed or on error
+         */
+        using recv_func = std::function<int(void *buf, size_t len)>;
+
+        explicit BufferedReader(recv_func f, size_t capacity = max_capacity) : m_recv(std::move(f)), m_buf(capacity) {}
+
+        template<typename T>
+        T* get()
+        {
+                static_assert(sizeof(T) <= max_capacity);
+                return static_cast<T*>(fetch(sizeof(T)));
+        }
+
+private:
+        recv_func m_recv;
+        std::vector<char> m_buf;
+        size_t m_pos{};
+        size_t m_end{};
+
+        void *fetch(size_t len);
+};
+
+struct exported_device
+{
+        usbip_usb_device udev;
+        std::vector<usbip_usb_interface> interfaces; // udev.bNumInterfaces
+};
+
+/*
+ * Decodes the part of OP_REP_DEVLIST that follows op_common, records are converted to host byte order.
+ * @param error is set if false is returned
+ */
+bool read_devlist(BufferedReader &rd, std::vector<exported_device> &devs, std::string &error);
+
+} // namespace usbip
@@ -4,6 +4,7 @@
  */
 
 #include "network.h"
+#include "connector.h"
 #include "common.h"
 #include "dbgcode.h"
 
@@ -12,6 +13,8 @@
 #include <ws2tcpip.h>
 #include <mstcpip.h>
 
+#include <vector>
+
 void usbip_setup_port_number(const char *arg)
 {
 	char *end;
@@ -218,51 +221,49 @@ int usbip_net_set_v6only(SOCKET sockfd)
 	return ret;
 }
 
+namespace
+{
+
+usbip::net::address_cache g_cache;
+
+} // namespace
+
+
 /*
- * IPv6 Ready
+ * IPv6 Ready.
+ * Addresses of different families are raced, see RFC 8305.
  */
-usbip::Socket usbip_net_tcp_connect(const char *hostname, const char *port)
+usbip::Socket usbip_net_tcp_connect(const char *hostname, const char *port, unsigned int timeout_ms)
 {
-        usbip::Socket sock;
-        struct addrinfo hints, *res, *rp;
-	int ret;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	using namespace usbip::net;
 
-	/* get all possible addresses */
-	ret = getaddrinfo(hostname, port, &hints, &res);
-	if (ret < 0) {
-		dbg("getaddrinfo: %s port %s: %s", hostname, port,
-		    gai_strerror(ret));
-		return sock;
+	std::vector<address> addrs;
+	if (auto err = resolve(hostname, port, addrs, &g_cache)) {
+		dbg("getaddrinfo: %s port %s: %s", hostname, port, gai_strerror(err));
+		return usbip::Socket();
 	}
 
-	/* try the addresses */
-	for (rp = res; rp; rp = rp->ai_next) {
-
-                sock.reset(socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol));
-                if (!sock) {
-                        continue;
-                }
+	if (addrs.empty()) {
+		return usbip::Socket();
+	}
 
-		/* should set TCP_NODELAY for usbip */
-		usbip_net_set_nodelay(sock.get());
-		/* TODO: write code for heartbeat */
-		usbip_net_set_keepalive(sock.get());
+	auto key = cache_key(hostname, port);
 
-		if (connect(sock.get(), rp->ai_addr, (int)rp->ai_addrlen) == 0)
-			break;
+	const address *winner{};
+	usbip::Socket sock(race(addrs, milliseconds(timeout_ms), winner));
 
-		sock.close();
+	if (!sock) {
+		dbg("%s:%s: all %zu address(es) have failed", hostname, port, addrs.size());
+		g_cache.remember(key, nullptr);
+		return sock;
 	}
 
-	freeaddrinfo(res);
+	g_cache.remember(key, winner);
 
-        if (!rp) {
-                sock.close();
-        }
+	/* should set TCP_NODELAY for usbip */
+	usbip_net_set_nodelay(sock.get());
+	/* the driver probes its own connection, see driver/vhci/heartbeat.cpp */
+	usbip_net_set_keepalive(sock.get());
 
 	return sock;
 }
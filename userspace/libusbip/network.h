@@ -18,4 +18,5 @@ int usbip_net_set_nodelay(SOCKET sockfd);
 int usbip_net_set_keepalive(SOCKET sockfd);
 int usbip_net_set_v6only(SOCKET sockfd);
 
-usbip::Socket usbip_net_tcp_connect(const char *hostname, const char *port);
+enum { USBIP_NET_CONNECT_TIMEOUT = 15'000 }; // msec
+usbip::Socket usbip_net_tcp_connect(const char *hostname, const char *port, unsigned int timeout_ms = USBIP_NET_CONNECT_TIMEOUT);
@@ -1,16 +1,30 @@
-﻿#include <usbip\proto_op.h>
-#include <intrin.h>
+﻿#include <usbip/proto_op.h>
 
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+/*
+ * The file is built on POSIX too, see userspace/CMakeLists.txt.
+ */
 void usbip_net_pack_uint32_t(int, UINT32 *num)
 {
+#ifdef _MSC_VER
         static_assert(sizeof(*num) == sizeof(unsigned long));
         *num = _byteswap_ulong(*num);
+#else
+        *num = __builtin_bswap32(*num);
+#endif
 }
 
 void usbip_net_pack_uint16_t(int, UINT16 *num)
 {
+#ifdef _MSC_VER
         static_assert(sizeof(*num) == sizeof(unsigned short));
         *num = _byteswap_ushort(*num);
+#else
+        *num = __builtin_bswap16(*num);
+#endif
 }
 
 void usbip_net_pack_usb_device(int pack, usbip_usb_device *udev)
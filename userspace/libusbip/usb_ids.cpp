@@ -4,56 +4,10 @@
 
 #include "usb_ids.h"
 
-#include <cassert>
-#include <cerrno>
-#include <functional>
-
-namespace
-{
-
-uint16_t remove_prefix_hex(std::string_view &s)
-{
-        char *end{};
-
-        errno = 0;
-        auto n = strtol(s.data(), &end, 16); // FIXME: doesn't respect s.size()
-
-        if (errno || end == s.data()) {
-		return 0;
-	}
-
-	size_t cnt = end - s.data();
-        if (cnt > s.size()) {
-                return 0;
-        }
-
-        s.remove_prefix(cnt);
-        return static_cast<uint16_t>(n);
-}
-
-using line_f = std::function<bool(std::string_view&, std::string_view&)>;
-
-void for_each_line(std::string_view text, const line_f &f)
-{
-        while (!text.empty()) {
-                auto pos = text.find('\n');
-                if (pos == text.npos) {
-                        std::string_view tail;
-                        f(text, tail);
-                        break;
-                }
-
-                auto line = text.substr(0, pos ? pos - 1 : 0); // rstrip '\n'
-                text.remove_prefix(++pos);
-
-                if (!line.empty() && f(line, text)) {
-                        break;
-                }
-        }
-}
-
-} // namespace
+#include <algorithm>
+#include <cstring>
 
+#ifdef _WIN32
 
 DWORD Resource::load(_In_opt_ HMODULE hModule, _In_ LPCSTR name, _In_ LPCSTR type)
 {
@@ -71,131 +25,96 @@ DWORD Resource::load(_In_opt_ HMODULE hModule, _In_ LPCSTR name, _In_ LPCSTR typ
         return ERROR_SUCCESS;
 }
 
-void UsbIds::load(const std::string_view &content)
+#endif // _WIN32
+
+/*
+ * @param content is the index produced by usbids.exe, it must outlive this object
+ */
+bool UsbIds::load(const std::string_view &content) noexcept
 {
-        uint16_t vid{};
-        uint16_t pid{};
-        
-        auto f = [this, &vid, &pid] (auto&&... args) 
-        { 
-                return parse_vid_pid(vid, pid, std::forward<decltype(args)>(args)...); 
+        using namespace usbids;
+
+        for (auto &i: m_sec) {
+                i = records();
+        }
+        m_strings = std::string_view();
+
+        if (content.size() < sizeof(header)) {
+                return false;
+        }
+
+        auto &hdr = *reinterpret_cast<const header*>(content.data());
+        if (memcmp(hdr.magic, magic, sizeof(hdr.magic)) || hdr.version != VERSION) {
+                return false;
+        }
+
+        auto in_range = [sz = content.size()] (auto &s, size_t elem_sz) 
+        {
+                return s.offset <= sz && s.count <= (sz - s.offset)/elem_sz;
         };
-        
-        for_each_line(content, std::move(f));
-}
 
-bool UsbIds::parse_vid_pid(uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail)
-{
-        if (line.starts_with("# List of known device classes, subclasses and protocols")) {
-                uint8_t cls{};
-                uint8_t subcls{};
-                auto f = [this, &cls, &subcls] (auto&&... args) 
-                { 
-                        return parse_class_sub_proto(cls, subcls, std::forward<decltype(args)>(args)...); 
-                };
-                for_each_line(tail, std::move(f));
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) {
-                assert(!"\\t\\t detected");
-        } else if (line.starts_with('\t')) {
-                line.remove_prefix(1);
-                if (bool(pid = remove_prefix_hex(line))) {
-                        line.remove_prefix(2); // device_name
-                        auto &prod = m_vendor[vid].second;
-                        auto [it, inserted] = prod.emplace(pid, line);
-                        assert(inserted);
+        for (int i = 0; i < SEC_STRINGS; ++i) {
+                auto &s = hdr.sections[i];
+                if (!in_range(s, sizeof(record)) || s.offset % alignof(record)) {
+                        return false;
                 }
-        } else if (bool(vid = remove_prefix_hex(line))) {
-                line.remove_prefix(2); // vendor_name
-                auto [it, inserted] = m_vendor.emplace(vid, std::make_pair(line, products_t()));
-                assert(inserted);
         }
 
-        return false;
+        if (auto &s = hdr.sections[SEC_STRINGS]; in_range(s, 1)) {
+                m_strings = content.substr(s.offset, s.count);
+        } else {
+                return false;
+        }
+
+        for (int i = 0; i < SEC_STRINGS; ++i) {
+                auto &s = hdr.sections[i];
+                m_sec[i] = records(reinterpret_cast<const record*>(content.data() + s.offset), s.count);
+        }
+
+        return true;
 }
 
-bool UsbIds::parse_class_sub_proto(uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view&)
+/*
+ * @param parent record of the previous level or nullptr for SEC_VENDOR, SEC_CLASS
+ */
+const usbids::record *UsbIds::find(usbids::section_t sec, const usbids::record *parent, uint16_t id) const noexcept
 {
-        if (line.starts_with("# List of Audio Class Terminal Types")) {
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) {
-                line.remove_prefix(2);
-                if (auto prot = (uint8_t)remove_prefix_hex(line)) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto &proto = sub[subcls].second;
-                        auto [it, inserted] = proto.emplace(prot, line);
-                        assert(inserted);
-                }
-        } else if (line.starts_with('\t')) {
-                line.remove_prefix(1);
-                if (bool(subcls = (uint8_t)remove_prefix_hex(line))) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto [it, inserted] = sub.emplace(subcls, std::make_pair(line, proto_t()));
-                        assert(inserted);
-                }
-        } else if (line.starts_with("C ")) {
-                line.remove_prefix(2);
-                if (bool(cls = (uint8_t)remove_prefix_hex(line))) {
-                        line.remove_prefix(2);
-                        auto [it, inserted] = m_class.emplace(cls, std::make_pair(line, subclass_t()));
-                        assert(inserted);
+        auto v = m_sec[sec];
+
+        if (parent) {
+                if (parent->first > v.size() || parent->count > v.size() - parent->first) {
+                        return nullptr;
                 }
+                v = v.subspan(parent->first, parent->count);
         }
 
-        return false;
+        auto i = std::lower_bound(v.begin(), v.end(), id, [] (auto &r, auto val) { return r.id < val; });
+        return i != v.end() && i->id == id ? &*i : nullptr;
 }
 
-std::pair<std::string_view, std::string_view> UsbIds::find_product(uint16_t vid, uint16_t pid) const noexcept
+std::string_view UsbIds::name(const usbids::record *r) const noexcept
 {
-        std::pair<std::string_view, std::string_view> res;
-
-        auto v = m_vendor.find(vid);
-        if (v == m_vendor.end()) {
-                return res;
-        }
+        return r && r->name <= m_strings.size() ? m_strings.substr(r->name, r->name_len) : std::string_view();
+}
 
-        res.first = v->second.first;
-        auto &prod = v->second.second;
+std::pair<std::string_view, std::string_view> UsbIds::find_product(uint16_t vid, uint16_t pid) const noexcept
+{
+        using namespace usbids;
 
-        auto p = prod.find(pid);
-        if (p != prod.end()) {
-                res.second = p->second;
-        }
+        auto v = find(SEC_VENDOR, nullptr, vid);
+        auto p = v ? find(SEC_PRODUCT, v, pid) : nullptr;
 
-        return res;
+        return std::make_pair(name(v), name(p));
 }
 
 std::tuple<std::string_view, std::string_view, std::string_view> 
 UsbIds::find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept
 {
-        std::tuple<std::string_view, std::string_view, std::string_view>  res;
+        using namespace usbids;
 
-        auto c = m_class.find(class_id);
-        if (c == m_class.end()) {
-                return res;
-        }
-
-        std::get<0>(res) = c->second.first;
-        auto &subcls = c->second.second;
-
-        auto s = subcls.find(subclass_id);
-        if (s == subcls.end()) {
-                return res;
-        }
-
-        std::get<1>(res) = s->second.first;
-        auto &prot = s->second.second;
-
-        auto p = prot.find(prot_id);
-        if (p != prot.end()) {
-                std::get<2>(res) = p->second;
-        }
+        auto c = find(SEC_CLASS, nullptr, class_id);
+        auto s = c ? find(SEC_SUBCLASS, c, subclass_id) : nullptr;
+        auto p = s ? find(SEC_PROTOCOL, s, prot_id) : nullptr;
 
-        return res;
+        return std::make_tuple(name(c), name(s), name(p));
 }
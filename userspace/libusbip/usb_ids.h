@@ -5,8 +5,12 @@
 #pragma once
 
 #include <cstdint>
+#include <span>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <tuple>
+
+#ifdef _WIN32
 
 #include <windows.h>
 
@@ -31,16 +35,62 @@ private:
 	std::string_view m_str;
 };
 
+#endif // _WIN32
+
+
+namespace usbids
+{
+
+/*
+ * Binary index compiled from usb.ids text by usbids.exe at build time.
+ * Children of a record are contiguous in the array of the next level, all arrays are sorted by id.
+ * Offsets are from the beginning of the index.
+ */
+enum section_t { SEC_VENDOR, SEC_PRODUCT, SEC_CLASS, SEC_SUBCLASS, SEC_PROTOCOL, SEC_STRINGS, SEC_COUNT };
+
+struct section
+{
+	uint32_t offset;
+	uint32_t count; // of records, bytes for SEC_STRINGS
+};
+
+struct header
+{
+	char magic[4];
+	uint32_t version;
+	section sections[SEC_COUNT];
+};
+
+struct record
+{
+	uint16_t id;
+	uint16_t name_len;
+	uint32_t name; // offset in SEC_STRINGS
+	uint32_t first; // index of the first child in the next level
+	uint32_t count; // number of children
+};
 
+inline constexpr char magic[] = "UIDX";
+enum { VERSION = 1 };
+
+static_assert(sizeof(header::magic) == sizeof(magic) - 1);
+static_assert(sizeof(record) == 16);
+
+} // namespace usbids
+
+
+/*
+ * Lookups are binary searches over the index, no heap allocations are made.
+ */
 class UsbIds
 {
 public:
 	UsbIds(const std::string_view &content) { load(content); }
 
-	auto operator!() const noexcept { return m_vendor.empty() || m_class.empty(); } 
+	auto operator!() const noexcept { return m_sec[usbids::SEC_VENDOR].empty() || m_sec[usbids::SEC_CLASS].empty(); } 
 	explicit operator bool() const noexcept { return !!*this; }
 
-	void load(const std::string_view &content);
+	bool load(const std::string_view &content) noexcept;
 
 	std::pair<std::string_view, std::string_view> find_product(uint16_t vid, uint16_t pid) const noexcept;
 
@@ -48,15 +98,11 @@ public:
 		find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept;
 
 private:
-	using products_t = std::unordered_map<uint16_t, std::string_view>;
-	using vendors_t = std::unordered_map<uint16_t, std::pair<std::string_view, products_t>>;
-	vendors_t m_vendor;
+	using records = std::span<const usbids::record>;
 
-	using proto_t = std::unordered_map<uint8_t, std::string_view>;
-	using subclass_t = std::unordered_map<uint8_t, std::pair<std::string_view, proto_t>>;
-	using class_t = std::unordered_map<uint8_t, std::pair<std::string_view, subclass_t>>;
-	class_t m_class;
+	records m_sec[usbids::SEC_STRINGS];
+	std::string_view m_strings;
 
-	bool parse_vid_pid(uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail);
-	bool parse_class_sub_proto(uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view &tail);
+	const usbids::record *find(usbids::section_t sec, const usbids::record *parent, uint16_t id) const noexcept;
+	std::string_view name(const usbids::record *r) const noexcept;
 };
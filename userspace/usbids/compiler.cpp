@@ -0,0 +1,217 @@
+#include "compiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace
+{
+
+struct node
+{
+        std::string_view name;
+        std::map<uint16_t, node> children;
+};
+
+using tree = std::map<uint16_t, node>;
+
+/*
+ * Zero is a valid id, f.e. class 00 "(Defined at Interface level)".
+ */
+bool remove_prefix_hex(std::string_view &s, uint16_t &id)
+{
+        char *end{};
+
+        errno = 0;
+        auto n = strtol(s.data(), &end, 16); // the text is NUL-terminated
+
+        if (errno || end == s.data() || n < 0 || n > UINT16_MAX) {
+                return false;
+        }
+
+        size_t cnt = end - s.data();
+        if (cnt > s.size()) {
+                return false;
+        }
+
+        s.remove_prefix(cnt);
+        id = static_cast<uint16_t>(n);
+        return true;
+}
+
+/*
+ * @return name that follows the id and two spaces
+ */
+auto get_name(std::string_view line)
+{
+        line.remove_prefix(std::min(line.size(), size_t(2)));
+        return line;
+}
+
+template<typename F>
+void for_each_line(std::string_view text, F &&f)
+{
+        while (!text.empty()) {
+                auto pos = text.find('\n');
+                auto line = text.substr(0, pos);
+
+                text.remove_prefix(pos == text.npos ? text.size() : pos + 1);
+
+                if (line.ends_with('\r')) {
+                        line.remove_suffix(1);
+                }
+
+                if (!line.empty() && f(line)) {
+                        break;
+                }
+        }
+}
+
+void parse(std::string_view text, tree &vendors, tree &classes)
+{
+        node *vendor{};
+        node *cls{};
+        node *subcls{};
+        bool in_classes{};
+        uint16_t id{};
+
+        for_each_line(text, [&] (auto line)
+        {
+                if (line.starts_with("# List of known device classes, subclasses and protocols")) {
+                        in_classes = true;
+                } else if (line.starts_with("# List of Audio Class Terminal Types")) {
+                        return true;
+                } else if (line.starts_with('#')) {
+                        // continue;
+                } else if (!in_classes) {
+                        if (line.starts_with("\t\t")) {
+                                // interfaces are not used
+                        } else if (line.starts_with('\t')) {
+                                line.remove_prefix(1);
+                                if (vendor && remove_prefix_hex(line, id)) {
+                                        vendor->children[id].name = get_name(line);
+                                }
+                        } else if (remove_prefix_hex(line, id)) {
+                                vendor = &vendors[id];
+                                vendor->name = get_name(line);
+                        }
+                } else if (line.starts_with("\t\t")) {
+                        line.remove_prefix(2);
+                        if (subcls && remove_prefix_hex(line, id)) {
+                                subcls->children[id].name = get_name(line);
+                        }
+                } else if (line.starts_with('\t')) {
+                        line.remove_prefix(1);
+                        if (cls && remove_prefix_hex(line, id)) {
+                                subcls = &cls->children[id];
+                                subcls->name = get_name(line);
+                        }
+                } else if (line.starts_with("C ")) {
+                        line.remove_prefix(2);
+                        if (remove_prefix_hex(line, id)) {
+                                cls = &classes[id];
+                                cls->name = get_name(line);
+                                subcls = nullptr;
+                        }
+                }
+
+                return false;
+        });
+}
+
+auto make_record(uint16_t id, std::string_view name, std::string &strings)
+{
+        usbids::record r{ id, static_cast<uint16_t>(name.size()), static_cast<uint32_t>(strings.size()) };
+        strings.append(name);
+        return r;
+}
+
+/*
+ * Breadth-first, children of every node become contiguous in the next level.
+ */
+void flatten(const tree &roots, std::vector<usbids::record> *levels, size_t cnt, std::string &strings)
+{
+        std::vector<const tree*> cur{ &roots };
+        std::vector<usbids::record> *parent{};
+
+        for (auto lvl = levels; lvl != levels + cnt; parent = lvl++) {
+
+                std::vector<const tree*> next;
+
+                for (size_t i = 0; i < cur.size(); ++i) {
+                        if (parent) {
+                                auto &p = (*parent)[i];
+                                p.first = static_cast<uint32_t>(lvl->size());
+                                p.count = static_cast<uint32_t>(cur[i]->size());
+                        }
+
+                        for (auto &[id, n]: *cur[i]) {
+                                lvl->push_back(make_record(id, n.name, strings));
+                                next.push_back(&n.children);
+                        }
+                }
+
+                cur = std::move(next);
+        }
+}
+
+auto serialize(std::vector<usbids::record> (&sec)[usbids::SEC_STRINGS], const std::string &strings)
+{
+        using namespace usbids;
+
+        header hdr{};
+        memcpy(hdr.magic, magic, sizeof(hdr.magic));
+        hdr.version = VERSION;
+
+        auto offset = static_cast<uint32_t>(sizeof(hdr));
+
+        for (int i = 0; i < SEC_STRINGS; ++i) {
+                auto cnt = static_cast<uint32_t>(sec[i].size());
+                hdr.sections[i] = section{ offset, cnt };
+                offset += cnt*sizeof(record);
+        }
+
+        hdr.sections[SEC_STRINGS] = section{ offset, static_cast<uint32_t>(strings.size()) };
+
+        std::string out;
+        out.reserve(offset + strings.size());
+        out.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+
+        for (auto &v: sec) {
+                out.append(reinterpret_cast<const char*>(v.data()), v.size()*sizeof(*v.data()));
+        }
+
+        out.append(strings);
+        return out;
+}
+
+} // namespace
+
+
+std::string usbids::compile(std::string_view text, std::string &error)
+{
+        tree vendors;
+        tree classes;
+        parse(text, vendors, classes);
+
+        if (vendors.empty() || classes.empty()) {
+                error = "no vendors or classes found";
+                return {};
+        }
+
+        std::vector<record> sec[SEC_STRINGS];
+        std::string strings;
+
+        flatten(vendors, sec + SEC_VENDOR, SEC_CLASS - SEC_VENDOR, strings);
+        flatten(classes, sec + SEC_CLASS, SEC_STRINGS - SEC_CLASS, strings);
+
+        if (strings.size() > UINT32_MAX) {
+                error = "string pool is too big";
+                return {};
+        }
+
+        return serialize(sec, strings);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * Compiler of usb.ids text into the binary index that UsbIds reads, it does not depend on Windows.
+ * It is built by usbids.vcxproj and on POSIX, see userspace/CMakeLists.txt.
+ */
+
+#include <libusbip/usb_ids.h>
+
+#include <string>
+#include <string_view>
+
+namespace usbids
+{
+
+/*
+ * @return the index or an empty string, see error
+ */
+std::string compile(std::string_view text, std::string &error);
+
+} // namespace usbids
@@ -0,0 +1,54 @@
+/*
+ * Compiles usb.ids text into the binary index that UsbIds reads from the resource.
+ * Usage: usbids <usb.ids> <output>
+ */
+
+#include "compiler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+
+enum { EXIT_USAGE = EXIT_FAILURE + 1 };
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        if (argc != 3) {
+                fprintf(stderr, "usage: usbids <usb.ids> <output>\n");
+                return EXIT_USAGE;
+        }
+
+        std::ifstream in(argv[1], std::ios::binary);
+        if (!in) {
+                fprintf(stderr, "can't open %s\n", argv[1]);
+                return EXIT_FAILURE;
+        }
+
+        std::ostringstream os;
+        os << in.rdbuf();
+
+        std::string error;
+        auto index = usbids::compile(os.str(), error);
+
+        if (index.empty()) {
+                fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+                return EXIT_FAILURE;
+        }
+
+        std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+        out.write(index.data(), index.size());
+
+        if (!out) {
+                fprintf(stderr, "can't write %s\n", argv[2]);
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -17,12 +17,20 @@
  */
 
 #include "vhci.h"
+#include "usbip.h"
 
 #include <libusbip\getopt.h>
 #include <libusbip\network.h>
 #include <libusbip\common.h>
 #include <libusbip\dbgcode.h>
 
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
 namespace
 {
 
@@ -31,9 +39,278 @@ const char usbip_attach_usage_string[] =
 "    -r, --remote=<host>    The machine with exported USB devices\n"
 "    -b, --busid=<busid>    Busid of the device on <host>\n"
 "    -s, --serial=<USB serial>  (Optional) USB serial to be overwritten\n"
+"    -m, --manifest=<file>  Attach devices listed in <file> concurrently,\n"
+"                           one \"<host> <busid> [<serial>]\" per line\n"
+"    -R, --reconnect=<sec>  Keep the device and reconnect if connection is lost,\n"
+"                           unplug it if that fails within <sec>\n"
+"    -S, --segment=<bytes>:<ep>[,<ep>...]  Split longer bulk transfers of the OUT endpoints\n"
+"                           into pipelined requests, f.e. 65536:0x02\n"
+"    -J, --jitter=<ms>:<ep>[,<ep>...]  Delay completions of isoch IN endpoints\n"
+"                           to smooth network jitter, f.e. 20:0x81\n"
+"    -B, --budget=<urbs>:<bytes>[/<urbs>:<bytes>]  Limit in-flight requests of the device\n"
+"                           [and of each endpoint], zero is unlimited, f.e. 64:4194304/16:1048576\n"
+"    -K, --key-file=<file>  Encrypt the traffic with the pre-shared 128-bit key in hex\n"
+"                           that is read from <file>, \"-\" is stdin;\n"
+"                           the server must have the same key\n"
+"    -W, --window=<min>:<max>  Tune the send window and the receive buffer\n"
+"                           by bandwidth-delay product within bounds, f.e. 65536:16777216\n"
+"    -H, --heartbeat=<ms>[:<misses>]  Probe the server if the link is idle for <ms>,\n"
+"                           the connection is lost after <misses> probes without reply, f.e. 2000:3\n"
+"    -U, --streams          Use USB 3 bulk streams (UASP) if the server supports them,\n"
+"                           an extra connection is made to a server that does not\n"
 "    -t, --terse            show port number as a result\n";
 
 
+/*
+ * Settings of ioctl_usbip_vhci_plugin that are common for all devices.
+ */
+struct plugin_options
+{
+        USHORT reconnect;
+        unsigned int segment_size;
+        unsigned int segment_endpoints;
+        USHORT jitter_delay;
+        USHORT jitter_endpoints;
+        USHORT max_urbs;
+        unsigned int max_bytes;
+        USHORT ep_max_urbs;
+        unsigned int ep_max_bytes;
+        unsigned char key[USBIP_KEY_SIZE];
+        unsigned int window_min;
+        unsigned int window_max;
+        USHORT heartbeat;
+        USHORT heartbeat_misses;
+        bool streams;
+};
+
+void init(ioctl_usbip_vhci_plugin &r, const plugin_options &opts)
+{
+        r.reconnect = opts.reconnect;
+        r.segment_size = opts.segment_size;
+        r.segment_endpoints = opts.segment_endpoints;
+        r.jitter_delay = opts.jitter_delay;
+        r.jitter_endpoints = opts.jitter_endpoints;
+        r.max_urbs = opts.max_urbs;
+        r.max_bytes = opts.max_bytes;
+        r.ep_max_urbs = opts.ep_max_urbs;
+        r.ep_max_bytes = opts.ep_max_bytes;
+        memcpy(r.key, opts.key, sizeof(r.key));
+        r.window_min = opts.window_min;
+        r.window_max = opts.window_max;
+        r.heartbeat = opts.heartbeat;
+        r.heartbeat_misses = opts.heartbeat_misses;
+        r.streams = opts.streams;
+}
+
+/*
+ * Format is "<value>:<ep>[,<ep>...]", <ep> is bEndpointAddress except EP0.
+ */
+auto parse_endpoints(const char *str, unsigned int &value, std::vector<unsigned char> &endpoints)
+{
+        std::istringstream is(str);
+
+        if (!(is >> value && is.get() == ':')) {
+                return false;
+        }
+
+        do {
+                unsigned int addr{};
+                if (!(is >> std::hex >> addr) || (addr & ~0x8FU) || !(addr & 0xF)) {
+                        return false;
+                }
+                endpoints.push_back(static_cast<unsigned char>(addr));
+        } while (is.get() == ',');
+
+        return is.eof();
+}
+
+auto parse_reconnect(const char *str, plugin_options &opts)
+{
+        unsigned int sec{};
+        if (!(sscanf_s(str, "%u", &sec) == 1 && sec <= UINT16_MAX)) {
+                return false;
+        }
+
+        opts.reconnect = static_cast<USHORT>(sec);
+        return true;
+}
+
+auto parse_segment(const char *str, plugin_options &opts)
+{
+        unsigned int size{};
+        std::vector<unsigned char> endpoints;
+
+        if (!(parse_endpoints(str, size, endpoints) && size >= USBIP_SEGMENT_ALIGN)) {
+                return false;
+        }
+
+        opts.segment_size = size;
+        opts.segment_endpoints = 0;
+
+        for (auto addr: endpoints) {
+                if (addr & 0x80) { // OUT only, see driver/vhci/segment.cpp
+                        return false;
+                }
+                opts.segment_endpoints |= segment_endpoint_bit(addr);
+        }
+
+        return true;
+}
+
+auto parse_jitter(const char *str, plugin_options &opts)
+{
+        unsigned int delay{};
+        std::vector<unsigned char> endpoints;
+
+        if (!(parse_endpoints(str, delay, endpoints) && delay && delay <= UINT16_MAX)) {
+                return false;
+        }
+
+        opts.jitter_delay = static_cast<USHORT>(delay);
+        opts.jitter_endpoints = 0;
+
+        for (auto addr: endpoints) {
+                if (!(addr & 0x80)) { // IN only
+                        return false;
+                }
+                opts.jitter_endpoints |= 1U << (addr & 0xF);
+        }
+
+        return true;
+}
+
+/*
+ * Format is "<urbs>:<bytes>[/<urbs>:<bytes>]", the device limits and optional limits of each endpoint.
+ */
+auto parse_budget(const char *str, plugin_options &opts)
+{
+        std::istringstream is(str);
+
+        auto parse = [&is] (USHORT &urbs, unsigned int &bytes)
+        {
+                unsigned int n{};
+                if (!(is >> n && n <= UINT16_MAX && is.get() == ':' && is >> bytes)) {
+                        return false;
+                }
+                urbs = static_cast<USHORT>(n);
+                return true;
+        };
+
+        if (!parse(opts.max_urbs, opts.max_bytes)) {
+                return false;
+        }
+
+        if (is.peek() == '/') {
+                is.get();
+                if (!parse(opts.ep_max_urbs, opts.ep_max_bytes)) {
+                        return false;
+                }
+        }
+
+        return is.peek() == std::char_traits<char>::eof();
+}
+
+/*
+ * Format is USBIP_KEY_SIZE bytes in hex, f.e. "000102030405060708090a0b0c0d0e0f".
+ */
+auto parse_key(const char *str, plugin_options &opts)
+{
+        if (strlen(str) != 2*sizeof(opts.key)) {
+                return false;
+        }
+
+        for (auto &b: opts.key) {
+                unsigned int n{};
+                if (!(isxdigit(str[0]) && isxdigit(str[1]) && sscanf_s(str, "%2x", &n) == 1)) {
+                        return false;
+                }
+                b = static_cast<unsigned char>(n);
+                str += 2;
+        }
+
+        return true;
+}
+
+/*
+ * The key is not accepted on the command line, it would be visible in the list of processes.
+ * @param path of the file with the key in the format of parse_key, "-" is stdin
+ */
+auto read_key(const char *path, plugin_options &opts)
+{
+        std::string s;
+
+        if (std::string_view(path) == "-") {
+                std::getline(std::cin, s);
+        } else if (std::ifstream in(path); in) {
+                std::getline(in, s);
+        } else {
+                err("can't open '%s'", path);
+                return false;
+        }
+
+        while (!s.empty() && isspace(static_cast<unsigned char>(s.back()))) {
+                s.pop_back();
+        }
+
+        auto ok = parse_key(s.c_str(), opts);
+        SecureZeroMemory(s.data(), s.size());
+
+        return ok;
+}
+
+/*
+ * Format is "<min>:<max>" in bytes.
+ */
+auto parse_window(const char *str, plugin_options &opts)
+{
+        std::istringstream is(str);
+        unsigned int min{};
+        unsigned int max{};
+
+        if (!(is >> min && is.get() == ':' && is >> max && is.peek() == std::char_traits<char>::eof())) {
+                return false;
+        }
+
+        if (!max || min > max) {
+                return false;
+        }
+
+        opts.window_min = min;
+        opts.window_max = max;
+
+        return true;
+}
+
+/*
+ * Format is "<ms>[:<misses>]".
+ */
+auto parse_heartbeat(const char *str, plugin_options &opts)
+{
+        std::istringstream is(str);
+        unsigned int interval{};
+        unsigned int misses{};
+
+        if (!(is >> interval && interval && interval <= UINT16_MAX)) {
+                return false;
+        }
+
+        if (is.peek() == ':') {
+                is.get();
+                if (!(is >> misses && misses && misses <= UINT16_MAX)) {
+                        return false;
+                }
+        }
+
+        if (is.peek() != std::char_traits<char>::eof()) {
+                return false;
+        }
+
+        opts.heartbeat = static_cast<USHORT>(interval);
+        opts.heartbeat_misses = static_cast<USHORT>(misses);
+
+        return true;
+}
+
 auto init(ioctl_usbip_vhci_plugin &r, const char *host, const char *busid, const char *serial)
 {
         struct Data
@@ -63,9 +340,11 @@ auto init(ioctl_usbip_vhci_plugin &r, const char *host, const char *busid, const
         return ERR_NONE;
 }
 
-auto import_device(hci_version version, const char *host, const char *busid, const char *serial)
+auto import_device(hci_version version, const char *host, const char *busid, const char *serial, const plugin_options &opts)
 {
         ioctl_usbip_vhci_plugin r{};
+        init(r, opts);
+
         if (auto err = init(r, host, busid, serial)) {
                 return make_error(err);
         }
@@ -83,38 +362,11 @@ auto import_device(hci_version version, const char *host, const char *busid, con
         return r.port;
 }
 
-constexpr auto get_port(int result) { return result & 0xFFFF; }
-constexpr auto get_error(int result) { return result >> 16; }
-
 /*
- * @see vhci/plugin.cpp, make_error
+ * @param result error part of the result, see get_error()
  */
-int attach_device(const char *host, const char *busid, const char *serial, bool terse)
+void print_error(int result, const char *host, const char *busid)
 {
-        int result = 0;
-
-        for (auto version: vhci_list) {
-                result = import_device(version, host, busid, serial);
-                if (get_port(result) || get_error(result) != ERR_USB_VER) {
-                        break;
-                }
-        }
-
-        if (int port = get_port(result)) {
-
-                assert(port > 0);
-                assert(!get_error(result));
-
-                if (terse) {
-                        printf("%d\n", port);
-                } else {
-                        printf("succesfully attached to port %d\n", port);
-                }
-
-                return 0;
-        }
-
-        result = get_error(result);
         assert(result);
 
         if (result > ST_OK) { // <linux>/tools/usb/usbip/libsrc/usbip_common.c, op_common_status_strings
@@ -154,16 +406,194 @@ int attach_device(const char *host, const char *busid, const char *serial, bool
                 case ERR_VERSION:
                         err("incompatible protocol version");
                         break;
+                case ERR_ACCESS:
+                        err("encryption is refused or the key is wrong");
+                        break;
                 default:
                         err("failed to attach: #%d %s", err, dbg_errcode(err));
         }
+}
+
+/*
+ * @see vhci/plugin.cpp, make_error
+ */
+int attach_device(const char *host, const char *busid, const char *serial, const plugin_options &opts, bool terse)
+{
+        int result = 0;
+
+        for (auto version: vhci_list) {
+                result = import_device(version, host, busid, serial, opts);
+                if (get_port(result) || get_error(result) != ERR_USB_VER) {
+                        break;
+                }
+        }
+
+        if (int port = get_port(result)) {
+
+                assert(port > 0);
+                assert(!get_error(result));
+
+                if (terse) {
+                        printf("%d\n", port);
+                } else {
+                        printf("succesfully attached to port %d\n", port);
+                }
+
+                return 0;
+        }
 
+        print_error(get_error(result), host, busid);
         return 3;
 }
 
+/*
+ * Line format is "<host> <busid> [<serial>]", empty lines and lines that start with '#' are skipped.
+ */
+auto read_manifest(const char *path, const plugin_options &opts, std::vector<ioctl_usbip_vhci_plugin> &entries)
+{
+        std::ifstream in(path);
+        if (!in) {
+                err("can't open manifest %s", path);
+                return false;
+        }
+
+        int lineno = 0;
+
+        for (std::string line; std::getline(in, line); ) {
+                ++lineno;
+
+                std::istringstream is(line);
+                std::string host;
+                std::string busid;
+                std::string serial;
+
+                if (!(is >> host) || host.starts_with('#')) {
+                        continue;
+                }
+
+                if (!(is >> busid)) {
+                        err("%s:%d: busid expected", path, lineno);
+                        return false;
+                }
+
+                is >> serial;
+
+                auto &r = entries.emplace_back();
+                init(r, opts);
+                if (init(r, host.c_str(), busid.c_str(), serial.empty() ? nullptr : serial.c_str())) {
+                        err("%s:%d: field is too long", path, lineno);
+                        return false;
+                }
+        }
+
+        if (entries.empty()) {
+                err("%s: no devices", path);
+                return false;
+        } else if (entries.size() > USBIP_PLUGIN_BATCH_MAX) {
+                err("%s: too many devices, %d max", path, int(USBIP_PLUGIN_BATCH_MAX));
+                return false;
+        }
+
+        return true;
+}
+
+int attach_manifest(const char *path, const plugin_options &opts, bool terse)
+{
+        std::vector<ioctl_usbip_vhci_plugin> entries;
+        if (!read_manifest(path, opts, entries)) {
+                return 1;
+        }
+
+        auto results = attach_devices(entries);
+
+        int rc = 0;
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+                auto &r = entries[i];
+
+                if (int port = get_port(results[i])) {
+                        if (terse) {
+                                printf("%d\n", port);
+                        } else {
+                                printf("%s %s: attached to port %d\n", r.host, r.busid, port);
+                        }
+                } else {
+                        err("%s %s:", r.host, r.busid);
+                        print_error(get_error(results[i]), r.host, r.busid);
+                        rc = 3;
+                }
+        }
+
+        return rc;
+}
+
 } // namespace
 
 
+/*
+ * Devices are imported concurrently by the driver, one request per hub.
+ * The driver moves a device to the hub of the required USB version itself,
+ * entries that fail with ERR_USB_VER anyway are retried on the next hub as attach_device does.
+ * @param entries [1..USBIP_PLUGIN_BATCH_MAX]
+ * @return result of every entry, see make_error
+ */
+std::vector<int> attach_devices(const std::vector<ioctl_usbip_vhci_plugin> &entries)
+{
+        std::vector<int> results(entries.size());
+
+        std::vector<size_t> pending(entries.size());
+        std::iota(pending.begin(), pending.end(), 0);
+
+        for (auto &version: vhci_list) {
+
+                std::vector<ioctl_usbip_vhci_plugin> batch;
+                for (auto i: pending) {
+                        batch.push_back(entries[i]);
+                }
+
+                auto hdev = usbip::vhci_driver_open(version);
+                if (!hdev) {
+                        dbg("failed to open vhci driver");
+                }
+
+                auto ok = hdev && usbip::vhci_attach_devices(hdev.get(), batch.data(), int(batch.size()));
+                auto last = &version == std::end(vhci_list) - 1;
+
+                std::vector<size_t> retry;
+
+                for (size_t j = 0; j < pending.size(); ++j) {
+                        auto &result = results[pending[j]];
+                        result = ok ? batch[j].port : make_error(hdev ? ERR_GENERAL : ERR_DRIVER);
+
+                        if (!last && !get_port(result) && get_error(result) == ERR_USB_VER) {
+                                retry.push_back(pending[j]);
+                        }
+                }
+
+                pending = std::move(retry);
+                if (pending.empty()) {
+                        break;
+                }
+        }
+
+        return results;
+}
+
+/*
+ * The key is read by the process that attaches, the service does not get it or the path to it.
+ */
+bool usbip_attach_can_forward(int argc, char *argv[])
+{
+        for (int i = 1; i < argc; ++i) {
+                std::string_view s(argv[i]);
+                if (s.starts_with("--key") || (s.size() > 1 && s[0] == '-' && s[1] != '-' && s.find('K') != s.npos)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
 void usbip_attach_usage()
 {
         printf("usage: %s", usbip_attach_usage_string);
@@ -176,6 +606,15 @@ int usbip_attach(int argc, char *argv[])
 		{ "remote", required_argument, nullptr, 'r' },
 		{ "busid", required_argument, nullptr, 'b' },
 		{ "serial", optional_argument, nullptr, 's' },
+		{ "manifest", required_argument, nullptr, 'm' },
+		{ "reconnect", required_argument, nullptr, 'R' },
+		{ "segment", required_argument, nullptr, 'S' },
+		{ "jitter", required_argument, nullptr, 'J' },
+		{ "budget", required_argument, nullptr, 'B' },
+		{ "key-file", required_argument, nullptr, 'K' },
+		{ "window", required_argument, nullptr, 'W' },
+		{ "heartbeat", required_argument, nullptr, 'H' },
+		{ "streams", no_argument, nullptr, 'U' },
 		{ "terse", required_argument, nullptr, 't' },
 		{}
 	};
@@ -183,14 +622,18 @@ int usbip_attach(int argc, char *argv[])
 	char *host{};
 	char *busid{};
         char *serial{};
+        char *manifest{};
+        plugin_options settings{};
         bool terse{};
 
 	while (true) {
-		int opt = getopt_long(argc, argv, "r:b:s:t", opts, nullptr);
+		int opt = getopt_long(argc, argv, "r:b:s:m:R:S:J:B:K:W:H:Ut", opts, nullptr);
 
 		if (opt == -1)
 			break;
 
+		auto ok = true;
+
 		switch (opt) {
 		case 'r':
 			host = optarg;
@@ -201,27 +644,61 @@ int usbip_attach(int argc, char *argv[])
 		case 's':
 			serial = optarg;
 			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'R':
+			ok = parse_reconnect(optarg, settings);
+			break;
+		case 'S':
+			ok = parse_segment(optarg, settings);
+			break;
+		case 'J':
+			ok = parse_jitter(optarg, settings);
+			break;
+		case 'B':
+			ok = parse_budget(optarg, settings);
+			break;
+		case 'K':
+			ok = read_key(optarg, settings);
+			break;
+		case 'W':
+			ok = parse_window(optarg, settings);
+			break;
+		case 'H':
+			ok = parse_heartbeat(optarg, settings);
+			break;
+		case 'U':
+			settings.streams = true;
+			break;
 		case 't':
 			terse = true;
 			break;
 		default:
+			ok = false;
+		}
+
+		if (!ok) {
 			err("invalid option: %c", opt);
 			usbip_attach_usage();
 			return 1;
 		}
 	}
 
-	if (!host) {
+	if (!(manifest || host)) {
 		err("empty remote host");
 		usbip_attach_usage();
 		return 1;
 	}
 	
-	if (!busid) {
+	if (!(manifest || busid)) {
 		err("empty busid");
 		usbip_attach_usage();
 		return 1;
 	}
 
-	return attach_device(host, busid, serial, terse);
+	auto rc = manifest ? attach_manifest(manifest, settings, terse) : attach_device(host, busid, serial, settings, terse);
+
+	SecureZeroMemory(settings.key, sizeof(settings.key));
+	return rc;
 }
@@ -0,0 +1,279 @@
+#include "vhci.h"
+#include "usbip.h"
+#include "autoattach_rules.h"
+
+#include <libusbip\getopt.h>
+#include <libusbip\network.h>
+#include <libusbip\common.h>
+#include <libusbip\dbgcode.h>
+
+#include <usbip\proto_op.h>
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+bool get_remote_devices(const char *host, std::vector<usbip_usb_device> &devs);
+
+namespace
+{
+
+using namespace usbip::autoattach;
+
+const char usbip_autoattach_usage_string[] =
+"usbip autoattach <args>\n"
+"    -f, --rules=<file>         Devices to keep attached, one rule per line:\n"
+"                               \"<host> <busid>\", \"<host> <vid>:<pid>\" or \"<host> *\"\n"
+"    -i, --interval=<sec>       Initial devlist polling interval (default 2)\n"
+"    -I, --max-interval=<sec>   Polling interval if nothing changes (default 60)\n";
+
+auto read_rules(const char *path, std::vector<host_state> &hosts)
+{
+        std::ifstream in(path);
+        if (!in) {
+                err("can't open rules %s", path);
+                return false;
+        }
+
+        std::string error;
+        if (!usbip::autoattach::read_rules(in, hosts, error)) {
+                err("%s: %s", path, error.c_str());
+                return false;
+        }
+
+        return true;
+}
+
+/*
+ * Devlists of the hosts that are due are fetched concurrently.
+ * New and changed devices that match the rules are attached at once.
+ */
+void poll_hosts(std::vector<host_state> &hosts, const poll_params &p, clock_type::time_point now)
+{
+        struct result
+        {
+                host_state *host;
+                std::future<bool> ok;
+                std::vector<usbip_usb_device> devs;
+        };
+
+        std::vector<result> v;
+        v.reserve(hosts.size()); // devs must not be moved while async is running
+
+        for (auto &h: hosts) {
+                if (h.next_poll <= now) {
+                        auto &r = v.emplace_back(&h);
+                        r.ok = std::async(std::launch::async, get_remote_devices, h.name.c_str(), std::ref(r.devs));
+                }
+        }
+
+        for (auto &r: v) {
+                auto &h = *r.host;
+                auto changed = false;
+
+                if (r.ok.get()) {
+                        devlist_changes c;
+                        changed = update(h, r.devs, now, c);
+
+                        for (auto &d: c.appeared) {
+                                info("%s: device %s %04x:%04x appeared", h.name.c_str(), get_busid(d).c_str(),
+                                      d.idVendor, d.idProduct);
+                        }
+
+                        for (auto &busid: c.gone) {
+                                info("%s: device %s has gone", h.name.c_str(), busid.c_str());
+                        }
+                } else {
+                        dbg("%s: can't get devlist", h.name.c_str());
+                }
+
+                h.interval = next_poll_interval(h.interval, changed, p);
+                h.next_poll = clock_type::now() + h.interval;
+        }
+}
+
+/*
+ * @return attached devices by "host/busid"
+ */
+auto get_attached()
+{
+        std::map<std::string, int> m;
+
+        for (auto version: vhci_list) {
+                if (auto hdev = usbip::vhci_driver_open(version)) {
+                        for (auto &d: usbip::vhci_get_imported_devs(hdev.get())) {
+                                if (!d.port) {
+                                        break;
+                                } else if (!strcmp(d.service, usbip_port)) {
+                                        m.emplace(std::string(d.host) + '/' + d.busid, d.port);
+                                }
+                        }
+                }
+        }
+
+        return m;
+}
+
+auto make_plugin(const std::string &host, const std::string &busid)
+{
+        ioctl_usbip_vhci_plugin r{};
+
+        strcpy_s(r.service, sizeof(r.service), usbip_port);
+        strcpy_s(r.host, sizeof(r.host), host.c_str());
+        strcpy_s(r.busid, sizeof(r.busid), busid.c_str());
+
+        return r;
+}
+
+/*
+ * Attaches matching devices that are not attached and which retry time has come.
+ */
+void attach_pending(std::vector<host_state> &hosts, clock_type::time_point now)
+{
+        auto attached = get_attached();
+
+        std::vector<ioctl_usbip_vhci_plugin> entries;
+        std::vector<device_state*> states;
+
+        for (auto &h: hosts) {
+                for (auto &[busid, st]: h.devices) {
+                        if (!st.match) {
+                                continue;
+                        }
+
+                        if (auto i = attached.find(h.name + '/' + busid); i != attached.end()) {
+                                st.port = i->second;
+                                st.failures = 0;
+                        } else if (st.port) {
+                                info("%s: device %s was detached from port %d", h.name.c_str(), busid.c_str(), st.port);
+                                st.port = 0;
+                                st.next_try = now;
+                        }
+
+                        if (!st.port && st.next_try <= now && entries.size() < USBIP_PLUGIN_BATCH_MAX) {
+                                entries.push_back(make_plugin(h.name, busid));
+                                states.push_back(&st);
+                        }
+                }
+        }
+
+        if (entries.empty()) {
+                return;
+        }
+
+        auto results = attach_devices(entries);
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+                auto &r = entries[i];
+                auto &st = *states[i];
+
+                if (int port = get_port(results[i])) {
+                        info("%s: device %s attached to port %d", r.host, r.busid, port);
+                        st.port = port;
+                        st.failures = 0;
+                        continue;
+                }
+
+                auto error = get_error(results[i]);
+                auto delay = next_retry_delay(++st.failures);
+
+                st.next_try = clock_type::now() + delay;
+
+                err("%s: can't attach device %s: %s, retry in %lld s", r.host, r.busid,
+                     error > ST_OK ? dbg_opcode_status(static_cast<op_status_t>(error)) : dbg_errcode(static_cast<err_t>(error)),
+                     std::chrono::duration_cast<std::chrono::seconds>(delay).count());
+        }
+}
+
+int run(std::vector<host_state> &hosts, const poll_params &p)
+{
+        for (auto &h: hosts) {
+                h.interval = p.min_interval;
+        }
+
+        while (true) {
+                auto now = clock_type::now();
+
+                poll_hosts(hosts, p, now);
+                attach_pending(hosts, now);
+
+                auto t = std::max(next_wakeup(hosts), clock_type::now() + 100ms);
+                std::this_thread::sleep_until(t);
+        }
+}
+
+} // namespace
+
+
+void usbip_autoattach_usage()
+{
+        printf("usage: %s", usbip_autoattach_usage_string);
+}
+
+/*
+ * Polls devlists of the hosts from the rules and keeps matching devices attached.
+ * Runs until it is killed.
+ */
+int usbip_autoattach(int argc, char *argv[])
+{
+        const option opts[] =
+        {
+                { "rules", required_argument, nullptr, 'f' },
+                { "interval", required_argument, nullptr, 'i' },
+                { "max-interval", required_argument, nullptr, 'I' },
+                {}
+        };
+
+        const char *rules{};
+        poll_params p;
+
+        while (true) {
+                int opt = getopt_long(argc, argv, "f:i:I:", opts, nullptr);
+                if (opt == -1) {
+                        break;
+                }
+
+                auto ok = true;
+
+                switch (opt) {
+                case 'f':
+                        rules = optarg;
+                        break;
+                case 'i':
+                        ok = parse_seconds(optarg, p.min_interval);
+                        break;
+                case 'I':
+                        ok = parse_seconds(optarg, p.max_interval);
+                        break;
+                default:
+                        ok = false;
+                }
+
+                if (!ok) {
+                        err("invalid option: %c", opt);
+                        usbip_autoattach_usage();
+                        return 1;
+                }
+        }
+
+        if (!rules) {
+                err("rules file required");
+                usbip_autoattach_usage();
+                return 1;
+        }
+
+        if (p.max_interval < p.min_interval) {
+                p.max_interval = p.min_interval;
+        }
+
+        std::vector<host_state> hosts;
+        if (!read_rules(rules, hosts)) {
+                return 1;
+        }
+
+        return run(hosts, p);
+}
@@ -0,0 +1,188 @@
+#include "autoattach_rules.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <sstream>
+
+namespace
+{
+
+/*
+ * @return true if the whole string is a number
+ */
+auto parse_number(std::string_view s, unsigned int &val, int base)
+{
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val, base);
+        return !s.empty() && ec == std::errc() && end == s.data() + s.size();
+}
+
+} // namespace
+
+
+std::string usbip::autoattach::get_busid(const usbip_usb_device &d)
+{
+        return std::string(d.busid, strnlen(d.busid, sizeof(d.busid)));
+}
+
+bool usbip::autoattach::same_device(const usbip_usb_device &a, const usbip_usb_device &b)
+{
+        return  a.busnum == b.busnum && a.devnum == b.devnum && a.speed == b.speed &&
+                a.idVendor == b.idVendor && a.idProduct == b.idProduct && a.bcdDevice == b.bcdDevice;
+}
+
+bool usbip::autoattach::matches(const std::vector<rule> &rules, const usbip_usb_device &d)
+{
+        auto busid = get_busid(d);
+
+        for (auto &r: rules) {
+                if (r.any) {
+                        return true;
+                } else if (r.busid.empty() ? r.vid == d.idVendor && r.pid == d.idProduct : r.busid == busid) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+bool usbip::autoattach::parse_rule(const std::string &s, rule &r)
+{
+        if (s == "*") {
+                r.any = true;
+                return true;
+        }
+
+        auto pos = s.find(':');
+        if (pos == s.npos) { // busid has no colons, f.e. "1-1.2"
+                r.busid = s;
+                return s.size() < USBIP_BUS_ID_SIZE;
+        }
+
+        unsigned int vid = 0;
+        unsigned int pid = 0;
+
+        std::string_view v(s);
+
+        if (!(parse_number(v.substr(0, pos), vid, 16) && parse_number(v.substr(pos + 1), pid, 16)) ||
+            vid > UINT16_MAX || pid > UINT16_MAX) {
+                return false;
+        }
+
+        r.vid = static_cast<UINT16>(vid);
+        r.pid = static_cast<UINT16>(pid);
+        return true;
+}
+
+bool usbip::autoattach::read_rules(std::istream &in, std::vector<host_state> &hosts, std::string &error)
+{
+        int lineno = 0;
+
+        for (std::string line; std::getline(in, line); ) {
+                ++lineno;
+
+                std::istringstream is(line);
+                std::string host;
+                std::string match;
+
+                if (!(is >> host) || host.starts_with('#')) {
+                        continue;
+                }
+
+                rule r{};
+                if (!(is >> match && parse_rule(match, r))) {
+                        error = "line " + std::to_string(lineno) + ": busid, <vid>:<pid> or * expected";
+                        return false;
+                }
+
+                auto h = std::find_if(hosts.begin(), hosts.end(), [&host] (auto &i) { return i.name == host; });
+                if (h == hosts.end()) {
+                        h = hosts.insert(h, host_state{ .name = host });
+                }
+
+                h->rules.push_back(std::move(r));
+        }
+
+        if (hosts.empty()) {
+                error = "no rules";
+                return false;
+        }
+
+        return true;
+}
+
+bool usbip::autoattach::parse_seconds(const char *s, clock_type::duration &d)
+{
+        unsigned int n = 0;
+        if (!parse_number(s, n, 10) || !n) {
+                return false;
+        }
+
+        d = std::chrono::seconds(n);
+        return true;
+}
+
+bool usbip::autoattach::update(
+        host_state &h, const std::vector<usbip_usb_device> &devs, clock_type::time_point now, devlist_changes &changes)
+{
+        std::map<std::string, device_state> next;
+        bool changed = false;
+
+        for (auto &d: devs) {
+                auto busid = get_busid(d);
+
+                if (auto i = h.devices.find(busid); i != h.devices.end() && same_device(i->second.udev, d)) {
+                        next.emplace(busid, std::move(i->second));
+                        continue;
+                }
+
+                changed = true;
+
+                device_state st{ .udev = d, .match = matches(h.rules, d), .next_try = now };
+                if (st.match) {
+                        changes.appeared.push_back(d);
+                }
+
+                next.emplace(std::move(busid), st);
+        }
+
+        for (auto &[busid, st]: h.devices) {
+                if (!next.contains(busid)) {
+                        changed = true;
+                        if (st.match) {
+                                changes.gone.push_back(busid);
+                        }
+                }
+        }
+
+        h.devices = std::move(next);
+        return changed;
+}
+
+auto usbip::autoattach::next_poll_interval(clock_type::duration interval, bool changed, const poll_params &p)
+        -> clock_type::duration
+{
+        return changed ? p.min_interval : std::min(2*interval, p.max_interval);
+}
+
+auto usbip::autoattach::next_retry_delay(unsigned int failures) -> clock_type::duration
+{
+        auto shift = std::min(failures - 1, 16U);
+        return std::min(clock_type::duration(retry_delay)*(1U << shift), clock_type::duration(max_retry_delay));
+}
+
+auto usbip::autoattach::next_wakeup(const std::vector<host_state> &hosts) -> clock_type::time_point
+{
+        auto t = clock_type::time_point::max();
+
+        for (auto &h: hosts) {
+                t = std::min(t, h.next_poll);
+                for (auto &[busid, st]: h.devices) {
+                        if (st.match && !st.port) {
+                                t = std::min(t, st.next_try);
+                        }
+                }
+        }
+
+        return t;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+/*
+ * Rules, devlist diff and timers of "usbip autoattach", they do not depend on Windows.
+ * It is built by usbip.vcxproj and on POSIX, see userspace/CMakeLists.txt.
+ */
+
+#include <usbip/proto_op.h>
+
+#include <chrono>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace usbip::autoattach
+{
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+inline constexpr auto retry_delay = 1s; // after the first failed attach, doubles on every next failure
+inline constexpr auto max_retry_delay = 5min;
+
+struct rule
+{
+        std::string busid; // empty if vid:pid is used
+        UINT16 vid;
+        UINT16 pid;
+        bool any;
+};
+
+struct device_state
+{
+        usbip_usb_device udev; // as seen in the last devlist
+        bool match;
+        int port; // zero if not attached
+        unsigned int failures;
+        clock_type::time_point next_try;
+};
+
+struct host_state
+{
+        std::string name;
+        std::vector<rule> rules;
+        std::map<std::string, device_state> devices; // the last devlist by busid
+        clock_type::duration interval;
+        clock_type::time_point next_poll;
+};
+
+struct poll_params
+{
+        clock_type::duration min_interval = 2s;
+        clock_type::duration max_interval = 60s;
+};
+
+std::string get_busid(const usbip_usb_device &d);
+
+/*
+ * A device that was replugged gets another devnum, so it is a new one.
+ */
+bool same_device(const usbip_usb_device &a, const usbip_usb_device &b);
+
+bool matches(const std::vector<rule> &rules, const usbip_usb_device &d);
+
+/*
+ * @param s "<busid>", "<vid>:<pid>" in hex or "*"
+ */
+bool parse_rule(const std::string &s, rule &r);
+
+/*
+ * One rule per line, "<host> <busid>", "<host> <vid>:<pid>" or "<host> *", '#' starts a comment.
+ * @param error is set if false is returned
+ */
+bool read_rules(std::istream &in, std::vector<host_state> &hosts, std::string &error);
+
+/*
+ * @param s positive number of seconds
+ */
+bool parse_seconds(const char *s, clock_type::duration &d);
+
+/*
+ * Matching devices that have appeared or gone since the previous devlist.
+ */
+struct devlist_changes
+{
+        std::vector<usbip_usb_device> appeared;
+        std::vector<std::string> gone; // busids
+};
+
+/*
+ * Diffs the devlist against the previous one, new and changed devices are due to attach at once.
+ * @return true if the devlist has changed
+ */
+bool update(host_state &h, const std::vector<usbip_usb_device> &devs, clock_type::time_point now, devlist_changes &changes);
+
+/*
+ * The interval is reset if a devlist has changed and doubles otherwise or on error.
+ */
+clock_type::duration next_poll_interval(clock_type::duration interval, bool changed, const poll_params &p);
+
+/*
+ * @param failures of attach in a row, at least one
+ */
+clock_type::duration next_retry_delay(unsigned int failures);
+
+/*
+ * @return the time of the next devlist poll or attach retry
+ */
+clock_type::time_point next_wakeup(const std::vector<host_state> &hosts);
+
+} // namespace usbip::autoattach
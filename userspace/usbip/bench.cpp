@@ -0,0 +1,86 @@
+#include "usbip.h"
+#include "benchmark.h"
+
+#include <libusbip\network.h>
+#include <libusbip\common.h>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+class socket_stream : public stream
+{
+public:
+        explicit socket_stream(SOCKET s) : m_sock(s) {}
+
+        bool send(const void *data, size_t len) override
+        {
+                return usbip_net_send(m_sock, const_cast<void*>(data), len) >= 0;
+        }
+
+        bool recv(void *data, size_t len) override
+        {
+                return usbip_net_recv(m_sock, data, len) >= 0;
+        }
+
+private:
+        SOCKET m_sock;
+};
+
+int bench_device(const char *host, const char *busid, const bench_params &p)
+{
+        auto sock = usbip_net_tcp_connect(host, usbip_port);
+        if (!sock) {
+                err("can't connect to %s:%s", host, usbip_port);
+                return 3;
+        }
+
+        socket_stream s(sock.get());
+        usbip_usb_device d{};
+        std::string error;
+
+        auto devid = import_device(s, busid, d, error);
+        if (!devid) {
+                err("%s", error.c_str());
+                return 3;
+        }
+
+        info("imported %s %04x:%04x, %s", busid, d.idVendor, d.idProduct,
+              usbip_speed_string(static_cast<usb_device_speed>(d.speed)));
+
+        bench_result r;
+        auto ok = run(s, devid, p, r, error);
+        if (!ok) {
+                err("%s", error.c_str());
+        }
+
+        print_result(stdout, r);
+        return ok ? 0 : 4;
+}
+
+} // namespace
+
+
+void usbip_bench_usage()
+{
+        printf("usage: %s", usage_string);
+}
+
+/*
+ * Imports the device directly, bypassing vhci driver.
+ * The device remains claimed by the server until the connection is closed.
+ */
+int usbip_bench(int argc, char *argv[])
+{
+        bench_args args;
+        std::string error;
+
+        if (!parse_args(argc, argv, args, error)) {
+                err("%s", error.c_str());
+                usbip_bench_usage();
+                return 1;
+        }
+
+        return bench_device(args.host, args.busid, args.params);
+}
@@ -0,0 +1,123 @@
+/*
+ * usbip-bench, POSIX build of "usbip bench" that runs against a remote usbipd from Linux, see userspace/CMakeLists.txt.
+ */
+#include "benchmark.h"
+#include <libusbip/connector.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+class fd_stream : public stream
+{
+public:
+        explicit fd_stream(int fd) : m_fd(fd) {}
+        ~fd_stream() { if (m_fd >= 0) close(m_fd); }
+
+        fd_stream(const fd_stream&) = delete;
+        fd_stream& operator =(const fd_stream&) = delete;
+
+        bool send(const void *data, size_t len) override
+        {
+                for (auto p = static_cast<const char*>(data); len; ) {
+                        auto n = ::send(m_fd, p, len, MSG_NOSIGNAL);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        } else if (n <= 0) {
+                                return false;
+                        }
+                        p += n;
+                        len -= n;
+                }
+                return true;
+        }
+
+        bool recv(void *data, size_t len) override
+        {
+                for (auto p = static_cast<char*>(data); len; ) {
+                        auto n = ::recv(m_fd, p, len, 0);
+                        if (n < 0 && errno == EINTR) {
+                                continue;
+                        } else if (n <= 0) {
+                                return false;
+                        }
+                        p += n;
+                        len -= n;
+                }
+                return true;
+        }
+
+private:
+        int m_fd;
+};
+
+/*
+ * The same Happy Eyeballs as usbip_net_tcp_connect.
+ */
+int connect_to(const char *host, const char *port)
+{
+        using namespace usbip::net;
+
+        std::vector<address> addrs;
+        if (auto err = resolve(host, port, addrs, nullptr)) {
+                fprintf(stderr, "getaddrinfo('%s:%s') %s\n", host, port, gai_strerror(err));
+                return -1;
+        }
+
+        const address *winner{};
+        auto fd = race(addrs, connection_attempt_timeout, winner);
+
+        if (fd >= 0) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        return fd;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench_args args;
+        std::string error;
+
+        if (!parse_args(argc, argv, args, error)) {
+                fprintf(stderr, "%s\nusage: %s", error.c_str(), usage_string);
+                return 1;
+        }
+
+        auto fd = connect_to(args.host, "3240");
+        if (fd < 0) {
+                fprintf(stderr, "can't connect to %s:3240\n", args.host);
+                return 3;
+        }
+
+        fd_stream s(fd);
+        usbip_usb_device udev{};
+
+        auto devid = import_device(s, args.busid, udev, error);
+        if (!devid) {
+                fprintf(stderr, "%s\n", error.c_str());
+                return 3;
+        }
+
+        printf("imported %s %04x:%04x\n", args.busid, udev.idVendor, udev.idProduct);
+
+        bench_result r;
+        auto ok = run(s, devid, args.params, r, error);
+        if (!ok) {
+                fprintf(stderr, "%s\n", error.c_str());
+        }
+
+        print_result(stdout, r);
+        return ok ? 0 : 4;
+}
@@ -0,0 +1,397 @@
+#include "benchmark.h"
+
+#include <usbip/ch9.h>
+#include <libusbip/dbgcode.h>
+
+#ifdef _WIN32
+  #include <libusbip/getopt.h>
+#else
+  #include <getopt.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+namespace
+{
+
+using namespace usbip::bench;
+
+/*
+ * @return formatted message, the format is checked by the compiler like printf
+ */
+template<typename... Args>
+auto format(const char *fmt, Args... args)
+{
+        std::string s(256, '\0');
+
+        auto n = snprintf(s.data(), s.size(), fmt, args...);
+        s.resize(n < 0 ? 0 : std::min(size_t(n), s.size() - 1));
+
+        return s;
+}
+
+} // namespace
+
+
+const char usbip::bench::usage_string[] =
+"usbip bench <args>\n"
+"    -r, --remote=<host>    The machine with exported USB devices\n"
+"    -b, --busid=<busid>    Busid of the device on <host>\n"
+"    -m, --mode=<mode>      ping (default), bulk-in, bulk-out, intr\n"
+"    -e, --endpoint=<num>   Endpoint number for bulk and interrupt modes\n"
+"    -n, --count=<num>      Number of URBs to complete (default 1000)\n"
+"    -q, --depth=<num>      Number of outstanding URBs (default 1)\n"
+"    -s, --size=<bytes>     Transfer buffer length (default 512)\n";
+
+bool usbip::bench::parse_mode(std::string_view s, bench_mode &mode)
+{
+        const struct {
+                std::string_view name;
+                bench_mode mode;
+        } v[] = {
+                {"ping", bench_mode::ping},
+                {"bulk-in", bench_mode::bulk_in},
+                {"bulk-out", bench_mode::bulk_out},
+                {"intr", bench_mode::intr},
+        };
+
+        for (auto &i: v) {
+                if (i.name == s) {
+                        mode = i.mode;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+bool usbip::bench::parse_uint(const char *s, UINT32 &val, UINT32 max_val)
+{
+        char *end{};
+        auto n = strtoul(s, &end, 0);
+
+        if (end == s || *end || *s == '-' || n > max_val) {
+                return false;
+        }
+
+        val = static_cast<UINT32>(n);
+        return true;
+}
+
+bool usbip::bench::parse_args(int argc, char *argv[], bench_args &args, std::string &error)
+{
+        const option opts[] =
+        {
+                { "remote", required_argument, nullptr, 'r' },
+                { "busid", required_argument, nullptr, 'b' },
+                { "mode", required_argument, nullptr, 'm' },
+                { "endpoint", required_argument, nullptr, 'e' },
+                { "count", required_argument, nullptr, 'n' },
+                { "depth", required_argument, nullptr, 'q' },
+                { "size", required_argument, nullptr, 's' },
+                {}
+        };
+
+        auto &p = args.params;
+        UINT32 size = p.size;
+
+        while (true) {
+                int opt = getopt_long(argc, argv, "r:b:m:e:n:q:s:", opts, nullptr);
+                if (opt == -1) {
+                        break;
+                }
+
+                auto ok = true;
+
+                switch (opt) {
+                case 'r':
+                        args.host = optarg;
+                        break;
+                case 'b':
+                        args.busid = optarg;
+                        break;
+                case 'm':
+                        ok = parse_mode(optarg, p.mode);
+                        break;
+                case 'e':
+                        ok = parse_uint(optarg, p.ep, 0xF);
+                        break;
+                case 'n':
+                        ok = parse_uint(optarg, p.count) && p.count;
+                        break;
+                case 'q':
+                        ok = parse_uint(optarg, p.depth) && p.depth;
+                        break;
+                case 's':
+                        ok = parse_uint(optarg, size, INT32_MAX);
+                        break;
+                default:
+                        ok = false;
+                }
+
+                if (!ok) {
+                        error = format("invalid option: %c", opt);
+                        return false;
+                }
+        }
+
+        if (!args.host) {
+                error = "empty remote host";
+                return false;
+        }
+
+        if (!args.busid) {
+                error = "empty busid";
+                return false;
+        }
+
+        if (p.mode != bench_mode::ping && !p.ep) {
+                error = "endpoint number required for this mode";
+                return false;
+        }
+
+        p.size = p.mode == bench_mode::ping ? INT32(sizeof(UINT16)) : static_cast<INT32>(size);
+        return true;
+}
+
+/*
+ * All fields before cmd_submit.setup are 32-bit integers, RET_SUBMIT has the same layout.
+ */
+void usbip::bench::byteswap(usbip_header &h)
+{
+        constexpr auto cnt = offsetof(usbip_header, u.cmd_submit.setup)/sizeof(UINT32);
+        static_assert(cnt == 10);
+
+        auto v = reinterpret_cast<UINT32*>(&h);
+        for (size_t i = 0; i < cnt; ++i) {
+                usbip_net_pack_uint32_t(0, v + i);
+        }
+}
+
+usbip_header usbip::bench::make_cmd_submit(const bench_params &p, UINT32 devid, seqnum_t seqnum)
+{
+        usbip_header h{};
+        auto &b = h.base;
+
+        b.command = USBIP_CMD_SUBMIT;
+        b.seqnum = seqnum;
+        b.devid = devid;
+
+        auto &c = h.u.cmd_submit;
+        c.number_of_packets = number_of_packets_non_isoch;
+
+        switch (p.mode) {
+        case bench_mode::ping: // GET_STATUS of the device
+                b.direction = USBIP_DIR_IN;
+                c.transfer_buffer_length = sizeof(UINT16);
+                c.setup[0] = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+                c.setup[6] = sizeof(UINT16);
+                break;
+        case bench_mode::bulk_out:
+                b.direction = USBIP_DIR_OUT;
+                b.ep = p.ep;
+                c.transfer_buffer_length = p.size;
+                break;
+        case bench_mode::intr:
+                c.interval = 1;
+                [[fallthrough]];
+        case bench_mode::bulk_in:
+                b.direction = USBIP_DIR_IN;
+                b.ep = p.ep;
+                c.transfer_buffer_length = p.size;
+                break;
+        }
+
+        return h;
+}
+
+UINT32 usbip::bench::import_device(stream &s, const char *busid, usbip_usb_device &udev, std::string &error)
+{
+        struct
+        {
+                op_common hdr{ USBIP_VERSION, OP_REQ_IMPORT, ST_OK };
+                op_import_request body{};
+        } req;
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        auto len = strlen(busid);
+        if (len >= sizeof(req.body.busid)) {
+                error = format("busid is too long: %s", busid);
+                return 0;
+        }
+
+        memcpy(req.body.busid, busid, len);
+
+        PACK_OP_COMMON(1, &req.hdr);
+        PACK_OP_IMPORT_REQUEST(1, &req.body);
+
+        if (!s.send(&req, sizeof(req))) {
+                error = "failed to send import request";
+                return 0;
+        }
+
+        op_common hdr{};
+        if (!s.recv(&hdr, sizeof(hdr))) {
+                error = "failed to recv common header";
+                return 0;
+        }
+
+        PACK_OP_COMMON(0, &hdr);
+
+        if (hdr.version != USBIP_VERSION) {
+                error = format("version mismatch: %#x != %#x", hdr.version, USBIP_VERSION);
+                return 0;
+        }
+
+        if (hdr.code != OP_REP_IMPORT) {
+                error = format("unexpected pdu %#x for %#x", hdr.code, OP_REP_IMPORT);
+                return 0;
+        }
+
+        if (hdr.status != ST_OK) {
+                error = format("import failed: %s", dbg_opcode_status(hdr.status));
+                return 0;
+        }
+
+        op_import_reply reply{};
+        if (!s.recv(&reply, sizeof(reply))) {
+                error = "failed to recv import reply";
+                return 0;
+        }
+
+        PACK_OP_IMPORT_REPLY(0, &reply);
+
+        udev = reply.udev;
+        if (strncmp(udev.busid, busid, sizeof(udev.busid))) {
+                error = format("received different busid '%.*s'", int(sizeof(udev.busid)), udev.busid);
+                return 0;
+        }
+
+        return udev.busnum << 16 | udev.devnum;
+}
+
+/*
+ * Sends and receives are done on the same thread, a reply is always read before the next submit.
+ */
+bool usbip::bench::run(stream &s, UINT32 devid, const bench_params &p, bench_result &r, std::string &error)
+{
+        std::vector<char> buf(p.size);
+        std::unordered_map<seqnum_t, clock_type::time_point> inflight;
+
+        r.latency.reserve(p.count);
+
+        seqnum_t seqnum = 0;
+        UINT32 submitted = 0;
+
+        auto dir_in = p.mode != bench_mode::bulk_out; // the server does not fill direction of RET_SUBMIT
+
+        auto submit = [&]
+        {
+                auto h = make_cmd_submit(p, devid, ++seqnum);
+                byteswap(h);
+                inflight.emplace(seqnum, clock_type::now());
+
+                if (!s.send(&h, sizeof(h)) || (!dir_in && !s.send(buf.data(), buf.size()))) {
+                        error = format("failed to send CMD_SUBMIT #%u", seqnum);
+                        return false;
+                }
+
+                ++submitted;
+                return true;
+        };
+
+        auto start = clock_type::now();
+
+        while (submitted < std::min(p.depth, p.count)) {
+                if (!submit()) {
+                        return false;
+                }
+        }
+
+        while (r.completed < p.count) {
+
+                usbip_header h{};
+                if (!s.recv(&h, sizeof(h))) {
+                        error = "failed to recv RET_SUBMIT";
+                        return false;
+                }
+
+                auto now = clock_type::now();
+                byteswap(h);
+
+                auto &ret = h.u.ret_submit;
+                if (h.base.command != USBIP_RET_SUBMIT || ret.actual_length < 0 || ret.actual_length > p.size) {
+                        error = format("unexpected reply: command %u, actual_length %d", h.base.command, ret.actual_length);
+                        return false;
+                }
+
+                auto i = inflight.find(h.base.seqnum);
+                if (i == inflight.end()) {
+                        error = format("unknown seqnum %u", h.base.seqnum);
+                        return false;
+                }
+
+                r.latency.push_back(now - i->second);
+                inflight.erase(i);
+
+                if (dir_in && !s.recv(buf.data(), ret.actual_length)) {
+                        error = "failed to recv transfer buffer";
+                        return false;
+                }
+
+                ++r.completed;
+                r.bytes += ret.actual_length;
+
+                if (ret.status) {
+                        ++r.errors;
+                }
+
+                if (submitted < p.count && !submit()) {
+                        return false;
+                }
+        }
+
+        r.elapsed = clock_type::now() - start;
+        return true;
+}
+
+usbip::bench::latency_summary usbip::bench::summarize(std::vector<clock_type::duration> &v)
+{
+        if (v.empty()) {
+                return {};
+        }
+
+        std::sort(v.begin(), v.end());
+
+        auto pct = [&v] (double p) { return v[static_cast<size_t>(p*(v.size() - 1))]; };
+        return { v.front(), pct(0.5), pct(0.99), pct(0.999), v.back() };
+}
+
+void usbip::bench::print_result(FILE *out, bench_result &r)
+{
+        using std::chrono::duration;
+        using usec = std::chrono::microseconds;
+
+        auto secs = duration<double>(r.elapsed).count();
+        if (secs <= 0) {
+                secs = 1e-9;
+        }
+
+        fprintf(out, "URBs:       %u (%u errors)\n", r.completed, r.errors);
+        fprintf(out, "Elapsed:    %.3f s\n", secs);
+        fprintf(out, "Throughput: %.2f MB/s, %.0f URB/s\n", r.bytes/secs/(1024*1024), r.completed/secs);
+
+        if (r.latency.empty()) {
+                return;
+        }
+
+        auto s = summarize(r.latency);
+        auto us = [] (auto d) { return static_cast<long long>(std::chrono::duration_cast<usec>(d).count()); };
+
+        fprintf(out, "Latency:    min %lld, p50 %lld, p99 %lld, p999 %lld, max %lld us\n",
+                us(s.min), us(s.p50), us(s.p99), us(s.p999), us(s.max));
+}
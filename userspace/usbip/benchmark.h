@@ -0,0 +1,106 @@
+#pragma once
+
+/*
+ * The engine of "usbip bench", it does not depend on Windows.
+ * It is built by usbip.vcxproj and on POSIX, see userspace/CMakeLists.txt.
+ */
+
+#include <usbip/proto.h>
+#include <usbip/proto_op.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace usbip::bench
+{
+
+using clock_type = std::chrono::steady_clock;
+
+enum class bench_mode { ping, bulk_in, bulk_out, intr };
+
+struct bench_params
+{
+        bench_mode mode = bench_mode::ping;
+        UINT32 ep{};
+        UINT32 count = 1000;
+        UINT32 depth = 1;
+        INT32 size = 512;
+};
+
+struct bench_result
+{
+        UINT32 completed{};
+        UINT32 errors{};
+        UINT64 bytes{};
+        clock_type::duration elapsed{};
+        std::vector<clock_type::duration> latency;
+};
+
+struct bench_args
+{
+        const char *host{};
+        const char *busid{};
+        bench_params params;
+};
+
+/*
+ * Blocking transport, a call transfers exactly len bytes or fails.
+ */
+class stream
+{
+public:
+        virtual ~stream() = default;
+
+        virtual bool send(const void *data, size_t len) = 0;
+        virtual bool recv(void *data, size_t len) = 0;
+};
+
+extern const char usage_string[];
+
+bool parse_mode(std::string_view s, bench_mode &mode);
+bool parse_uint(const char *s, UINT32 &val, UINT32 max_val = UINT32_MAX);
+
+/*
+ * @param argv options of "usbip bench", getopt_long is used
+ * @param error is set if false is returned
+ */
+bool parse_args(int argc, char *argv[], bench_args &args, std::string &error);
+
+void byteswap(usbip_header &h);
+usbip_header make_cmd_submit(const bench_params &p, UINT32 devid, seqnum_t seqnum);
+
+/*
+ * Sends OP_REQ_IMPORT and receives OP_REP_IMPORT.
+ * @param udev in host byte order
+ * @return devid of the imported device or zero, see error
+ */
+UINT32 import_device(stream &s, const char *busid, usbip_usb_device &udev, std::string &error);
+
+/*
+ * Keeps p.depth URBs in flight until p.count of them are completed.
+ * @return false on protocol or transport error, r has the URBs that were completed
+ */
+bool run(stream &s, UINT32 devid, const bench_params &p, bench_result &r, std::string &error);
+
+struct latency_summary
+{
+        clock_type::duration min;
+        clock_type::duration p50;
+        clock_type::duration p99;
+        clock_type::duration p999;
+        clock_type::duration max;
+};
+
+/*
+ * Percentile p is the sample at index p*(n - 1) after sorting, the samples are sorted in place.
+ * @return zeroes if there are no samples
+ */
+latency_summary summarize(std::vector<clock_type::duration> &latency);
+
+void print_result(FILE *out, bench_result &r);
+
+} // namespace usbip::bench
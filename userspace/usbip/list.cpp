@@ -26,7 +26,8 @@ int list_exported_devices(const char *host);
 static const char usbip_list_usage_string[] =
 	"usbip list [-p|--parsable] <args>\n"
 	"    -p, --parsable         Parsable list format\n"
-	"    -r, --remote=<host>    List the exported USB devices on <host>\n"
+	"    -r, --remote=<host>[,<host>...]\n"
+	"                           List the exported USB devices on <host>(s)\n"
 	;
 
 void usbip_list_usage()
@@ -22,16 +22,62 @@
 #include <libusbip\common.h>
 #include <libusbip\network.h>
 #include <libusbip\dbgcode.h>
+#include <libusbip\devlist.h>
 
 #include <usbip\proto_op.h>
 
+#include <chrono>
+#include <cstdarg>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
 namespace
 {
 
-int get_exported_devices(const char *host, SOCKET sockfd)
+enum { RECV_TIMEOUT = 10'000 }; // msec, per host
+
+struct host_result
+{
+	int rc;
+	bool no_devices;
+	std::string out;
+	std::string error;
+};
+
+void append(std::string &s, const char *fmt, ...)
 {
-	auto rc = usbip_net_send_op_common(sockfd, OP_REQ_DEVLIST, 0);
-	if (rc < 0) {
+	va_list args;
+
+	va_start(args, fmt);
+	auto len = vsnprintf(nullptr, 0, fmt, args);
+	va_end(args);
+
+	if (len <= 0) {
+		return;
+	}
+
+	auto pos = s.size();
+	s.resize(pos + len + 1);
+
+	va_start(args, fmt);
+	vsnprintf(s.data() + pos, len + 1, fmt, args);
+	va_end(args);
+
+	s.pop_back(); // '\0'
+}
+
+/*
+ * Sends OP_REQ_DEVLIST and decodes OP_REP_DEVLIST, records are converted to host byte order.
+ * @return zero or error code, see err_t
+ */
+int get_devlist(SOCKET sockfd, std::vector<usbip::exported_device> &devs)
+{
+	devs.clear();
+
+	if (auto rc = usbip_net_send_op_common(sockfd, OP_REQ_DEVLIST, 0)) {
 		dbg("failed to send common header: %s", dbg_errcode(rc));
 		return ERR_NETWORK;
 	}
@@ -39,86 +85,222 @@ int get_exported_devices(const char *host, SOCKET sockfd)
 	uint16_t code = OP_REP_DEVLIST;
 	int status = 0;
 
-	rc = usbip_net_recv_op_common(sockfd, &code, &status);
-	if (rc < 0) {
+	if (auto rc = usbip_net_recv_op_common(sockfd, &code, &status)) {
 		dbg("failed to recv common header: %s", dbg_errcode(rc));
 		return rc;
 	}
 
-	op_devlist_reply reply{};
-	rc = usbip_net_recv(sockfd, &reply, sizeof(reply));
-	if (rc < 0) {
-		dbg("failed to recv devlist: %s", dbg_errcode(rc));
+	usbip::BufferedReader rd([sockfd] (void *buf, size_t len)
+	{
+		return recv(sockfd, static_cast<char*>(buf), static_cast<int>(len), 0);
+	});
+
+	std::string error;
+	if (!read_devlist(rd, devs, error)) {
+		dbg("%s", error.c_str());
+		return ERR_NETWORK;
+	}
+
+	return 0;
+}
+
+int get_exported_devices(const char *host, SOCKET sockfd, host_result &r)
+{
+	std::vector<usbip::exported_device> devs;
+	if (auto rc = get_devlist(sockfd, devs)) {
 		return rc;
 	}
 
-	PACK_OP_DEVLIST_REPLY(0, &reply);
-	dbg("exportable devices: %d\n", reply.ndev);
+	dbg("exportable devices: %zu\n", devs.size());
 
-	if (!reply.ndev) {
-		info("no exportable devices found on %s", host);
+	if (devs.empty()) {
+		r.no_devices = true;
 		return 0;
 	}
 
-	printf("Exportable USB devices\n");
-	printf("======================\n");
-	printf(" - %s\n", host);
+	auto &out = r.out;
 
-	for (unsigned int i = 0; i < reply.ndev; ++i) {
+	append(out, "Exportable USB devices\n");
+	append(out, "======================\n");
+	append(out, " - %s\n", host);
 
-		usbip_usb_device udev{};
-		rc = usbip_net_recv(sockfd, &udev, sizeof(udev));
-		if (rc < 0) {
-			dbg("failed to recv devlist: usbip_usb_device[%d]: %s", i, dbg_errcode(rc));
-			return ERR_NETWORK;
-		}
-		usbip_net_pack_usb_device(0, &udev);
+	auto &ids = get_ids();
+
+	for (auto &d: devs) {
+		auto &udev = d.udev;
 
-		auto &ids = get_ids();
 		auto product_name = usbip_names_get_product(ids, udev.idVendor, udev.idProduct);
 		auto class_name = usbip_names_get_class(ids, udev.bDeviceClass, udev.bDeviceSubClass, udev.bDeviceProtocol);
 
-		printf("%11s: %s\n", udev.busid, product_name.c_str());
-		printf("%11s: %s\n", "", udev.path);
-		printf("%11s: %s\n", "", class_name.c_str());
-
-		for (int j = 0; j < udev.bNumInterfaces; ++j) {
-			usbip_usb_interface uintf{};
-			rc = usbip_net_recv(sockfd, &uintf, sizeof(uintf));
-			if (rc < 0) {
-				dbg("failed to recv devlist: usbip_usb_intf[%d]: %s", j, dbg_errcode(rc));
-				return ERR_NETWORK;
-			}
-
-			usbip_net_pack_usb_interface(0, &uintf);
+		append(out, "%11.*s: %s\n", int(sizeof(udev.busid)), udev.busid, product_name.c_str());
+		append(out, "%11s: %.*s\n", "", int(sizeof(udev.path)), udev.path);
+		append(out, "%11s: %s\n", "", class_name.c_str());
 
+		for (size_t j = 0; j < d.interfaces.size(); ++j) {
+			auto &uintf = d.interfaces[j];
 			auto csp = usbip_names_get_class(ids, uintf.bInterfaceClass, uintf.bInterfaceSubClass, uintf.bInterfaceProtocol);
-			printf("%11s: %2d - %s\n", "", j, csp.c_str());
+			append(out, "%11s: %2zu - %s\n", "", j, csp.c_str());
 		}
 
-		printf("\n");
+		append(out, "\n");
 	}
 
 	return 0;
 }
 
+auto set_recv_timeout(SOCKET s, DWORD msec)
+{
+	if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&msec), sizeof(msec))) {
+		dbg("setsockopt(SO_RCVTIMEO) error %d", WSAGetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Device lists of remote hosts, filled only if usbip_devlist_ttl is set (usbip service).
+ */
+struct cached_result
+{
+	std::chrono::steady_clock::time_point expires;
+	host_result r;
+};
+
+std::mutex g_devlist_mtx;
+std::map<std::string, cached_result> g_devlist;
+
+auto get_cached(const std::string &key, host_result &r)
+{
+	std::lock_guard lck(g_devlist_mtx);
+
+	auto i = g_devlist.find(key);
+	if (i == g_devlist.end()) {
+		return false;
+	} else if (i->second.expires <= std::chrono::steady_clock::now()) {
+		g_devlist.erase(i);
+		return false;
+	}
+
+	r = i->second.r;
+	return true;
+}
+
+void put_cached(std::string key, const host_result &r)
+{
+	auto expires = std::chrono::steady_clock::now() + std::chrono::seconds(usbip_devlist_ttl);
+
+	std::lock_guard lck(g_devlist_mtx);
+	g_devlist.insert_or_assign(std::move(key), cached_result{ expires, r });
+}
+
+auto list_host(const std::string &host)
+{
+	host_result r{};
+
+	auto key = host + ':' + usbip_port;
+	if (usbip_devlist_ttl && get_cached(key, r)) {
+		dbg("%s: cached device list", key.c_str());
+		return r;
+	}
+
+	auto sock = usbip_net_tcp_connect(host.c_str(), usbip_port, RECV_TIMEOUT);
+	if (!sock) {
+		append(r.error, "failed to connect a remote host: %s", host.c_str());
+		r.rc = 3;
+		return r;
+	}
+	dbg("connected to %s:%s\n", host.c_str(), usbip_port);
+
+	set_recv_timeout(sock.get(), RECV_TIMEOUT);
+
+	if (get_exported_devices(host.c_str(), sock.get(), r) < 0) {
+		append(r.error, "failed to get device list from %s", host.c_str());
+		r.rc = 4;
+	} else if (usbip_devlist_ttl) {
+		put_cached(std::move(key), r);
+	}
+
+	return r;
+}
+
+auto split(std::string_view s, char sep)
+{
+	std::vector<std::string> v;
+
+	while (!s.empty()) {
+		auto pos = s.find(sep);
+		if (auto h = s.substr(0, pos); !h.empty()) {
+			v.emplace_back(h);
+		}
+		s.remove_prefix(pos == s.npos ? s.size() : pos + 1);
+	}
+
+	return v;
+}
+
 } // namespace
 
 
-int list_exported_devices(const char *host)
+/*
+ * The same reply as for "usbip list", interfaces are not returned.
+ * @return false if the host is unreachable or the reply is malformed
+ */
+bool get_remote_devices(const char *host, std::vector<usbip_usb_device> &devs)
 {
-	auto sock = usbip_net_tcp_connect(host, usbip_port);
+	auto sock = usbip_net_tcp_connect(host, usbip_port, RECV_TIMEOUT);
 	if (!sock) {
-		err("failed to connect a remote host: %s", host);
-		return 3;
+		dbg("failed to connect a remote host: %s", host);
+		return false;
+	}
+
+	set_recv_timeout(sock.get(), RECV_TIMEOUT);
+
+	std::vector<usbip::exported_device> v;
+	if (get_devlist(sock.get(), v)) {
+		return false;
 	}
-	dbg("connected to %s:%s\n", host, usbip_port);
 
-	auto rc = get_exported_devices(host, sock.get());
-	if (rc < 0) {
-		err("failed to get device list from %s", host);
-		return 4;
+	devs.clear();
+	for (auto &d: v) {
+		devs.push_back(d.udev);
 	}
 
-	return 0;
-}
\ No newline at end of file
+	return true;
+}
+
+/*
+ * @param hosts comma separated list, hosts are queried concurrently and printed in the given order
+ */
+int list_exported_devices(const char *hosts)
+{
+	auto v = split(hosts, ',');
+	if (v.empty()) {
+		err("empty remote host");
+		return 1;
+	}
+
+	std::vector<std::future<host_result>> results;
+	results.reserve(v.size());
+
+	for (auto &h: v) {
+		auto policy = v.size() == 1 ? std::launch::deferred : std::launch::async;
+		results.push_back(std::async(policy, list_host, std::cref(h)));
+	}
+
+	int rc = 0;
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto r = results[i].get();
+		fputs(r.out.c_str(), stdout);
+
+		if (r.no_devices) {
+			info("no exportable devices found on %s", v[i].c_str());
+		} else if (r.rc) {
+			err("%s", r.error.c_str());
+			rc = r.rc;
+		}
+	}
+
+	return rc;
+}
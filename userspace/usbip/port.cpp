@@ -22,6 +22,7 @@
 
 #include <set>
 #include <sstream>
+#include <string_view>
 #include <vector>
 
 namespace
@@ -48,6 +49,10 @@ int usbip_vhci_imported_device_dump(const ioctl_usbip_vhci_imported_dev &d)
                 printf("%10s -> serial '%s'\n", " ", d.serial);
         }
 
+        if (d.rtt) {
+                printf("%10s -> rtt %.3f ms, rttvar %.3f ms\n", " ", d.rtt/1000.0, d.rttvar/1000.0);
+        }
+
         return 0;
 }
 
@@ -90,7 +95,6 @@ auto get_imported_devices(std::vector<ioctl_usbip_vhci_imported_dev> &devs, int
 int list_imported_devices(const std::set<int> &ports)
 {
         std::vector<ioctl_usbip_vhci_imported_dev> devs;
-        devs.reserve(USBIP_TOTAL_PORTS);
 
         {
                 auto port = ports.size() == 1 ? *ports.begin() : 0;
@@ -120,28 +124,201 @@ int list_imported_devices(const std::set<int> &ports)
         return 0;
 }
 
+auto is_watch_option(std::string_view s)
+{
+        return s == "-w" || s == "--watch";
+}
+
+/*
+ * Pending IOCTL_USBIP_VHCI_GET_PORT_CHANGES of a hub.
+ */
+struct hub_watch
+{
+        hci_version version;
+        usbip::Handle dev;
+        usbip::Handle event;
+        OVERLAPPED ov;
+        UINT32 generation = USBIP_PORT_CHANGES_SYNC;
+        bool synced;
+        std::vector<ioctl_usbip_vhci_port_change> buf;
+};
+
+auto start(hub_watch &w)
+{
+        w.ov = OVERLAPPED{ .hEvent = w.event.get() };
+        return usbip::vhci_get_port_changes(w.dev.get(), w.generation, w.buf, w.ov);
+}
+
+void dump_port(const std::vector<ioctl_usbip_vhci_imported_dev> &devs, int port)
+{
+        for (auto &d: devs) {
+                if (!d.port) {
+                        break;
+                } else if (d.port == port) {
+                        usbip_vhci_imported_device_dump(d);
+                        return;
+                }
+        }
+
+        printf("Port %02d: <%s>\n", port, usbip_status_string(VDEV_ST_NULL));
+}
+
+void print_changes(hub_watch &w, const ioctl_usbip_vhci_port_change *r, size_t cnt, const std::set<int> &ports)
+{
+        std::vector<ioctl_usbip_vhci_imported_dev> devs;
+        bool devs_read{};
+
+        auto get_devs = [&] () -> auto&
+        {
+                if (!devs_read) {
+                        devs = usbip::vhci_get_imported_devs(w.dev.get());
+                        devs_read = true;
+                }
+                return devs;
+        };
+
+        for (auto end = r + cnt; r != end; ++r) {
+                w.generation = r->generation;
+
+                switch (r->event) {
+                case PORT_CHANGE_SYNC:
+                        if (w.synced) {
+                                info("%s hub: port changes were lost, current state follows", w.version == HCI_USB3 ? "USB3" : "USB2");
+                        }
+                        w.synced = true;
+                        for (auto &d: get_devs()) {
+                                if (!d.port) {
+                                        break;
+                                } else if (ports.empty() || ports.contains(d.port)) {
+                                        usbip_vhci_imported_device_dump(d);
+                                }
+                        }
+                        break;
+                case PORT_CHANGE_ATTACHED:
+                        if (ports.empty() || ports.contains(r->port)) {
+                                printf("Port %02d: attached\n", r->port);
+                                dump_port(get_devs(), r->port);
+                        }
+                        break;
+                case PORT_CHANGE_DETACHED:
+                        if (ports.empty() || ports.contains(r->port)) {
+                                printf("Port %02d: detached\n", r->port);
+                        }
+                        break;
+                default:
+                        dbg("unexpected event %d, port %d", r->event, r->port);
+                }
+        }
+
+        fflush(stdout);
+}
+
+/*
+ * Prints the imported devices and then their changes as they happen, never returns on success.
+ */
+int watch_ports(const std::set<int> &ports)
+{
+        hub_watch hubs[ARRAYSIZE(vhci_list)];
+        HANDLE events[ARRAYSIZE(hubs)];
+
+        printf("Imported USB devices\n");
+        printf("====================\n");
+
+        for (size_t i = 0; i < ARRAYSIZE(hubs); ++i) {
+                auto &w = hubs[i];
+                w.version = vhci_list[i];
+
+                w.dev = usbip::vhci_driver_open(w.version);
+                if (!w.dev) {
+                        err("failed to open vhci driver");
+                        return 3;
+                }
+
+                if (auto n = usbip::vhci_get_num_ports(w.dev.get())) {
+                        w.buf.resize(n); // a change per port
+                } else {
+                        err("failed to get the number of ports");
+                        return 3;
+                }
+
+                if (auto ev = CreateEvent(nullptr, true, false, nullptr)) {
+                        w.event.reset(ev);
+                        events[i] = ev;
+                } else {
+                        err("CreateEvent error %#lx", GetLastError());
+                        return 3;
+                }
+
+                if (!start(w)) {
+                        err("failed to get port changes");
+                        return 2;
+                }
+        }
+
+        while (true) {
+                auto ret = WaitForMultipleObjects(ARRAYSIZE(events), events, false, INFINITE);
+                if (ret >= WAIT_OBJECT_0 + ARRAYSIZE(events)) {
+                        err("WaitForMultipleObjects error %#lx", GetLastError());
+                        return 3;
+                }
+
+                auto &w = hubs[ret - WAIT_OBJECT_0];
+
+                DWORD len = 0;
+                if (!GetOverlappedResult(w.dev.get(), &w.ov, &len, false)) {
+                        err("failed to get port changes, error %#lx", GetLastError());
+                        return 2;
+                }
+
+                print_changes(w, w.buf.data(), len/sizeof(w.buf[0]), ports);
+
+                if (!start(w)) {
+                        err("failed to get port changes");
+                        return 2;
+                }
+        }
+}
+
 } // namespace
 
 
 void usbip_port_usage()
 {
         const char fmt[] =
-"usage: usbip port [portN...]\n"
-"    portN      list given port(s) for checking, valid range is 1-%d\n";
+"usage: usbip port [-w|--watch] [portN...]\n"
+"    -w, --watch  keep running and show attach/detach of devices as they happen\n"
+"    portN        list given port(s) for checking, valid range is 1-%d\n";
 
         printf(fmt, USBIP_TOTAL_PORTS);
 }
 
+/*
+ * --watch never ends and must not occupy usbip service.
+ */
+bool usbip_port_can_forward(int argc, char *argv[])
+{
+        for (int i = 1; i < argc; ++i) {
+                if (is_watch_option(argv[i])) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
 int usbip_port_show(int argc, char *argv[])
 {
         std::set<int> ports;
+        bool watch{};
 
         for (int i = 1; i < argc; ++i) {
 
                 auto str = argv[i];
                 int port;
 
-                if ((std::istringstream(str) >> port) && is_valid_vport(port)) {
+                if (is_watch_option(str)) {
+                        watch = true;
+                } else if ((std::istringstream(str) >> port) && is_valid_vport(port)) {
                         ports.insert(port);
                 } else {
                         err("invalid port: %s", str);
@@ -150,5 +327,5 @@ int usbip_port_show(int argc, char *argv[])
                 }
         }
 
-	return list_imported_devices(ports);
+	return watch ? watch_ports(ports) : list_imported_devices(ports);
 }
@@ -0,0 +1,409 @@
+#include "usbip.h"
+
+#include <libusbip\getopt.h>
+#include <libusbip\common.h>
+#include <libusbip\network.h>
+#include <libusbip\win_handle.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <io.h>
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+const char pipe_name[] = "\\\\.\\pipe\\usbip";
+enum { PIPE_BUFSZ = 64*1024, PIPE_WAIT_TIMEOUT = 5'000 };
+
+const char usbip_service_usage_string[] =
+"usbip service [--devlist-ttl=<sec>]\n"
+"    Serve attach, detach, list, port and stats commands of other usbip processes\n"
+"    while keeping vhci driver paths, usb.ids, DNS results and device lists cached.\n"
+"    -l, --devlist-ttl=<sec>  Reuse remote device lists for <sec> seconds (default 5)\n";
+
+struct reply_header
+{
+        INT32 rc;
+        UINT32 out_len;
+        UINT32 err_len;
+};
+
+struct command_stats
+{
+        UINT32 count;
+        UINT32 failed;
+        clock_type::duration total;
+        clock_type::duration max;
+};
+
+bool g_in_service;
+clock_type::time_point g_started;
+std::map<std::string, command_stats> g_stats;
+
+/*
+ * Redirects stdout or stderr of the process to a temporary file.
+ */
+class Capture
+{
+public:
+        explicit Capture(FILE *stream);
+        ~Capture();
+
+        Capture(const Capture&) = delete;
+        Capture& operator=(const Capture&) = delete;
+
+        std::string finish();
+
+private:
+        FILE *m_stream;
+        int m_saved = -1;
+        int m_fd = -1;
+
+        void restore();
+};
+
+Capture::Capture(FILE *stream) : m_stream(stream)
+{
+        char dir[MAX_PATH];
+        char path[MAX_PATH];
+
+        if (!GetTempPath(sizeof(dir), dir) || !GetTempFileName(dir, "usb", 0, path)) {
+                return;
+        }
+
+        auto h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+
+        if (h == INVALID_HANDLE_VALUE) {
+                DeleteFile(path);
+                return;
+        }
+
+        m_fd = _open_osfhandle(reinterpret_cast<intptr_t>(h), _O_RDWR | _O_BINARY);
+        if (m_fd < 0) {
+                CloseHandle(h);
+                return;
+        }
+
+        fflush(m_stream);
+        m_saved = _dup(_fileno(m_stream));
+
+        if (m_saved < 0 || _dup2(m_fd, _fileno(m_stream))) {
+                restore();
+        }
+}
+
+Capture::~Capture()
+{
+        restore();
+
+        if (m_fd >= 0) {
+                _close(m_fd);
+        }
+}
+
+void Capture::restore()
+{
+        if (m_saved >= 0) {
+                fflush(m_stream);
+                _dup2(m_saved, _fileno(m_stream));
+                _close(m_saved);
+                m_saved = -1;
+        }
+}
+
+std::string Capture::finish()
+{
+        restore();
+
+        std::string s;
+        if (m_fd < 0) {
+                return s;
+        }
+
+        s.resize(_lseek(m_fd, 0, SEEK_END));
+        _lseek(m_fd, 0, SEEK_SET);
+
+        auto n = _read(m_fd, s.data(), static_cast<unsigned int>(s.size()));
+        s.resize(n > 0 ? n : 0);
+
+        return s;
+}
+
+/*
+ * Reads a whole message from the pipe opened in message mode.
+ */
+auto read_message(HANDLE pipe, std::vector<char> &buf)
+{
+        buf.clear();
+
+        for (size_t chunk = PIPE_BUFSZ; ; ) {
+                auto pos = buf.size();
+                buf.resize(pos + chunk);
+
+                DWORD n = 0;
+                auto ok = ReadFile(pipe, buf.data() + pos, static_cast<DWORD>(chunk), &n, nullptr);
+                buf.resize(pos + n);
+
+                if (ok) {
+                        return true;
+                } else if (GetLastError() != ERROR_MORE_DATA) {
+                        dbg("ReadFile error %#lx", GetLastError());
+                        return false;
+                }
+        }
+}
+
+auto write_message(HANDLE pipe, const std::vector<char> &buf)
+{
+        DWORD n = 0;
+        auto ok = WriteFile(pipe, buf.data(), static_cast<DWORD>(buf.size()), &n, nullptr) && n == buf.size();
+
+        if (!ok) {
+                dbg("WriteFile error %#lx", GetLastError());
+        }
+
+        return ok;
+}
+
+/*
+ * Request is a sequence of NUL-terminated strings: current directory of the client and its argv.
+ * Commands run one at a time, so redirection of the process's stdout and stderr is safe.
+ */
+auto execute(std::vector<char> &req)
+{
+        req.push_back('\0');
+
+        std::vector<char*> argv;
+        for (auto p = req.data(), end = p + req.size() - 1; p < end; p += strlen(p) + 1) {
+                argv.push_back(p);
+        }
+
+        if (argv.size() < 2) { // cwd and program name at least
+                reply_header hdr{ EXIT_FAILURE, 0, 0 };
+                return std::vector<char>(reinterpret_cast<char*>(&hdr), reinterpret_cast<char*>(&hdr + 1));
+        }
+
+        if (!SetCurrentDirectory(argv.front())) { // relative paths in arguments, f.e. attach --manifest
+                dbg("SetCurrentDirectory('%s') error %#lx", argv.front(), GetLastError());
+        }
+
+        argv.erase(argv.begin());
+        argv.push_back(nullptr);
+
+        auto port = usbip_port; // global options of the request must not stick
+        auto debug = usbip_use_debug;
+
+        const char *name{};
+        int rc = 0;
+        std::string out;
+        std::string errs;
+
+        auto start = clock_type::now();
+        {
+                Capture cap_out(stdout);
+                Capture cap_err(stderr);
+
+                rc = usbip_run(static_cast<int>(argv.size() - 1), argv.data(), false, &name);
+
+                out = cap_out.finish();
+                errs = cap_err.finish();
+        }
+        auto elapsed = clock_type::now() - start;
+
+        usbip_port = port;
+        usbip_use_debug = debug;
+
+        if (name) {
+                auto &st = g_stats[name];
+                ++st.count;
+                st.failed += !!rc;
+                st.total += elapsed;
+                st.max = std::max(st.max, elapsed);
+        }
+
+        reply_header hdr{ rc, static_cast<UINT32>(out.size()), static_cast<UINT32>(errs.size()) };
+
+        std::vector<char> reply(reinterpret_cast<char*>(&hdr), reinterpret_cast<char*>(&hdr + 1));
+        reply.insert(reply.end(), out.begin(), out.end());
+        reply.insert(reply.end(), errs.begin(), errs.end());
+
+        return reply;
+}
+
+auto serve()
+{
+        usbip::Handle pipe(CreateNamedPipe(pipe_name,
+                                PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                1, PIPE_BUFSZ, PIPE_BUFSZ, 0, nullptr));
+
+        if (!pipe) {
+                auto error = GetLastError();
+                if (error == ERROR_ACCESS_DENIED) {
+                        err("usbip service is already running");
+                } else {
+                        err("CreateNamedPipe error %#lx", error);
+                }
+                return 2;
+        }
+
+        g_in_service = true;
+        g_started = clock_type::now();
+
+        info("listening on %s", pipe_name);
+
+        for (std::vector<char> req; ; DisconnectNamedPipe(pipe.get())) {
+
+                if (!ConnectNamedPipe(pipe.get(), nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+                        err("ConnectNamedPipe error %#lx", GetLastError());
+                        return 3;
+                }
+
+                if (read_message(pipe.get(), req) && !req.empty() && req.back() == '\0') {
+                        write_message(pipe.get(), execute(req));
+                        FlushFileBuffers(pipe.get());
+                }
+        }
+}
+
+auto open_pipe()
+{
+        for (int i = 0; i < 2; ++i) {
+                usbip::Handle h(CreateFile(pipe_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr));
+                if (h) {
+                        DWORD mode = PIPE_READMODE_MESSAGE;
+                        if (SetNamedPipeHandleState(h.get(), &mode, nullptr, nullptr)) {
+                                return h;
+                        }
+                        break;
+                } else if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(pipe_name, PIPE_WAIT_TIMEOUT)) {
+                        break;
+                }
+        }
+
+        return usbip::Handle();
+}
+
+} // namespace
+
+
+unsigned int usbip_devlist_ttl;
+
+/*
+ * @return false if the request is not sent, f.e. usbip service is not running
+ */
+bool usbip_service_call(int argc, char *argv[], int &rc)
+{
+        auto pipe = open_pipe();
+        if (!pipe) {
+                return false;
+        }
+
+        char cwd[MAX_PATH];
+        if (!GetCurrentDirectory(sizeof(cwd), cwd)) {
+                return false;
+        }
+
+        std::vector<char> buf(cwd, cwd + strlen(cwd) + 1);
+        for (int i = 0; i < argc; ++i) {
+                buf.insert(buf.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+        }
+
+        if (!write_message(pipe.get(), buf)) {
+                return false;
+        }
+
+        rc = EXIT_FAILURE; // the service may have run the command, it must not be run again
+
+        if (!read_message(pipe.get(), buf)) {
+                err("can't read reply of usbip service");
+                return true;
+        }
+
+        reply_header hdr{};
+        if (buf.size() < sizeof(hdr)) {
+                err("reply of usbip service is too short, %zu bytes", buf.size());
+                return true;
+        }
+
+        memcpy(&hdr, buf.data(), sizeof(hdr));
+        if (buf.size() - sizeof(hdr) != UINT64(hdr.out_len) + hdr.err_len) {
+                err("invalid reply of usbip service");
+                return true;
+        }
+
+        auto out = buf.data() + sizeof(hdr);
+        fwrite(out, 1, hdr.out_len, stdout);
+        fwrite(out + hdr.out_len, 1, hdr.err_len, stderr);
+
+        rc = hdr.rc;
+        return true;
+}
+
+void usbip_service_usage()
+{
+        printf("usage: %s", usbip_service_usage_string);
+}
+
+int usbip_service(int argc, char *argv[])
+{
+        const option opts[] =
+        {
+                { "devlist-ttl", required_argument, nullptr, 'l' },
+                {}
+        };
+
+        unsigned int ttl = 5;
+
+        while (true) {
+                int opt = getopt_long(argc, argv, "l:", opts, nullptr);
+                if (opt == -1) {
+                        break;
+                }
+
+                switch (opt) {
+                case 'l':
+                        if (sscanf_s(optarg, "%u", &ttl) == 1) {
+                                break;
+                        }
+                        [[fallthrough]];
+                default:
+                        err("invalid option: %c", opt);
+                        usbip_service_usage();
+                        return 1;
+                }
+        }
+
+        usbip_devlist_ttl = ttl;
+        return serve();
+}
+
+int usbip_stats(int, char*[])
+{
+        using std::chrono::duration_cast;
+        using std::chrono::seconds;
+        using msec = std::chrono::duration<double, std::milli>;
+
+        if (!g_in_service) {
+                err("usbip service is not running");
+                return 2;
+        }
+
+        printf("Uptime: %lld s\n", duration_cast<seconds>(clock_type::now() - g_started).count());
+        printf("%-10s %8s %8s %10s %10s\n", "command", "count", "failed", "avg, ms", "max, ms");
+
+        for (auto &[name, st]: g_stats) {
+                auto avg = st.count ? st.total/st.count : clock_type::duration();
+                printf("%-10s %8u %8u %10.3f %10.3f\n", name.c_str(), st.count, st.failed,
+                        duration_cast<msec>(avg).count(), duration_cast<msec>(st.max).count());
+        }
+
+        return 0;
+}
@@ -52,16 +52,23 @@ struct command
 	int (*fn)(int argc, char *argv[]);
 	const char *help;
 	void (*usage)();
+	bool (*service)(int argc, char *argv[]); // can be forwarded to usbip service
 };
 
+bool always(int, char*[]) { return true; }
+
 const command cmds[] =
 {
 	{ "help", usbip_help},
 	{ "version", usbip_version},
-	{ "attach", usbip_attach, "Attach a remote USB device",	usbip_attach_usage },
-	{ "detach", usbip_detach, "Detach a remote USB device", usbip_detach_usage },
-	{ "list", usbip_list, "List remote USB devices", usbip_list_usage },
-	{ "port", usbip_port_show, "Show imported USB devices", usbip_port_usage },
+	{ "attach", usbip_attach, "Attach a remote USB device",	usbip_attach_usage, usbip_attach_can_forward },
+	{ "detach", usbip_detach, "Detach a remote USB device", usbip_detach_usage, always },
+	{ "list", usbip_list, "List remote USB devices", usbip_list_usage, always },
+	{ "port", usbip_port_show, "Show imported USB devices", usbip_port_usage, usbip_port_can_forward },
+	{ "autoattach", usbip_autoattach, "Keep remote USB devices attached", usbip_autoattach_usage },
+	{ "bench", usbip_bench, "Measure throughput and latency of a remote USB device", usbip_bench_usage },
+	{ "service", usbip_service, "Run persistent process that serves other usbip commands", usbip_service_usage },
+	{ "stats", usbip_stats, "Show statistics of usbip service", nullptr, always },
 };
 
 int usbip_help(int argc, char *argv[])
@@ -122,7 +129,11 @@ UsbIds& get_ids()
 	return ids;
 }
 
-int main(int argc, char *argv[])
+/*
+ * @param forward pass the command to usbip service if it is running
+ * @param name of the command that was run
+ */
+int usbip_run(int argc, char *argv[], bool forward, const char **name)
 {
 	const option opts[] = 
 	{
@@ -134,10 +145,7 @@ int main(int argc, char *argv[])
 	int opt{};
 	int rc = EXIT_FAILURE;
 
-	usbip_progname = "usbip";
-	usbip_use_stderr = true;
-
-	for (opterr = 0; ; ) {
+	for (optind = 0, opterr = 0; ; ) {
 		opt = getopt_long(argc, argv, "+dt:", opts, nullptr);
 		if (opt == -1) {
 			break;
@@ -159,15 +167,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	usbip::InitWinSock2 ws2;
-	if (!ws2) {
-		err("cannot setup windows socket");
-		return EXIT_FAILURE;
-	}
-
 	if (auto cmd = argv[optind]) {
 		for (auto &c: cmds)
 			if (std::string_view(c.name) == cmd) {
+				if (forward && c.service && c.service(argc - optind, argv + optind) &&
+				    usbip_service_call(argc, argv, rc)) {
+					return rc;
+				}
+				if (name) {
+					*name = c.name;
+				}
 				argc -= optind;
 				argv += optind;
 				optind = 0;
@@ -179,3 +188,17 @@ int main(int argc, char *argv[])
 	usbip_help(0, nullptr);
 	return rc;
 }
+
+int main(int argc, char *argv[])
+{
+	usbip_progname = "usbip";
+	usbip_use_stderr = true;
+
+	usbip::InitWinSock2 ws2;
+	if (!ws2) {
+		err("cannot setup windows socket");
+		return EXIT_FAILURE;
+	}
+
+	return usbip_run(argc, argv, true);
+}
@@ -18,7 +18,10 @@
 
 #pragma once
 
+#include <vector>
+
 class UsbIds;
+struct ioctl_usbip_vhci_plugin;
 UsbIds& get_ids();
 
 /* usbip commands */
@@ -26,8 +29,26 @@ int usbip_attach(int argc, char *argv[]);
 int usbip_detach(int argc, char *argv[]);
 int usbip_list(int argc, char *argv[]);
 int usbip_port_show(int argc, char* argv[]);
+int usbip_autoattach(int argc, char *argv[]);
+int usbip_bench(int argc, char *argv[]);
+int usbip_service(int argc, char *argv[]);
+int usbip_stats(int argc, char *argv[]);
 
 void usbip_attach_usage();
 void usbip_detach_usage();
 void usbip_list_usage();
 void usbip_port_usage();
+void usbip_autoattach_usage();
+void usbip_bench_usage();
+void usbip_service_usage();
+
+std::vector<int> attach_devices(const std::vector<ioctl_usbip_vhci_plugin> &entries);
+
+bool usbip_attach_can_forward(int argc, char *argv[]);
+bool usbip_port_can_forward(int argc, char *argv[]);
+
+int usbip_run(int argc, char *argv[], bool forward, const char **name = nullptr);
+bool usbip_service_call(int argc, char *argv[], int &rc);
+
+/* seconds to reuse device lists of remote hosts, zero disables caching */
+extern unsigned int usbip_devlist_ttl;
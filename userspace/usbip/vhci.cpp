@@ -2,7 +2,9 @@
 #include <libusbip\dbgcode.h>
 #include <libusbip\setupdi.h>
 
+#include <algorithm>
 #include <cassert>
+#include <mutex>
 #include <string>
 
 #include <initguid.h>
@@ -36,6 +38,18 @@ auto get_vhci_devpath(hci_version version)
         return r.path;
 }
 
+/*
+ * SetupDi enumeration is expensive, usbip service opens the driver many times.
+ */
+std::mutex g_devpath_mtx;
+std::string g_devpath[std::size(vhci_list)];
+
+auto open_devpath(const std::string &devpath)
+{
+        dbg("device path: %s", devpath.c_str());
+        return CreateFile(devpath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+}
+
 } // namespace
 
 
@@ -43,22 +57,51 @@ auto usbip::vhci_driver_open(hci_version version) -> Handle
 {
         Handle h;
 
-        auto devpath = get_vhci_devpath(version);
-        if (devpath.empty()) {
-                return h;
+        std::lock_guard lck(g_devpath_mtx);
+        auto &devpath = g_devpath[version];
+
+        if (!devpath.empty()) {
+                h.reset(open_devpath(devpath));
+                if (h) {
+                        return h;
+                }
+                devpath.clear(); // the driver was reinstalled or disabled
+        }
+
+        devpath = get_vhci_devpath(version);
+        if (!devpath.empty()) {
+                h.reset(open_devpath(devpath));
         }
-        
-        dbg("device path: %s", devpath.c_str());
-        
-        auto fh = CreateFile(devpath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
-        h.reset(fh);
 
         return h;
 }
 
+/*
+ * @return zero on error
+ */
+int usbip::vhci_get_num_ports(HANDLE hdev)
+{
+        ioctl_usbip_vhci_num_ports r{};
+
+        if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_NUM_PORTS, nullptr, 0, &r, sizeof(r), nullptr, nullptr)) {
+                dbg("%s: DeviceIoControl error %#x", __func__, GetLastError());
+                return 0;
+        }
+
+        assert(is_valid_rhport(r.num_ports));
+        return r.num_ports;
+}
+
 std::vector<ioctl_usbip_vhci_imported_dev> usbip::vhci_get_imported_devs(HANDLE hdev)
 {
-        std::vector<ioctl_usbip_vhci_imported_dev> v(VHUB_NUM_PORTS + 1);
+        std::vector<ioctl_usbip_vhci_imported_dev> v;
+
+        if (auto n = vhci_get_num_ports(hdev)) {
+                v.resize(n + 1); // and the end mark
+        } else {
+                return v;
+        }
+
         auto idevs_bytes = DWORD(v.size()*sizeof(v[0]));
 
         if (!DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_IMPORTED_DEVICES, nullptr, 0, v.data(), idevs_bytes, nullptr, nullptr)) {
@@ -78,6 +121,68 @@ bool usbip::vhci_attach_device(HANDLE hdev, ioctl_usbip_vhci_plugin &r)
         return ok;
 }
 
+/*
+ * The driver pends the request until all devices are imported.
+ * @param count [1..USBIP_PLUGIN_BATCH_MAX], port of every entry is set on success
+ */
+bool usbip::vhci_attach_devices(HANDLE hdev, ioctl_usbip_vhci_plugin *entries, int count, int parallelism)
+{
+        assert(count > 0 && count <= USBIP_PLUGIN_BATCH_MAX);
+
+        auto len = DWORD(plugin_batch_size(count));
+        std::vector<char> buf(len);
+
+        auto &r = *reinterpret_cast<ioctl_usbip_vhci_plugin_batch*>(buf.data());
+        r.count = count;
+        r.parallelism = parallelism;
+        std::copy(entries, entries + count, r.entries);
+
+        auto ev = CreateEvent(nullptr, true, false, nullptr); // returns NULL on error
+        if (!ev) {
+                dbg("%s: CreateEvent error %#x", __func__, GetLastError());
+                return false;
+        }
+        Handle event(ev);
+
+        OVERLAPPED ov{ .hEvent = event.get() };
+        DWORD outlen = 0;
+
+        auto ok = DeviceIoControl(hdev, IOCTL_USBIP_VHCI_PLUGIN_HARDWARE_BATCH, buf.data(), len, buf.data(), len, nullptr, &ov) ||
+                  (GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(hdev, &ov, &outlen, true));
+
+        if (!ok) {
+                dbg("%s: DeviceIoControl error %#x", __func__, GetLastError());
+                return false;
+        }
+
+        for (int i = 0; i < count; ++i) {
+                entries[i].port = r.entries[i].port;
+        }
+
+        return true;
+}
+
+/*
+ * Starts the request, its result must be obtained by GetOverlappedResult.
+ * @param buf is used for input and output, must not be reallocated until the request is completed
+ */
+bool usbip::vhci_get_port_changes(HANDLE hdev, UINT32 generation, std::vector<ioctl_usbip_vhci_port_change> &buf, OVERLAPPED &ov)
+{
+        static_assert(sizeof(ioctl_usbip_vhci_get_port_changes) <= sizeof(ioctl_usbip_vhci_port_change));
+        assert(!buf.empty());
+
+        reinterpret_cast<ioctl_usbip_vhci_get_port_changes*>(buf.data())->generation = generation;
+        auto outlen = DWORD(buf.size()*sizeof(buf[0]));
+
+        if (DeviceIoControl(hdev, IOCTL_USBIP_VHCI_GET_PORT_CHANGES, buf.data(), sizeof(ioctl_usbip_vhci_get_port_changes),
+                            buf.data(), outlen, nullptr, &ov) || GetLastError() == ERROR_IO_PENDING) {
+                return true;
+        }
+
+        dbg("%s: DeviceIoControl error %#x", __func__, GetLastError());
+        return false;
+}
+
 int usbip::vhci_detach_device(HANDLE hdev, int port)
 {
         ioctl_usbip_vhci_unplug r{ port };
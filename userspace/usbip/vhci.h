@@ -5,14 +5,24 @@
 #include <usbip\vhci.h>
 #include <libusbip\win_handle.h>
 
+/*
+ * @see make_error
+ */
+constexpr auto get_port(int result) { return result & 0xFFFF; }
+constexpr auto get_error(int result) { return result >> 16; }
+
 namespace usbip
 {
 
 Handle vhci_driver_open(hci_version version);
 
+int vhci_get_num_ports(HANDLE hdev);
 std::vector<ioctl_usbip_vhci_imported_dev> vhci_get_imported_devs(HANDLE hdev);
 
 bool vhci_attach_device(HANDLE hdev, ioctl_usbip_vhci_plugin &r);
+bool vhci_attach_devices(HANDLE hdev, ioctl_usbip_vhci_plugin *entries, int count, int parallelism = 0);
 int vhci_detach_device(HANDLE hdev, int port);
 
+bool vhci_get_port_changes(HANDLE hdev, UINT32 generation, std::vector<ioctl_usbip_vhci_port_change> &buf, OVERLAPPED &ov);
+
 } // namespace usbip